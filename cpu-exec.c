@@ -42,11 +42,40 @@
 #ifdef CONFIG_LLVM
 #include "panda/tcg-llvm.h"
 const int has_llvm_engine = 1;
+extern bool (*panda_llvm_block_filter)(CPUState *cpu, TranslationBlock *tb);
 #endif
 
 int generate_llvm = 0;
 int execute_llvm = 0;
 extern bool panda_tb_chaining;
+extern bool panda_replay_tb_chaining;
+extern uint64_t panda_fast_forward_instr;
+extern void panda_fast_forward_end(void);
+
+#ifdef CONFIG_SOFTMMU
+static inline uint64_t rr_instr_until(uint64_t instr)
+{
+    uint64_t now = rr_get_guest_instr_count();
+    return instr > now ? instr - now : 0;
+}
+
+/* Whether gdb has rr breakpoints set, which are only tested when TBs are
+ * translated, so TBs must not be chained.  */
+static bool cpu_has_rr_breakpoints(CPUState *cpu)
+{
+    CPUBreakpoint *bp;
+
+    if (cpu->temp_rr_bp_instr) {
+        return true;
+    }
+    QTAILQ_FOREACH(bp, &cpu->breakpoints, entry) {
+        if (bp->rr_instr_count) {
+            return true;
+        }
+    }
+    return false;
+}
+#endif
 
 /* -icount align implementation. */
 
@@ -201,7 +230,8 @@ static inline tcg_target_ulong cpu_tb_exec(CPUState *cpu, TranslationBlock *itb)
     panda_bb_invalidate_done = false;
 
 #if defined(CONFIG_LLVM)
-    if (execute_llvm) {
+    if (execute_llvm && (!panda_llvm_block_filter ||
+                         panda_llvm_block_filter(cpu, itb))) {
         assert(itb->llvm_tc_ptr);
         ret = tcg_llvm_qemu_tb_exec(env, itb);
     } else {
@@ -213,6 +243,14 @@ static inline tcg_target_ulong cpu_tb_exec(CPUState *cpu, TranslationBlock *itb)
 #endif // CONFIG_LLVM
 
     cpu->can_do_io = 1;
+    /* Generated code only returns at TB boundaries, so anything a
+     * cpu_restore_state that was not followed by an exit held back of the
+     * record/replay count has been executed since.  */
+    if (unlikely(cpu->rr_icount_ahead)) {
+        cpu->rr_guest_instr_count += cpu->rr_icount_ahead;
+        cpu->rr_icount_ahead = 0;
+    }
+    cpu->rr_icount_tb = NULL;
     last_tb = (TranslationBlock *)(ret & ~TB_EXIT_MASK);
     ranBlockSinceEnter = true;
 
@@ -319,6 +357,7 @@ static void cpu_exec_step(CPUState *cpu)
 #ifndef CONFIG_SOFTMMU
         tcg_debug_assert(!have_mmap_lock());
 #endif
+        cpu_restore_insn_count(cpu);
         tb_lock_reset();
     }
 }
@@ -341,8 +380,15 @@ struct tb_desc {
     CPUArchState *env;
     tb_page_addr_t phys_page1;
     uint32_t flags;
+    uint32_t rr_trunc; /* CF_RR_TRUNC | length, or 0 for a regular TB */
 };
 
+static inline uint32_t tb_rr_trunc(const TranslationBlock *tb)
+{
+    return (tb->cflags & CF_RR_TRUNC)
+        ? tb->cflags & (CF_RR_TRUNC | CF_COUNT_MASK) : 0;
+}
+
 static bool tb_cmp(const void *p, const void *d)
 {
     const TranslationBlock *tb = p;
@@ -352,6 +398,7 @@ static bool tb_cmp(const void *p, const void *d)
         tb->page_addr[0] == desc->phys_page1 &&
         tb->cs_base == desc->cs_base &&
         tb->flags == desc->flags &&
+        tb_rr_trunc(tb) == desc->rr_trunc &&
         !atomic_read(&tb->invalid)) {
         /* check next page if needed */
         if (tb->page_addr[1] == -1) {
@@ -373,7 +420,8 @@ static bool tb_cmp(const void *p, const void *d)
 static TranslationBlock *tb_htable_lookup(CPUState *cpu,
                                           target_ulong pc,
                                           target_ulong cs_base,
-                                          uint32_t flags)
+                                          uint32_t flags,
+                                          uint32_t rr_trunc)
 {
     tb_page_addr_t phys_pc;
     struct tb_desc desc;
@@ -382,6 +430,7 @@ static TranslationBlock *tb_htable_lookup(CPUState *cpu,
     desc.env = (CPUArchState *)cpu->env_ptr;
     desc.cs_base = cs_base;
     desc.flags = flags;
+    desc.rr_trunc = rr_trunc;
     desc.pc = pc;
     phys_pc = get_page_addr_code(desc.env, pc);
     desc.phys_page1 = phys_pc & TARGET_PAGE_MASK;
@@ -389,6 +438,41 @@ static TranslationBlock *tb_htable_lookup(CPUState *cpu,
     return qht_lookup(&tcg_ctx.tb_ctx.htable, tb_cmp, &desc, h);
 }
 
+#ifdef CONFIG_SOFTMMU
+/* Replay: return the variant of @tb that ends after exactly @max_icount
+ * instructions, so the next interrupt is delivered on the same basic block
+ * boundary as during record.  Truncated variants sit in the same hash
+ * bucket as the full-length TB but are never returned by tb_find, so both
+ * survive and get reused every time the same block straddles an interrupt.
+ */
+static TranslationBlock *tb_find_rr_truncated(CPUState *cpu,
+                                              TranslationBlock *tb,
+                                              uint32_t max_icount)
+{
+    uint32_t rr_trunc = CF_RR_TRUNC | max_icount;
+    TranslationBlock *ttb;
+
+    ttb = tb_htable_lookup(cpu, tb->pc, tb->cs_base, tb->flags, rr_trunc);
+    if (ttb) {
+        atomic_inc(&tcg_ctx.tb_ctx.rr_trunc_hit_count);
+        return ttb;
+    }
+
+    mmap_lock();
+    tb_lock();
+    ttb = tb_htable_lookup(cpu, tb->pc, tb->cs_base, tb->flags, rr_trunc);
+    if (!ttb) {
+        panda_callbacks_before_block_translate(cpu, tb->pc);
+        ttb = tb_gen_code(cpu, tb->pc, tb->cs_base, tb->flags, rr_trunc);
+        panda_callbacks_after_block_translate(cpu, ttb);
+        tcg_ctx.tb_ctx.rr_trunc_gen_count++;
+    }
+    tb_unlock();
+    mmap_unlock();
+    return ttb;
+}
+#endif
+
 static inline TranslationBlock *tb_find(CPUState *cpu,
                                         TranslationBlock *last_tb,
                                         int tb_exit)
@@ -406,7 +490,7 @@ static inline TranslationBlock *tb_find(CPUState *cpu,
     tb = atomic_rcu_read(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)]);
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
                  tb->flags != flags)) {
-        tb = tb_htable_lookup(cpu, pc, cs_base, flags);
+        tb = tb_htable_lookup(cpu, pc, cs_base, flags, 0);
         if (!tb) {
 
             /* mmap_lock is needed by tb_gen_code, and mmap_lock must be
@@ -420,7 +504,7 @@ static inline TranslationBlock *tb_find(CPUState *cpu,
             /* There's a chance that our desired tb has been translated while
              * taking the locks so we check again inside the lock.
              */
-            tb = tb_htable_lookup(cpu, pc, cs_base, flags);
+            tb = tb_htable_lookup(cpu, pc, cs_base, flags, 0);
             if (!tb) {
                 panda_callbacks_before_block_translate(cpu, pc);
                 /* if no translated code available, then translate it now */
@@ -445,7 +529,12 @@ static inline TranslationBlock *tb_find(CPUState *cpu,
 #endif
     /* See if we can patch the calling TB. */
 #ifdef CONFIG_SOFTMMU
-    if (!rr_in_replay() && panda_tb_chaining) {
+    /* During replay only TBs that check the instruction budget may be
+     * chained to, so that we still stop at every nondet log event. */
+    if (panda_tb_chaining && (!rr_in_replay() ||
+            (panda_replay_tb_chaining && !execute_llvm
+             && (tb->cflags & CF_RR_BUDGET)
+             && !cpu_has_rr_breakpoints(cpu)))) {
 #endif
     if (last_tb && !qemu_loglevel_mask(CPU_LOG_TB_NOCHAIN)) {
         if (!have_tb_lock) {
@@ -688,6 +777,15 @@ static inline void cpu_loop_exec_tb(CPUState *cpu, TranslationBlock *tb,
         break;
     case TB_EXIT_ICOUNT_EXPIRED:
     {
+#ifndef CONFIG_USER_ONLY
+        if (tb->cflags & CF_RR_BUDGET) {
+            /* Replay instruction budget ran out before this TB. Go back
+             * to the main loop, which will deliver the pending log event
+             * or retranslate the TB so it ends at the event. */
+            *last_tb = NULL;
+            break;
+        }
+#endif
         /* Instruction counter expired.  */
 #ifdef CONFIG_USER_ONLY
         abort();
@@ -752,6 +850,38 @@ __attribute__((always_inline)) static inline void detect_infinite_loops(void) {
     }
 }
 
+#ifdef CONFIG_SOFTMMU
+/* Replay: the number of instructions after which the checks at the top of
+ * the cpu_exec loop need to run again, i.e. until the next rr breakpoint,
+ * debug checkpoint or progress report.  Chained TBs would run past them
+ * otherwise.  Returns -1 if there is none.
+ */
+static uint64_t rr_instr_until_next_check(CPUState *cpu)
+{
+    uint64_t now = rr_get_guest_instr_count();
+    uint64_t until = -1;
+    uint64_t total = rr_nondet_log->last_prog_point.guest_instr_count;
+    uint64_t progress = (total * rr_next_progress + 99) / 100;
+    CPUBreakpoint *bp;
+
+    if (progress > now) {
+        until = progress - now;
+    }
+    if (cpu->temp_rr_bp_instr > now) {
+        until = MIN(until, cpu->temp_rr_bp_instr + 1 - now);
+    }
+    QTAILQ_FOREACH(bp, &cpu->breakpoints, entry) {
+        if (bp->rr_instr_count > now) {
+            until = MIN(until, bp->rr_instr_count - now);
+        }
+    }
+#ifdef CONFIG_DEBUG_TCG
+    until = MIN(until, ((counter_128k + 1) << 17) - now);
+#endif
+    return until;
+}
+#endif
+
 /* main execution loop */
 
 int cpu_exec(CPUState *cpu)
@@ -795,6 +925,7 @@ int cpu_exec(CPUState *cpu)
         g_assert(cc == CPU_GET_CLASS(cpu));
 #endif /* buggy compiler */
         cpu->can_do_io = 1;
+        cpu_restore_insn_count(cpu);
         tb_lock_reset();
     }
 
@@ -827,11 +958,44 @@ int cpu_exec(CPUState *cpu)
                 break;
             }
 
+            if (unlikely(panda_fast_forward_instr) &&
+                rr_get_guest_instr_count() >= panda_fast_forward_instr) {
+                /* Reached -replay-start-at. The flush this requests also
+                 * kicks us out before any stale TB runs. */
+                printf("Fast-forwarded to instr %" PRIu64
+                       "; enabling plugins\n", rr_get_guest_instr_count());
+                panda_fast_forward_end();
+            }
+
             panda_callbacks_before_find_fast();
             TranslationBlock *tb = tb_find(cpu, last_tb, tb_exit);
+
+#ifdef CONFIG_SOFTMMU
+            uint64_t until_interrupt = rr_num_instr_before_next_interrupt();
+            if (rr_in_replay()) {
+                /* Stop exactly at -replay-start-at and -replay-end-at, as
+                 * at an interrupt. */
+                if (panda_fast_forward_instr) {
+                    until_interrupt = MIN(until_interrupt,
+                            rr_instr_until(panda_fast_forward_instr));
+                }
+                if (rr_replay_end_instr) {
+                    until_interrupt = MIN(until_interrupt,
+                            rr_instr_until(rr_replay_end_instr));
+                }
+            }
+            if (rr_in_replay() && until_interrupt > 0
+                    && tb->icount > until_interrupt) {
+                /* Use a shorter variant so that basic block boundary
+                 * matches record & replay for interrupt delivery.  Only
+                 * these are translated short; the full-length TB stays. */
+                tb = tb_find_rr_truncated(cpu, tb, until_interrupt);
+            }
+#endif // CONFIG_SOFTMMU
+
             panda_bb_invalidate_done = panda_callbacks_after_find_fast(
                     cpu, tb, panda_bb_invalidate_done, &panda_invalidate_tb);
-        
+
             if (unlikely(cpu->temp_rr_bp_instr) && rr_get_guest_instr_count() > cpu->temp_rr_bp_instr) {
                 // Restore rr breakpoint if one was disabled for continue
                 cpu_rr_breakpoint_insert(cpu, cpu->temp_rr_bp_instr, BP_GDB, NULL);
@@ -841,12 +1005,7 @@ int cpu_exec(CPUState *cpu)
             qemu_log_rr(tb->pc);
 
 #ifdef CONFIG_SOFTMMU
-            uint64_t until_interrupt = rr_num_instr_before_next_interrupt();
-            if (panda_invalidate_tb
-                    || (rr_in_replay() && until_interrupt > 0
-                        && tb->icount > until_interrupt)) {
-                /* Retranslate so that basic block boundary matches
-                 * record & replay for interrupt delivery. */
+            if (panda_invalidate_tb) {
                 tb_lock();
                 tb_phys_invalidate(tb, -1);
                 tb_unlock();
@@ -861,6 +1020,17 @@ int cpu_exec(CPUState *cpu)
             }
 
             if (!rr_in_replay() || until_interrupt > 0) {
+                // Chained replay TBs may run at most this many instructions.
+                // They stop at the first TB boundary past the next check,
+                // but the TB at hand always runs.
+                uint64_t budget = until_interrupt;
+#ifdef CONFIG_SOFTMMU
+                if (rr_in_replay()) {
+                    budget = MIN(budget, MAX(rr_instr_until_next_check(cpu),
+                                             tb->icount));
+                }
+#endif
+                cpu->rr_instr_budget = MIN(budget, INT32_MAX);
                 cpu_loop_exec_tb(cpu, tb, &last_tb, &tb_exit, &sc);
                 /* Try to align the host and virtual clocks
                    if the guest is in advance */
@@ -35,6 +35,7 @@
 #include "panda/rr/rr_log_all.h"
 #include "panda/rr/rr_log.h"
 #include "panda/callbacks/cb-support.h"
+#include "panda/common.h"
 
 /* DEBUG defines, enable DEBUG_TLB_LOG to log to the CPU_LOG_MMU target */
 /* #define DEBUG_TLB */
@@ -122,6 +123,8 @@ static void tlb_flush_nocheck(CPUState *cpu)
     memset(env->tlb_table, -1, sizeof(env->tlb_table));
     memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+    /* PANDA's translation cache follows the guest's TLB. */
+    panda_tlb_flush();
 
     env->vtlb_index = 0;
     env->tlb_flush_addr = -1;
@@ -187,6 +190,7 @@ static void tlb_flush_by_mmuidx_async_work(CPUState *cpu, run_on_cpu_data data)
     }
 
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+    panda_tlb_flush();
 
     tlb_debug("done\n");
 
@@ -270,6 +274,11 @@ static void tlb_flush_page_async_work(CPUState *cpu, run_on_cpu_data data)
         return;
     }
 
+    /* The page may be part of a large page PANDA cached piecemeal, so all
+     * of PANDA's translations go.
+     */
+    panda_tlb_flush();
+
     addr &= TARGET_PAGE_MASK;
     i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
@@ -320,6 +329,8 @@ static void tlb_flush_page_by_mmuidx_async_work(CPUState *cpu,
     tlb_debug("page:%d addr:"TARGET_FMT_lx" mmu_idx:0x%lx\n",
               page, addr, mmu_idx_bitmap);
 
+    panda_tlb_flush();
+
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         if (test_bit(mmu_idx, &mmu_idx_bitmap)) {
             tlb_flush_entry(&env->tlb_table[mmu_idx][page], addr);
@@ -790,6 +801,7 @@ static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
     CPUState *cpu = ENV_GET_CPU(env);
     hwaddr physaddr = iotlbentry->addr;
     MemoryRegion *mr = iotlb_to_region(cpu, physaddr, iotlbentry->attrs);
+    TranslationBlock *rr_tb;
     uint64_t val;
 
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
@@ -799,8 +811,14 @@ static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
     }
 
     cpu->mem_io_vaddr = addr;
-    if (mr->name && !strcmp(mr->name, "watch")){
+    /* Device reads are logged at the instruction count of the access.  */
+    rr_tb = cpu_sync_insn_count(cpu, retaddr);
+    /* Pages with watchpoints or panda_watch_range() ranges are RAM, not
+       devices: they aren't logged and get no mmio callbacks.  */
+    if (mr == &io_mem_panda_watch ||
+        (mr->name && !strcmp(mr->name, "watch"))) {
         memory_region_dispatch_read(mr, physaddr, &val, size, iotlbentry->attrs);
+        cpu_unsync_insn_count(cpu, rr_tb);
         return val;
     }
 
@@ -812,6 +830,7 @@ static uint64_t io_readx(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
         /* location= */ RR_CALLSITE_IO_READ_ALL);
 
     panda_callbacks_mmio_after_read(cpu, physaddr, addr, size, &val);
+    cpu_unsync_insn_count(cpu, rr_tb);
 
     return val;
 }
@@ -823,6 +842,7 @@ static void io_writex(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
     CPUState *cpu = ENV_GET_CPU(env);
     hwaddr physaddr = iotlbentry->addr;
     MemoryRegion *mr = iotlb_to_region(cpu, physaddr, iotlbentry->attrs);
+    TranslationBlock *rr_tb;
 
     physaddr = (physaddr & TARGET_PAGE_MASK) + addr;
     if (mr != &io_mem_rom && mr != &io_mem_notdirty && !cpu->can_do_io) {
@@ -831,11 +851,25 @@ static void io_writex(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
 
     cpu->mem_io_vaddr = addr;
     cpu->mem_io_pc = retaddr;
+    /* Code page writes (notdirty) are frequent and not logged; a write that
+     * invalidates the running TB restores the count by itself.  */
+    rr_tb = NULL;
+    if (mr != &io_mem_rom && mr != &io_mem_notdirty) {
+        rr_tb = cpu_sync_insn_count(cpu, retaddr);
+    }
+
+    /* Watched RAM, see io_readx().  */
+    if (mr == &io_mem_panda_watch) {
+        memory_region_dispatch_write(mr, physaddr, val, size, iotlbentry->attrs);
+        cpu_unsync_insn_count(cpu, rr_tb);
+        return;
+    }
 
     panda_callbacks_mmio_before_write(cpu, physaddr, addr, size, &val);
 
     if (mr->name && !strcmp(mr->name, "watch")){
         memory_region_dispatch_write(mr, physaddr, val, size, iotlbentry->attrs);
+        cpu_unsync_insn_count(cpu, rr_tb);
         return;
     }
 
@@ -849,6 +883,7 @@ static void io_writex(CPUArchState *env, CPUIOTLBEntry *iotlbentry,
     } else {
         memory_region_dispatch_write(mr, physaddr, val, size, iotlbentry->attrs);
     }
+    cpu_unsync_insn_count(cpu, rr_tb);
 }
 
 /* Return true if ADDR is present in the victim tlb, and has been copied
@@ -73,7 +73,6 @@
 #include "qemu/mmap-alloc.h"
 #endif
 
-#include <zlib.h>
 #include "panda/callbacks/cb-support.h"
 #include "panda/checkpoint.h"
 
@@ -91,7 +90,7 @@ static MemoryRegion *system_io;
 AddressSpace address_space_io;
 AddressSpace address_space_memory;
 
-MemoryRegion io_mem_rom, io_mem_notdirty;
+MemoryRegion io_mem_rom, io_mem_notdirty, io_mem_panda_watch;
 static MemoryRegion io_mem_unassigned;
 
 /* RAM is pre-allocated and passed into qemu_ram_alloc_from_ptr */
@@ -208,6 +207,7 @@ typedef struct subpage_t {
 #define PHYS_SECTION_NOTDIRTY 1
 #define PHYS_SECTION_ROM 2
 #define PHYS_SECTION_WATCH 3
+#define PHYS_SECTION_PANDA_WATCH 4
 
 static void io_mem_init(void);
 static void memory_map_init(void);
@@ -396,7 +396,7 @@ static MemoryRegionSection *phys_page_find(PhysPageEntry lp, hwaddr addr,
 bool memory_region_is_unassigned(MemoryRegion *mr)
 {
     return mr != &io_mem_rom && mr != &io_mem_notdirty && !mr->rom_device
-        && mr != &io_mem_watch;
+        && mr != &io_mem_watch && mr != &io_mem_panda_watch;
 }
 
 /* Called from RCU critical section */
@@ -1230,6 +1230,14 @@ hwaddr memory_region_section_get_iotlb(CPUState *cpu,
         }
     }
 
+    /* PANDA: likewise for RAM pages with ranges watched by
+       panda_watch_range(), to run the memory callbacks for them.  */
+    if (!(*address & TLB_MMIO) && memory_region_is_ram(section->mr)
+        && panda_watch_page(vaddr, paddr, prot)) {
+        iotlb = PHYS_SECTION_PANDA_WATCH + paddr;
+        *address |= TLB_MMIO;
+    }
+
     return iotlb;
 }
 #endif /* defined(CONFIG_USER_ONLY) */
@@ -2488,6 +2496,93 @@ static const MemoryRegionOps watch_mem_ops = {
     .endianness = DEVICE_NATIVE_ENDIAN,
 };
 
+/* PANDA: accesses to pages with ranges watched by panda_watch_range() come
+   here.  The ones that touch a watched range get the memory callbacks, and
+   all of them pass through to the normal out-of-line phys routines.  */
+static MemTxResult panda_watch_mem_read(void *opaque, hwaddr addr,
+                                        uint64_t *pdata, unsigned size,
+                                        MemTxAttrs attrs)
+{
+    CPUState *cpu = current_cpu;
+    MemTxResult res;
+    uint64_t data;
+    int asidx = cpu_asidx_from_attrs(cpu, attrs);
+    AddressSpace *as = cpu->cpu_ases[asidx].as;
+    target_ulong vaddr = cpu->mem_io_vaddr;
+    bool hit = panda_watch_hit(vaddr, addr, size, false);
+
+    if (hit) {
+        panda_callbacks_mem_before_read(cpu, cpu->panda_guest_pc, vaddr,
+                                        size, NULL);
+    }
+    switch (size) {
+    case 1:
+        data = address_space_ldub(as, addr, attrs, &res);
+        break;
+    case 2:
+        data = address_space_lduw(as, addr, attrs, &res);
+        break;
+    case 4:
+        data = address_space_ldl(as, addr, attrs, &res);
+        break;
+    case 8:
+        data = address_space_ldq(as, addr, attrs, &res);
+        break;
+    default: abort();
+    }
+    if (hit) {
+        panda_callbacks_mem_after_read(cpu, cpu->panda_guest_pc, vaddr,
+                                       size, data, NULL);
+    }
+    *pdata = data;
+    return res;
+}
+
+static MemTxResult panda_watch_mem_write(void *opaque, hwaddr addr,
+                                         uint64_t val, unsigned size,
+                                         MemTxAttrs attrs)
+{
+    CPUState *cpu = current_cpu;
+    MemTxResult res;
+    int asidx = cpu_asidx_from_attrs(cpu, attrs);
+    AddressSpace *as = cpu->cpu_ases[asidx].as;
+    target_ulong vaddr = cpu->mem_io_vaddr;
+    bool hit = panda_watch_hit(vaddr, addr, size, true);
+
+    if (hit) {
+        panda_callbacks_mem_before_write(cpu, cpu->panda_guest_pc, vaddr,
+                                         size, val, NULL);
+    }
+    switch (size) {
+    case 1:
+        address_space_stb(as, addr, val, attrs, &res);
+        break;
+    case 2:
+        address_space_stw(as, addr, val, attrs, &res);
+        break;
+    case 4:
+        address_space_stl(as, addr, val, attrs, &res);
+        break;
+    case 8:
+        address_space_stq(as, addr, val, attrs, &res);
+        break;
+    default: abort();
+    }
+    if (hit) {
+        panda_callbacks_mem_after_write(cpu, cpu->panda_guest_pc, vaddr,
+                                        size, val, NULL);
+    }
+    return res;
+}
+
+static const MemoryRegionOps panda_watch_mem_ops = {
+    .read_with_attrs = panda_watch_mem_read,
+    .write_with_attrs = panda_watch_mem_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .valid.max_access_size = 8,
+    .impl.max_access_size = 8,
+};
+
 static MemTxResult subpage_read(void *opaque, hwaddr addr, uint64_t *data,
                                 unsigned len, MemTxAttrs attrs)
 {
@@ -2650,6 +2745,8 @@ static void io_mem_init(void)
                           "notdirty", UINT64_MAX);
     memory_region_init_io(&io_mem_watch, NULL, &watch_mem_ops, NULL,
                           "watch", UINT64_MAX);
+    memory_region_init_io(&io_mem_panda_watch, NULL, &panda_watch_mem_ops,
+                          NULL, "panda-watch", UINT64_MAX);
 }
 
 static void mem_begin(MemoryListener *listener)
@@ -2666,6 +2763,8 @@ static void mem_begin(MemoryListener *listener)
     assert(n == PHYS_SECTION_ROM);
     n = dummy_section(&d->map, as, &io_mem_watch);
     assert(n == PHYS_SECTION_WATCH);
+    n = dummy_section(&d->map, as, &io_mem_panda_watch);
+    assert(n == PHYS_SECTION_PANDA_WATCH);
 
     d->phys_map  = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .skip = 1 };
     d->as = as;
@@ -3344,9 +3443,6 @@ address_space_extend_translation(AddressSpace *as, hwaddr addr, hwaddr target_le
     }
 }
 
-QLIST_HEAD(rr_map_list, RR_MapList) rr_map_list
-    = QLIST_HEAD_INITIALIZER(rr_map_list);
-
 /* Map a physical memory region into a host virtual address.
  * May map a subset of the requested range, given by and returned in *plen.
  * May return NULL if resources needed to perform the mapping are exhausted.
@@ -3401,14 +3497,9 @@ void *address_space_map(AddressSpace *as,
     ptr = qemu_ram_ptr_length(mr->ram_block, xlat, plen, true);
     rcu_read_unlock();
 
-    if (!rr_in_replay()) {
-        // Keep a list of these so we can find out when they change
-        RR_MapList *region = g_malloc(sizeof(*region));
-        region->addr = addr;
-        region->len = *plen; // can't use len because it was modified
-        region->ptr = ptr;
-        region->crc = crc32(crc32(0, Z_NULL, 0), region->ptr, region->len);
-        QLIST_INSERT_HEAD(&rr_map_list, region, link);
+    if (rr_in_record()) {
+        // Keep track of these so we can find out when they change
+        rr_tracked_mem_region_map(addr, ptr, *plen);
     }
 
     return ptr;
@@ -3439,20 +3530,9 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         }
         memory_region_unref(mr);
 
-        // Remove it from the tracked map regions for rec/replay
-        if (!rr_in_replay()) {
-            RR_MapList *region;
-            bool found = false;
-            QLIST_FOREACH(region, &rr_map_list, link) {
-                if (region->ptr == buffer && region->len == len) {
-                    found = true;
-                    break;
-                }
-            }
-            if (found) {
-                QLIST_REMOVE(region, link);
-                g_free(region);
-            }
+        // Remove it from the tracked map regions for record
+        if (rr_in_record()) {
+            rr_tracked_mem_region_unmap(buffer, len);
         }
 
         return;
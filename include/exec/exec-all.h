@@ -65,6 +65,10 @@ void restore_state_to_opc(CPUArchState *env, struct TranslationBlock *tb,
 
 void cpu_gen_init(void);
 bool cpu_restore_state(CPUState *cpu, uintptr_t searched_pc);
+struct TranslationBlock *cpu_sync_insn_count(CPUState *cpu, uintptr_t retaddr);
+struct TranslationBlock *cpu_sync_insn_count_pc(CPUState *cpu);
+void cpu_unsync_insn_count(CPUState *cpu, struct TranslationBlock *tb);
+void cpu_restore_insn_count(CPUState *cpu);
 
 void QEMU_NORETURN cpu_loop_exit_noexc(CPUState *cpu);
 void QEMU_NORETURN cpu_io_recompile(CPUState *cpu, uintptr_t retaddr);
@@ -339,6 +343,11 @@ struct TranslationBlock {
 #define CF_NOCACHE     0x10000 /* To be freed after execution */
 #define CF_USE_ICOUNT  0x20000
 #define CF_IGNORE_ICOUNT 0x40000 /* Do not generate icount code */
+#define CF_RR_BUDGET   0x80000 /* Check replay instruction budget on entry */
+#define CF_RR_TRUNC    0x100000 /* Replay variant cut short at an interrupt;
+                                   CF_COUNT_MASK holds its length */
+#define CF_PRECISE_PC  0x200000 /* Update PC and insn count at every insn */
+#define CF_TB_ICOUNT   0x400000 /* Add the whole insn count on entry */
 
     uint16_t invalid;
 
@@ -402,6 +411,7 @@ struct TranslationBlock {
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUState *cpu);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
+void tb_invalidate_virt_pcs(const uint64_t *pcs, size_t n);
 
 #if defined(USE_DIRECT_JUMP)
 
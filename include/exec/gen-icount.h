@@ -8,6 +8,9 @@
 static int icount_start_insn_idx;
 static TCGLabel *icount_label;
 static TCGLabel *exitreq_label;
+static int rr_budget_start_insn_idx;
+static TCGLabel *rr_budget_label;
+static int rr_icount_insn_idx;
 
 static inline void gen_tb_start(TranslationBlock *tb)
 {
@@ -20,6 +23,57 @@ static inline void gen_tb_start(TranslationBlock *tb)
     tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
     tcg_temp_free_i32(flag);
 
+    if (tb->cflags & CF_RR_BUDGET) {
+        /* Replay: leave the TB chain before running past the next log
+         * event.  Same scheme as icount below, but against the replay
+         * budget the main loop refreshes before entering a TB.  */
+        TCGv_i32 budget, rr_imm;
+
+        rr_budget_label = gen_new_label();
+        budget = tcg_temp_local_new_i32();
+        tcg_gen_ld_i32(budget, cpu_env,
+                       -ENV_OFFSET + offsetof(CPUState, rr_instr_budget));
+
+        rr_imm = tcg_temp_new_i32();
+        rr_budget_start_insn_idx = tcg_op_buf_count();
+        tcg_gen_movi_i32(rr_imm, 0xdeadbeef);
+
+        tcg_gen_sub_i32(budget, budget, rr_imm);
+        tcg_temp_free_i32(rr_imm);
+
+        tcg_gen_brcondi_i32(TCG_COND_LT, budget, 0, rr_budget_label);
+        tcg_gen_st_i32(budget, cpu_env,
+                       -ENV_OFFSET + offsetof(CPUState, rr_instr_budget));
+        tcg_temp_free_i32(budget);
+    }
+
+    if (tb->cflags & CF_TB_ICOUNT) {
+        /* Record/replay: count all of the TB's instructions now that it is
+         * known to run, and remember the TB so that cpu_restore_state can
+         * take back the ones it did not get to.  */
+        TCGv_i64 rr_count, rr_count_imm;
+        TCGv_ptr tb_ptr;
+
+        rr_count = tcg_temp_new_i64();
+        tcg_gen_ld_i64(rr_count, cpu_env,
+                       -ENV_OFFSET + offsetof(CPUState, rr_guest_instr_count));
+
+        rr_count_imm = tcg_temp_new_i64();
+        rr_icount_insn_idx = tcg_op_buf_count();
+        tcg_gen_movi_i64(rr_count_imm, 0xdeadbeef);
+
+        tcg_gen_add_i64(rr_count, rr_count, rr_count_imm);
+        tcg_temp_free_i64(rr_count_imm);
+        tcg_gen_st_i64(rr_count, cpu_env,
+                       -ENV_OFFSET + offsetof(CPUState, rr_guest_instr_count));
+        tcg_temp_free_i64(rr_count);
+
+        tb_ptr = tcg_const_ptr(tb);
+        tcg_gen_st_ptr(tb_ptr, cpu_env,
+                       -ENV_OFFSET + offsetof(CPUState, rr_icount_tb));
+        tcg_temp_free_ptr(tb_ptr);
+    }
+
     if (!(tb->cflags & CF_USE_ICOUNT)) {
         return;
     }
@@ -50,6 +104,16 @@ static void gen_tb_end(TranslationBlock *tb, int num_insns)
     gen_set_label(exitreq_label);
     tcg_gen_exit_tb((uintptr_t)tb + TB_EXIT_REQUESTED);
 
+    if (tb->cflags & CF_RR_BUDGET) {
+        tcg_set_insn_param(rr_budget_start_insn_idx, 1, num_insns);
+        gen_set_label(rr_budget_label);
+        tcg_gen_exit_tb((uintptr_t)tb + TB_EXIT_ICOUNT_EXPIRED);
+    }
+
+    if (tb->cflags & CF_TB_ICOUNT) {
+        tcg_set_insn_param(rr_icount_insn_idx, 1, num_insns);
+    }
+
     if (tb->cflags & CF_USE_ICOUNT) {
         /* Update the num_insn immediate parameter now that we know
          * the actual insn count.  */
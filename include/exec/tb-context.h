@@ -40,6 +40,10 @@ struct TBContext {
     /* statistics */
     unsigned tb_flush_count;
     int tb_phys_invalidate_count;
+
+    /* replay TBs truncated at an interrupt: translated vs. reused */
+    unsigned rr_trunc_gen_count;
+    unsigned rr_trunc_hit_count;
 };
 
 #endif
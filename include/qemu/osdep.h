@@ -233,6 +233,11 @@ void qemu_anon_ram_free(void *ptr, size_t size);
 #else
 #define QEMU_MADV_DONTFORK  QEMU_MADV_INVALID
 #endif
+#ifdef MADV_DOFORK
+#define QEMU_MADV_DOFORK    MADV_DOFORK
+#else
+#define QEMU_MADV_DOFORK    QEMU_MADV_INVALID
+#endif
 #ifdef MADV_MERGEABLE
 #define QEMU_MADV_MERGEABLE MADV_MERGEABLE
 #else
@@ -269,6 +274,7 @@ void qemu_anon_ram_free(void *ptr, size_t size);
 #define QEMU_MADV_WILLNEED  POSIX_MADV_WILLNEED
 #define QEMU_MADV_DONTNEED  POSIX_MADV_DONTNEED
 #define QEMU_MADV_DONTFORK  QEMU_MADV_INVALID
+#define QEMU_MADV_DOFORK    QEMU_MADV_INVALID
 #define QEMU_MADV_MERGEABLE QEMU_MADV_INVALID
 #define QEMU_MADV_UNMERGEABLE QEMU_MADV_INVALID
 #define QEMU_MADV_DODUMP QEMU_MADV_INVALID
@@ -281,6 +287,7 @@ void qemu_anon_ram_free(void *ptr, size_t size);
 #define QEMU_MADV_WILLNEED  QEMU_MADV_INVALID
 #define QEMU_MADV_DONTNEED  QEMU_MADV_INVALID
 #define QEMU_MADV_DONTFORK  QEMU_MADV_INVALID
+#define QEMU_MADV_DOFORK    QEMU_MADV_INVALID
 #define QEMU_MADV_MERGEABLE QEMU_MADV_INVALID
 #define QEMU_MADV_UNMERGEABLE QEMU_MADV_INVALID
 #define QEMU_MADV_DODUMP QEMU_MADV_INVALID
@@ -392,6 +392,14 @@ struct CPUState {
     int32_t exception_index; /* used by m68k TCG */
     uint64_t rr_guest_instr_count;
     vaddr panda_guest_pc;
+    // CF_TB_ICOUNT TB that counted all its instructions on entry, and how
+    // many of those are held back while rr_guest_instr_count is made exact
+    // for an instruction in the middle of it.
+    struct TranslationBlock *rr_icount_tb;
+    uint32_t rr_icount_ahead;
+    // Instructions chained TBs may still run before the next replay event.
+    // Only consulted by TBs translated with CF_RR_BUDGET.
+    int32_t rr_instr_budget;
 
     // Used for rr reverse debugging
     uint8_t reverse_flags;
@@ -1286,13 +1286,10 @@ done:
     return ret;
 }
 
-static int qemu_save_device_state(QEMUFile *f)
+static int qemu_save_device_state_sections(QEMUFile *f)
 {
     SaveStateEntry *se;
 
-    qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
-    qemu_put_be32(f, QEMU_VM_FILE_VERSION);
-
     cpu_synchronize_all_states();
 
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
@@ -1318,6 +1315,24 @@ static int qemu_save_device_state(QEMUFile *f)
     return qemu_file_get_error(f);
 }
 
+static int qemu_save_device_state(QEMUFile *f)
+{
+    qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
+    qemu_put_be32(f, QEMU_VM_FILE_VERSION);
+
+    return qemu_save_device_state_sections(f);
+}
+
+/* PANDA: device state that qemu_loadvm_state() can load back, that is with
+ * the configuration section when it expects one.  Unlike the stream
+ * qemu_save_device_state() writes for Xen, which must stay as it is.  */
+int panda_save_device_state(QEMUFile *f)
+{
+    qemu_savevm_state_header(f);
+
+    return qemu_save_device_state_sections(f);
+}
+
 static SaveStateEntry *find_se(const char *idstr, int instance_id)
 {
     SaveStateEntry *se;
@@ -97,6 +97,11 @@ typedef enum panda_cb_type {
 
     PANDA_CB_BEFORE_HANDLE_INTERRUPT, // ditto, for interrupts
 
+    PANDA_CB_START_BLOCK_EXEC,      // Before executing each basic block,
+                                    // called from the block's code
+    PANDA_CB_END_BLOCK_EXEC,        // After executing each basic block,
+                                    // called from the block's code
+
     PANDA_CB_LAST
 } panda_cb_type;
 
@@ -999,6 +1004,46 @@ typedef union panda_cb {
 
     int32_t (*before_handle_interrupt)(CPUState *cpu, int32_t interrupt_request);
 
+    /* Callback ID: PANDA_CB_START_BLOCK_EXEC
+
+       start_block_exec:
+        Called before execution of every basic block, like
+        before_block_exec. The call is made from the block's generated
+        code rather than from cpu-exec.c, so blocks can still be chained
+        to each other.
+
+       Arguments:
+        CPUState *env:        the current CPU state
+        TranslationBlock *tb: the TB we are about to execute
+
+       Helper call location: TCG-generated code, see translate-all.c
+
+       Return value:
+        none
+    */
+    void (*start_block_exec)(CPUState *env, TranslationBlock *tb);
+
+    /* Callback ID: PANDA_CB_END_BLOCK_EXEC
+
+       end_block_exec:
+        Called after execution of every basic block, from the block's
+        generated code like start_block_exec. It runs just before the
+        block jumps to the next one or returns to cpu-exec.c, when the
+        guest PC may not point to the next block yet. Unlike
+        after_block_exec, it is not called for blocks that are left
+        early, e.g. because of an exception.
+
+       Arguments:
+        CPUState *env:        the current CPU state
+        TranslationBlock *tb: the TB we just executed
+
+       Helper call location: TCG-generated code, see translate-all.c
+
+       Return value:
+        none
+    */
+    void (*end_block_exec)(CPUState *env, TranslationBlock *tb);
+
     void (*cbaddr)(void);
 } panda_cb;
 
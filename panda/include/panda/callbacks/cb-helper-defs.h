@@ -13,6 +13,9 @@
 PANDAENDCOMMENT */
 DEF_HELPER_1(panda_insn_exec, void, tl)
 DEF_HELPER_1(panda_after_insn_exec, void, tl)
+DEF_HELPER_1(panda_start_block_exec, void, ptr)
+DEF_HELPER_1(panda_end_block_exec, void, ptr)
+DEF_HELPER_2(panda_hooks, void, ptr, i64)
 
 #if defined(TARGET_ARM)
 DEF_HELPER_1(panda_guest_hypercall, void, env)
@@ -0,0 +1,72 @@
+/* PANDABEGINCOMMENT
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+#pragma once
+/*
+ * Code generation for the insn_exec and after_insn_exec callbacks, included
+ * by the target translators after exec/helper-gen.h.
+ *
+ * When a single callback is enabled (see panda_cb_direct()), generated code
+ * calls it directly with first_cpu and pc rather than going through the
+ * helper that dispatches over all of them, as long as panda_cb_direct_gen
+ * hasn't changed since the block was translated.
+ */
+#include "panda/plugin.h"
+
+static inline void gen_panda_insn_cb_direct(void *fn, uint32_t gen,
+                                            const char *name, target_ulong pc)
+{
+    TCGLabel *skip = gen_new_label();
+    TCGv_ptr gen_ptr = tcg_const_ptr(&panda_cb_direct_gen);
+    TCGv_i32 cur_gen = tcg_temp_new_i32();
+    TCGv_ptr arg1;
+    TCGv arg2;
+    TCGArg args[2];
+
+    tcg_gen_ld_i32(cur_gen, gen_ptr, 0);
+    tcg_gen_brcondi_i32(TCG_COND_NE, cur_gen, gen, skip);
+    tcg_temp_free_i32(cur_gen);
+    tcg_temp_free_ptr(gen_ptr);
+
+    arg1 = tcg_const_ptr(first_cpu);
+    arg2 = tcg_const_tl(pc);
+    args[0] = dh_arg(ptr, 1);
+    args[1] = dh_arg(tl, 2);
+
+    // The int returned by the callback is ignored, like the helper does
+    tcg_register_helper(&tcg_ctx, fn, name, 0,
+                        dh_sizemask(void, 0) | dh_sizemask(ptr, 1) |
+                        dh_sizemask(tl, 2));
+    tcg_gen_callN(&tcg_ctx, fn, TCG_CALL_DUMMY_ARG, 2, args);
+    tcg_temp_free_ptr(arg1);
+    tcg_temp_free(arg2);
+    gen_set_label(skip);
+}
+
+static inline void gen_panda_insn_exec(target_ulong pc)
+{
+    // read the generation first, so a change in between only skips calls
+    uint32_t gen = atomic_mb_read(&panda_cb_direct_gen);
+    void *fn = panda_cb_direct(PANDA_CB_INSN_EXEC);
+
+    if (fn) {
+        gen_panda_insn_cb_direct(fn, gen, "panda_insn_exec_cb", pc);
+    } else {
+        gen_helper_panda_insn_exec(tcg_const_tl(pc));
+    }
+}
+
+static inline void gen_panda_after_insn_exec(target_ulong pc)
+{
+    uint32_t gen = atomic_mb_read(&panda_cb_direct_gen);
+    void *fn = panda_cb_direct(PANDA_CB_AFTER_INSN_EXEC);
+
+    if (fn) {
+        gen_panda_insn_cb_direct(fn, gen, "panda_after_insn_exec_cb", pc);
+    } else {
+        gen_helper_panda_after_insn_exec(tcg_const_tl(pc));
+    }
+}
@@ -17,18 +17,28 @@ PANDAENDCOMMENT */
 
 void HELPER(panda_insn_exec)(target_ulong pc) {
     // PANDA instrumentation: before basic block
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_INSN_EXEC]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.insn_exec(first_cpu, pc);
-    }
+    panda_callbacks_insn_exec(first_cpu, pc);
 }
 
 void HELPER(panda_after_insn_exec)(target_ulong pc) {
     // PANDA instrumentation: after basic block
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_AFTER_INSN_EXEC]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.after_insn_exec(first_cpu, pc);
-    }
+    panda_callbacks_after_insn_exec(first_cpu, pc);
+}
+
+// Calls to these are added to each TB by translate-all.c
+void HELPER(panda_start_block_exec)(void *tb) {
+    panda_callbacks_start_block_exec(first_cpu, tb);
+}
+
+void HELPER(panda_end_block_exec)(void *tb) {
+    panda_callbacks_end_block_exec(first_cpu, tb);
+}
+
+void HELPER(panda_hooks)(void *tb, uint64_t pc) {
+    // Hooks see the count of the hooked instruction, not the whole block's
+    TranslationBlock *rr_tb = cpu_sync_insn_count(first_cpu, GETPC());
+    panda_run_hooks(first_cpu, tb, pc);
+    cpu_unsync_insn_count(first_cpu, rr_tb);
 }
 
 #if defined(TARGET_ARM)
@@ -47,16 +47,24 @@
 //       panda_cbs[NAME]. Unfortunately the preprocessor can't do the case conversion
 //       for us. Is there a better way than taking in both as arguments?
 
+// Callbacks are dispatched from the flat arrays in panda_cbs_enabled. A
+// callback can register or disable callbacks while it runs, which replaces
+// the array, so it is only read inside an RCU critical section.
+#define PANDA_CBS_ENABLED(name_upper) \
+    atomic_rcu_read(&panda_cbs_enabled[PANDA_CB_ ## name_upper])
+
 // Call all enabled & registered functions for this callback. Return void
 #define MAKE_CALLBACK_void(name_upper, name, ...) \
     void panda_callbacks_ ## name(COMBINE_TYPES(__VA_ARGS__)) { \
-        panda_cb_list *plist; \
-        for (plist = panda_cbs[PANDA_CB_ ## name_upper]; \
-             plist != NULL; \
-             plist = panda_cb_list_next(plist)) { \
-              if (plist->enabled) \
-                plist->entry. ENTRY_NAME(name, EVERY_SECOND(__VA_ARGS__)); \
+        panda_cb_array *cbs; \
+        if (!atomic_read(&panda_cbs_enabled[PANDA_CB_ ## name_upper])) \
+            return; \
+        rcu_read_lock(); \
+        cbs = PANDA_CBS_ENABLED(name_upper); \
+        for (int i = 0; cbs && i < cbs->n; i++) { \
+            cbs->fns[i]. ENTRY_NAME(name, EVERY_SECOND(__VA_ARGS__)); \
         } \
+        rcu_read_unlock(); \
     }
 
 // Call all enabled & registered functions for this callback. Return
@@ -64,14 +72,16 @@
 // XXX: double underscore in name is intentional
 #define MAKE_CALLBACK__Bool(name_upper, name, ...) \
     bool panda_callbacks_ ## name(COMBINE_TYPES(__VA_ARGS__)) { \
-        panda_cb_list *plist; \
+        panda_cb_array *cbs; \
         bool any_true = false; \
-        for (plist = panda_cbs[PANDA_CB_ ## name_upper]; \
-             plist != NULL; \
-             plist = panda_cb_list_next(plist)) { \
-              if (plist->enabled) \
-                any_true |= plist->entry. ENTRY_NAME(name, EVERY_SECOND(__VA_ARGS__)); \
+        if (!atomic_read(&panda_cbs_enabled[PANDA_CB_ ## name_upper])) \
+            return false; \
+        rcu_read_lock(); \
+        cbs = PANDA_CBS_ENABLED(name_upper); \
+        for (int i = 0; cbs && i < cbs->n; i++) { \
+            any_true |= cbs->fns[i]. ENTRY_NAME(name, EVERY_SECOND(__VA_ARGS__)); \
         } \
+        rcu_read_unlock(); \
         return any_true; \
     }
 
@@ -89,12 +99,12 @@
 #define MAKE_REPLAY_ONLY_CALLBACK(name_upper, name, ...) \
     void panda_callbacks_ ## name(COMBINE_TYPES(__VA_ARGS__)) { \
         if (rr_in_replay()) { \
-          panda_cb_list *plist; \
-          for (plist = panda_cbs[PANDA_CB_ ## name_upper]; \
-               plist != NULL; \
-               plist = panda_cb_list_next(plist)) { \
-                if (plist->enabled) \
-                  plist->entry. ENTRY_NAME(name, EVERY_SECOND(__VA_ARGS__)); \
+          panda_cb_array *cbs; \
+          rcu_read_lock(); \
+          cbs = PANDA_CBS_ENABLED(name_upper); \
+          for (int i = 0; cbs && i < cbs->n; i++) { \
+              cbs->fns[i]. ENTRY_NAME(name, EVERY_SECOND(__VA_ARGS__)); \
           } \
+          rcu_read_unlock(); \
         } \
     }
@@ -63,6 +63,22 @@ void panda_callbacks_mem_after_read(CPUState *env, target_ptr_t pc, target_ptr_t
 void panda_callbacks_mem_before_write(CPUState *env, target_ptr_t pc, target_ptr_t addr, size_t data_size, uint64_t val, void *ram_ptr);
 void panda_callbacks_mem_after_write(CPUState *env, target_ptr_t pc, target_ptr_t addr, size_t data_size, uint64_t val, void *ram_ptr);
 
+/* invoked from exec.c, for ranges watched with panda_watch_range() */
+bool panda_watch_page(target_ptr_t vaddr, hwaddr paddr, int prot);
+bool panda_watch_hit(target_ptr_t vaddr, hwaddr paddr, size_t size, bool is_write);
+
+/* invoked from generated code, see translate-all.c */
+void panda_callbacks_start_block_exec(CPUState *env, TranslationBlock *tb);
+void panda_callbacks_end_block_exec(CPUState *env, TranslationBlock *tb);
+void panda_run_hooks(CPUState *env, TranslationBlock *tb, target_ptr_t pc);
+
+/* invoked from translate-all.c, for hooks added with panda_hook_add() */
+bool panda_hooks_present(void);
+bool panda_precise_pc_needed(void);
+bool panda_hooked(target_ptr_t pc);
+/* invoked before block lookups, see cb-support.c */
+void panda_hooks_invalidate(void);
+
 /* invoked from cpu-exec.c */
 void panda_callbacks_before_find_fast(void);
 bool panda_callbacks_after_find_fast(CPUState *cpu, TranslationBlock *tb, bool bb_invalidate_done, bool *invalidate);
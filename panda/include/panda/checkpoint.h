@@ -1,5 +1,8 @@
 #include "panda/rr/rr_log.h"
 
+// A deduplicated guest page; NULL stands for a page of zeroes.
+typedef struct CheckpointPage CheckpointPage;
+
 typedef struct Checkpoint {
     uint64_t guest_instr_count;
     size_t nondet_log_position;
@@ -10,20 +13,59 @@ typedef struct Checkpoint {
 
     unsigned next_progress;
 
+    // device state only; RAM is kept in the page store below
     int memfd;
 
     size_t memfd_usage;
 
+    // RAM is stored as the pages that changed since the parent checkpoint.
+    // Every so often a keyframe also keeps a full page table so that
+    // rebuilding RAM never has to walk far back.
+    struct Checkpoint *parent;
+    unsigned depth;             // checkpoints since the last keyframe
+    CheckpointPage **pages;     // full page table, keyframes only
+    uint32_t *dirty_idx;
+    CheckpointPage **dirty_pages;
+    size_t num_dirty;
+    size_t ram_usage;           // bytes of new pages and metadata
+
+    // fork backend: parked process holding this checkpoint's RAM, and the
+    // pipe that keeps it parked
+    pid_t pid;
+    int park_fd;
+    size_t private_usage;       // bytes only that process holds, as measured
+
     QLIST_ENTRY(Checkpoint) next;
 } Checkpoint;
 
-#define MAX_CHECKPOINTS 256
+#define MAX_CHECKPOINTS 65536
 extern Checkpoint* checkpoints[MAX_CHECKPOINTS];
 
 /*void* search_checkpoints(uint64_t target_instr);*/
 size_t get_num_checkpoints(void);
+size_t get_checkpoint_total_usage(void);
 int get_closest_checkpoint_num(uint64_t instr_count);
 Checkpoint* get_checkpoint(int num);
 void* panda_checkpoint(void);
 void panda_restore_by_num(int num);
 void panda_restore(void *opaque);
+
+// Saved checkpoints are full VM snapshots kept next to the recording as
+// <name>-rr-ckpt-<instr>, and listed in <name>-rr-ckpt.idx, so that later
+// replays can start from them (-replay-checkpoint).
+typedef struct SavedCheckpoint {
+    uint64_t guest_instr_count;
+    uint64_t nondet_log_position;
+    char *file;
+} SavedCheckpoint;
+
+// Save a checkpoint of the current replay point to disk.
+bool panda_checkpoint_save(void);
+// Find the latest saved checkpoint of the recording <prefix> at or before
+// instr_count. On success the caller frees saved->file.
+bool panda_checkpoint_find_saved(const char *prefix, uint64_t instr_count,
+                                 SavedCheckpoint *saved);
+
+// Keep checkpoint RAM in forked copy-on-write processes instead of the
+// in-memory page store. Must be called before the first checkpoint.
+void panda_checkpoint_use_fork(void);
@@ -68,8 +68,45 @@ target_ulong panda_current_asid(CPUState *env);
  */
 target_ulong panda_current_pc(CPUState *cpu);
 
+/**
+ * @brief One read of a panda_virtual_memory_read_vec() batch. \p ret is
+ * set to what panda_virtual_memory_read() would have returned.
+ */
+typedef struct panda_mem_req {
+    target_ulong addr;
+    uint8_t *buf;
+    int len;
+    int ret;
+} panda_mem_req;
+
+/**
+ * @brief Reads \p n ranges of guest virtual memory. Returns the number of
+ * reads that failed.
+ */
+int panda_virtual_memory_read_vec(CPUState *env, panda_mem_req *reqs, int n);
+
+/**
+ * @brief Returns the number of hits and misses of PANDA's translation cache.
+ */
+void panda_tlb_stats(uint64_t *hits, uint64_t *misses);
+
 // END_PYPANDA_NEEDS_THIS -- do not delete this comment!
 
+/**
+ * @brief Translates the guest virtual page \p page to a guest physical
+ * page, or -1 if it isn't mapped.
+ *
+ * Translations are cached by (asid, page) until the guest flushes its TLB,
+ * see panda_tlb_flush().
+ */
+hwaddr panda_virt_to_phys_page(CPUState *env, target_ulong page);
+
+/**
+ * @brief Drops PANDA's cached translations. Called whenever QEMU's TLB is
+ * flushed, in whole or for a page.
+ */
+void panda_tlb_flush(void);
+
 /**
  * @brief Reads/writes data into/from \p buf from/to guest physical address \p addr.
  */
@@ -102,7 +139,7 @@ static inline hwaddr panda_virt_to_phys(CPUState *env, target_ulong addr) {
     target_ulong page;
     hwaddr phys_addr;
     page = addr & TARGET_PAGE_MASK;
-    phys_addr = cpu_get_phys_page_debug(env, page);
+    phys_addr = panda_virt_to_phys_page(env, page);
     if (phys_addr == -1) {
         // no physical page mapped
         return -1;
@@ -126,31 +163,30 @@ void exit_priv(CPUState* cpu);
 
 
 /**
- * @brief Reads/writes data into/from \p buf from/to guest virtual address \p addr.
- *
- * For ARM/MIPS we switch into privileged mode if the access fails. The mode is always reset
- * before we return.
+ * @brief Like panda_virtual_memory_rw(), but leaves the guest in privileged
+ * mode if it had to be entered, which is recorded in \p changed_priv. A batch
+ * of accesses thus switches modes at most once; the caller calls exit_priv()
+ * when done if \p changed_priv is set.
  */
-static inline int panda_virtual_memory_rw(CPUState *env, target_ulong addr,
-                                          uint8_t *buf, int len, bool is_write) {
+static inline int panda_virtual_memory_rw_batch(CPUState *env, target_ulong addr,
+                                                uint8_t *buf, int len, bool is_write,
+                                                bool *changed_priv) {
     int l;
     int ret;
     hwaddr phys_addr;
     target_ulong page;
-    bool changed_priv = false;
 
     while (len > 0) {
         page = addr & TARGET_PAGE_MASK;
-        phys_addr = cpu_get_phys_page_debug(env, page);
+        phys_addr = panda_virt_to_phys_page(env, page);
         // If we failed and we aren't in priv mode and we CAN go into it, toggle modes and try again
-        if (phys_addr == -1  && !changed_priv && (changed_priv=enter_priv(env))) {
-            phys_addr = cpu_get_phys_page_debug(env, page);
+        if (phys_addr == -1  && !*changed_priv && (*changed_priv=enter_priv(env))) {
+            phys_addr = panda_virt_to_phys_page(env, page);
             //if (phys_addr != -1) printf("[panda dbg] virt->phys failed until privileged mode\n");
         }
 
         // No physical page mapped, even after potential privileged switch, abort
         if (phys_addr == -1)  {
-            if (changed_priv) exit_priv(env); // Cleanup mode if necessary
             return -1;
         }
 
@@ -162,13 +198,12 @@ static inline int panda_virtual_memory_rw(CPUState *env, target_ulong addr,
         ret = panda_physical_memory_rw(phys_addr, buf, l, is_write);
 
         // Failed and privileged mode wasn't already enabled - enable priv and retry if we can
-        if (ret != MEMTX_OK && !changed_priv && (changed_priv = enter_priv(env))) {
+        if (ret != MEMTX_OK && !*changed_priv && (*changed_priv = enter_priv(env))) {
             ret = panda_physical_memory_rw(phys_addr, buf, l, is_write);
             //if (ret == MEMTX_OK) printf("[panda dbg] accessing phys failed until privileged mode\n");
         }
         // Still failed, even after potential privileged switch, abort
         if (ret != MEMTX_OK) {
-            if (changed_priv) exit_priv(env); // Cleanup mode if necessary
             return ret;
         }
 
@@ -176,10 +211,24 @@ static inline int panda_virtual_memory_rw(CPUState *env, target_ulong addr,
         buf += l;
         addr += l;
     }
-    if (changed_priv) exit_priv(env); // Clear privileged mode if necessary
     return 0;
 }
 
+/**
+ * @brief Reads/writes data into/from \p buf from/to guest virtual address \p addr.
+ *
+ * For ARM/MIPS we switch into privileged mode if the access fails. The mode is always reset
+ * before we return.
+ */
+static inline int panda_virtual_memory_rw(CPUState *env, target_ulong addr,
+                                          uint8_t *buf, int len, bool is_write) {
+    bool changed_priv = false;
+    int ret = panda_virtual_memory_rw_batch(env, addr, buf, len, is_write,
+                                            &changed_priv);
+    if (changed_priv) exit_priv(env); // Clear privileged mode if necessary
+    return ret;
+}
+
 /**
  * @brief Reads data into \p buf from guest virtual address \p addr.
  */
@@ -17,6 +17,7 @@ void panda_cont(void);
 void _panda_set_library_mode(const bool);
 int panda_delvm(char *snapshot_name);
 void panda_start_pandalog(const char *name);
+bool panda_set_pandalog_codec(const char *codec);
 int panda_revert(char *snapshot_name);
 void panda_reset(void);
 int panda_snap(char *snapshot_name);
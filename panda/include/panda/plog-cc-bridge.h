@@ -5,6 +5,8 @@
  *
  */
 
+#include <stdbool.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -14,9 +16,16 @@ void pandalog_init(const char *fname);
 // Closes global C++ pandalog in common.c
 void pandalog_cc_close(void);
 
+// Waits for the pandalog's worker threads to go idle, e.g. before a fork
+void pandalog_cc_quiesce(void);
+
 //Interface for plog.c to pass a packed protobuf entry to C++ pandalog
 void pandalog_write_packed(size_t entry_size, unsigned char* buf);
 
+// Interface for plog.c to pack an entry straight into the current chunk:
+// returns where to put the entry_size packed bytes of an entry for instr
+unsigned char *pandalog_cc_reserve(size_t entry_size, uint64_t instr);
+
 // Interface for plog.c to read an entry
 unsigned char* pandalog_read_packed(void);
 
@@ -32,6 +41,10 @@ void pandalog_cc_init_write(const char* path);
 //Seek to an instr
 void pandalog_cc_seek(uint64_t instr);
 
+// Select the chunk codec (zlib, zstd or lz4) for the log being written.
+// Returns false if the codec is unknown or not built in.
+bool pandalog_cc_set_codec(const char *name);
+
 #ifdef __cplusplus
 }
 #endif
@@ -24,11 +24,30 @@ extern "C" {
 #include <iostream>
 #include <memory>
 #include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
 #include "plog.pb.h"
 
-#define PL_CURRENT_VERSION 2
+#define PL_CURRENT_VERSION 3
 // compression level
 #define PL_Z_LEVEL 9
+#define PL_ZSTD_LEVEL 3
+// threads compressing full chunks, and how many full chunks may wait for
+// them before the writer blocks
+#define PL_COMPRESS_THREADS 2
+#define PL_MAX_PENDING_CHUNKS 4
+// threads decompressing chunks while reading, and how many chunks past the
+// one being read they decompress
+#define PL_READ_THREADS 4
+#define PL_READ_AHEAD 4
+// a chunk index lists at most this many asids; past that it matches any
+#define PL_INDEX_MAX_ASIDS 64
 // 16 MB chunk
 #define PL_CHUNKSIZE (1024 * 1024 * 16)
 // header at most this many bytes
@@ -39,6 +58,7 @@ typedef struct pandalog_header_struct {
     uint32_t version;     // version number
     uint64_t dir_pos;     // position in file of directory
     uint32_t chunk_size;  // chunk size
+    uint32_t codec;       // chunk codec (PlCodec), version 3 and later
 } PlHeader;
 
 // directory mapping instructions to chunks in the outfile
@@ -62,18 +82,63 @@ struct PandalogCcChunk {
     //pandalog_cc_chunk_struct() : entries(128){}
 
     uint32_t size;              // in bytes of a chunk
+    size_t cap;                 // allocated bytes of buf; more than size once one
+                                // instr's entries didn't fit (while writing)
     uint32_t zsize;             // in bytes of a compressed chunk. 
     unsigned char *buf;         // uncompressed chunk data
     unsigned char *buf_p;       // pointer into uncompressed chunk (used while writing)
     unsigned char *zbuf;        // corresponding compressed chunk
     // these are used while writing to remember things needed for dir entry
-    uint32_t start_instr;       // first instruction in current chunk 
+    uint64_t start_instr;       // first instruction in current chunk, -1 until
+                                // an entry with an instr is written to it
     uint64_t start_pos;         // pos in file of start of current chunk
-    // these are used while reading and contain current chunk data, expanded into pl entries
-    std::vector<std::unique_ptr<panda::LogEntry>> entries;    // this will be array of entries in current chunk 
-    uint32_t num_entries;       // size of that array 
-    uint32_t max_num_entries;   // capacity of that array
-    uint32_t ind_entry;         // index into array of entries
+    // these are used while reading, for the current chunk
+    uint32_t num_entries;       // number of entries in it
+    uint32_t ind_entry;         // index of the next entry to read
+};
+
+// a chunk decompressed while reading. entries are parsed out of buf the
+// first time they are asked for, into an arena that goes with the chunk
+struct PandalogCcReadChunk {
+    std::vector<unsigned char> buf;                 // uncompressed chunk data
+    std::vector<uint32_t> offsets;                  // where each entry's size is in buf
+    std::vector<const panda::LogEntry *> entries;   // parsed entries, NULL until then
+    google::protobuf::Arena arena;
+
+    // packed entry i and its size
+    const unsigned char *packed(uint32_t i, uint32_t *size) const;
+    // entry i, parsed
+    const panda::LogEntry *entry(uint32_t i);
+};
+
+// what the entries of a chunk hold, so queries can skip the chunk
+struct PandalogCcChunkIndex {
+    bool built;
+    uint64_t pc_min;
+    uint64_t pc_max;
+    std::vector<uint32_t> fields;   // LogEntry field numbers set in some entry, sorted
+    bool any_asid;                  // too many asids to list
+    std::vector<uint64_t> asids;    // distinct asids of entries with one, sorted
+};
+
+// selects entries for PandaLog::query. by default everything matches
+struct PandalogQuery {
+    uint32_t field = 0;         // LogEntry field number that must be set, e.g.
+                                // panda::LogEntry::kTaintedBranchFieldNumber
+    bool has_asid = false;      // match only entries whose asid field is asid
+    uint64_t asid = 0;
+    uint64_t pc_lo = 0;         // match only entries with pc in [pc_lo, pc_hi]
+    uint64_t pc_hi = UINT64_MAX;
+};
+
+// a full chunk handed off to the compression threads
+struct PandalogCcJob {
+    uint32_t chunk_num;
+    uint32_t num_entries;
+    PlCodec codec;
+    unsigned char *buf;         // uncompressed chunk data, owned by the job
+    unsigned long size;         // in bytes of that data
+    size_t cap;                 // allocated bytes of buf
 };
 
 class PandaLog {
@@ -83,14 +148,53 @@ class PandaLog {
     PandalogCcDir dir;
     PandalogCcChunk chunk;
     uint32_t chunk_num;
+    PlCodec codec;
+
+    // While writing, full chunks are compressed by a pool of threads so the
+    // thread calling write_entry only hands them off. Compressed chunks are
+    // written to the file in chunk order by whichever thread finishes the
+    // next one, so the directory can be assembled in order.
+    std::vector<std::thread> workers;
+    std::mutex jobs_lock;                       // protects the fields below
+    std::condition_variable jobs_cv;
+    std::deque<PandalogCcJob> jobs;             // full chunks waiting for a worker
+    uint32_t jobs_pending;                      // full chunks not yet in the file
+    bool stopping;
+    std::vector<unsigned char *> free_bufs;     // chunk buffers for reuse
+    std::mutex file_lock;                       // protects the fields below and file
+    std::map<uint32_t, std::vector<unsigned char>> compressed;  // waiting for their turn
+    uint32_t next_chunk_out;                    // next chunk to go to the file
+
+    // While reading, the same pool of threads decompresses the chunk being
+    // read and the ones after it (before it, reading backward). Entries are
+    // parsed only when they are read.
+    std::deque<uint32_t> read_jobs;             // chunks waiting for a worker, under jobs_lock
+    std::set<uint32_t> read_queued;             // chunks queued or being decompressed, ditto
+    std::map<uint32_t, std::shared_ptr<PandalogCcReadChunk>> read_chunks;  // decompressed, ditto
+    std::shared_ptr<PandalogCcReadChunk> cur_chunk;     // chunk being read
+    bool indexing;                              // workers also fill in index, under jobs_lock
+    std::vector<PandalogCcChunkIndex> index;    // per chunk, once build_index is called
 
 public:    
     //default constructor
     PandaLog(): mode(PL_MODE_UNKNOWN){
         mode = PL_MODE_UNKNOWN;
         chunk_num = 0;
+        codec = PL_CODEC_ZLIB;
+        jobs_pending = 0;
+        stopping = false;
+        next_chunk_out = 0;
+        indexing = false;
     };
 
+    ~PandaLog(){
+        stop_workers();
+    }
+
+    // select the codec for compressing chunks. only valid before the first
+    // chunk is full. returns false if support for it wasn't built in.
+    bool set_codec(PlCodec codec);
+
     // open pandalog for write with this uncompressed chunk size
     void open_write(const char *path, uint32_t chunk_size);
 
@@ -109,14 +213,45 @@ public:
 
     void write_entry(std::unique_ptr<panda::LogEntry> entry);
 
+    // make room in the current chunk for an n byte packed entry for instr
+    // and return where to put it. the entry's pc and instr fields must
+    // already be set, and the caller must write exactly n bytes there
+    // before the next call.
+    unsigned char *reserve_entry(size_t n, uint64_t instr);
+
+    // returns a copy of the next entry, or NULL at the end of the log
     std::unique_ptr<panda::LogEntry> read_entry(void);
 
+    // like read_entry, but returns the entry itself rather than a copy. it
+    // stays valid for as long as the pointer is held.
+    std::shared_ptr<const panda::LogEntry> read_entry_view(void);
+
+    // like read_entry, but returns the packed entry without parsing it. it
+    // stays valid until the reader moves to another chunk.
+    const unsigned char *read_entry_packed(uint32_t *size);
+
+    // builds the per-chunk index that lets query skip chunks, decompressing
+    // every chunk in parallel. the index is saved next to the log as
+    // <log>.idx and loaded from there the next time.
+    void build_index(void);
+
+    // calls fn on every entry that matches q, in log order. entries are
+    // matched before they are parsed, and once the index is built chunks
+    // that can't hold a match aren't decompressed at all. doesn't move the
+    // position read_entry reads from.
+    void query(const PandalogQuery &q,
+               const std::function<void(const panda::LogEntry &)> &fn);
+
     // seek to the element in pandalog corresponding to this instr
     // only valid in read mode.  
     // if PL_MODE_READ_FWD then we seek to FIRST element in log for this instr
     // if PL_MODE_READ_BWD then we seek to LAST element in log for this instr
     void seek(uint64_t instr);
 
+    // waits until the worker threads have finished the chunks handed to
+    // them, so that they are all idle until more are
+    void quiesce(void);
+
 private: 
     //initializes some fields in the pandalog
     void create(uint32_t chunk_size);
@@ -133,15 +268,45 @@ private:
     //Write directory entries
     void write_dir();
 
-    // decompresses chunk and reads all entries into vector
+    // makes chunk_num the chunk being read
     void unmarshall_chunk(uint32_t chunk_num);
 
-    // Adds directory entry to list of directory entries. Does not write to log
-    void add_dir_entry();
+    // moves to the next entry in the read direction and returns its index in
+    // cur_chunk. returns false at the end of the log
+    bool next_entry(uint32_t *ind);
+
+    // waits for chunk_num to be decompressed, and has the workers
+    // decompress the chunks in ahead meanwhile. chunks not in either are
+    // dropped
+    std::shared_ptr<PandalogCcReadChunk> get_chunk(uint32_t chunk_num,
+                                                   const std::vector<uint32_t> &ahead);
+
+    // Decompression thread: decompresses chunks in read_jobs
+    void decompress_chunks();
 
-    //Zlib compresses and writes current chunk to log
+    // reads and decompresses a chunk
+    std::shared_ptr<PandalogCcReadChunk> load_chunk(uint32_t chunk_num);
+
+    // fills in index[chunk_num] from the chunk's entries
+    void index_chunk(uint32_t chunk_num, const PandalogCcReadChunk &chunk);
+
+    // reads/writes the index in <log>.idx. load_index returns false if there
+    // isn't one or it's for another log
+    bool load_index();
+    void save_index();
+
+    // stops the compression or decompression threads
+    void stop_workers();
+
+    // Hands off the current chunk to the compression threads
     void write_current_chunk();
 
+    // Compression thread: compresses chunks and writes them to the log
+    void compress_chunks();
+
+    // Writes out compressed chunks that are next in order. file_lock held
+    void write_compressed_chunks();
+
     // Finds index of entry with this instr number
     uint32_t find_ind(uint64_t instr, uint32_t lo, uint32_t high);
 
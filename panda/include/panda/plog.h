@@ -22,6 +22,15 @@ typedef enum {
     PL_MODE_UNKNOWN
 } PlMode;
 
+// how chunks are compressed. recorded in the header since version 3; older
+// pandalogs use zlib.
+typedef enum {
+    PL_CODEC_ZLIB,
+    PL_CODEC_ZSTD,
+    PL_CODEC_LZ4,
+    PL_CODEC_LAST
+} PlCodec;
+
 // open pandalog for write with this uncompressed chunk size
 void pandalog_open_write(const char *path, uint32_t chunk_size);
 
@@ -36,6 +45,7 @@ void pandalog_open(const char *path, const char *mode);
 // close pandalog (all modes)
 void pandalog_close(void);
 
+// fill in the entry's pc and instr and write it to the pandalog
 void pandalog_write_entry(Panda__LogEntry *entry);
 
 Panda__LogEntry *pandalog_read_entry(void);
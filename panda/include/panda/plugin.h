@@ -44,6 +44,16 @@ struct _panda_cb_list {
     bool enabled;
 };
 panda_cb_list *panda_cb_list_next(panda_cb_list *plist);
+
+// Flat array of the enabled callbacks of one type, in registration order.
+// Rebuilt from the callback list whenever it changes; this is what dispatch
+// iterates over.
+typedef struct panda_cb_array {
+    int n;
+    panda_cb *fns;
+} panda_cb_array;
+void *panda_cb_direct(panda_cb_type type);
+extern uint32_t panda_cb_direct_gen;
 void panda_enable_plugin(void *plugin);
 void panda_disable_plugin(void *plugin);
 
@@ -71,9 +81,11 @@ void   panda_unload_plugins(void);
 extern bool panda_update_pc;
 extern bool panda_use_memcb;
 extern panda_cb_list *panda_cbs[PANDA_CB_LAST];
+extern panda_cb_array *panda_cbs_enabled[PANDA_CB_LAST];
 extern bool panda_plugins_to_unload[MAX_PANDA_PLUGINS];
 extern bool panda_plugin_to_unload;
 extern bool panda_tb_chaining;
+extern bool panda_replay_tb_chaining;
 
 // this stuff is used by the new qemu cmd-line arg '-os os_name'
 typedef enum OSFamilyEnum { OS_UNKNOWN, OS_WINDOWS, OS_LINUX, OS_FREEBSD } PandaOsFamily;
@@ -94,12 +106,43 @@ void panda_enable_precise_pc(void);
 void panda_disable_precise_pc(void);
 void panda_enable_memcb(void);
 void panda_disable_memcb(void);
+
+// Flags for panda_watch_range()
+typedef enum panda_watch_flags {
+    PANDA_WATCH_READ = 1,
+    PANDA_WATCH_WRITE = 2,
+    PANDA_WATCH_PHYS = 4,   // start is a guest physical address, not virtual
+} panda_watch_flags;
+
+// Run the virt_mem_* and phys_mem_* callbacks for accesses that touch
+// [start, start+len) without panda_enable_memcb(). Only pages holding a
+// watched range leave the TLB fast path. Virtual ranges apply to every
+// address space. Returns an id for panda_unwatch_range().
+int panda_watch_range(uint64_t start, uint64_t len, int flags);
+void panda_unwatch_range(int id);
+// Hooks: fn runs right before the guest executes the instruction at pc, in
+// any address space, whether or not it starts a block. Only the blocks that
+// hold a hooked pc are translated with a call, and they are retranslated
+// when hooks are added or removed. Returns an id for panda_hook_remove().
+typedef void (*panda_hook_func_t)(CPUState *env, TranslationBlock *tb, target_ptr_t pc, void *opaque);
+int panda_hook_add(target_ptr_t pc, panda_hook_func_t fn, void *opaque);
+void panda_hook_remove(int id);
 void panda_enable_llvm(void);
 void panda_disable_llvm(void);
 void panda_enable_llvm_helpers(void);
 void panda_disable_llvm_helpers(void);
+// With LLVM on, run a block's LLVM version only if filter returns true for it,
+// and its plain TCG version otherwise. NULL (the default) always runs LLVM.
+void panda_set_llvm_block_filter(bool (*filter)(CPUState *cpu, TranslationBlock *tb));
 void panda_enable_tb_chaining(void);
 void panda_disable_tb_chaining(void);
+void panda_enable_replay_tb_chaining(void);
+void panda_disable_replay_tb_chaining(void);
+// Replay without plugin callbacks or instrumentation until the instruction
+// count reaches instr (-replay-start-at); nonzero while that is going on.
+extern uint64_t panda_fast_forward_instr;
+void panda_fast_forward_begin(uint64_t instr);
+void panda_fast_forward_end(void);
 void panda_memsavep(FILE *f);
 
 // Struct for holding a parsed key/value pair from
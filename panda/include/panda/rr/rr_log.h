@@ -14,6 +14,7 @@
 #include "panda/cheaders.h"
 #endif
 #include "panda/rr/rr_log_all.h"
+#include "panda/rr/rr_log_stream.h"
 
 // accessors
 uint64_t rr_get_pc(void);
@@ -51,13 +52,11 @@ typedef struct {
     int len;
 } RR_cpu_reg_write_args;
 
-typedef struct RR_MapList {
-    void *ptr;
-    hwaddr addr;
-    hwaddr len;
-    uint32_t crc;
-    QLIST_ENTRY(RR_MapList) link;
-} RR_MapList;
+// DMA-mapped regions tracked while recording, so device writes through
+// the mapping are recorded even before it is unmapped
+void rr_tracked_mem_region_map(hwaddr addr, void *ptr, hwaddr len);
+void rr_tracked_mem_region_unmap(void *ptr, hwaddr len);
+void rr_tracked_mem_regions_clear(void);
 
 void rr_cpu_physical_memory_unmap_record(hwaddr addr, uint8_t* buf,
                                          hwaddr len, int is_write);
@@ -131,6 +130,9 @@ typedef struct rr_log_entry_t {
         // if log_entry.kind == RR_LAST
         // no variant fields
     } variant;
+    // Replay only: end offset of this entry's payload in the prefetch arena,
+    // or 0 if its payload (if any) was g_malloc'd.
+    size_t arena_pos;
 } RR_log_entry;
 
 // a program-point indexed record/replay log
@@ -141,7 +143,7 @@ typedef struct RR_log_t {
     RR_prog_point last_prog_point; // to report progress
 
     char* name; // file name
-    FILE* fp;   // file pointer for log
+    RR_log_stream* stream; // log contents, see rr_log_stream.h
     unsigned long long
         size; // for a log being opened for read, this will be the size in bytes
     uint64_t bytes_read;
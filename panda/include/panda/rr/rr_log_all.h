@@ -46,6 +46,12 @@ void rr_create_record_log(const char* filename);
 void rr_create_replay_log(const char* filename);
 void rr_destroy_log(void);
 uint8_t rr_replay_finished(void);
+// reposition replay at the given byte offset of the nondet log
+void rr_nondet_log_seek(uint64_t file_pos);
+// set by -replay-checkpoint, -replay-start-at and -replay-end-at
+extern uint64_t rr_replay_checkpoint_instr;
+extern uint64_t rr_replay_start_instr;
+extern uint64_t rr_replay_end_instr;
 
 // used from monitor.c
 int rr_do_begin_record(const char* name, CPUState* cpu_state);
@@ -245,6 +251,10 @@ bool rr_replay_intno(uint32_t *intno);
 
 extern void rr_replay_skipped_calls_internal(RR_callsite_id cs);
 
+// make the instruction count exact around inputs logged from helpers
+struct TranslationBlock *rr_sync_insn_count(void);
+void rr_unsync_insn_count(struct TranslationBlock *tb);
+
 // print current log entry
 void rr_spit_queue_head(void);
 
@@ -323,6 +333,8 @@ static inline void rr_replay_skipped_calls(void)
 // non-determinism caused by ACTION
 // mz - REPLAY_ACTION = whatever is necessary to replay that non-determinism
 // mz - LOCATION = one of RR_callsite_id constants
+// Inputs are logged at the count of the instruction that caused them, also
+// when it is in the middle of a block that counts on entry (CF_TB_ICOUNT).
 #define RR_DO_RECORD_OR_REPLAY(ACTION, RECORD_ACTION, REPLAY_ACTION, LOCATION) \
     do {                                                                       \
         switch (rr_control.mode) {                                             \
@@ -330,17 +342,21 @@ static inline void rr_replay_skipped_calls(void)
             if (rr_record_in_progress || rr_record_in_main_loop_wait) {        \
                 ACTION;                                                        \
             } else {                                                           \
+                struct TranslationBlock *rr_sync_tb = rr_sync_insn_count();    \
                 rr_record_in_progress = 1;                                     \
                 rr_skipped_callsite_location = LOCATION;                       \
                 ACTION;                                                        \
                 RECORD_ACTION;                                                 \
                 rr_record_in_progress = 0;                                     \
+                rr_unsync_insn_count(rr_sync_tb);                              \
             }                                                                  \
         } break;                                                               \
         case RR_REPLAY: {                                                      \
+            struct TranslationBlock *rr_sync_tb = rr_sync_insn_count();        \
             rr_skipped_callsite_location = LOCATION;                           \
             rr_replay_skipped_calls();                                         \
             REPLAY_ACTION;                                                     \
+            rr_unsync_insn_count(rr_sync_tb);                                  \
         } break;                                                               \
         case RR_OFF:                                                           \
         default:                                                               \
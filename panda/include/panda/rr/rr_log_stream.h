@@ -0,0 +1,116 @@
+/*
+ * Record and Replay for QEMU
+ *
+ * Byte stream underneath the nondet log.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Callers always see the log laid out as in format v1: an 8-byte header
+ * holding the final guest instruction count, followed by the serialized log
+ * entries. Positions handed in and out (RR_header.file_pos, bytes_read,
+ * checkpoint log positions) are offsets into that logical stream, so they
+ * mean the same thing whichever format is on disk.
+ *
+ * Format v1 is exactly that stream. Format v2, which is what we record,
+ * looks like this on disk (all integers little-endian):
+ *
+ *   0x00  uint64_t  final guest instruction count
+ *   0x08  RR_log_v2_header
+ *   0x38  chunks, each an RR_log_chunk_header followed by comp_size bytes of
+ *         data compressed with the header's codec that decompress to
+ *         raw_size bytes of log entries. Chunks always start on an entry
+ *         boundary.
+ *   ....  RR_log_chunk_index[num_chunks], starting at index_offset
+ *
+ * A log whose recording was never closed has index_offset == 0. Its index
+ * is rebuilt on open by walking the chunk headers.
+ *
+ * Headers of version 2 end before the codec field, so their chunks start at
+ * 0x30 and are always zlib.
+ */
+
+#define RR_LOG_HEADER_SIZE 8
+#define RR_LOG_V2_MAGIC "PANDARR2"
+#define RR_LOG_V2_VERSION 3
+// chunks are closed at the first entry boundary past this many raw bytes
+#define RR_LOG_V2_CHUNK_SIZE (1 << 20)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_size;
+    uint64_t index_offset;
+    uint64_t num_chunks;
+    uint64_t raw_size;      // bytes of log entries, excluding the header
+    uint32_t codec;         // RR_log_codec, from version 3 on
+    uint32_t reserved;
+} RR_log_v2_header;
+
+typedef enum {
+    RR_LOG_CODEC_ZLIB = 0,
+    RR_LOG_CODEC_ZSTD = 1,
+} RR_log_codec;
+
+typedef struct {
+    uint64_t first_instr;   // instr count of the first entry in the chunk
+    uint32_t raw_size;
+    uint32_t comp_size;
+} RR_log_chunk_header;
+
+typedef struct {
+    uint64_t first_instr;
+    uint64_t raw_offset;    // logical offset of the chunk's first entry
+    uint64_t file_offset;   // file offset of the chunk's RR_log_chunk_header
+    uint32_t raw_size;
+    uint32_t comp_size;
+} RR_log_chunk_index;
+
+typedef struct RR_log_stream RR_log_stream;
+
+// Open a log of either format for reading, positioned at the first entry.
+RR_log_stream *rr_log_stream_open_read(const char *path);
+// Create a new v2 log. Full chunks are compressed and written by a
+// background thread, so writing an entry only ever copies it into memory.
+RR_log_stream *rr_log_stream_open_write(const char *path);
+// Compression level (0, no compression, to 9) for logs opened for writing
+// from now on; returns false if it's out of range. The default is 1. Chunks
+// are compressed with zstd at that level when PANDA was built with it, and
+// with zlib otherwise or at level 0.
+bool rr_log_stream_set_write_level(int level);
+// Close the log. For a log being written this waits for the writer thread,
+// flushes the last chunk and writes the index and headers; returns false if
+// any of that failed.
+bool rr_log_stream_close(RR_log_stream *s);
+
+int rr_log_stream_version(RR_log_stream *s);
+uint64_t rr_log_stream_last_instr(RR_log_stream *s);
+void rr_log_stream_set_last_instr(RR_log_stream *s, uint64_t instr);
+// logical size, header included
+uint64_t rr_log_stream_size(RR_log_stream *s);
+uint64_t rr_log_stream_tell(RR_log_stream *s);
+size_t rr_log_stream_num_chunks(RR_log_stream *s);
+const RR_log_chunk_index *rr_log_stream_chunk(RR_log_stream *s, size_t i);
+
+// Writing: call begin_entry before each entry, then write its bytes.
+// begin_entry fails once a chunk couldn't be written out.
+bool rr_log_stream_begin_entry(RR_log_stream *s, uint64_t instr);
+bool rr_log_stream_write(RR_log_stream *s, const void *ptr, size_t len);
+
+// Reading. Both fail (return false) on a short or corrupt log.
+bool rr_log_stream_read(RR_log_stream *s, void *ptr, size_t len);
+bool rr_log_stream_seek(RR_log_stream *s, uint64_t pos);
+
+// Logical offset of an entry boundary such that every entry with
+// instruction count >= instr lies at or after it. Binary searches the chunk
+// index of a v2 log; for a v1 log this is always the first entry.
+uint64_t rr_log_stream_find_instr(RR_log_stream *s, uint64_t instr);
@@ -59,6 +59,7 @@
 #include <iostream>
 #include <sstream>
 #include <map>
+#include <set>
 
 #include "panda/cheaders.h"
 #include "panda/tcg-llvm.h"
@@ -1370,6 +1371,22 @@ void TCGLLVMTranslator::generateCode(TCGContext *s, TranslationBlock *tb)
     InstrCount->setMetadata("host", RRUpdateMD);
     Value *One64 = constInt(64, 1);
 
+    /* The TCG code keeps panda_guest_pc and rr_guest_instr_count up to date
+       itself, so that it can run in place of this function. Those ops are
+       dropped here in favor of the stores generated at each insn_start,
+       and so is the rr_icount_tb store of TBs that count on entry. */
+    const int64_t pcOffset = -ENV_OFFSET + offsetof(CPUState, panda_guest_pc);
+    const int64_t icountOffset =
+        -ENV_OFFSET + offsetof(CPUState, rr_guest_instr_count);
+    const int64_t icountTbOffset =
+        -ENV_OFFSET + offsetof(CPUState, rr_icount_tb);
+    std::set<TCGArg> icountTemps;
+    // only loads and stores through env itself are those fields
+    auto envBased = [s](TCGArg base) {
+        const TCGTemp &temp = s->temps[base];
+        return temp.name && !strcmp(temp.name, "env");
+    };
+
     /* Generate code for each opc */
     const TCGArg *args;
     TCGOp *op;
@@ -1379,6 +1396,34 @@ void TCGLLVMTranslator::generateCode(TCGContext *s, TranslationBlock *tb)
         args = &s->gen_opparam_buf[op->args];
         int opc = op->opc;
 
+        if (opc != INDEX_op_insn_start && opc != INDEX_op_call) {
+            const TCGOpDef &def = tcg_op_defs[opc];
+            bool skip = false;
+            if (opc == INDEX_op_ld_i64 && envBased(args[1]) &&
+                    (int64_t)args[2] == icountOffset) {
+                skip = true;
+            } else if (opc == INDEX_op_st_i64 && envBased(args[1]) &&
+                    ((int64_t)args[2] == icountOffset ||
+                     (int64_t)args[2] == pcOffset ||
+                     (int64_t)args[2] == icountTbOffset)) {
+                skip = true;
+            } else {
+                for (int i = 0; i < def.nb_iargs; i++) {
+                    skip |= icountTemps.count(args[def.nb_oargs + i]) > 0;
+                }
+            }
+            for (int i = 0; i < def.nb_oargs; i++) {
+                if (skip) {
+                    icountTemps.insert(args[i]);
+                } else {
+                    icountTemps.erase(args[i]);
+                }
+            }
+            if (skip) {
+                continue;
+            }
+        }
+
         if (opc == INDEX_op_insn_start) {
             // volatile store of current PC
             Constant *PC = constInt(64, args[0]);
@@ -0,0 +1,167 @@
+/* PANDABEGINCOMMENT
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+ * PANDAENDCOMMENT */
+
+// Measures what PANDA spends per callback invocation, with 0, 1 and n
+// subscribers, for the insn_exec helper dispatch, a direct call of a lone
+// insn_exec callback (what generated code does, see panda_cb_direct()),
+// before_block_exec dispatch, and a walk of the callback list for comparison.
+
+#include "panda/plugin.h"
+#include "panda/callbacks/cb-support.h"
+#include "qemu/rcu.h"
+#include "qemu/timer.h"
+
+#define MAX_SUBSCRIBERS 16
+
+bool init_plugin(void *);
+void uninit_plugin(void *);
+void after_init(CPUState *env);
+
+static void *plugin_self;
+static uint32_t subscribers;
+static uint64_t iters;
+static volatile uint64_t calls;
+
+// A plugin can register a function only once per callback type, so every
+// subscriber needs its own.
+#define BENCH_CBS(X) X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) \
+                     X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15)
+
+#define BENCH_CB_FNS(i) \
+    static int insn_exec_##i(CPUState *env, target_ptr_t pc) { \
+        calls++; \
+        return 0; \
+    } \
+    static void before_block_exec_##i(CPUState *env, TranslationBlock *tb) { \
+        calls++; \
+    }
+BENCH_CBS(BENCH_CB_FNS)
+
+#define INSN_EXEC_CB(i) { .insn_exec = insn_exec_##i },
+#define BEFORE_BLOCK_EXEC_CB(i) { .before_block_exec = before_block_exec_##i },
+static const panda_cb insn_exec_cbs[MAX_SUBSCRIBERS] = {
+    BENCH_CBS(INSN_EXEC_CB)
+};
+static const panda_cb before_block_exec_cbs[MAX_SUBSCRIBERS] = {
+    BENCH_CBS(BEFORE_BLOCK_EXEC_CB)
+};
+
+// Enables the first k of this plugin's callbacks of the type
+static void subscribe(panda_cb_type type, const panda_cb *cbs, uint32_t k)
+{
+    for (uint32_t i = 0; i < subscribers; i++) {
+        if (i < k) {
+            panda_enable_callback(plugin_self, type, cbs[i]);
+        } else {
+            panda_disable_callback(plugin_self, type, cbs[i]);
+        }
+    }
+}
+
+// The dispatch below is what generated code and cpu_exec() call, both of
+// which run inside cpu_exec()'s RCU read-side critical section.
+#define TIME_NS(stmt) ({ \
+        int64_t start_, ns_; \
+        rcu_read_lock(); \
+        start_ = get_clock(); \
+        for (uint64_t it_ = 0; it_ < iters; it_++) { \
+            stmt; \
+        } \
+        ns_ = get_clock() - start_; \
+        rcu_read_unlock(); \
+        (double)ns_ / iters; \
+    })
+
+static double list_walk_insn_exec(CPUState *env)
+{
+    return TIME_NS(
+        for (panda_cb_list *plist = panda_cbs[PANDA_CB_INSN_EXEC];
+             plist != NULL; plist = panda_cb_list_next(plist)) {
+            if (plist->enabled) {
+                plist->entry.insn_exec(env, it_);
+            }
+        });
+}
+
+static void bench_insn_exec(CPUState *env, uint32_t k)
+{
+    double dispatch, direct = 0, list;
+    int (*fn)(CPUState *, target_ptr_t);
+
+    subscribe(PANDA_CB_INSN_EXEC, insn_exec_cbs, k);
+    dispatch = TIME_NS(panda_callbacks_insn_exec(env, it_));
+    list = list_walk_insn_exec(env);
+    fn = panda_cb_direct(PANDA_CB_INSN_EXEC);
+    if (fn) {
+        direct = TIME_NS(fn(env, it_));
+    }
+    LOG_INFO("insn_exec, %2u subscribers: %6.2f ns/call dispatch, "
+             "%6.2f ns/call list walk%s", k, dispatch, list,
+             fn ? "" : ", not called directly");
+    if (fn) {
+        LOG_INFO("insn_exec, %2u subscribers: %6.2f ns/call direct", k, direct);
+    }
+}
+
+static void bench_before_block_exec(CPUState *env, uint32_t k)
+{
+    double dispatch;
+
+    subscribe(PANDA_CB_BEFORE_BLOCK_EXEC, before_block_exec_cbs, k);
+    dispatch = TIME_NS(panda_callbacks_before_block_exec(env, NULL));
+    LOG_INFO("before_block_exec, %2u subscribers: %6.2f ns/call dispatch",
+             k, dispatch);
+}
+
+void after_init(CPUState *env) {
+    uint32_t counts[] = { 0, 1, subscribers };
+
+    // Other plugins' callbacks would be run with made-up arguments
+    subscribe(PANDA_CB_INSN_EXEC, insn_exec_cbs, 0);
+    subscribe(PANDA_CB_BEFORE_BLOCK_EXEC, before_block_exec_cbs, 0);
+    if (panda_cbs_enabled[PANDA_CB_INSN_EXEC] ||
+        panda_cbs_enabled[PANDA_CB_BEFORE_BLOCK_EXEC]) {
+        LOG_ERROR("other plugins subscribe to insn_exec or before_block_exec; "
+                  "load cb_bench on its own");
+        return;
+    }
+
+    for (int i = 0; i < ARRAY_SIZE(counts); i++) {
+        bench_insn_exec(env, counts[i]);
+    }
+    for (int i = 0; i < ARRAY_SIZE(counts); i++) {
+        bench_before_block_exec(env, counts[i]);
+    }
+    subscribe(PANDA_CB_INSN_EXEC, insn_exec_cbs, 0);
+    subscribe(PANDA_CB_BEFORE_BLOCK_EXEC, before_block_exec_cbs, 0);
+}
+
+bool init_plugin(void *self) {
+    panda_arg_list *args = panda_get_args("cb_bench");
+    subscribers = panda_parse_uint32_opt(args, "n", 8,
+            "Number of subscribers for the many-subscriber case");
+    iters = panda_parse_uint64_opt(args, "iters", 10000000,
+            "Dispatches to time for each case");
+    panda_free_args(args);
+    subscribers = MIN(MAX(subscribers, 1), MAX_SUBSCRIBERS);
+    iters = MAX(iters, 1);
+    plugin_self = self;
+
+    // Registered callbacks start out enabled; they're disabled in after_init
+    // until their case is timed.
+    for (uint32_t i = 0; i < subscribers; i++) {
+        panda_register_callback(self, PANDA_CB_INSN_EXEC, insn_exec_cbs[i]);
+        panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC,
+                                before_block_exec_cbs[i]);
+    }
+    panda_cb pcb = { .after_machine_init = after_init };
+    panda_register_callback(self, PANDA_CB_AFTER_MACHINE_INIT, pcb);
+
+    return true;
+}
+
+void uninit_plugin(void *self) { }
@@ -17,6 +17,8 @@
 #include "panda/checkpoint.h"
 
 uint64_t checkpoint_instr_size;
+uint64_t checkpoint_space;
+bool checkpoint_save;
 
 bool init_plugin(void *);
 void uninit_plugin(void *);
@@ -26,11 +28,26 @@ void after_init(CPUState *env);
 bool before_block_exec(CPUState *env, TranslationBlock *tb) {
     static int progress = 0;
 
-    if (progress == 0 || rr_get_guest_instr_count()/checkpoint_instr_size > progress) {
+    static bool out_of_space = false;
+
+    if (!out_of_space &&
+        (progress == 0 || rr_get_guest_instr_count()/checkpoint_instr_size > progress)) {
         progress++;
-        LOG_INFO("Taking panda checkpoint %u... at %" PRIu64, progress, rr_get_guest_instr_count());
-        panda_checkpoint();
-        LOG_INFO("Done.");
+        if (checkpoint_save) {
+            LOG_INFO("Saving panda checkpoint %u... at %" PRIu64, progress, rr_get_guest_instr_count());
+            if (!panda_checkpoint_save()) {
+                LOG_WARNING("Saving checkpoint failed; no more checkpoints");
+                out_of_space = true;
+            }
+        } else if (get_checkpoint_total_usage() >= checkpoint_space) {
+            LOG_WARNING("Checkpoint space used up; no more checkpoints after %zu",
+                    get_num_checkpoints());
+            out_of_space = true;
+        } else {
+            LOG_INFO("Taking panda checkpoint %u... at %" PRIu64, progress, rr_get_guest_instr_count());
+            panda_checkpoint();
+            LOG_INFO("Done.");
+        }
     }
 
     // If this found tb could contain a breakpoint or watchpoint that is set for some instruction count,
@@ -55,14 +72,22 @@ void after_init(CPUState* env) {
     uint64_t space_bytes;
     parse_option_size("space", avail_space, &space_bytes, NULL );
 
-    // Get approx size of each checkpoint
+    // Checkpoints only store pages dirtied since the previous one, so their
+    // size can't be known up front. Space is enforced as a budget instead,
+    // and only the first checkpoint has to hold all of RAM.
+    checkpoint_save = panda_parse_bool_opt(args, "save",
+            "Save checkpoints next to the recording instead of keeping them in memory");
+
     LOG_INFO("Avail space %" PRIx64 ", ram_size %" PRIx64, space_bytes, ram_size);
-    if (space_bytes < ram_size){
+    if (!checkpoint_save && space_bytes < ram_size){
         LOG_ERROR("Not enough RAM for a checkpoint!");
         abort();
     }
-    uint64_t num_checkpoints = space_bytes/ram_size;
-    LOG_INFO("Number of checkpoints allowed:  %" PRIu64, num_checkpoints);
+    checkpoint_space = space_bytes;
+    uint64_t num_checkpoints = panda_parse_uint64_opt(args, "count", 1024,
+            "Number of checkpoints to spread across the replay");
+    num_checkpoints = MIN(MAX(num_checkpoints, 1), MAX_CHECKPOINTS);
+    LOG_INFO("Number of checkpoints requested:  %" PRIu64, num_checkpoints);
     checkpoint_instr_size = rr_nondet_log->last_prog_point.guest_instr_count/num_checkpoints;
     if (checkpoint_instr_size < 500000) {
         checkpoint_instr_size = 500000;
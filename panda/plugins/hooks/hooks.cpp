@@ -16,8 +16,8 @@ PANDAENDCOMMENT */
 #include "panda/plugin.h"
 #include "hooks_int_fns.h"
 #include <iostream>
-#include <unordered_map>
-#include <vector>
+#include <map>
+#include <utility>
 
 // These need to be extern "C" so that the ABI is compatible with
 // QEMU/PANDA, which is written in C
@@ -26,117 +26,73 @@ bool init_plugin(void *);
 void uninit_plugin(void *);
 }
 
-// Hooking framework to execute code before guest executes given basic block
+// Hooking framework to execute code before guest executes given address.
+// The hooks live in PANDA's hook table (panda_hook_add), so only blocks
+// holding a hooked address call them.
 
-// Mapping of addresses to hook functions
-std::unordered_map<target_ulong, std::vector<hook_func_t>> hooks;
+// PANDA hook ids of each hook function, by address
+std::map<std::pair<target_ulong, hook_func_t>, int> hooks;
 
-// Callback object
-panda_cb c_callback;
-
-// Handle to self
-void* self = NULL;
-
-// Enable and disable callbacks
-void enable_hooking() {
-  assert(self != NULL);
-  panda_enable_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, c_callback);
-}
-void disable_hooking() {
-  assert(self != NULL);
-  panda_disable_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, c_callback);
-}
-
-void update_hook(hook_func_t hook, target_ulong value){
-  //Given hook function, move it to fire on a different address
-  for (auto it = hooks.begin(); it != hooks.end(); ++it){
-		if (it->first == value) continue;
-        std::vector<hook_func_t> hook_pile = it->second;
-        auto i = hook_pile.begin();
-        while (i != hook_pile.end()){
-            if (hook == *i){
-                i = hook_pile.erase(i);
-            }else{
-                ++i;
-            }
-
-        }
-       it->second = hook_pile;
-    }
-	hooks[value].push_back(hook);
-#if DEBUG
-  printf("Updated hook to fire at %p\n", &hook);
+static void call_hook(CPUState *cpu, TranslationBlock *tb, target_ptr_t pc, void *opaque) {
+#ifdef DEBUG
+    printf("[hooks] Calling hook at %p since guest hit 0x" TARGET_FMT_lx "\n", opaque, pc);
 #endif
-}
-
-void enable_hook(hook_func_t hook, target_ulong value){
-	update_hook(hook, value);
-
+    ((hook_func_t)opaque)(cpu, tb);
 }
 
 void disable_hook(hook_func_t hook){
-    for (auto it = hooks.begin(); it != hooks.end(); ++it){
-        std::vector<hook_func_t> hook_pile = it->second;
-        auto i = hook_pile.begin();
-        while (i != hook_pile.end()){
-            if (hook == *i){
-                i = hook_pile.erase(i);
-            }else{
-                ++i;
-            }
-
+    for (auto it = hooks.begin(); it != hooks.end(); ) {
+        if (it->first.second == hook) {
+            panda_hook_remove(it->second);
+            it = hooks.erase(it);
+        } else {
+            ++it;
         }
-       it->second = hook_pile;
     }
 }
 
-
 void add_hook(target_ulong addr, hook_func_t hook) {
 #ifdef DEBUG
   printf("Adding hook from guest 0x" TARGET_FMT_lx " to host %p\n", addr, hook);
 #endif
 
-  if (!panda_is_callback_enabled(self, PANDA_CB_BEFORE_BLOCK_EXEC, c_callback)) enable_hooking(); // Ensure our panda callback is enabled when we add a hook
-	// check for existing hook
-  std::vector<hook_func_t> hook_pile = hooks[addr];
-	for (auto it=hook_pile.begin(); it!=hook_pile.end(); ++it){
-		if (*it == hook){
-			return;
-		}
-	}
-  hooks[addr].push_back(hook);
+  auto key = std::make_pair(addr, hook);
+  if (hooks.count(key)) {
+    return;
+  }
+  hooks[key] = panda_hook_add(addr, call_hook, (void *)hook);
 }
 
-
-// The panda callback to determine if we should call a python callback
-//bool before_block_exec_invalidate_opt(CPUState *cpu, TranslationBlock *tb) {
-void before_block_exec(CPUState *cpu, TranslationBlock *tb) {
-    // Call any callbacks registered at this PC.
-    auto func_hooks = hooks.find(tb->pc);
-    if (func_hooks != hooks.end()) {
-        for (auto &hook : func_hooks->second) {
-#ifdef DEBUG
-          printf("[hooks] Calling hook at %p since guest hit BB at 0x" TARGET_FMT_lx "\n", &hook, tb->pc);
+void update_hook(hook_func_t hook, target_ulong value){
+  //Given hook function, move it to fire on a different address
+  auto key = std::make_pair(value, hook);
+  int id = hooks.count(key) ? hooks[key] : 0;
+  if (id) {
+    hooks.erase(key);
+  }
+  disable_hook(hook);
+  if (id) {
+    hooks[key] = id;
+  } else {
+    add_hook(value, hook);
+  }
+#if DEBUG
+  printf("Updated hook to fire at %p\n", &hook);
 #endif
-            (*hook)(cpu, tb);
-        }
-    }
 }
 
+void enable_hook(hook_func_t hook, target_ulong value){
+	update_hook(hook, value);
 
-bool init_plugin(void *_self) {
-    // On init, register a callback but don't enable it
-    self = _self;
-
-    panda_disable_tb_chaining();
-
-    c_callback.before_block_exec = before_block_exec;
-    panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, c_callback);
-    panda_disable_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, c_callback);
-
-    panda_enable_memcb();
+}
 
+bool init_plugin(void *self) {
     return true;
 }
 
-void uninit_plugin(void *self) {}
+void uninit_plugin(void *self) {
+    for (auto &it : hooks) {
+        panda_hook_remove(it.second);
+    }
+    hooks.clear();
+}
@@ -10,6 +10,7 @@
 #include <cstdlib>
 #include <cerrno>
 #include <map>
+#include <set>
 #include <glib.h>
 
 #include "panda/plugin.h"
@@ -52,6 +53,7 @@ struct KernelProfile const *kernel_profile;
 extern const char *qemu_file;
 static bool osi_initialized;
 static bool first_osi_check = true;
+static bool cache_enabled;
 
 /* ******************************************************************
  Helpers
@@ -280,6 +282,283 @@ bool osi_guest_is_ready(CPUState *cpu, void** ret) {
     return false;
 }
 
+/* ******************************************************************
+ Process and memory map cache
+****************************************************************** */
+/*
+ * The process list and the memory maps of each process are kept between
+ * requests. Syscalls that change them drop the affected entries, which are
+ * read again from the guest the next time they are asked for. The maps of a
+ * process can also change without a syscall we watch, so each request checks
+ * them against a signature read from the mm_struct. The cached
+ * arrays are never modified after they are read, so they can be shared as
+ * snapshots: holders take a reference, and an array dropped from the cache
+ * lives on until its last holder releases it.
+ */
+struct mappings_sig {
+    uint64_t create_time;   // tells apart processes reusing a task struct
+    target_ptr_t vma_first; // changes when the head of the VMA list does
+    target_ptr_t brk;       // changes when the heap grows or shrinks
+    int32_t map_count;      // changes when areas are added, split or merged
+    target_ulong total_vm;  // changes when areas grow, e.g. the stack
+
+    bool operator==(const mappings_sig &o) const {
+        return create_time == o.create_time && vma_first == o.vma_first &&
+            brk == o.brk && map_count == o.map_count &&
+            total_vm == o.total_vm;
+    }
+};
+
+struct mappings_entry {
+    mappings_sig sig;
+    GArray *mappings;
+};
+
+static GArray *proc_cache;
+static std::map<target_ptr_t, mappings_entry> mappings_cache;
+
+/**
+ * @brief Appends copies of the elements of `from` to `to`.
+ */
+template <typename ET>
+static void append_copies(GArray *to, GArray *from, ET *(*copy)(ET *, ET *)) {
+    ET element;
+    for (uint32_t i = 0; i < from->len; i++) {
+        memset(&element, 0, sizeof(ET));
+        copy(&g_array_index(from, ET, i), &element);
+        g_array_append_val(to, element);
+    }
+}
+
+static void invalidate_processes(void) {
+    if (proc_cache != NULL) {
+        g_array_unref(proc_cache);
+        proc_cache = NULL;
+    }
+}
+
+static void invalidate_mappings(target_ptr_t taskd) {
+    auto it = mappings_cache.find(taskd);
+    if (it != mappings_cache.end()) {
+        g_array_unref(it->second.mappings);
+        mappings_cache.erase(it);
+    }
+}
+
+static void invalidate_cache(void) {
+    invalidate_processes();
+    for (auto &kv : mappings_cache) {
+        g_array_unref(kv.second.mappings);
+    }
+    mappings_cache.clear();
+}
+
+/**
+ * @brief Drops the memory maps of processes missing from a fresh process
+ * list, e.g. ones killed by a signal rather than through exit().
+ */
+static void prune_mappings(GArray *ps) {
+    std::set<target_ptr_t> live;
+    for (uint32_t i = 0; i < ps->len; i++) {
+        live.insert(g_array_index(ps, OsiProc, i).taskd);
+    }
+    for (auto it = mappings_cache.begin(); it != mappings_cache.end(); ) {
+        if (live.count(it->first)) {
+            ++it;
+            continue;
+        }
+        g_array_unref(it->second.mappings);
+        it = mappings_cache.erase(it);
+    }
+}
+
+/**
+ * @brief Returns a reference to the process list, reading it from the guest
+ * unless it is cached. Release it with g_array_unref().
+ */
+static GArray *processes_snapshot(CPUState *env) {
+    if (proc_cache == NULL) {
+        GArray *ps = NULL;
+        // instantiate and call function from get_process_info template
+        get_process_info<>(env, &ps, fill_osiproc, free_osiproc_contents);
+        if (ps == NULL || !cache_enabled) return ps;
+        proc_cache = ps;
+        prune_mappings(ps);
+    }
+    return g_array_ref(proc_cache);
+}
+
+/**
+ * @brief Reads the memory areas on the VMA list starting at vma_first.
+ */
+static GArray *read_mappings(CPUState *env, target_ptr_t vma_first) {
+    OsiModule m;
+    target_ptr_t vma_current = vma_first;
+
+    // g_array_sized_new() args: zero_term, clear, element_sz, reserved_sz
+    GArray *ms = g_array_sized_new(false, false, sizeof(OsiModule), 128);
+    g_array_set_clear_func(ms, (GDestroyNotify)free_osimodule_contents);
+
+    do {
+        memset(&m, 0, sizeof(OsiModule));
+        fill_osimodule(env, &m, vma_current);
+        g_array_append_val(ms, m);
+        vma_current = get_vma_next(env, vma_current);
+    } while(vma_current != (target_ptr_t)NULL && vma_current != vma_first);
+
+    return ms;
+}
+
+/**
+ * @brief Returns a reference to the memory maps of process p, reading them
+ * from the guest unless they are cached. Release it with g_array_unref().
+ */
+static GArray *mappings_snapshot(CPUState *env, OsiProc *p) {
+    target_ptr_t vma_first = get_vma_first(env, p->taskd);
+    if (vma_first == (target_ptr_t)NULL) return NULL;
+    if (!cache_enabled) return read_mappings(env, vma_first);
+
+    // A few reads of the mm_struct instead of a walk of the VMA list. Profiles
+    // without map_count and total_vm only catch changes to the list head and
+    // the heap here.
+    target_ptr_t mm = get_task_mm(env, p->taskd);
+    mappings_sig sig = { p->create_time, vma_first, get_mm_brk(env, mm),
+                         get_mm_map_count(env, mm), get_mm_total_vm(env, mm) };
+
+    auto it = mappings_cache.find(p->taskd);
+    if (it != mappings_cache.end() && !(it->second.sig == sig)) {
+        invalidate_mappings(p->taskd);
+        it = mappings_cache.end();
+    }
+    if (it == mappings_cache.end()) {
+        mappings_entry e = { sig, read_mappings(env, vma_first) };
+        it = mappings_cache.insert({p->taskd, e}).first;
+    }
+    return g_array_ref(it->second.mappings);
+}
+
+/**
+ * @brief Returns the thread group leader of the current task, the taskd
+ * that keys its memory maps.
+ */
+static target_ptr_t current_taskd(CPUState *cpu) {
+    target_ptr_t ts = kernel_profile->get_current_task_struct(cpu);
+    if (ts == (target_ptr_t)NULL) return (target_ptr_t)NULL;
+    return kernel_profile->get_group_leader(cpu, ts);
+}
+
+#if defined(TARGET_I386) || defined(TARGET_ARM) || defined(TARGET_MIPS)
+// Syscalls changing the memory maps of the calling process.
+static void cache_mmap_return(CPUState *cpu, target_ulong pc,
+        target_ulong addr, target_ulong len, target_ulong prot,
+        target_ulong flags, target_ulong fd, target_ulong off) {
+    invalidate_mappings(current_taskd(cpu));
+}
+
+static void cache_munmap_return(CPUState *cpu, target_ulong pc,
+        target_ulong addr, uint32_t len) {
+    invalidate_mappings(current_taskd(cpu));
+}
+
+static void cache_mprotect_return(CPUState *cpu, target_ulong pc,
+        target_ulong start, uint32_t len, target_ulong prot) {
+    invalidate_mappings(current_taskd(cpu));
+}
+
+static void cache_brk_return(CPUState *cpu, target_ulong pc,
+        target_ulong brk) {
+    invalidate_mappings(current_taskd(cpu));
+}
+
+static void cache_mremap_return(CPUState *cpu, target_ulong pc,
+        target_ulong addr, target_ulong old_len, target_ulong new_len,
+        target_ulong flags, target_ulong new_addr) {
+    invalidate_mappings(current_taskd(cpu));
+}
+
+// Syscalls changing the process list. An exec also replaces the maps.
+static void cache_clone_return(CPUState *cpu, target_ulong pc,
+        target_ulong arg0, target_ulong arg1, target_ulong arg2,
+        target_ulong arg3, target_ulong arg4) {
+    invalidate_processes();
+}
+
+static void cache_fork_return(CPUState *cpu, target_ulong pc) {
+    invalidate_processes();
+}
+
+static void cache_prctl_return(CPUState *cpu, target_ulong pc,
+        int32_t option, target_ulong arg2, target_ulong arg3,
+        target_ulong arg4, target_ulong arg5) {
+    invalidate_processes();  // PR_SET_NAME renames the caller
+}
+
+static void cache_execve_return(CPUState *cpu, target_ulong pc,
+        target_ulong filename, target_ulong argv, target_ulong envp) {
+    invalidate_processes();
+    invalidate_mappings(current_taskd(cpu));
+}
+
+static void cache_execveat_return(CPUState *cpu, target_ulong pc,
+        int32_t dfd, target_ulong filename, target_ulong argv,
+        target_ulong envp, int32_t flags) {
+    cache_execve_return(cpu, pc, filename, argv, envp);
+}
+
+// exit() and exit_group() don't return, so they are caught on entry.
+static void cache_exit_enter(CPUState *cpu, target_ulong pc, int32_t code) {
+    invalidate_processes();
+    invalidate_mappings(current_taskd(cpu));
+}
+
+// Processes killed by a signal never call exit(). Their maps are pruned
+// when the process list is read again.
+static void cache_kill_return(CPUState *cpu, target_ulong pc,
+        int32_t pid, int32_t sig) {
+    invalidate_processes();
+}
+
+static void cache_tgkill_return(CPUState *cpu, target_ulong pc,
+        int32_t tgid, int32_t pid, int32_t sig) {
+    invalidate_processes();
+}
+
+static void cache_tkill_return(CPUState *cpu, target_ulong pc,
+        int32_t pid, int32_t sig) {
+    invalidate_processes();
+}
+#endif
+
+/**
+ * @brief Drops the process list when it doesn't know the address space
+ * being switched to, i.e. a process created without a syscall we watch.
+ *
+ * The memory maps are left alone: those changed without a syscall (the stack
+ * growing through page faults, areas split by madvise() or mlock(), shmat())
+ * are caught by their signature when they are asked for, see
+ * mappings_snapshot(). Dropping them here would make every get_mappings
+ * made on an asid change miss the cache.
+ */
+bool cache_asid_changed(CPUState *cpu, target_ptr_t oldval, target_ptr_t newval) {
+    if (newval == 0) return false;
+    if (proc_cache == NULL) return false;
+    for (uint32_t i = 0; i < proc_cache->len; i++) {
+        OsiProc *p = &g_array_index(proc_cache, OsiProc, i);
+        if ((p->asid & TARGET_PAGE_MASK) == (newval & TARGET_PAGE_MASK)) {
+            return false;
+        }
+    }
+    invalidate_processes();
+    return false;
+}
+
+/**
+ * @brief The cache doesn't follow the guest across snapshot loads.
+ */
+void cache_after_loadvm(CPUState *cpu) {
+    invalidate_cache();
+}
+
 /* ******************************************************************
  PPP Callbacks
 ****************************************************************** */
@@ -287,11 +566,29 @@ bool osi_guest_is_ready(CPUState *cpu, void** ret) {
 /**
  * @brief PPP callback to retrieve process list from the running OS.
  *
+ * The process list is served from the cache, so callers get a copy.
  */
 void on_get_processes(CPUState *env, GArray **out) {
     if (!osi_guest_is_ready(env, (void**)out)) return;
-    // instantiate and call function from get_process_info template
-    get_process_info<>(env, out, fill_osiproc, free_osiproc_contents);
+
+    GArray *ps = processes_snapshot(env);
+    if (ps == NULL) {
+        if (*out != NULL) {
+            g_array_free(*out, true);
+        }
+        *out = NULL;
+        return;
+    }
+    if (*out == NULL && !cache_enabled) {
+        *out = ps;  // not shared with anyone
+        return;
+    }
+    if (*out == NULL) {
+        *out = g_array_sized_new(false, false, sizeof(OsiProc), ps->len);
+        g_array_set_clear_func(*out, (GDestroyNotify)free_osiproc_contents);
+    }
+    append_copies(*out, ps, copy_osiproc);
+    g_array_unref(ps);
 }
 
 /**
@@ -388,41 +685,32 @@ void on_get_process(CPUState *env, const OsiProcHandle *h, OsiProc **out) {
  *
  * Current implementation returns all the memory areas mapped by the
  * process and the files they were mapped from. Libraries that have
- * many mappings will appear multiple times.
+ * many mappings will appear multiple times. Like the process list, the
+ * memory maps are served from the cache.
  *
  * @todo Remove duplicates from results.
  */
 void on_get_mappings(CPUState *env, OsiProc *p, GArray **out) {
     if (!osi_guest_is_ready(env, (void**)out)) return;
 
-    OsiModule m;
-    target_ptr_t vma_first, vma_current;
-
-    // Read the module info for the process.
-    vma_first = vma_current = get_vma_first(env, p->taskd);
-    if (vma_current == (target_ptr_t)NULL) goto error0;
-
+    GArray *ms = mappings_snapshot(env, p);
+    if (ms == NULL) {
+        if (*out != NULL) {
+            g_array_free(*out, true);
+        }
+        *out = NULL;
+        return;
+    }
+    if (*out == NULL && !cache_enabled) {
+        *out = ms;  // not shared with anyone
+        return;
+    }
     if (*out == NULL) {
-        // g_array_sized_new() args: zero_term, clear, element_sz, reserved_sz
-        *out = g_array_sized_new(false, false, sizeof(OsiModule), 128);
+        *out = g_array_sized_new(false, false, sizeof(OsiModule), ms->len);
         g_array_set_clear_func(*out, (GDestroyNotify)free_osimodule_contents);
     }
-
-    do {
-        memset(&m, 0, sizeof(OsiModule));
-        fill_osimodule(env, &m, vma_current);
-        g_array_append_val(*out, m);
-        vma_current = get_vma_next(env, vma_current);
-    } while(vma_current != (target_ptr_t)NULL && vma_current != vma_first);
-
-    return;
-
-error0:
-    if(*out != NULL) {
-        g_array_free(*out, true);
-    }
-    *out = NULL;
-    return;
+    append_copies(*out, ms, copy_osimod);
+    g_array_unref(ms);
 }
 
 /**
@@ -529,6 +817,16 @@ unsigned long long  osi_linux_fd_to_pos(CPUState *env, OsiProc *p, int fd) {
     return get_fd_pos(env, ts_current, fd);
 }
 
+GArray *osi_linux_get_processes_snapshot(CPUState *env) {
+    if (!osi_guest_is_ready(env, NULL)) return NULL;
+    return processes_snapshot(env);
+}
+
+GArray *osi_linux_get_mappings_snapshot(CPUState *env, OsiProc *p) {
+    if (!osi_guest_is_ready(env, NULL)) return NULL;
+    return mappings_snapshot(env, p);
+}
+
 
 
 /* ******************************************************************
@@ -681,6 +979,7 @@ bool init_plugin(void *self) {
     char *kconf_file = g_strdup(panda_parse_string_opt(plugin_args, "kconf_file", NULL, "file containing kernel configuration information"));
     char *kconf_group = g_strdup(panda_parse_string_opt(plugin_args, "kconf_group", NULL, "kernel profile to use"));
     osi_initialized = panda_parse_bool_opt(plugin_args, "load_now", "Raise a fatal error if OSI cannot be initialized immediately");
+    cache_enabled = !panda_parse_bool_opt(plugin_args, "no_cache", "Read processes and memory maps from the guest on every request");
     panda_free_args(plugin_args);
 
     if (!kconf_file) {
@@ -763,6 +1062,43 @@ bool init_plugin(void *self) {
       PPP_REG_CB("syscalls2", on_all_sys_enter, on_first_syscall);
     }
 
+    // The cache is kept up to date from the syscalls that change processes
+    // and their memory maps.
+    if (cache_enabled) {
+        panda_require("syscalls2");
+#if defined(TARGET_X86_64)
+        PPP_REG_CB("syscalls2", on_sys_mmap_return, cache_mmap_return);
+#elif defined(TARGET_I386)
+        PPP_REG_CB("syscalls2", on_sys_mmap_pgoff_return, cache_mmap_return);
+#elif defined(TARGET_ARM)
+        PPP_REG_CB("syscalls2", on_do_mmap2_return, cache_mmap_return);
+#elif defined(TARGET_MIPS)
+        PPP_REG_CB("syscalls2", on_sys_mmap_return, cache_mmap_return);
+#endif
+        PPP_REG_CB("syscalls2", on_sys_munmap_return, cache_munmap_return);
+        PPP_REG_CB("syscalls2", on_sys_mprotect_return, cache_mprotect_return);
+        PPP_REG_CB("syscalls2", on_sys_brk_return, cache_brk_return);
+        PPP_REG_CB("syscalls2", on_sys_mremap_return, cache_mremap_return);
+        PPP_REG_CB("syscalls2", on_sys_clone_return, cache_clone_return);
+        PPP_REG_CB("syscalls2", on_sys_fork_return, cache_fork_return);
+#if !defined(TARGET_MIPS)
+        PPP_REG_CB("syscalls2", on_sys_vfork_return, cache_fork_return);
+#endif
+        PPP_REG_CB("syscalls2", on_sys_prctl_return, cache_prctl_return);
+        PPP_REG_CB("syscalls2", on_sys_execve_return, cache_execve_return);
+        PPP_REG_CB("syscalls2", on_sys_execveat_return, cache_execveat_return);
+        PPP_REG_CB("syscalls2", on_sys_exit_enter, cache_exit_enter);
+        PPP_REG_CB("syscalls2", on_sys_exit_group_enter, cache_exit_enter);
+        PPP_REG_CB("syscalls2", on_sys_kill_return, cache_kill_return);
+        PPP_REG_CB("syscalls2", on_sys_tgkill_return, cache_tgkill_return);
+        PPP_REG_CB("syscalls2", on_sys_tkill_return, cache_tkill_return);
+
+        panda_cb pcb = { .asid_changed = cache_asid_changed };
+        panda_register_callback(self, PANDA_CB_ASID_CHANGED, pcb);
+        pcb.after_loadvm = cache_after_loadvm;
+        panda_register_callback(self, PANDA_CB_AFTER_LOADVM, pcb);
+    }
+
 
     return true;
 #else
@@ -778,10 +1114,7 @@ error:
  * @brief Plugin cleanup.
  */
 void uninit_plugin(void *self) {
-#if defined(TARGET_I386) || defined(TARGET_ARM)
-    // Nothing to do...
-#endif
-    return;
+    invalidate_cache();
 }
 
 /* vim:set tabstop=4 softtabstop=4 expandtab: */
@@ -252,6 +252,23 @@ IMPLEMENT_OFFSET_GET(get_mm_brk, mm_struct, target_ptr_t, ki.mm.brk_offset, 0)
  */
 IMPLEMENT_OFFSET_GET(get_mm_start_stack, mm_struct, target_ptr_t, ki.mm.start_stack_offset, 0)
 
+/**
+ * @brief Retrieves the address of the mm_struct from a task_struct.
+ */
+IMPLEMENT_OFFSET_GET(get_task_mm, task_struct, target_ptr_t, ki.task.mm_offset, 0)
+
+/**
+ * @brief Retrieves the number of memory areas from an mm_struct, or 0 if
+ * the kernel profile lacks the offset.
+ */
+IMPLEMENT_OPTIONAL_OFFSET_GET(get_mm_map_count, mm_struct, int32_t, ki.mm.map_count_offset, 0)
+
+/**
+ * @brief Retrieves the number of mapped pages from an mm_struct, or 0 if
+ * the kernel profile lacks the offset.
+ */
+IMPLEMENT_OPTIONAL_OFFSET_GET(get_mm_total_vm, mm_struct, target_ulong, ki.mm.total_vm_offset, 0)
+
 /**
  * @brief Retrieves the address of the first vm_area_struct of the task.
  */
@@ -16,6 +16,13 @@ char *osi_linux_fd_to_filename(CPUState *env, OsiProc *p, int fd);
 // returns pos in a file 
 unsigned long long osi_linux_fd_to_pos(CPUState *env, OsiProc *p, int fd);
 
+// returns the process list shared with the osi_linux cache, or NULL if
+// failed. The array must not be modified; release it with g_array_unref()
+GArray *osi_linux_get_processes_snapshot(CPUState *env);
+
+// ditto, for the memory mappings of process p
+GArray *osi_linux_get_mappings_snapshot(CPUState *env, OsiProc *p);
+
 // END_PYPANDA_NEEDS_THIS -- do not delete this comment!
 
 /* vim:set tabstop=4 softtabstop=4 expandtab: */
@@ -106,6 +106,8 @@ PACKED_STRUCT(mm_info) {
 	int start_brk_offset;
 	int brk_offset;
 	int start_stack_offset;
+	int map_count_offset;			/**< Optional, 0 when missing. */
+	int total_vm_offset;			/**< Optional, 0 when missing. */
 };
 
 /**
@@ -160,6 +160,8 @@ int read_kernelinfo(gchar const *file, gchar const *group, struct kernelinfo *ki
 	READ_INFO_INT(ki, mm.start_brk_offset, gerr, err.mm, &errbmp);
 	READ_INFO_INT(ki, mm.brk_offset, gerr, err.mm, &errbmp);
 	READ_INFO_INT(ki, mm.start_stack_offset, gerr, err.mm, &errbmp);
+	OPTIONAL_READ_INFO_INT(ki, mm.map_count_offset, gerr, err.mm, &errbmp);
+	OPTIONAL_READ_INFO_INT(ki, mm.total_vm_offset, gerr, err.mm, &errbmp);
 
 	/* read vma information */
 	READ_INFO_INT(ki, vma.size, gerr, err.vma, &errbmp);
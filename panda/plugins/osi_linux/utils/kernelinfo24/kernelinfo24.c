@@ -83,6 +83,8 @@ static int __init kernelinfo24_init(void)
 	PRINT_OFFSET(mm_struct__p,			start_brk,		"mm");
 	PRINT_OFFSET(mm_struct__p,			brk,			"mm");
 	PRINT_OFFSET(mm_struct__p,			start_stack,	"mm");
+	PRINT_OFFSET(mm_struct__p,			map_count,		"mm");
+	PRINT_OFFSET(mm_struct__p,			total_vm,		"mm");
 
 	PRINT_SIZE(vm_area_struct__s,		"size",			"vma");
 	PRINT_OFFSET(vm_area_struct__p,		vm_mm,			"vma");
@@ -0,0 +1,135 @@
+/* PANDABEGINCOMMENT
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+ * PANDAENDCOMMENT */
+
+// Measures how many records per second C plugins can write to the pandalog,
+// through pandalog_write_entry(), which packs entries straight into the
+// current chunk, and through the packed path it used to take, where the
+// packed entry is parsed into a C++ LogEntry and serialized again.
+
+#include "panda/plugin.h"
+#include "panda/plog-cc-bridge.h"
+#include "qemu/timer.h"
+
+#define NUM_MODULES 8
+
+bool init_plugin(void *);
+void uninit_plugin(void *);
+
+static void *plugin_self;
+static uint64_t records;
+static uint32_t batch;
+
+// A small record, like the ones tainted_instr writes for every tainted
+// instruction, and a large one, like loaded_libs writes for every process.
+static Panda__TaintedInstrSummary tis = PANDA__TAINTED_INSTR_SUMMARY__INIT;
+static Panda__Module modules[NUM_MODULES];
+static Panda__Module *module_ptrs[NUM_MODULES];
+static Panda__LoadedLibs libs = PANDA__LOADED_LIBS__INIT;
+
+enum { BENCH_SMALL, BENCH_LARGE, BENCH_KINDS };
+enum { PATH_DIRECT, PATH_PACKED, BENCH_PATHS };
+static const char *kind_names[BENCH_KINDS] = { "small", "large" };
+
+static uint64_t written[BENCH_KINDS][BENCH_PATHS];
+static int64_t elapsed_ns[BENCH_KINDS][BENCH_PATHS];
+
+// What pandalog_write_entry() did before it packed into the chunk
+static void write_entry_packed(Panda__LogEntry *entry)
+{
+    size_t packed_size = panda__log_entry__get_packed_size(entry);
+    unsigned char *buf = malloc(packed_size);
+    panda__log_entry__pack(entry, buf);
+    pandalog_write_packed(packed_size, buf);
+    free(buf);
+}
+
+static void make_entry(Panda__LogEntry *ple, int kind, uint64_t i)
+{
+    *ple = (Panda__LogEntry) PANDA__LOG_ENTRY__INIT;
+    ple->has_asid = 1;
+    ple->asid = i;
+    if (kind == BENCH_SMALL) {
+        tis.asid = i;
+        tis.pc = i * 4;
+        ple->tainted_instr_summary = &tis;
+    } else {
+        ple->asid_libraries = &libs;
+    }
+}
+
+// Records are written a batch at a time from each block, so entries have
+// different instruction counts and chunks are cut as usual.
+static void bench_block(CPUState *env, TranslationBlock *tb)
+{
+    Panda__LogEntry ple;
+    bool done = true;
+
+    for (int kind = 0; kind < BENCH_KINDS; kind++) {
+        for (int path = 0; path < BENCH_PATHS; path++) {
+            uint64_t n = MIN(batch, records - written[kind][path]);
+            int64_t start = get_clock();
+            for (uint64_t i = 0; i < n; i++) {
+                make_entry(&ple, kind, written[kind][path] + i);
+                if (path == PATH_DIRECT) {
+                    pandalog_write_entry(&ple);
+                } else {
+                    write_entry_packed(&ple);
+                }
+            }
+            elapsed_ns[kind][path] += get_clock() - start;
+            written[kind][path] += n;
+            done &= written[kind][path] == records;
+        }
+    }
+    if (!done) {
+        return;
+    }
+
+    for (int kind = 0; kind < BENCH_KINDS; kind++) {
+        double direct = records * 1e9 / MAX(elapsed_ns[kind][PATH_DIRECT], 1);
+        double packed = records * 1e9 / MAX(elapsed_ns[kind][PATH_PACKED], 1);
+        LOG_INFO("%s records: %12.0f records/s direct, %12.0f records/s "
+                 "packed (%.2fx)", kind_names[kind], direct, packed,
+                 direct / packed);
+    }
+    panda_cb pcb = { .before_block_exec = bench_block };
+    panda_disable_callback(plugin_self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
+}
+
+bool init_plugin(void *self) {
+    panda_arg_list *args = panda_get_args("plog_bench");
+    records = panda_parse_uint64_opt(args, "records", 1000000,
+            "Records to write through each path, for each record size");
+    batch = panda_parse_uint32_opt(args, "batch", 100,
+            "Records to write through each path per basic block");
+    panda_free_args(args);
+    batch = MAX(batch, 1);
+    plugin_self = self;
+
+    if (!pandalog) {
+        LOG_ERROR("plog_bench needs a pandalog to write to; use -pandalog");
+        return false;
+    }
+
+    for (int i = 0; i < NUM_MODULES; i++) {
+        modules[i] = (Panda__Module) PANDA__MODULE__INIT;
+        modules[i].name = "libbench.so";
+        modules[i].file = "/usr/lib/x86_64-linux-gnu/libbench.so";
+        modules[i].base_addr = 0x7f0000000000 + i * 0x200000;
+        modules[i].size = 0x1000 * (i + 1);
+        module_ptrs[i] = &modules[i];
+    }
+    libs.modules = module_ptrs;
+    libs.n_modules = NUM_MODULES;
+
+    panda_cb pcb = { .before_block_exec = bench_block };
+    panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
+
+    return true;
+}
+
+void uninit_plugin(void *self) { }
@@ -33,8 +33,8 @@ static uint64_t end_count;
 static char *nondet_name;
 static char *snp_name;
 
-static FILE *oldlog = NULL;
-static FILE *newlog = NULL;
+static RR_log_stream *oldlog = NULL;
+static RR_log_stream *newlog = NULL;
 
 static RR_log_type rr_nondet_log_type;
 static unsigned long long rr_nondet_log_size;
@@ -59,19 +59,15 @@ static void sassert(bool condition, int which) {
 
 #define INLINEIT inline
 
-static INLINEIT size_t rr_fwrite(void *ptr, size_t size, size_t nmemb, FILE *f) {
-    size_t result = fwrite(ptr, size, nmemb, f);
-    sassert(result == nmemb, 1);
-    return result;
+static INLINEIT void rr_fwrite(void *ptr, size_t size, size_t nmemb, RR_log_stream *f) {
+    sassert(rr_log_stream_write(f, ptr, size * nmemb), 1);
 }
 
-static INLINEIT size_t rr_fread(void *ptr, size_t size, size_t nmemb, FILE *f) {
-    size_t result = fread(ptr, size, nmemb, f);
-    sassert(result == nmemb, 2);
-    return result;
+static INLINEIT void rr_fread(void *ptr, size_t size, size_t nmemb, RR_log_stream *f) {
+    sassert(rr_log_stream_read(f, ptr, size * nmemb), 2);
 }
 
-static INLINEIT void rr_fcopy(void *ptr, size_t size, size_t nmemb, FILE *oldlog, FILE *newlog) {
+static INLINEIT void rr_fcopy(void *ptr, size_t size, size_t nmemb, RR_log_stream *oldlog, RR_log_stream *newlog) {
     rr_fread(ptr, size, nmemb, oldlog);
     rr_fwrite(ptr, size, nmemb, newlog);
 }
@@ -86,8 +82,7 @@ static INLINEIT RR_log_entry *alloc_new_entry(void)
 
 static INLINEIT bool rr_log_is_empty(void) {
     if (rr_nondet_log_type == REPLAY){
-        long pos = ftell(oldlog);
-        return pos == rr_nondet_log_size;
+        return rr_log_stream_tell(oldlog) == rr_nondet_log_size;
     } else {
         return false;
     }
@@ -99,19 +94,21 @@ static RR_prog_point copy_entry(void) {
     // Copy entry.
     RR_log_entry *item = alloc_new_entry();
 
-    long pos = ftell(oldlog);
+    uint64_t pos = rr_log_stream_tell(oldlog);
 
     rr_fread(&(item->header.prog_point.guest_instr_count), sizeof(item->header.prog_point.guest_instr_count), 1, oldlog);
 
     if (item->header.prog_point.guest_instr_count > end_count) {
         // We don't want to copy this one.
-        fseek(oldlog, pos, SEEK_SET);
+        sassert(rr_log_stream_seek(oldlog, pos), 11);
         return item->header.prog_point;
     }
 
     //ph Fix up instruction count
     RR_prog_point original_prog_point = item->header.prog_point;
     item->header.prog_point.guest_instr_count -= actual_start_count;
+    sassert(rr_log_stream_begin_entry(newlog,
+                item->header.prog_point.guest_instr_count), 12);
     rr_fwrite(&item->header.prog_point, sizeof(item->header.prog_point), 1, newlog);
 
 #define RR_COPY_ITEM(field) rr_fcopy(&(field), sizeof(field), 1, oldlog, newlog)
@@ -219,10 +216,10 @@ static RR_prog_point copy_entry(void) {
 }
 
 static void start_snip(uint64_t count) {
-    sassert((oldlog = fopen(rr_nondet_log->name, "r")), 8);
+    sassert((oldlog = rr_log_stream_open_read(rr_nondet_log->name)), 8);
     rr_nondet_log_type = rr_nondet_log->type;
     rr_nondet_log_size = rr_nondet_log->size;
-    sassert(fread(&orig_last_prog_point, sizeof(RR_prog_point), 1, oldlog) == 1, 9);
+    orig_last_prog_point.guest_instr_count = rr_log_stream_last_instr(oldlog);
     printf("Original ending prog point: %" PRId64 "\n", (uint64_t) orig_last_prog_point.guest_instr_count);
 
     actual_start_count = count;
@@ -240,19 +237,17 @@ static void start_snip(uint64_t count) {
     printf("Beginning cut-and-paste process at prog point: % " PRId64 "\n", (uint64_t) rr_get_guest_instr_count());
 
     printf("Writing entries to %s...\n", nondet_name);
-    newlog = fopen(nondet_name, "w");
+    // The header is a placeholder; we'll fix this up later.
+    newlog = rr_log_stream_open_write(nondet_name);
     sassert(newlog, 10);
-    // We'll fix this up later.
     RR_prog_point prog_point = {0};
-    fwrite(&prog_point.guest_instr_count,
-           sizeof(prog_point.guest_instr_count), 1, newlog);
     
-    fseek(oldlog, ftell(rr_nondet_log->fp), SEEK_SET);
+    sassert(rr_log_stream_seek(oldlog, rr_nondet_log->bytes_read), 9);
     
     // If there are items in the queue, then start copying the log
     // from there
     RR_log_entry *item = rr_get_queue_head();
-    if (item != NULL) fseek(oldlog, item->header.file_pos, SEEK_SET);
+    if (item != NULL) sassert(rr_log_stream_seek(oldlog, item->header.file_pos), 9);
     
     //rw: For some reason I need to add an interrupt entry at the beginning of the log?
     RR_log_entry temp;
@@ -262,10 +257,11 @@ static void start_snip(uint64_t count) {
     temp.header.callsite_loc = RR_CALLSITE_CPU_HANDLE_INTERRUPT_BEFORE;
     temp.variant.pending_interrupts = 2;
     
-    fwrite(&temp.header.prog_point, sizeof(temp.header.prog_point), 1, newlog);
-    fwrite(&temp.header.kind, 1, 1, newlog);
-    fwrite(&temp.header.callsite_loc, 1, 1, newlog);
-    fwrite(&temp.variant.pending_interrupts, sizeof(temp.variant.pending_interrupts), 1, newlog);
+    sassert(rr_log_stream_begin_entry(newlog, temp.header.prog_point.guest_instr_count), 12);
+    rr_fwrite(&temp.header.prog_point, sizeof(temp.header.prog_point), 1, newlog);
+    rr_fwrite(&temp.header.kind, 1, 1, newlog);
+    rr_fwrite(&temp.header.callsite_loc, 1, 1, newlog);
+    rr_fwrite(&temp.variant.pending_interrupts, sizeof(temp.variant.pending_interrupts), 1, newlog);
 
     while (prog_point.guest_instr_count < end_count && !rr_log_is_empty()) {
         prog_point = copy_entry();
@@ -302,15 +298,15 @@ static void end_snip(void) {
     end.kind = RR_END_OF_LOG;
     end.callsite_loc = RR_CALLSITE_LAST;
     end.prog_point = prog_point;
-    sassert(fwrite(&(end.prog_point.guest_instr_count),
-                sizeof(end.prog_point.guest_instr_count), 1, newlog) == 1, 5);
-    sassert(fwrite(&(end.kind), 1, 1, newlog) == 1, 6);
-    sassert(fwrite(&(end.callsite_loc), 1, 1, newlog) == 1, 7);
-
-    rewind(newlog);
-    fwrite(&prog_point.guest_instr_count,
-            sizeof(prog_point.guest_instr_count), 1, newlog);
-    fclose(newlog);
+    sassert(rr_log_stream_begin_entry(newlog, end.prog_point.guest_instr_count), 12);
+    sassert(rr_log_stream_write(newlog, &(end.prog_point.guest_instr_count),
+                sizeof(end.prog_point.guest_instr_count)), 5);
+    sassert(rr_log_stream_write(newlog, &(end.kind), 1), 6);
+    sassert(rr_log_stream_write(newlog, &(end.callsite_loc), 1), 7);
+
+    rr_log_stream_set_last_instr(newlog, prog_point.guest_instr_count);
+    sassert(rr_log_stream_close(newlog), 13);
+    rr_log_stream_close(oldlog);
 
     done = true;
 }
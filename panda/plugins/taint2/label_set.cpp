@@ -3,122 +3,316 @@ extern "C" {
 }
 
 #include <cassert>
+#include <cstring>
 
-#include <map>
+#include <algorithm>
 #include <vector>
 #include <set>
-#include <unordered_set>
-#include <unordered_map>
-#include <functional>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LABEL_SET_SIMD
+#endif
 
 #include "label_set.h"
 
-template<typename T>
+/*
+ * Label sets live in an arena and are hash-consed through an open-addressing
+ * table keyed on their contents, so every distinct set exists exactly once.
+ * Unions are memoized in a bounded set-associative cache with LRU
+ * replacement within each set; a miss merges the two sorted label arrays
+ * (with SSE4.1 when the host has it) and interns the result.
+ */
+
 class ArenaAlloc {
 private:
     uint8_t *next = NULL;
+    uint8_t *limit = NULL;
     std::vector<std::pair<uint8_t *, size_t>> blocks;
     size_t next_block_size = 1 << 15;
 
-    void alloc_block() {
+    void alloc_block(size_t min_size) {
+        while (next_block_size < min_size) next_block_size <<= 1;
         //printf("taint2: allocating block of size %lu\n", next_block_size);
         next = (uint8_t *)mmap(NULL, next_block_size, PROT_READ | PROT_WRITE,
                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        assert(next);
+        assert(next != MAP_FAILED);
         blocks.push_back(std::make_pair(next, next_block_size));
+        limit = next + next_block_size;
         next_block_size <<= 1;
     }
 
-    T *alloc_imp() {
-        assert(blocks.size() > 0);
-        std::pair<uint8_t *, size_t>& block = blocks.back();
-        if (next + sizeof(T) > block.first + block.second) {
-            alloc_block();
-            assert(next != NULL);
-        }
+public:
+    size_t bytes = 0;
 
-        T *result = new(next) T;
-        next += sizeof(T);
+    void *alloc(size_t size) {
+        size = (size + 7) & ~(size_t)7;
+        if (next == NULL || next + size > limit) {
+            alloc_block(size);
+        }
+        void *result = next;
+        next += size;
+        bytes += size;
         return result;
     }
 
-public:
-    ArenaAlloc() {
-        alloc_block();
+    ~ArenaAlloc() {
+        for (auto&& block : blocks) {
+            munmap(block.first, block.second);
+        }
     }
+};
+
+static ArenaAlloc LSA;
 
-    const T *alloc() {
-        return alloc_imp();
+static inline uint64_t label_set_hash(const TaintLabel *labels, size_t n) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ n;
+    for (size_t i = 0; i < n; i++) {
+        h = (h ^ labels[i]) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
     }
+    return h;
+}
 
-    const T *alloc(T &old) {
-        T *result = alloc_imp();
-        result->swap(old);
-        return result;
+// Open-addressing table of all label sets, keyed on contents.
+class LabelSetStore {
+    LabelSetP *slots = nullptr;
+    size_t mask = 0;
+
+    void grow() {
+        size_t new_cap = slots ? (mask + 1) * 2 : 1 << 12;
+        LabelSetP *new_slots = new LabelSetP[new_cap]();
+        for (size_t i = 0; slots && i <= mask; i++) {
+            if (!slots[i]) continue;
+            size_t j = slots[i]->hash & (new_cap - 1);
+            while (new_slots[j]) j = (j + 1) & (new_cap - 1);
+            new_slots[j] = slots[i];
+        }
+        delete[] slots;
+        slots = new_slots;
+        mask = new_cap - 1;
     }
 
-    ~ArenaAlloc() {
-        for (auto&& block : blocks) {
-            munmap(block.first, block.second);
+public:
+    size_t count = 0;
+
+    size_t bytes() const {
+        return slots ? (mask + 1) * sizeof(*slots) : 0;
+    }
+
+    LabelSetP intern(const TaintLabel *labels, size_t n) {
+        if ((count + 1) * 4 > (mask + 1) * 3) grow();
+
+        uint64_t hash = label_set_hash(labels, n);
+        size_t i = hash & mask;
+        for (; slots[i]; i = (i + 1) & mask) {
+            LabelSetP ls = slots[i];
+            if (ls->hash == hash && ls->count == n &&
+                memcmp(ls->labels, labels, n * sizeof(*labels)) == 0) {
+                return ls;
+            }
         }
+
+        LabelSet *ls = (LabelSet *)LSA.alloc(sizeof(LabelSet) +
+                n * sizeof(TaintLabel));
+        ls->hash = hash;
+        ls->count = n;
+        memcpy(ls->labels, labels, n * sizeof(*labels));
+        slots[i] = ls;
+        count++;
+        return ls;
     }
 };
 
-static ArenaAlloc<std::set<uint32_t>> LSA;
-
-namespace std {
-template<>
-class hash<set<uint32_t>> {
-  public:
-    size_t operator()(const set<uint32_t> &labels) const {
-        uint64_t result = 0;
-        for (uint32_t l : labels) {
-            result ^= l;
-            result = result << 11 | result >> 53;
+static LabelSetStore label_sets;
+
+// 4-way set-associative union cache; ways are kept in MRU order.
+#define UNION_CACHE_SETS (1 << 15)
+#define UNION_CACHE_WAYS 4
+
+struct UnionCacheEntry {
+    LabelSetP min, max, result;
+};
+
+static UnionCacheEntry union_cache[UNION_CACHE_SETS][UNION_CACHE_WAYS];
+static uint64_t num_unions, num_union_hits;
+
+static inline UnionCacheEntry *union_cache_set(LabelSetP min, LabelSetP max) {
+    uint64_t h = ((uintptr_t)min * 0x9e3779b97f4a7c15ULL) ^ (uintptr_t)max;
+    h *= 0xff51afd7ed558ccdULL;
+    return union_cache[(h >> 32) & (UNION_CACHE_SETS - 1)];
+}
+
+static LabelSetP union_cache_lookup(LabelSetP min, LabelSetP max) {
+    UnionCacheEntry *set = union_cache_set(min, max);
+    for (int w = 0; w < UNION_CACHE_WAYS; w++) {
+        if (set[w].min == min && set[w].max == max) {
+            UnionCacheEntry hit = set[w];
+            memmove(&set[1], &set[0], w * sizeof(*set));
+            set[0] = hit;
+            return hit.result;
         }
-        return result;
     }
-};
+    return nullptr;
+}
+
+static void union_cache_insert(LabelSetP min, LabelSetP max, LabelSetP result) {
+    UnionCacheEntry *set = union_cache_set(min, max);
+    // evicts the least recently used way
+    memmove(&set[1], &set[0], (UNION_CACHE_WAYS - 1) * sizeof(*set));
+    set[0] = { min, max, result };
+}
 
-template<>
-class hash<pair<LabelSetP, LabelSetP>> {
-  public:
-    size_t operator()(const pair<LabelSetP, LabelSetP> &labels) const {
-        return hash<LabelSetP>()(labels.first) ^
-            (hash<LabelSetP>()(labels.second) << (sizeof(LabelSetP) / 2));
+static size_t union_scalar(const TaintLabel *a, size_t na,
+                           const TaintLabel *b, size_t nb, TaintLabel *out) {
+    size_t i = 0, j = 0, n = 0;
+    while (i < na && j < nb) {
+        TaintLabel x = a[i], y = b[j];
+        out[n++] = x < y ? x : y;
+        i += x <= y;
+        j += y <= x;
     }
-};
+    while (i < na) out[n++] = a[i++];
+    while (j < nb) out[n++] = b[j++];
+    return n;
 }
 
-static std::unordered_set<std::set<uint32_t>> label_sets;
-LabelSetP label_set_union(LabelSetP ls1, LabelSetP ls2) {
-    static std::unordered_map<std::pair<LabelSetP, LabelSetP>, LabelSetP> memoized_unions;
+#ifdef LABEL_SET_SIMD
+// pshufb masks that move the lanes not set in the index to the front
+static uint8_t uniq_shuffle[16][16];
+
+static void init_uniq_shuffle(void) {
+    for (int m = 0; m < 16; m++) {
+        int k = 0;
+        for (int lane = 0; lane < 4; lane++) {
+            if (m & (1 << lane)) continue;
+            for (int b = 0; b < 4; b++) {
+                uniq_shuffle[m][k++] = lane * 4 + b;
+            }
+        }
+        while (k < 16) uniq_shuffle[m][k++] = 0x80;
+    }
+}
 
+// Merge two sorted vectors: min gets the 4 smallest lanes, max the rest.
+__attribute__((target("sse4.1")))
+static inline void sse_merge(__m128i a, __m128i b, __m128i *min, __m128i *max) {
+    __m128i tmp = _mm_min_epu32(a, b);
+    *max = _mm_max_epu32(a, b);
+    for (int i = 0; i < 3; i++) {
+        tmp = _mm_alignr_epi8(tmp, tmp, 4);
+        *min = _mm_min_epu32(tmp, *max);
+        *max = _mm_max_epu32(tmp, *max);
+        tmp = *min;
+    }
+    *min = _mm_alignr_epi8(*min, *min, 4);
+}
+
+// Store the lanes of v that differ from their predecessor (the last lane of
+// prev for the first one). Writes 16 bytes; returns how many labels count.
+__attribute__((target("sse4.1")))
+static inline size_t store_unique(__m128i prev, __m128i v, TaintLabel *out) {
+    __m128i shifted = _mm_alignr_epi8(v, prev, 12);
+    int dup = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(shifted, v)));
+    __m128i key = _mm_loadu_si128((const __m128i *)uniq_shuffle[dup]);
+    _mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(v, key));
+    return 4 - __builtin_popcount(dup);
+}
+
+// out needs room for na + nb + 4 labels
+__attribute__((target("sse4.1")))
+static size_t union_sse(const TaintLabel *a, size_t na,
+                        const TaintLabel *b, size_t nb, TaintLabel *out) {
+    size_t va = na / 4, vb = nb / 4;
+    size_t pa = 1, pb = 1, n = 0;
+    __m128i min, max, v;
+    // can't equal the first label we store
+    __m128i last = _mm_set1_epi32((a[0] < b[0] ? a[0] : b[0]) - 1);
+
+    sse_merge(_mm_loadu_si128((const __m128i *)a),
+              _mm_loadu_si128((const __m128i *)b), &min, &max);
+    n += store_unique(last, min, out + n);
+    last = min;
+    while (pa < va && pb < vb) {
+        if (a[4 * pa] <= b[4 * pb]) {
+            v = _mm_loadu_si128((const __m128i *)(a + 4 * pa++));
+        } else {
+            v = _mm_loadu_si128((const __m128i *)(b + 4 * pb++));
+        }
+        sse_merge(v, max, &min, &max);
+        n += store_unique(last, min, out + n);
+        last = min;
+    }
+
+    // Finish with the leftover lanes of max, the tail of whichever array ran
+    // out of whole vectors, and the rest of the other one.
+    TaintLabel buf[12], tail[8];
+    size_t nbuf = store_unique(last, max, buf);
+    const TaintLabel *rest;
+    size_t nrest;
+    if (pa == va) {
+        memcpy(buf + nbuf, a + 4 * va, (na - 4 * va) * sizeof(*a));
+        nbuf += na - 4 * va;
+        rest = b + 4 * pb;
+        nrest = nb - 4 * pb;
+    } else {
+        memcpy(buf + nbuf, b + 4 * vb, (nb - 4 * vb) * sizeof(*b));
+        nbuf += nb - 4 * vb;
+        rest = a + 4 * pa;
+        nrest = na - 4 * pa;
+    }
+    // buf is two sorted runs without duplicates of their own
+    size_t first_run = (pa == va) ? nbuf - (na - 4 * va) : nbuf - (nb - 4 * vb);
+    size_t ntail = union_scalar(buf, first_run, buf + first_run,
+            nbuf - first_run, tail);
+    return n + union_scalar(tail, ntail, rest, nrest, out + n);
+}
+
+static bool have_sse41;
+#endif
+
+static struct LabelSetInit {
+    LabelSetInit() {
+#ifdef LABEL_SET_SIMD
+        init_uniq_shuffle();
+        __builtin_cpu_init();
+        have_sse41 = __builtin_cpu_supports("sse4.1");
+#endif
+    }
+} label_set_init;
+
+LabelSetP label_set_union(LabelSetP ls1, LabelSetP ls2) {
     if (ls1 == ls2) {
         return ls1;
     } else if (ls1 && ls2) {
         LabelSetP min = std::min(ls1, ls2);
         LabelSetP max = std::max(ls1, ls2);
-        std::pair<LabelSetP, LabelSetP> minmax(min, max);
 
-        {
-            auto it = memoized_unions.find(minmax);
-            if (it != memoized_unions.end()) {
-                return it->second;
-            }
+        num_unions++;
+        LabelSetP result = union_cache_lookup(min, max);
+        if (result) {
+            num_union_hits++;
+            return result;
         }
 
-        std::set<uint32_t> temp(*min);
-        for (auto l : *max) {
-            temp.insert(l);
+        size_t cap = min->count + max->count + 4;
+        TaintLabel stack_buf[256];
+        TaintLabel *buf = cap <= 256 ? stack_buf : new TaintLabel[cap];
+        size_t n;
+#ifdef LABEL_SET_SIMD
+        if (have_sse41 && min->count >= 4 && max->count >= 4) {
+            n = union_sse(min->labels, min->count, max->labels, max->count,
+                    buf);
+        } else
+#endif
+        {
+            n = union_scalar(min->labels, min->count, max->labels, max->count,
+                    buf);
         }
+        result = label_sets.intern(buf, n);
+        if (buf != stack_buf) delete[] buf;
 
-        // insert returns a pair <iterator, bool>; second is whether it happened
-        // first is iterator to new/existing element
-        auto it = label_sets.insert(temp).first;
-        const std::set<uint32_t> *result = &(*it);
-
-        memoized_unions.insert(std::make_pair(minmax, result));
+        union_cache_insert(min, max, result);
         return result;
     } else if (ls1) {
         return ls1;
@@ -128,12 +322,24 @@ LabelSetP label_set_union(LabelSetP ls1, LabelSetP ls2) {
 }
 
 LabelSetP label_set_singleton(uint32_t label) {
-    std::set<uint32_t> temp;
-    temp.insert(label);
-    return LSA.alloc(temp);
+    return label_sets.intern(&label, 1);
+}
+
+void label_set_iter(LabelSetP ls, void (*leaf)(TaintLabel, void *), void *user) {
+    if (!ls) return;
+    for (TaintLabel l : *ls) {
+        leaf(l, user);
+    }
 }
 
 std::set<uint32_t> label_set_render_set(LabelSetP ls) {
-    if (ls) return *ls;
+    if (ls) return std::set<uint32_t>(ls->begin(), ls->end());
     else return std::set<uint32_t>();
 }
+
+void label_set_get_stats(LabelSetStats *stats) {
+    stats->live_sets = label_sets.count;
+    stats->bytes = LSA.bytes + label_sets.bytes() + sizeof(union_cache);
+    stats->unions = num_unions;
+    stats->union_hits = num_union_hits;
+}
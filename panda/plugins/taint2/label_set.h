@@ -15,13 +15,28 @@ PANDAENDCOMMENT */
 #ifndef __LABEL_SET_H_
 #define __LABEL_SET_H_
 
+#include <cstddef>
 #include <cstdint>
 #include <set>
 
 typedef uint32_t TaintLabel;
 
+// An immutable, sorted set of labels. Label sets are hash-consed: there is
+// only ever one LabelSet with given contents, so they can be compared by
+// pointer, and they are never freed.
+struct LabelSet {
+    uint64_t hash;
+    uint32_t count;
+    TaintLabel labels[];
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const TaintLabel *begin() const { return labels; }
+    const TaintLabel *end() const { return labels + count; }
+};
+
 extern "C" {
-typedef const std::set<TaintLabel> *LabelSetP;
+typedef const LabelSet *LabelSetP;
 LabelSetP label_set_union(LabelSetP ls1, LabelSetP ls2);
 LabelSetP label_set_singleton(TaintLabel label);
 }
@@ -29,5 +44,13 @@ LabelSetP label_set_singleton(TaintLabel label);
 void label_set_iter(LabelSetP ls, void (*leaf)(TaintLabel, void *), void *user);
 std::set<TaintLabel> label_set_render_set(LabelSetP ls);
 
+struct LabelSetStats {
+    uint64_t live_sets;     // distinct label sets
+    uint64_t bytes;         // memory held by label sets and the store
+    uint64_t unions;        // non-trivial label_set_union calls
+    uint64_t union_hits;    // ... answered from the union cache
+};
+
+void label_set_get_stats(LabelSetStats *stats);
 
 #endif
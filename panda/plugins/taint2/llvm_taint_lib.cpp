@@ -19,7 +19,10 @@ PANDAENDCOMMENT */
 //
 // 15-FEB-2019:  ensure LLVM frames cleared before they are reused
 
+#include <algorithm>
 #include <iostream>
+#include <iterator>
+#include <map>
 #include <vector>
 
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
@@ -30,6 +33,7 @@ PANDAENDCOMMENT */
 #include <llvm/IR/Verifier.h>
 #include <llvm/Support/SourceMgr.h>
 #include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/IntrinsicInst.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/Pass.h>
 #include <llvm/IR/IRBuilder.h>
@@ -51,6 +55,7 @@ extern "C" {
 #include "libgen.h"
 
 extern bool tainted_pointer;
+extern bool detaint_cb0_bytes;
 
 PPP_PROT_REG_CB(on_branch2);
 PPP_CB_BOILERPLATE(on_branch2);
@@ -74,6 +79,13 @@ PPP_CB_BOILERPLATE(on_after_store);
 
 extern const char *qemu_file;
 
+bool optimize_taint_ops = true;
+bool taint_opt_stats = false;
+
+// Taint ops seen by optimizeTaintOps, and how many of them it removed
+uint64_t taint_ops_emitted = 0;
+uint64_t taint_ops_removed = 0;
+
 // Helper methods for doing structure computations.
 #define cpu_off(member) (uint64_t)(&((CPUArchState *)0)->member)
 #define cpu_size(member) sizeof(((CPUArchState *)0)->member)
@@ -362,6 +374,13 @@ bool PandaTaintFunctionPass::runOnFunction(Function &F) {
         }
     }
 
+    // Taint change reports include LLVM temporaries, so leave every op in
+    // place while someone is listening for them.
+    if (optimize_taint_ops && !track_taint_state) {
+        PTV->optimizeTaintOps(F);
+    }
+    PTV->inlineQueuedCalls();
+
 #ifdef TAINT2_DEBUG
     //F.dump();
     /*std::string err;
@@ -449,9 +468,17 @@ ConstantInt *PandaTaintVisitor::valueSizeValue(const Value *V) {
 
 bool inline_taint = false;
 
+// Calls are only queued here; they are inlined after optimizeTaintOps has
+// had a chance to remove them.
 void PandaTaintVisitor::inlineCall(CallInst *CI) {
     assert(CI && "CallInst can't be null");
     if (inline_taint) {
+        inlineQueue.push_back(CI);
+    }
+}
+
+void PandaTaintVisitor::inlineQueuedCalls() {
+    for (CallInst *CI : inlineQueue) {
         InlineFunctionInfo IFI;
         // LLVM-10
         if (!InlineFunction(CI, IFI)) {
@@ -460,6 +487,7 @@ void PandaTaintVisitor::inlineCall(CallInst *CI) {
             printf("Inlining failed!\n");
         }
     }
+    inlineQueue.clear();
 }
 
 Function *PandaTaintVisitor::getFunction(Module *m,
@@ -1870,3 +1898,442 @@ void PandaTaintVisitor::visitInstruction(Instruction &I) {
     //I.dump();
     assert(false);
 }
+
+/***
+ *** Taint op optimization
+ ***/
+
+// Bytes [start, end) of one shadow. A non-constant address could be
+// anywhere in it.
+struct ShadowRange {
+    Value *shad = nullptr;
+    bool known = false;
+    uint64_t start = 0;
+    uint64_t end = 0;
+
+    ShadowRange() {}
+
+    ShadowRange(Value *shad, uint64_t start, uint64_t size)
+        : shad(shad), known(true), start(start), end(start + size) {}
+
+    ShadowRange(Value *shad, Value *addr, uint64_t size) : shad(shad) {
+        ConstantInt *CI = dyn_cast<ConstantInt>(addr);
+        if (CI) {
+            known = true;
+            start = CI->getZExtValue();
+            end = start + size;
+        }
+    }
+
+    uint64_t size() const {
+        return end - start;
+    }
+};
+
+static bool mayAlias(const ShadowRange &a, const ShadowRange &b) {
+    return a.shad && a.shad == b.shad &&
+        (!a.known || !b.known || (a.start < b.end && b.start < a.end));
+}
+
+// Byte ranges of the LLVM shadow that may still be read.
+class LiveShadow {
+private:
+    std::map<uint64_t, uint64_t> ranges; // start -> end, disjoint
+
+public:
+    void add_all() {
+        ranges.clear();
+        ranges[0] = UINT64_MAX;
+    }
+
+    void add(uint64_t start, uint64_t end) {
+        auto it = ranges.upper_bound(start);
+        if (it != ranges.begin() && std::prev(it)->second >= start) {
+            --it;
+            start = it->first;
+            end = std::max(end, it->second);
+            it = ranges.erase(it);
+        }
+        while (it != ranges.end() && it->first <= end) {
+            end = std::max(end, it->second);
+            it = ranges.erase(it);
+        }
+        ranges[start] = end;
+    }
+
+    void remove(uint64_t start, uint64_t end) {
+        auto it = ranges.upper_bound(start);
+        if (it != ranges.begin()) {
+            auto prev = std::prev(it);
+            uint64_t prev_end = prev->second;
+            if (prev_end > start) {
+                if (prev->first == start) ranges.erase(prev);
+                else prev->second = start;
+                if (prev_end > end) {
+                    ranges[end] = prev_end;
+                    return;
+                }
+            }
+        }
+        while (it != ranges.end() && it->first < end) {
+            if (it->second > end) {
+                ranges[end] = it->second;
+                ranges.erase(it);
+                break;
+            }
+            it = ranges.erase(it);
+        }
+    }
+
+    bool overlaps(uint64_t start, uint64_t end) const {
+        auto it = ranges.upper_bound(start);
+        if (it != ranges.begin() && std::prev(it)->second > start) return true;
+        return it != ranges.end() && it->first < end;
+    }
+};
+
+// What one taint op call does to the shadow.
+struct PandaTaintVisitor::TaintOpInfo {
+    CallInst *call = nullptr;  // null once the op has been removed
+    bool barrier = true;       // may read or write anything
+    bool clobbers_guest = false; // may write any shadow but the LLVM one
+    bool calls_out = false;    // may use LLVM shadow past this frame
+    bool removable = false;    // writing dest is its only effect
+    bool kills = false;        // always overwrites all of dest
+    bool pure_copy = false;    // taint_copy that changes no labels or masks
+    ShadowRange dest;
+    ShadowRange src;           // taint_copy source
+    vector<ShadowRange> reads;
+};
+
+// update_cb() leaves the masks of these copies as they were copied.
+static bool isPlainCopyOpcode(uint64_t opcode) {
+    switch (opcode) {
+        case 0:
+            return true;
+        case Instruction::ZExt:
+        case Instruction::IntToPtr:
+        case Instruction::PtrToInt:
+        case Instruction::BitCast:
+        case Instruction::Store:
+        case Instruction::Load:
+        case Instruction::ExtractValue:
+        case Instruction::InsertValue:
+            return !detaint_cb0_bytes;
+        default:
+            return false;
+    }
+}
+
+// Returns false if I can't touch the shadow.
+bool PandaTaintVisitor::getTaintOpInfo(Instruction &I, TaintOpInfo &op) {
+    CallInst *CI = dyn_cast<CallInst>(&I);
+    if (!CI || isa<IntrinsicInst>(CI)) {
+        return false;
+    }
+
+    op = TaintOpInfo();
+    op.call = CI;
+
+    Function *F = CI->getCalledFunction();
+    StringRef name = F ? F->getName() : "";
+    if (name == memlog_popF.getName() || name == breadcrumbF.getName()) {
+        return false;
+    }
+
+    uint64_t size[2];
+    auto arg = [CI](unsigned i) { return CI->getArgOperand(i); };
+    auto sizes = [&](unsigned i, unsigned j) {
+        ConstantInt *a = dyn_cast<ConstantInt>(arg(i));
+        ConstantInt *b = dyn_cast<ConstantInt>(arg(j));
+        if (!a || !b) return false;
+        size[0] = a->getZExtValue();
+        size[1] = b->getZExtValue();
+        return true;
+    };
+    // Constant sources (~0) have no shadow.
+    auto addRead = [&](Value *shad, Value *addr, uint64_t n) {
+        ConstantInt *C = dyn_cast<ConstantInt>(addr);
+        if (!C || !C->isMinusOne()) {
+            op.reads.push_back(ShadowRange(shad, addr, n));
+        }
+    };
+
+    if (name == copyF.getName()) {
+        if (!sizes(4, 5)) return true;
+        op.dest = ShadowRange(arg(0), arg(1), size[0]);
+        op.src = ShadowRange(arg(2), arg(3), size[0]);
+        op.reads.push_back(op.src);
+        // an out of range (I/O) source leaves dest alone
+        op.kills = op.src.known;
+        op.pure_copy = isPlainCopyOpcode(size[1]);
+    } else if (name == deleteF.getName()) {
+        if (!sizes(2, 2)) return true;
+        op.dest = ShadowRange(arg(0), arg(1), size[0]);
+        op.kills = true;
+    } else if (name == mixF.getName() || name == sextF.getName()) {
+        if (!sizes(2, 4)) return true;
+        op.dest = ShadowRange(arg(0), arg(1), size[0]);
+        addRead(arg(0), arg(3), size[1]);
+        op.kills = true;
+    } else if (name == parallel_computeF.getName() ||
+            name == mix_computeF.getName() || name == mul_computeF.getName()) {
+        if (!sizes(2, 5)) return true;
+        // parallel computes write src_size bytes, and mul computes may do
+        // either kind, or nothing at all
+        uint64_t dest_size = name == parallel_computeF.getName() ? size[1] :
+            name == mix_computeF.getName() ? size[0] :
+            std::max(size[0], size[1]);
+        op.dest = ShadowRange(arg(0), arg(1), dest_size);
+        addRead(arg(0), arg(3), size[1]);
+        addRead(arg(0), arg(4), size[1]);
+        op.kills = name != mul_computeF.getName();
+    } else if (name == selectF.getName()) {
+        if (!sizes(2, 2)) return true;
+        op.dest = ShadowRange(arg(0), arg(1), size[0]);
+        for (unsigned i = 4; i + 1 < CI->getNumArgOperands(); i += 2) {
+            addRead(arg(0), arg(i), size[0]);
+        }
+    } else if (name == pointerF.getName()) {
+        if (!sizes(4, 7)) return true;
+        // runs the pointer callbacks, so it always stays
+        op.dest = ShadowRange(arg(0), arg(1), size[1]);
+        addRead(arg(2), arg(3), size[0]);
+        addRead(arg(5), arg(6), size[1]);
+    } else if (name == branch_runF.getName() ||
+            name == copyRegToPc_runF.getName()) {
+        if (!sizes(2, 2)) return true;
+        addRead(arg(0), arg(1), size[0]);
+    } else if (name == afterLdF.getName()) {
+        if (!sizes(2, 2)) return true;
+        addRead(llvConst, arg(0), size[0]);
+    } else if (name == host_copyF.getName()) {
+        ConstantInt *is_store = dyn_cast<ConstantInt>(arg(9));
+        if (!sizes(7, 7) || !is_store) return true;
+        if (is_store->isZero()) {
+            // irrelevant addresses leave dest alone
+            op.dest = ShadowRange(arg(2), arg(3), size[0]);
+        } else {
+            addRead(arg(2), arg(3), size[0]);
+            op.clobbers_guest = true;
+        }
+    } else if (name == host_memcpyF.getName() ||
+            name == host_deleteF.getName()) {
+        op.clobbers_guest = true;
+    } else if (name == reset_frameF.getName() ||
+            (name.startswith("taint_") && name != push_frameF.getName() &&
+             name != pop_frameF.getName())) {
+        return true;
+    } else {
+        // Helpers get a frame of their own past this one; push_frame and
+        // pop_frame only ever surround such a call.
+        op.clobbers_guest = true;
+        op.calls_out = true;
+    }
+
+    op.barrier = false;
+    op.removable = op.dest.shad == llvConst && op.dest.known &&
+        name != pointerF.getName();
+    return true;
+}
+
+void PandaTaintVisitor::eraseTaintOp(CallInst *CI) {
+    auto it = std::find(inlineQueue.begin(), inlineQueue.end(), CI);
+    if (it != inlineQueue.end()) {
+        inlineQueue.erase(it);
+    }
+    CI->eraseFromParent();
+}
+
+// Make copies out of LLVM temporaries read the temporary's own source
+// instead, so the temporary's copy can die, and fuse copies of contiguous
+// ranges into one.
+void PandaTaintVisitor::forwardTaintCopies(vector<TaintOpInfo> &ops) {
+    vector<TaintOpInfo *> avail; // copies whose dest still matches src
+    TaintOpInfo *prev = nullptr;
+
+    for (TaintOpInfo &op : ops) {
+        if (op.barrier) {
+            avail.clear();
+            prev = nullptr;
+            continue;
+        }
+        if (op.clobbers_guest || op.calls_out) {
+            uint64_t frame_end = MAXREGSIZE * shad->num_vals;
+            auto clobbered = [&](const ShadowRange &r) {
+                return r.shad == llvConst ?
+                    op.calls_out && (!r.known || r.end > frame_end) :
+                    op.clobbers_guest;
+            };
+            avail.erase(std::remove_if(avail.begin(), avail.end(),
+                [&](TaintOpInfo *c) {
+                    return clobbered(c->dest) || clobbered(c->src);
+                }), avail.end());
+            prev = nullptr;
+        }
+
+        if (op.pure_copy && op.src.known) {
+            for (auto it = avail.rbegin(); it != avail.rend(); ++it) {
+                TaintOpInfo *c = *it;
+                if (c->dest.shad != op.src.shad ||
+                        c->dest.start > op.src.start ||
+                        c->dest.end < op.src.end) {
+                    continue;
+                }
+                ShadowRange src(c->src.shad,
+                    c->src.start + (op.src.start - c->dest.start),
+                    op.src.size());
+                if (!mayAlias(src, op.dest)) {
+                    op.call->setArgOperand(2, src.shad);
+                    op.call->setArgOperand(3, const_uint64(src.start));
+                    op.src = src;
+                    op.reads = { src };
+                }
+                break;
+            }
+        }
+
+        TaintOpInfo *cur = &op;
+        if (prev && prev->pure_copy && op.pure_copy && prev->kills &&
+                op.kills && prev->dest.known && op.dest.known &&
+                prev->dest.shad == op.dest.shad &&
+                prev->src.shad == op.src.shad &&
+                prev->dest.end == op.dest.start &&
+                prev->src.end == op.src.start) {
+            ShadowRange dest(op.dest.shad, prev->dest.start,
+                prev->dest.size() + op.dest.size());
+            ShadowRange src(op.src.shad, prev->src.start, dest.size());
+            if (!mayAlias(src, dest)) {
+                // opcode 0: both copies left the masks alone
+                vector<Value *> args { dest.shad, const_uint64(dest.start),
+                    src.shad, const_uint64(src.start),
+                    const_uint64(dest.size()), zeroConst, zeroConst,
+                    zeroConst };
+                CallInst *fused = insertCall(*prev->call, copyF, args, true,
+                    true);
+                eraseTaintOp(prev->call);
+                eraseTaintOp(op.call);
+                op.call = nullptr;
+
+                avail.erase(std::remove(avail.begin(), avail.end(), prev),
+                    avail.end());
+                prev->call = fused;
+                prev->dest = dest;
+                prev->src = src;
+                prev->reads = { src };
+                cur = prev;
+            }
+        }
+
+        avail.erase(std::remove_if(avail.begin(), avail.end(),
+            [cur](TaintOpInfo *c) {
+                return mayAlias(c->dest, cur->dest) ||
+                    mayAlias(c->src, cur->dest);
+            }), avail.end());
+        if (cur->pure_copy && cur->kills && cur->dest.known &&
+                !mayAlias(cur->src, cur->dest)) {
+            avail.push_back(cur);
+        }
+        prev = cur;
+    }
+}
+
+// Backwards liveness over the LLVM shadow. Ops that only write LLVM shadow
+// nobody reads before it is overwritten or the function returns are dropped.
+void PandaTaintVisitor::eliminateDeadTaintOps(BasicBlock &BB,
+        vector<TaintOpInfo> &ops) {
+    LiveShadow live;
+
+    // Other blocks only read the shadow of values they use; after a return
+    // the frame is dead. This block can run again through a loop, though,
+    // and then reads its PHIs' incoming values and its alloca slots before
+    // writing them, so those stay live whoever uses them.
+    if (!isa<ReturnInst>(BB.getTerminator())) {
+        auto liveOut = [&](Value &V) {
+            int slot = PST->getLocalSlot(&V);
+            if (slot < 0) return;
+            bool live_out = isa<AllocaInst>(V);
+            for (User *U : V.users()) {
+                Instruction *UI = dyn_cast<Instruction>(U);
+                if (live_out) break;
+                live_out = !UI || UI->getParent() != &BB || isa<PHINode>(UI);
+            }
+            if (live_out) {
+                live.add(MAXREGSIZE * slot, MAXREGSIZE * (slot + 1));
+            }
+        };
+        Function *F = BB.getParent();
+        for (Argument &A : F->args()) {
+            liveOut(A);
+        }
+        for (BasicBlock &B : *F) {
+            for (Instruction &I : B) {
+                liveOut(I);
+            }
+        }
+    }
+
+    for (auto it = ops.rbegin(); it != ops.rend(); ++it) {
+        TaintOpInfo &op = *it;
+        if (!op.call) continue;
+
+        if (op.barrier) {
+            live.add_all();
+            continue;
+        }
+        if (op.calls_out) {
+            live.add(MAXREGSIZE * shad->num_vals, UINT64_MAX);
+        }
+
+        if (op.removable && !live.overlaps(op.dest.start, op.dest.end)) {
+            eraseTaintOp(op.call);
+            op.call = nullptr;
+            continue;
+        }
+
+        if (op.kills && op.dest.shad == llvConst && op.dest.known) {
+            live.remove(op.dest.start, op.dest.end);
+        }
+        for (ShadowRange &r : op.reads) {
+            if (r.shad != llvConst) continue;
+            if (r.known) live.add(r.start, r.end);
+            else live.add_all();
+        }
+    }
+}
+
+unsigned PandaTaintVisitor::optimizeTaintOps(Function &F) {
+    auto countTaintOps = [&F]() {
+        unsigned n = 0;
+        for (BasicBlock &BB : F) {
+            for (Instruction &I : BB) {
+                CallInst *CI = dyn_cast<CallInst>(&I);
+                Function *callee = CI ? CI->getCalledFunction() : nullptr;
+                if (callee && callee->getName().startswith("taint_")) n++;
+            }
+        }
+        return n;
+    };
+
+    unsigned before = countTaintOps();
+    for (BasicBlock &BB : F) {
+        vector<TaintOpInfo> ops;
+        for (Instruction &I : BB) {
+            TaintOpInfo op;
+            if (getTaintOpInfo(I, op)) {
+                ops.push_back(op);
+            }
+        }
+        forwardTaintCopies(ops);
+        eliminateDeadTaintOps(BB, ops);
+    }
+    unsigned removed = before - countTaintOps();
+
+    taint_ops_emitted += before;
+    taint_ops_removed += removed;
+    if (taint_opt_stats) {
+        printf("taint2: %s: removed %u of %u taint ops\n",
+            F.getName().str().c_str(), removed, before);
+    }
+    return removed;
+}
@@ -127,6 +127,8 @@ class Instruction;
  */
 class PandaTaintVisitor : public InstVisitor<PandaTaintVisitor> {
 private:
+    struct TaintOpInfo;
+
     std::unique_ptr<PandaSlotTracker> PST;
     ShadowState *shad; // no ownership. weak ptr.
     taint2_memlog *taint_memlog; // same.
@@ -134,6 +136,9 @@ private:
     // for counting up slots used by called subroutines
     std::unique_ptr<PandaSlotTracker> subframePST;
 
+    // taint op calls to inline once the function has been optimized
+    vector<CallInst *> inlineQueue;
+
     ConstantInt *const_uint64_ptr(void *ptr);
     Constant *constSlot(Value *value);
     Constant *constWeakSlot(Value *value);
@@ -184,6 +189,10 @@ private:
     void insertStateOp(Instruction &I);
     uint64_t getInstructionFlags(Instruction &I);
     Instruction *getResult(Instruction *I);
+    bool getTaintOpInfo(Instruction &I, TaintOpInfo &op);
+    void eraseTaintOp(CallInst *CI);
+    void forwardTaintCopies(vector<TaintOpInfo> &ops);
+    void eliminateDeadTaintOps(BasicBlock &BB, vector<TaintOpInfo> &ops);
 
 public:
     LLVMContext *ctx;
@@ -242,6 +251,12 @@ public:
     Constant *const_i64p(void *ptr);
     Constant *const_struct_ptr(Type *ptrT, void *ptr);
 
+    // Block-local cleanup of the inserted taint ops: forwards copies through
+    // LLVM temporaries, fuses contiguous copies and drops ops whose LLVM
+    // shadow results are never read. Returns how many ops it removed.
+    unsigned optimizeTaintOps(Function &F);
+    void inlineQueuedCalls();
+
     // Overrides.
     void visitFunction(Function& F);
     void visitBasicBlock(BasicBlock &BB);
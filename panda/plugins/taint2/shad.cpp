@@ -38,8 +38,6 @@ Shad::Shad(std::string name, uint64_t max_size)
 
 Shad::~Shad() = default;
 
-typedef const std::set<uint32_t> *LabelSetP;
-
 FastShad::FastShad(std::string name, uint64_t labelsets) : Shad(name, labelsets)
 {
     TaintData *array;
@@ -70,6 +68,71 @@ FastShad::~FastShad() {
     }
 }
 
+PagedShad::PagedShad(std::string name, uint64_t size)
+    : Shad(name, size), num_allocated(0), num_tainted(0), free_list(NULL),
+      num_free(0)
+{
+    num_pages = (size + page_size - 1) >> page_bits;
+    pages = (Page **)calloc(num_pages, sizeof(Page *));
+    assert(pages);
+    printf("taint2: Allocating paged shadow directory for %" PRIu64 " pages.\n",
+            num_pages);
+}
+
+PagedShad::~PagedShad()
+{
+    for (uint64_t i = 0; i < num_pages; i++) {
+        free(pages[i]);
+    }
+    free(pages);
+    while (free_list) {
+        Page *next = free_list->next_free;
+        free(free_list);
+        free_list = next;
+    }
+}
+
+// Keep a few released pages around so that taint moving back and forth
+// across a page boundary doesn't hit the allocator every time.
+#define PAGED_SHAD_MAX_FREE 64
+
+PagedShad::Page *PagedShad::alloc_page(uint64_t idx)
+{
+    Page *page = free_list;
+    if (page) {
+        free_list = page->next_free;
+        num_free--;
+        page->next_free = NULL;
+    } else {
+        page = (Page *)calloc(1, sizeof(Page));
+        assert(page);
+    }
+    pages[idx] = page;
+    num_allocated++;
+    return page;
+}
+
+void PagedShad::free_page(uint64_t idx)
+{
+    Page *page = pages[idx];
+    pages[idx] = NULL;
+    num_allocated--;
+    num_tainted -= page->tainted;
+    if (num_free < PAGED_SHAD_MAX_FREE) {
+#pragma GCC diagnostic push
+#if defined(__GNUC__) && __GNUC__ >= 8
+#pragma GCC diagnostic ignored "-Wclass-memaccess"
+#endif
+        memset(page, 0, sizeof(Page));
+#pragma GCC diagnostic pop
+        page->next_free = free_list;
+        free_list = page;
+        num_free++;
+    } else {
+        free(page);
+    }
+}
+
 LazyShad::LazyShad(std::string name, uint64_t max_size) : Shad(name, max_size)
 {
     tassert(this->size > 0);
@@ -133,6 +133,13 @@ class Shad
     // addr+size-1] are tainted.
     virtual bool range_tainted(uint64_t addr, uint64_t size) = 0;
 
+    // True if no location in [addr .. addr+size-1] holds any taint data,
+    // not even leftover masks. Shadows that can't tell cheaply say false.
+    virtual bool range_clean(uint64_t addr, uint64_t size)
+    {
+        return false;
+    }
+
   public:
     Shad(std::string name, uint64_t max_size);
 
@@ -150,6 +157,9 @@ class Shad
     {
         return size; }
 
+    // True if any location holds a label set.
+    virtual bool any_tainted() = 0;
+
     virtual void label(uint64_t addr, LabelSetP ls) = 0;
 
     static void copy(Shad *shad_dest, uint64_t dest, Shad *shad_src,
@@ -160,6 +170,13 @@ class Shad
         tassert(dest + size <= shad_dest->size);
         tassert(src + size <= shad_src->size);
 
+        // copying nothing is a delete
+        if (shad_src->range_clean(src, size)) {
+            if (!shad_dest->range_clean(dest, size))
+                shad_dest->remove(dest, size);
+            return;
+        }
+
         bool change = false;
         if (track_taint_state && (shad_dest->range_tainted(dest, size) ||
                     shad_src->range_tainted(src, size)))
@@ -224,6 +241,38 @@ class FastShad : public Shad
         return &labels[guest_addr];
     }
 
+    // Entries holding a label set, across all frames.
+    uint64_t num_tainted = 0;
+
+    void store(TaintData *td_p, const TaintData &td)
+    {
+        num_tainted += (td.ls != NULL) - (td_p->ls != NULL);
+        *td_p = td;
+    }
+
+    void clear(uint64_t addr, uint64_t n)
+    {
+        TaintData *t = get_td_p(addr);
+        for (uint64_t i = 0; i < n; i++) {
+            num_tainted -= t[i].ls != NULL;
+        }
+#if 0
+        // GCC8 doesn't like this memset and raises a warning but we really do want it
+        // for performance reasons. The following code prevents the warning, but it's
+        // about 10x slower so we instead disable the warning.
+        for (int i=0; i < n; i++) {
+          t[i] = TaintData();
+        }
+#else
+#pragma GCC diagnostic push
+#if defined(__GNUC__) && __GNUC__ >= 8
+#pragma GCC diagnostic ignored "-Wclass-memaccess"
+#endif
+        memset(t, 0, n * sizeof(TaintData));
+#pragma GCC diagnostic pop
+#endif
+    }
+
   protected:
     bool range_tainted(uint64_t addr, uint64_t size) override
     {
@@ -238,11 +287,16 @@ class FastShad : public Shad
     FastShad(std::string name, uint64_t size);
     ~FastShad();
 
+    bool any_tainted() override
+    {
+        return num_tainted > 0;
+    }
+
     // Taint an address with a labelset.
     void label(uint64_t addr, LabelSetP ls) override
     {
         taint_log("LABEL: %s[%lx] (%p)\n", name(), addr, ls);
-        *get_td_p(addr) = TaintData(ls);
+        store(get_td_p(addr), TaintData(ls));
     }
 
     // Remove taint.
@@ -254,23 +308,8 @@ class FastShad : public Shad
         bool change = false;
         if (track_taint_state && range_tainted(addr, remove_size))
             change = true;
-        
-#if 0
-        // GCC8 doesn't like this memset and raises a warning but we really do want it
-        // for performance reasons. The following code prevents the warning, but it's
-        // about 10x slower so we instead disable the warning.
-        TaintData *t = get_td_p(addr);
-        for (int i=0; i < remove_size; i++) {
-          t[i] = TaintData();
-        }
-#else
-#pragma GCC diagnostic push
-#if defined(__GNUC__) && __GNUC__ >= 8
-#pragma GCC diagnostic ignored "-Wclass-memaccess"
-#endif
-        memset(get_td_p(addr), 0, remove_size * sizeof(TaintData));
-#pragma GCC diagnostic pop
-#endif
+
+        clear(addr, remove_size);
 
         if (change)
             taint_state_changed(this, addr, remove_size);
@@ -281,22 +320,7 @@ class FastShad : public Shad
         tassert(addr + remove_size >= addr);
         tassert(addr + remove_size <= size);
 
-#if 0
-        // GCC8 doesn't like this memset and raises a warning but we really do want it
-        // for performance reasons. The following code prevents the warning, but it's
-        // about 10x slower so we instead disable the warning.
-        TaintData *t = get_td_p(addr);
-        for (int i=0; i < remove_size; i++) {
-          t[i] = TaintData();
-        }
-#else
-#pragma GCC diagnostic push
-#if defined(__GNUC__) && __GNUC__ >= 8
-#pragma GCC diagnostic ignored "-Wclass-memaccess"
-#endif
-        memset(get_td_p(addr), 0, remove_size * sizeof(TaintData));
-#pragma GCC diagnostic pop
-#endif
+        clear(addr, remove_size);
     }
 
     LabelSetP query(uint64_t addr) override
@@ -340,7 +364,7 @@ class FastShad : public Shad
             ((max_taintset_card == 0) || (newcard <= max_taintset_card)))
         {
             bool change = !(td == *get_td_p(addr));
-            labels[addr] = td;
+            store(&labels[addr], td);
             
             if (change) taint_state_changed(this, addr, 1);
         }
@@ -360,13 +384,232 @@ class FastShad : public Shad
     void set_full_quiet(uint64_t addr, TaintData td) override
     {
         tassert(addr < size);
-        labels[addr] = td;
+        store(&labels[addr], td);
+    }
+
+    uint32_t query_tcn(uint64_t addr) override
+    {
+        return (query_full(addr)).tcn;
+    }
+};
+
+// A sparse shadow for guest RAM. The directory only points to a shadow page
+// for guest pages that hold taint data, and each shadow page counts its
+// non-empty and its labeled entries, so clean pages are skipped without
+// touching them. A page is given back as soon as it is empty again.
+class PagedShad : public Shad
+{
+  private:
+    static const unsigned page_bits = 12;
+    static const uint64_t page_size = 1ULL << page_bits;
+    static const uint64_t page_mask = page_size - 1;
+
+    struct Page {
+        TaintData data[page_size];
+        uint32_t used;      // entries that aren't TaintData()
+        uint32_t tainted;   // entries with a label set
+        Page *next_free;
+    };
+
+    Page **pages;
+    uint64_t num_pages;
+    uint64_t num_allocated;
+    uint64_t num_tainted;
+    Page *free_list;
+    uint64_t num_free;
+
+    Page *alloc_page(uint64_t idx);
+    void free_page(uint64_t idx);
+
+    static bool is_empty(const TaintData &td)
+    {
+        return td == TaintData();
+    }
+
+    void put(uint64_t addr, TaintData td)
+    {
+        tassert(addr < size);
+        uint64_t idx = addr >> page_bits;
+        Page *page = pages[idx];
+        bool empty = is_empty(td);
+        if (!page) {
+            if (empty) return;
+            page = alloc_page(idx);
+        }
+
+        TaintData &slot = page->data[addr & page_mask];
+        bool was_empty = is_empty(slot);
+        int tainted = (td.ls != NULL) - (slot.ls != NULL);
+        page->tainted += tainted;
+        num_tainted += tainted;
+        slot = td;
+        if (was_empty && !empty) {
+            page->used++;
+        } else if (!was_empty && empty && --page->used == 0) {
+            free_page(idx);
+        }
+    }
+
+  protected:
+    bool range_tainted(uint64_t addr, uint64_t size) override
+    {
+        uint64_t end = addr + size;
+        for (uint64_t cur = addr; cur < end;) {
+            uint64_t page_end = std::min(end, (cur | page_mask) + 1);
+            Page *page = pages[cur >> page_bits];
+            if (page && page->tainted) {
+                for (; cur < page_end; cur++) {
+                    if (page->data[cur & page_mask].ls)
+                        return true;
+                }
+            }
+            cur = page_end;
+        }
+        return false;
+    }
+
+    bool range_clean(uint64_t addr, uint64_t size) override
+    {
+        if (size == 0) return true;
+        uint64_t last = (addr + size - 1) >> page_bits;
+        for (uint64_t idx = addr >> page_bits; idx <= last; idx++) {
+            if (pages[idx])
+                return false;
+        }
+        return true;
+    }
+
+  public:
+    PagedShad(std::string name, uint64_t size);
+    ~PagedShad();
+
+    // Number of shadow pages currently allocated.
+    uint64_t get_num_pages()
+    {
+        return num_allocated;
+    }
+
+    bool any_tainted() override
+    {
+        return num_tainted > 0;
+    }
+
+    void label(uint64_t addr, LabelSetP ls) override
+    {
+        taint_log("LABEL: %s[%lx] (%p)\n", name(), addr, ls);
+        put(addr, TaintData(ls));
+    }
+
+    void remove(uint64_t addr, uint64_t remove_size) override
+    {
+        tassert(addr + remove_size >= addr);
+        tassert(addr + remove_size <= size);
+
+        bool change = false;
+        if (track_taint_state && range_tainted(addr, remove_size))
+            change = true;
+
+        remove_quiet(addr, remove_size);
+
+        if (change)
+            taint_state_changed(this, addr, remove_size);
+    }
+
+    void remove_quiet(uint64_t addr, uint64_t remove_size) override
+    {
+        tassert(addr + remove_size >= addr);
+        tassert(addr + remove_size <= size);
+
+        uint64_t end = addr + remove_size;
+        for (uint64_t cur = addr; cur < end;) {
+            uint64_t idx = cur >> page_bits;
+            uint64_t page_end = std::min(end, (cur | page_mask) + 1);
+            Page *page = pages[idx];
+            if (page && page_end - cur == page_size) {
+                free_page(idx);
+            } else if (page) {
+                for (; cur < page_end; cur++) {
+                    TaintData &slot = page->data[cur & page_mask];
+                    if (!is_empty(slot)) {
+                        if (slot.ls) {
+                            page->tainted--;
+                            num_tainted--;
+                        }
+                        slot = TaintData();
+                        if (--page->used == 0) {
+                            free_page(idx);
+                            break;
+                        }
+                    }
+                }
+            }
+            cur = page_end;
+        }
+    }
+
+    LabelSetP query(uint64_t addr) override
+    {
+        tassert(addr < size);
+        Page *page = pages[addr >> page_bits];
+        return page ? page->data[addr & page_mask].ls : NULL;
+    }
+
+    TaintData query_full(uint64_t addr) override
+    {
+        tassert(addr < size);
+        Page *page = pages[addr >> page_bits];
+        return page ? page->data[addr & page_mask] : TaintData();
+    }
+
+    void set_full(uint64_t addr, TaintData td) override
+    {
+        tassert(addr < size);
+
+        uint32_t newcard = 0;
+        if (td.ls != NULL) newcard = td.ls->size();
+        if (((max_tcn == 0) || (td.tcn <= max_tcn)) &&
+            ((max_taintset_card == 0) || (newcard <= max_taintset_card)))
+        {
+            bool change = !(td == query_full(addr));
+            put(addr, td);
+
+            if (change) taint_state_changed(this, addr, 1);
+        }
+        else
+        {
+            // delete taint, if there is any, as things have gone too far
+            if (range_tainted(addr, 1))
+            {
+                // remove will take care of taint_state_changed, unless they
+                // don't care to be informed of removals
+                remove(addr, 1);
+            }
+        }
+    }
+
+    // Set taint quietly - ie. no taint change report is made.
+    void set_full_quiet(uint64_t addr, TaintData td) override
+    {
+        put(addr, td);
     }
 
     uint32_t query_tcn(uint64_t addr) override
     {
         return (query_full(addr)).tcn;
     }
+
+    // RAM has no frames.
+    void reset_frame() override
+    {
+    }
+
+    void push_frame(uint64_t framesize) override
+    {
+    }
+
+    void pop_frame(uint64_t framesize) override
+    {
+    }
 };
 
 class LazyShad : public Shad
@@ -390,6 +633,15 @@ class LazyShad : public Shad
     LazyShad(std::string name, uint64_t size);
     ~LazyShad();
 
+    // Walks every entry, so only cheap while there are few.
+    bool any_tainted() override
+    {
+        for (auto &entry : labels) {
+            if (entry.second.ls) return true;
+        }
+        return false;
+    }
+
     void label(uint64_t addr, LabelSetP ls) override
     {
         taint_log("LABEL: %s[%lx] (%p)\n", name(), addr, ls);
@@ -47,8 +47,6 @@
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
 
-#include "shad_dir_32.h"
-#include "shad_dir_64.h"
 #include "llvm_taint_lib.h"
 #include "shad.h"
 #include "taint_ops.h"
@@ -56,6 +54,7 @@
 #include "label_set.h"
 #include "taint_api.h"
 #include "taint2_hypercalls.h"
+#include "taint_summary.h"
 
 #define CPU_OFF(member) (uint64_t)(&((CPUArchState *)0)->member)
 
@@ -67,6 +66,8 @@ bool init_plugin(void *);
 void uninit_plugin(void *);
 int after_block_translate(CPUState *cpu, TranslationBlock *tb);
 bool before_block_exec_invalidate_opt(CPUState *cpu, TranslationBlock *tb);
+bool taint_could_flow(CPUState *cpu, TranslationBlock *tb);
+bool taint_block_filter(CPUState *cpu, TranslationBlock *tb);
 
 // for i386 condition code adjustments
 #if defined(TARGET_I386)
@@ -83,6 +84,8 @@ void on_replay_before_dma(CPUState *cpu, const uint8_t *src_addr, hwaddr dest_ad
 void taint_state_changed(Shad *, uint64_t, uint64_t);
 PPP_PROT_REG_CB(on_taint_change);
 PPP_CB_BOILERPLATE(on_taint_change);
+PPP_CB_EXTERN(on_after_load);
+PPP_CB_EXTERN(on_after_store);
 
 bool track_taint_state = false;
 uint32_t max_tcn = 0;          // ie disabled
@@ -138,8 +141,17 @@ taint2_memlog taint_memlog;
 bool tainted_pointer = true;
 bool optimize_llvm = true;
 extern bool inline_taint;
+extern bool optimize_taint_ops;
+extern bool taint_opt_stats;
+extern uint64_t taint_ops_emitted;
+extern uint64_t taint_ops_removed;
 bool debug_taint = false;
 bool detaint_cb0_bytes = false;
+bool fast_path = true;
+
+// Guest instructions run without (fast) and with taint instrumentation
+uint64_t fast_path_instrs = 0;
+uint64_t taint_path_instrs = 0;
 
 /*
  * These memory callbacks are only for whole-system mode.  User-mode memory
@@ -295,6 +307,8 @@ void taint2_enable_taint(void) {
     if (shadow) delete shadow;
     shadow = new ShadowState();
 
+    panda_set_llvm_block_filter(taint_block_filter);
+
     // Initialize memlog.
     memset(&taint_memlog, 0, sizeof(taint_memlog));
 
@@ -488,6 +502,37 @@ void taint_state_changed(Shad *shad, uint64_t shad_addr, uint64_t size)
     PPP_RUN_CB(on_taint_change, addr, size);
 }
 
+// Blocks keep both their TCG and their taint-instrumented LLVM code. Run the
+// LLVM code only when taint could flow through the block: some register or
+// CPU state is tainted, or there is taint anywhere in RAM or I/O, or a plugin
+// may label data in the middle of the block, as it is loaded or from an
+// instruction callback. Which code runs is only decided on block entry.
+// Hypercalls end their block (see cpuid in target/i386/translate.c, cp7 in
+// target/arm/translate.c), so labels they apply take effect right after.
+bool taint_could_flow(CPUState *cpu, TranslationBlock *tb) {
+    bool could_flow = ppp_on_after_load_num_cb > 0 ||
+        ppp_on_after_store_num_cb > 0 ||
+        panda_cbs_enabled[PANDA_CB_INSN_EXEC] ||
+        panda_cbs_enabled[PANDA_CB_AFTER_INSN_EXEC] ||
+        shadow->grv.any_tainted() || shadow->gsv.any_tainted() ||
+        shadow->ram.any_tainted() || shadow->io.any_tainted();
+    if (could_flow) {
+        taint_path_instrs += tb->icount;
+    } else {
+        fast_path_instrs += tb->icount;
+    }
+    return could_flow;
+}
+
+// Blocks of summarized functions run their TCG code, their effect on taint
+// having been applied when the function was entered.
+bool taint_block_filter(CPUState *cpu, TranslationBlock *tb) {
+    if (taint_summary_block(cpu, tb)) {
+        return false;
+    }
+    return !fast_path || taint_could_flow(cpu, tb);
+}
+
 bool before_block_exec_invalidate_opt(CPUState *cpu, TranslationBlock *tb) {
     if (taintEnabled) {
         return tb->llvm_tc_ptr ? false : true /* invalidate! */;
@@ -537,16 +582,26 @@ bool init_plugin(void *self) {
     std::cerr << PANDA_MSG "taint operations inlining " << PANDA_FLAG_STATUS(inline_taint) << std::endl;
     optimize_llvm = panda_parse_bool_opt(args, "opt", "run LLVM optimization on taint");
     std::cerr << PANDA_MSG "llvm optimizations " << PANDA_FLAG_STATUS(optimize_llvm) << std::endl;
+    optimize_taint_ops = !panda_parse_bool_opt(args, "no_taint_opt", "keep taint operations whose results are never read");
+    std::cerr << PANDA_MSG "taint operation optimization " << PANDA_FLAG_STATUS(optimize_taint_ops) << std::endl;
+    taint_opt_stats = panda_parse_bool_opt(args, "opt_stats", "print how many taint operations are removed from each block");
     debug_taint = panda_parse_bool_opt(args, "debug", "enable taint debugging");
     std::cerr << PANDA_MSG "taint debugging " << PANDA_FLAG_STATUS(debug_taint) << std::endl;
     detaint_cb0_bytes = panda_parse_bool_opt(args, "detaint_cb0", "detaint bytes whose control mask bits are 0");
     std::cerr << PANDA_MSG "detaint if control bits 0 " << PANDA_FLAG_STATUS(detaint_cb0_bytes) << std::endl;
+    fast_path = !panda_parse_bool_opt(args, "no_fast_path", "always run taint-instrumented code, even while nothing is tainted");
+    std::cerr << PANDA_MSG "uninstrumented code while nothing is tainted " << PANDA_FLAG_STATUS(fast_path) << std::endl;
     max_tcn = panda_parse_uint32_opt(args, "max_taintset_compute_number", 0,
         "stop propagating taint after it goes through this number of computations (0=never stop)");
     std::cerr << PANDA_MSG "maximum taint compute number (0=unlimited) " << max_tcn << std::endl;
     max_taintset_card = panda_parse_uint32_opt(args, "max_taintset_card", 0,
         "maximum size a label set can reach before stop tracking taint on it (0=never stop)");
     std::cerr << PANDA_MSG "maximum taintset cardinality (0=unlimited) " << max_taintset_card << std::endl;
+    const char *summaries = panda_parse_string_opt(args, "summaries", nullptr,
+        "guest functions to summarize, as name@address, name@module+offset, name@symbol or name, separated by ':'");
+    if (summaries && !taint_summary_parse(summaries)) {
+        return false;
+    }
     
     // load dependencies
     panda_require("callstack_instr");
@@ -556,7 +611,37 @@ bool init_plugin(void *self) {
 }
 
 void uninit_plugin(void *self) {
+    LabelSetStats ls_stats;
+    label_set_get_stats(&ls_stats);
+    std::cerr << PANDA_MSG "label sets: " << ls_stats.live_sets << " ("
+              << ls_stats.bytes / (1024 * 1024) << " MiB), unions: "
+              << ls_stats.unions << " (" << ls_stats.union_hits
+              << " cached)" << std::endl;
+
+    if (taint_ops_emitted > 0) {
+        std::cerr << PANDA_MSG "taint ops removed: " << taint_ops_removed
+                  << " of " << taint_ops_emitted << " ("
+                  << 100.0 * taint_ops_removed / taint_ops_emitted << "%)"
+                  << std::endl;
+    }
+
+    if (summary_calls > 0) {
+        std::cerr << PANDA_MSG "summarized calls: " << summary_calls << " ("
+                  << summary_instrs << " instructions)" << std::endl;
+    }
+
+    uint64_t total_instrs = fast_path_instrs + taint_path_instrs;
+    if (fast_path && total_instrs > 0) {
+        std::cerr << PANDA_MSG "fast path: " << fast_path_instrs << " of "
+                  << total_instrs << " instructions ("
+                  << 100.0 * fast_path_instrs / total_instrs << "%)"
+                  << std::endl;
+    }
+
     if (shadow) {
+        std::cerr << PANDA_MSG "RAM shadow pages in use: "
+                  << shadow->ram.get_num_pages() << std::endl;
+
         delete shadow;
         shadow = nullptr;
     }
@@ -23,13 +23,10 @@
 #include "panda/plugin.h"
 
 #include "shad.h"
-#include "shad_dir_32.h"
-#include "shad_dir_64.h"
 #include "taint_defines.h"
 #include "addr.h"
 #include "query_res.h"
-
-typedef const std::set<uint32_t> *LabelSetP;
+#include "label_set.h"
 
 typedef void (*on_branch2_t) (Addr, uint64_t);
 typedef void (*on_indirect_jump_t) (Addr, uint64_t);
@@ -44,7 +41,7 @@ typedef void (*on_after_store_t) (Addr, uint64_t, uint64_t);
 struct ShadowState {
     uint64_t prev_bb; // label for previous BB.
     uint32_t num_vals;
-    FastShad ram;
+    PagedShad ram;
     FastShad llv;  // LLVM registers, with multiple frames
     FastShad ret;  // LLVM return value, also temp register
     FastShad grv;  // guest general purpose registers
@@ -106,6 +106,20 @@ uint32_t taint2_num_labels_applied(void);
 // Track whether taint state actually changed during a BB
 void taint2_track_taint_state(void);
 
+// Summarize the guest function at pc with the built-in summary name (e.g.
+// "memcpy"): its effect on taint is applied when it is called, and its body
+// runs uninstrumented. asid 0 matches any address space.
+bool taint2_add_summary(uint64_t asid, uint64_t pc, const char *name);
+
+// ditto, but for the function at offset in the named module of every process.
+// needs osi.
+bool taint2_add_module_summary(const char *module, uint64_t offset, const char *name);
+
+// ditto, but for the function pri names symbol (e.g. "__memcpy_sse2"), in
+// every process, from its first call on. needs osi, and pri with a symbol
+// source such as pri_dwarf.
+bool taint2_add_summary_by_name(const char *symbol, const char *name);
+
 typedef uint32_t TaintLabel;
 
 // Initializes the labelset label iterator in the query result
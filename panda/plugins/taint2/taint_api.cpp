@@ -1,5 +1,6 @@
 #include "taint2.h"
 #include "taint_api.h"
+#include "taint_summary.h"
 #include <set>
 
 Addr make_haddr(uint64_t a)
@@ -66,6 +67,7 @@ target_ulong debug_asid = 0;
 // for that specific asid.
 extern "C"
 int asid_changed_callback(CPUState *env, target_ulong oldval, target_ulong newval) {
+    taint_summary_asid_changed(env, newval);
     if (debug_asid) {
         if (newval == debug_asid) {
             qemu_loglevel |= CPU_LOG_TAINT_OPS | CPU_LOG_LLVM_IR | CPU_LOG_TB_IN_ASM | CPU_LOG_EXEC;
@@ -510,8 +512,8 @@ int taint2_enabled() {
 }
 
 // from label_set.h
-// typedef const std::set<TaintLabel> *LabelSetP;
-typedef std::set<TaintLabel>::iterator LabelSetIter;
+// typedef const LabelSet *LabelSetP;
+typedef const TaintLabel *LabelSetIter;
 
 void taint2_query_results_iter(QueryResult *qr) {
 
@@ -547,7 +549,7 @@ void taint2_query_laddr_full(uint64_t la, uint64_t offset, QueryResult *qr) {
 	qr->num_labels = td.ls->size();
 	qr->tcn = td.tcn;
 	qr->cb_mask = td.cb_mask;
-	qr->ls = (void *) td.ls;  // this should be a (const std::set<TaintLabel> *) type
+	qr->ls = (void *) td.ls;  // this should be a (const LabelSet *) type
 	taint2_query_results_iter(qr);
 }
 
@@ -559,7 +561,7 @@ void taint2_query_reg_full(uint32_t reg_num, uint32_t offset, QueryResult *qr) {
 	qr->num_labels = td.ls->size();
 	qr->tcn = td.tcn;
 	qr->cb_mask = td.cb_mask;
-	qr->ls = (void *) td.ls;  // this should be a (const std::set<TaintLabel> *) type
+	qr->ls = (void *) td.ls;  // this should be a (const LabelSet *) type
 	taint2_query_results_iter(qr);
 }
 //
@@ -572,6 +574,6 @@ void taint2_query_ram_full(uint64_t RamOffset, QueryResult *qr) {
 	qr->num_labels = td.ls->size();
 	qr->tcn = td.tcn;
 	qr->cb_mask = td.cb_mask;
-	qr->ls = (void *) td.ls;  // this should be a (const std::set<TaintLabel> *) type
+	qr->ls = (void *) td.ls;  // this should be a (const LabelSet *) type
 	taint2_query_results_iter(qr);
 }
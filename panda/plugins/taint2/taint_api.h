@@ -66,6 +66,9 @@ uint32_t taint2_num_labels_applied(void);
 
 void taint2_track_taint_state(void);
 
+bool taint2_add_summary(uint64_t asid, uint64_t pc, const char *name);
+bool taint2_add_module_summary(const char *module, uint64_t offset, const char *name);
+
 //typedef uint32_t TaintLabel;
 
 void taint2_query_results_iter(QueryResult *qr);
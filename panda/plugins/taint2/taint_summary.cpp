@@ -0,0 +1,824 @@
+/*!
+ * @file taint_summary.cpp
+ * @brief Function-level taint summaries for guest library routines.
+ *
+ * Summaries are registered for a guest address, either absolute (for any
+ * process, or one address space) or relative to a module that is resolved
+ * through OSI in each process, or for a function name that is resolved
+ * through pri as the function is first called in each process. When a block
+ * starting at a summarized address is about to run, the arguments are read
+ * following the calling convention of the target, the function's effect on
+ * the shadow is applied in bulk and the caller-saved registers get their
+ * taint on return. Until the function returns, its blocks run their plain
+ * TCG code.
+ *
+ * @copyright This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ */
+#ifndef __STDC_FORMAT_MACROS
+#define __STDC_FORMAT_MACROS
+#endif
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "panda/plugin.h"
+#include "panda/plugin_plugin.h"
+
+extern "C" {
+#include "osi/osi_types.h"
+#include "osi/osi_ext.h"
+}
+
+#include "pri/pri_types.h"
+#include "pri/pri_ext.h"
+#include "pri/pri.h"
+
+#include "taint2.h"
+#include "taint_api.h"
+#include "taint_summary.h"
+
+#if defined(TARGET_I386) || defined(TARGET_MIPS) || defined(TARGET_PPC) || \
+    (defined(TARGET_ARM) && !defined(TARGET_AARCH64))
+#define TAINT_SUMMARIES
+#endif
+
+// Summaries read at most this many arguments.
+#define SUMMARY_MAX_ARGS 3
+
+// Longest range of memory a summary handles; calls that touch more run
+// instrumented.
+#define SUMMARY_MAX_LEN (16 << 20)
+
+// How far the stack may grow below its pointer at entry while blocks still
+// count as running inside the summarized function.
+#define SUMMARY_STACK_WINDOW (1 << 20)
+
+extern ShadowState *shadow;
+
+uint64_t summary_instrs = 0;
+uint64_t summary_calls = 0;
+
+// Where a value lives in the shadow. shad is null if the value isn't tracked.
+struct ShadLoc {
+    Shad *shad;
+    uint64_t addr;
+
+    ShadLoc() : shad(nullptr), addr(0) {}
+    ShadLoc(Shad *shad, uint64_t addr) : shad(shad), addr(addr) {}
+};
+
+// Arguments and return information of a call being summarized.
+struct SummaryCall {
+    target_ulong arg[SUMMARY_MAX_ARGS];
+    ShadLoc arg_loc[SUMMARY_MAX_ARGS];
+    unsigned arg_size;
+    target_ulong sp;
+    target_ulong ret_addr;
+
+    // registers the callee may change, and the one the result goes in
+    const int *clobbered;
+    size_t num_clobbered;
+    int ret_reg;
+
+    // taint of a computed result
+    TaintData ret_td;
+};
+
+enum SummaryResult {
+    RESULT_NONE,    // untainted, or no result
+    RESULT_ARG0,    // the first argument
+    RESULT_MIX,     // computed from the bytes the function looked at
+};
+
+typedef bool (*summary_fn)(CPUState *cpu, SummaryCall &c);
+
+struct SummaryDef {
+    const char *name;
+    summary_fn apply;   // returns false if the call can't be summarized
+    SummaryResult result;
+};
+
+struct Summary {
+    target_ulong asid;  // 0 for any address space
+    const SummaryDef *def;
+    bool resolved;      // found through a module or symbol of one process
+};
+
+struct ModuleSummary {
+    std::string module;
+    target_ulong offset;
+    const SummaryDef *def;
+};
+
+// Module summaries resolved for an address space.
+struct ProcessSummaries {
+    target_ulong pid;
+    std::vector<bool> resolved;
+};
+
+// A summarized call whose body is running.
+struct ActiveCall {
+    bool active;
+    target_ulong asid;
+    bool in_kernel;
+    target_ulong sp;
+    target_ulong ret_addr;
+
+    ActiveCall() : active(false), asid(0), in_kernel(false), sp(0),
+        ret_addr(0) {}
+};
+
+// A run of guest virtual memory that is contiguous in RAM.
+struct RamRun {
+    uint64_t ram;
+    uint64_t len;
+};
+
+static std::unordered_map<target_ulong, std::vector<Summary>> summaries;
+static std::vector<ModuleSummary> module_summaries;
+// summaries of functions by the name pri reports for them
+static std::unordered_map<std::string, const SummaryDef *> symbol_summaries;
+static std::unordered_map<target_ulong, ProcessSummaries> process_summaries;
+static std::vector<ActiveCall> active_calls;
+static bool osi_ready = false;
+static bool pri_ready = false;
+static bool resolve_pending = false;
+
+#ifdef TAINT_SUMMARIES
+
+static inline ShadLoc reg_loc(int reg) {
+    return ShadLoc(&shadow->grv, (uint64_t)reg * sizeof(target_ulong));
+}
+
+static inline ShadLoc ram_loc(CPUState *cpu, target_ulong addr) {
+    ram_addr_t RamOffset = RAM_ADDR_INVALID;
+    if (PandaVirtualAddressToRamOffset(&RamOffset, cpu, addr, false) != MEMTX_OK) {
+        return ShadLoc();
+    }
+    return ShadLoc(&shadow->ram, RamOffset);
+}
+
+#if defined(TARGET_I386)
+static const int x86_clobbered[] = { R_EAX, R_ECX, R_EDX };
+#ifdef TARGET_X86_64
+static const int x64_args[] = { R_EDI, R_ESI, R_EDX };
+static const int x64_clobbered[] = { R_EAX, R_ECX, R_EDX, R_ESI, R_EDI,
+    8, 9, 10, 11 };
+#endif
+#elif defined(TARGET_ARM)
+static const int arm_clobbered[] = { 0, 1, 2, 3, 12 };
+#elif defined(TARGET_MIPS)
+static const int mips_clobbered[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12,
+    13, 14, 15, 24, 25 };
+#elif defined(TARGET_PPC)
+static const int ppc_clobbered[] = { 0, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12 };
+#endif
+
+static target_ulong stack_pointer(CPUState *cpu) {
+    CPUArchState *env = (CPUArchState *)cpu->env_ptr;
+#if defined(TARGET_I386)
+    return env->regs[R_ESP];
+#elif defined(TARGET_ARM)
+    return env->regs[13];
+#elif defined(TARGET_MIPS)
+    return env->active_tc.gpr[29];
+#elif defined(TARGET_PPC)
+    return env->gpr[1];
+#endif
+}
+
+// Reads the arguments and return address of a call that has just entered
+// the callee.
+static bool read_call(CPUState *cpu, SummaryCall &c) {
+    CPUArchState *env = (CPUArchState *)cpu->env_ptr;
+    c.sp = stack_pointer(cpu);
+#if defined(TARGET_I386)
+#ifdef TARGET_X86_64
+    if (env->hflags & HF_CS64_MASK) {
+        // System V: arguments in registers, return address on the stack
+        uint64_t ret_addr;
+        if (panda_virtual_memory_read(cpu, c.sp, (uint8_t *)&ret_addr,
+                    sizeof(ret_addr)) != 0) {
+            return false;
+        }
+        c.ret_addr = ret_addr;
+        c.arg_size = 8;
+        for (int i = 0; i < SUMMARY_MAX_ARGS; i++) {
+            c.arg[i] = env->regs[x64_args[i]];
+            c.arg_loc[i] = reg_loc(x64_args[i]);
+        }
+        c.clobbered = x64_clobbered;
+        c.num_clobbered = ARRAY_SIZE(x64_clobbered);
+        c.ret_reg = R_EAX;
+        return true;
+    }
+#endif
+    // cdecl: return address, then the arguments, on the stack
+    uint32_t words[1 + SUMMARY_MAX_ARGS];
+    if (panda_virtual_memory_read(cpu, c.sp, (uint8_t *)words,
+                sizeof(words)) != 0) {
+        return false;
+    }
+    c.ret_addr = words[0];
+    c.arg_size = 4;
+    for (int i = 0; i < SUMMARY_MAX_ARGS; i++) {
+        c.arg[i] = words[i + 1];
+        c.arg_loc[i] = ram_loc(cpu, c.sp + 4 * (i + 1));
+    }
+    c.clobbered = x86_clobbered;
+    c.num_clobbered = ARRAY_SIZE(x86_clobbered);
+    c.ret_reg = R_EAX;
+#elif defined(TARGET_ARM)
+    c.ret_addr = env->regs[14] & ~(target_ulong)1;
+    c.arg_size = sizeof(target_ulong);
+    for (int i = 0; i < SUMMARY_MAX_ARGS; i++) {
+        c.arg[i] = env->regs[i];
+        c.arg_loc[i] = reg_loc(i);
+    }
+    c.clobbered = arm_clobbered;
+    c.num_clobbered = ARRAY_SIZE(arm_clobbered);
+    c.ret_reg = 0;
+#elif defined(TARGET_MIPS)
+    c.ret_addr = env->active_tc.gpr[31];
+    c.arg_size = sizeof(target_ulong);
+    for (int i = 0; i < SUMMARY_MAX_ARGS; i++) {
+        c.arg[i] = env->active_tc.gpr[4 + i];
+        c.arg_loc[i] = reg_loc(4 + i);
+    }
+    c.clobbered = mips_clobbered;
+    c.num_clobbered = ARRAY_SIZE(mips_clobbered);
+    c.ret_reg = 2;
+#elif defined(TARGET_PPC)
+    c.ret_addr = env->lr;
+    c.arg_size = sizeof(target_ulong);
+    for (int i = 0; i < SUMMARY_MAX_ARGS; i++) {
+        c.arg[i] = env->gpr[3 + i];
+        c.arg_loc[i] = reg_loc(3 + i);
+    }
+    c.clobbered = ppc_clobbered;
+    c.num_clobbered = ARRAY_SIZE(ppc_clobbered);
+    c.ret_reg = 3;
+#endif
+    return true;
+}
+
+// Bytes from addr up to the end of its page, at most max.
+static inline uint64_t page_chunk(target_ulong addr, uint64_t max) {
+    uint64_t left = TARGET_PAGE_SIZE - (addr & ~TARGET_PAGE_MASK);
+    return left < max ? left : max;
+}
+
+// Splits len bytes of guest virtual memory at addr into runs of RAM. Fails
+// if any page isn't mapped to RAM.
+static bool translate(CPUState *cpu, target_ulong addr, uint64_t len,
+        bool is_write, std::vector<RamRun> &runs) {
+    runs.clear();
+    while (len > 0) {
+        uint64_t n = page_chunk(addr, len);
+        ram_addr_t RamOffset = RAM_ADDR_INVALID;
+        if (PandaVirtualAddressToRamOffset(&RamOffset, cpu, addr, is_write) != MEMTX_OK) {
+            return false;
+        }
+        if (!runs.empty() && runs.back().ram + runs.back().len == RamOffset) {
+            runs.back().len += n;
+        } else {
+            runs.push_back({ RamOffset, n });
+        }
+        addr += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Copies the taint of len bytes of guest memory from src to dst, like
+// memmove.
+static bool copy_taint(CPUState *cpu, target_ulong dst, target_ulong src,
+        uint64_t len) {
+    static std::vector<RamRun> dst_runs, src_runs;
+
+    if (len > SUMMARY_MAX_LEN) return false;
+    if (!translate(cpu, dst, len, true, dst_runs) ||
+        !translate(cpu, src, len, false, src_runs)) {
+        return false;
+    }
+
+    // pair up the runs so that each piece is contiguous on both sides
+    struct Piece { uint64_t dst, src, len; };
+    std::vector<Piece> pieces;
+    size_t d = 0, s = 0;
+    uint64_t d_off = 0, s_off = 0;
+    while (d < dst_runs.size()) {
+        uint64_t n = std::min(dst_runs[d].len - d_off, src_runs[s].len - s_off);
+        pieces.push_back({ dst_runs[d].ram + d_off, src_runs[s].ram + s_off, n });
+        d_off += n;
+        s_off += n;
+        if (d_off == dst_runs[d].len) { d++; d_off = 0; }
+        if (s_off == src_runs[s].len) { s++; s_off = 0; }
+    }
+
+    Shad *ram = &shadow->ram;
+    if (dst > src && dst - src < len) {
+        // overlapping move to higher addresses: copy back to front
+        for (auto p = pieces.rbegin(); p != pieces.rend(); ++p) {
+            for (uint64_t i = p->len; i-- > 0;) {
+                ram->set_full(p->dst + i, ram->query_full(p->src + i));
+            }
+        }
+    } else {
+        for (auto &p : pieces) {
+            Shad::copy(ram, p.dst, ram, p.src, p.len);
+        }
+    }
+    return true;
+}
+
+// Gives len bytes of guest memory at dst the taint td.
+static bool fill_taint(CPUState *cpu, target_ulong dst, uint64_t len,
+        TaintData td) {
+    static std::vector<RamRun> runs;
+
+    if (len > SUMMARY_MAX_LEN) return false;
+    if (!translate(cpu, dst, len, true, runs)) return false;
+
+    Shad *ram = &shadow->ram;
+    for (auto &r : runs) {
+        if (!td.ls) {
+            ram->remove(r.ram, r.len);
+            continue;
+        }
+        for (uint64_t i = 0; i < r.len; i++) {
+            ram->set_full(r.ram + i, td);
+        }
+    }
+    return true;
+}
+
+// Unions the taint of len bytes of guest memory at addr into td.
+static bool mix_taint(CPUState *cpu, target_ulong addr, uint64_t len,
+        TaintData &td) {
+    static std::vector<RamRun> runs;
+
+    if (len > SUMMARY_MAX_LEN) return false;
+    if (!translate(cpu, addr, len, false, runs)) return false;
+
+    for (auto &r : runs) {
+        for (uint64_t i = 0; i < r.len; i++) {
+            TaintData byte_td = shadow->ram.query_full(r.ram + i);
+            if (byte_td.ls) td = TaintData::make_union(td, byte_td, false);
+        }
+    }
+    return true;
+}
+
+// Length of the NUL-terminated guest string at addr, stopping at max.
+static bool guest_strnlen(CPUState *cpu, target_ulong addr, uint64_t max,
+        uint64_t &len) {
+    uint8_t buf[256];
+    len = 0;
+    while (len < max) {
+        if (len >= SUMMARY_MAX_LEN) return false;
+        uint64_t n = page_chunk(addr + len, std::min<uint64_t>(max - len, sizeof(buf)));
+        if (panda_virtual_memory_read(cpu, addr + len, buf, n) != 0) {
+            return false;
+        }
+        uint8_t *nul = (uint8_t *)memchr(buf, 0, n);
+        if (nul) {
+            len += nul - buf;
+            return true;
+        }
+        len += n;
+    }
+    return true;
+}
+
+// Number of bytes a comparison of the guest buffers at a and b looks at: up
+// to the first difference, or for strings the first NUL, stopping at max.
+static bool guest_cmp_len(CPUState *cpu, target_ulong a, target_ulong b,
+        uint64_t max, bool is_string, uint64_t &len) {
+    uint8_t buf_a[256], buf_b[256];
+    len = 0;
+    while (len < max) {
+        if (len >= SUMMARY_MAX_LEN) return false;
+        uint64_t n = page_chunk(a + len, std::min<uint64_t>(max - len, sizeof(buf_a)));
+        n = page_chunk(b + len, n);
+        if (panda_virtual_memory_read(cpu, a + len, buf_a, n) != 0 ||
+            panda_virtual_memory_read(cpu, b + len, buf_b, n) != 0) {
+            return false;
+        }
+        for (uint64_t i = 0; i < n; i++) {
+            if (buf_a[i] != buf_b[i] || (is_string && buf_a[i] == 0)) {
+                len += i + 1;
+                return true;
+            }
+        }
+        len += n;
+    }
+    return true;
+}
+
+static bool summarize_memcpy(CPUState *cpu, SummaryCall &c) {
+    return copy_taint(cpu, c.arg[0], c.arg[1], c.arg[2]);
+}
+
+static bool summarize_memset(CPUState *cpu, SummaryCall &c) {
+    // every byte gets the taint of the low byte of the value
+    TaintData td;
+    if (c.arg_loc[1].shad) td = c.arg_loc[1].shad->query_full(c.arg_loc[1].addr);
+    return fill_taint(cpu, c.arg[0], c.arg[2], td);
+}
+
+static bool summarize_bzero(CPUState *cpu, SummaryCall &c) {
+    return fill_taint(cpu, c.arg[0], c.arg[1], TaintData());
+}
+
+static bool summarize_strcpy(CPUState *cpu, SummaryCall &c) {
+    uint64_t len;
+    if (!guest_strnlen(cpu, c.arg[1], SUMMARY_MAX_LEN, len)) return false;
+    return copy_taint(cpu, c.arg[0], c.arg[1], len + 1);
+}
+
+static bool summarize_strncpy(CPUState *cpu, SummaryCall &c) {
+    // copies the string, then pads with (untainted) NULs
+    uint64_t len;
+    if (!guest_strnlen(cpu, c.arg[1], c.arg[2], len)) return false;
+    return copy_taint(cpu, c.arg[0], c.arg[1], len) &&
+        fill_taint(cpu, c.arg[0] + len, c.arg[2] - len, TaintData());
+}
+
+static bool summarize_strcat(CPUState *cpu, SummaryCall &c) {
+    uint64_t dst_len, src_len;
+    if (!guest_strnlen(cpu, c.arg[0], SUMMARY_MAX_LEN, dst_len) ||
+        !guest_strnlen(cpu, c.arg[1], SUMMARY_MAX_LEN, src_len)) {
+        return false;
+    }
+    return copy_taint(cpu, c.arg[0] + dst_len, c.arg[1], src_len + 1);
+}
+
+static bool summarize_strlen(CPUState *cpu, SummaryCall &c) {
+    // only counts bytes; memory is unchanged and the length isn't tainted
+    return true;
+}
+
+static bool summarize_cmp(CPUState *cpu, SummaryCall &c, uint64_t max,
+        bool is_string) {
+    uint64_t len;
+    if (!guest_cmp_len(cpu, c.arg[0], c.arg[1], max, is_string, len)) {
+        return false;
+    }
+    c.ret_td = TaintData();
+    if (!mix_taint(cpu, c.arg[0], len, c.ret_td) ||
+        !mix_taint(cpu, c.arg[1], len, c.ret_td)) {
+        return false;
+    }
+    c.ret_td.increment_tcn();
+    return true;
+}
+
+static bool summarize_memcmp(CPUState *cpu, SummaryCall &c) {
+    return summarize_cmp(cpu, c, c.arg[2], false);
+}
+
+static bool summarize_strcmp(CPUState *cpu, SummaryCall &c) {
+    return summarize_cmp(cpu, c, SUMMARY_MAX_LEN, true);
+}
+
+static bool summarize_strncmp(CPUState *cpu, SummaryCall &c) {
+    return summarize_cmp(cpu, c, c.arg[2], true);
+}
+
+static const SummaryDef builtin_summaries[] = {
+    { "memcpy",  summarize_memcpy,  RESULT_ARG0 },
+    { "memmove", summarize_memcpy,  RESULT_ARG0 },
+    { "memset",  summarize_memset,  RESULT_ARG0 },
+    { "bzero",   summarize_bzero,   RESULT_NONE },
+    { "strcpy",  summarize_strcpy,  RESULT_ARG0 },
+    { "strncpy", summarize_strncpy, RESULT_ARG0 },
+    { "strcat",  summarize_strcat,  RESULT_ARG0 },
+    { "strlen",  summarize_strlen,  RESULT_NONE },
+    { "strnlen", summarize_strlen,  RESULT_NONE },
+    { "memcmp",  summarize_memcmp,  RESULT_MIX },
+    { "strcmp",  summarize_strcmp,  RESULT_MIX },
+    { "strncmp", summarize_strncmp, RESULT_MIX },
+};
+
+// Gives the registers the taint they have once the function returns.
+static void set_result_taint(const SummaryCall &c, SummaryResult result,
+        const TaintData *arg0_td) {
+    Shad *grv = &shadow->grv;
+    for (size_t i = 0; i < c.num_clobbered; i++) {
+        grv->remove(c.clobbered[i] * sizeof(target_ulong), sizeof(target_ulong));
+    }
+
+    uint64_t ret = c.ret_reg * sizeof(target_ulong);
+    switch (result) {
+        case RESULT_ARG0:
+            for (unsigned i = 0; i < c.arg_size; i++) {
+                if (arg0_td[i].ls) grv->set_full(ret + i, arg0_td[i]);
+            }
+            break;
+        case RESULT_MIX:
+            if (c.ret_td.ls) {
+                for (unsigned i = 0; i < sizeof(target_ulong); i++) {
+                    grv->set_full(ret + i, c.ret_td);
+                }
+            }
+            break;
+        case RESULT_NONE:
+            break;
+    }
+}
+
+// Applies a summary to a call that has just entered the function.
+static bool apply_summary(CPUState *cpu, const SummaryDef *def,
+        ActiveCall &call) {
+    SummaryCall c;
+    if (!read_call(cpu, c)) return false;
+
+    // the memory effect may overwrite where the first argument came from
+    TaintData arg0_td[sizeof(uint64_t)];
+    if (c.arg_loc[0].shad) {
+        for (unsigned i = 0; i < c.arg_size; i++) {
+            arg0_td[i] = c.arg_loc[0].shad->query_full(c.arg_loc[0].addr + i);
+        }
+    }
+
+    if (!def->apply(cpu, c)) return false;
+    set_result_taint(c, def->result, arg0_td);
+
+    call.active = true;
+    call.asid = panda_current_asid(cpu);
+    call.in_kernel = panda_in_kernel(cpu);
+    call.sp = c.sp;
+    call.ret_addr = c.ret_addr;
+    summary_calls++;
+    return true;
+}
+
+#endif
+
+static const SummaryDef *find_summary_def(const char *name) {
+#ifdef TAINT_SUMMARIES
+    for (auto &def : builtin_summaries) {
+        if (strcmp(def.name, name) == 0) return &def;
+    }
+    std::cerr << PANDA_MSG "no taint summary for " << name << std::endl;
+#else
+    std::cerr << PANDA_MSG "taint summaries aren't supported on this architecture" << std::endl;
+#endif
+    return nullptr;
+}
+
+static bool setup_osi() {
+    if (!osi_ready) {
+        panda_require("osi");
+        osi_ready = init_osi_api();
+        if (!osi_ready) {
+            std::cerr << PANDA_MSG "module and symbol taint summaries need osi" << std::endl;
+        }
+    }
+    return osi_ready;
+}
+
+static void add_summary(target_ulong asid, target_ulong pc,
+        const SummaryDef *def, bool resolved) {
+    summaries[pc].push_back({ asid, def, resolved });
+}
+
+// Drops the summaries resolved from modules and symbols for one address
+// space, or for all of them.
+static void remove_resolved_summaries(target_ulong asid, bool all) {
+    for (auto &kv : summaries) {
+        auto &v = kv.second;
+        v.erase(std::remove_if(v.begin(), v.end(), [&](const Summary &s) {
+                    return s.resolved && (all || s.asid == asid);
+                }), v.end());
+    }
+}
+
+static bool add_module_summary(const char *module, target_ulong offset,
+        const SummaryDef *def) {
+    if (!setup_osi()) return false;
+    module_summaries.push_back({ module, offset, def });
+    // processes already seen get searched again, for all modules
+    remove_resolved_summaries(0, true);
+    process_summaries.clear();
+    resolve_pending = true;
+    return true;
+}
+
+#ifdef TAINT_SUMMARIES
+// pri reports calls as they reach the callee, before its first block runs,
+// so the summary is in place for that block.
+static void summary_fn_start(CPUState *cpu, target_ulong pc,
+        const char *file_name, const char *funct_name) {
+    if (!funct_name) return;
+    auto it = symbol_summaries.find(funct_name);
+    if (it == symbol_summaries.end()) return;
+
+    target_ulong asid = panda_current_asid(cpu);
+    auto &v = summaries[pc];
+    for (auto &s : v) {
+        if (s.resolved && s.asid == asid) return;
+    }
+    add_summary(asid, pc, it->second, true);
+}
+#endif
+
+static bool add_symbol_summary(const char *symbol, const SummaryDef *def) {
+    // osi tells when an address space is reused by another process
+    if (!setup_osi()) return false;
+    if (!pri_ready) {
+        panda_require("pri");
+        pri_ready = init_pri_api();
+        if (!pri_ready) {
+            std::cerr << PANDA_MSG "symbol taint summaries need pri" << std::endl;
+            return false;
+        }
+#ifdef TAINT_SUMMARIES
+        PPP_REG_CB("pri", on_fn_start, summary_fn_start);
+#endif
+    }
+    symbol_summaries[symbol] = def;
+    return true;
+}
+
+#ifdef TAINT_SUMMARIES
+// Finds the modules that have summaries in the running process.
+static void resolve_module_summaries(CPUState *cpu) {
+    OsiProc *proc = get_current_process(cpu);
+    if (!proc) return;
+
+    target_ulong asid = panda_current_asid(cpu);
+    auto it = process_summaries.find(asid);
+    if (it != process_summaries.end() && it->second.pid != proc->pid) {
+        // the address space was reused by another process
+        remove_resolved_summaries(asid, false);
+        process_summaries.erase(it);
+        it = process_summaries.end();
+    }
+    if (it == process_summaries.end()) {
+        it = process_summaries.insert({ asid, { proc->pid,
+                std::vector<bool>(module_summaries.size()) } }).first;
+    }
+
+    // Modules that aren't mapped yet may still be loaded with dlopen, so
+    // keep looking each time the process runs; osi_linux caches mappings
+    // that haven't changed.
+    ProcessSummaries &ps = it->second;
+    bool done = std::all_of(ps.resolved.begin(), ps.resolved.end(),
+            [](bool r) { return r; });
+    if (done) {
+        free_osiproc(proc);
+        return;
+    }
+
+    GArray *ms = get_mappings(cpu, proc);
+    if (ms) {
+        for (size_t i = 0; i < module_summaries.size(); i++) {
+            if (ps.resolved[i]) continue;
+            const ModuleSummary &m = module_summaries[i];
+            // a module is mapped in several pieces; offsets are from the
+            // lowest one
+            bool found = false;
+            target_ulong base = 0;
+            for (guint j = 0; j < ms->len; j++) {
+                OsiModule *om = &g_array_index(ms, OsiModule, j);
+                if (!om->name || m.module != om->name) continue;
+                if (!found || om->base < base) base = om->base;
+                found = true;
+            }
+            if (found) {
+                add_summary(asid, base + m.offset, m.def, true);
+                ps.resolved[i] = true;
+            }
+        }
+        g_array_free(ms, true);
+    }
+    free_osiproc(proc);
+}
+#endif
+
+void taint_summary_asid_changed(CPUState *cpu, target_ulong new_asid) {
+    // OSI still sees the previous process here, so look the modules up once
+    // the new one runs in user mode
+    resolve_pending = !module_summaries.empty() || !symbol_summaries.empty();
+}
+
+bool taint_summary_block(CPUState *cpu, TranslationBlock *tb) {
+#ifdef TAINT_SUMMARIES
+    if (resolve_pending && !panda_in_kernel(cpu)) {
+        resolve_pending = false;
+        resolve_module_summaries(cpu);
+    }
+    if (summaries.empty()) return false;
+
+    if (active_calls.size() <= (size_t)cpu->cpu_index) {
+        active_calls.resize(cpu->cpu_index + 1);
+    }
+    ActiveCall &call = active_calls[cpu->cpu_index];
+
+    if (call.active) {
+        // Blocks of other address spaces, privilege levels and stacks (e.g.
+        // other threads) don't belong to the call and take the normal path.
+        if (panda_current_asid(cpu) != call.asid ||
+            panda_in_kernel(cpu) != call.in_kernel) {
+            return false;
+        }
+        target_ulong sp = stack_pointer(cpu);
+        if (sp <= call.sp && call.sp - sp < SUMMARY_STACK_WINDOW &&
+            !(tb->pc == call.ret_addr && sp == call.sp)) {
+            summary_instrs += tb->icount;
+            return true;
+        }
+        if ((tb->pc == call.ret_addr && sp >= call.sp) ||
+            (sp > call.sp && sp - call.sp < SUMMARY_STACK_WINDOW)) {
+            // returned (or unwound past the call)
+            call.active = false;
+        } else {
+            return false;
+        }
+    }
+
+    auto it = summaries.find(tb->pc);
+    if (it == summaries.end()) return false;
+
+    target_ulong asid = panda_current_asid(cpu);
+    for (auto &s : it->second) {
+        if (s.asid != 0 && s.asid != asid) continue;
+        if (apply_summary(cpu, s.def, call)) {
+            summary_instrs += tb->icount;
+            return true;
+        }
+        break;
+    }
+#endif
+    return false;
+}
+
+bool taint_summary_parse(const char *spec) {
+    std::string s(spec);
+    size_t start = 0;
+    while (start <= s.size()) {
+        size_t end = s.find(':', start);
+        if (end == std::string::npos) end = s.size();
+        std::string entry = s.substr(start, end - start);
+        start = end + 1;
+        if (entry.empty()) continue;
+
+        size_t at = entry.find('@');
+        size_t plus = entry.rfind('+');
+        if (at == 0 || at + 1 == entry.size()) {
+            std::cerr << PANDA_MSG "bad taint summary " << entry << std::endl;
+            return false;
+        }
+        std::string name = entry.substr(0, at);
+        bool ok;
+        if (at == std::string::npos) {
+            // a bare name summarizes the function of that name
+            ok = taint2_add_summary_by_name(name.c_str(), name.c_str());
+        } else if (plus != std::string::npos && plus > at) {
+            std::string module = entry.substr(at + 1, plus - at - 1);
+            target_ulong offset = strtoull(entry.c_str() + plus + 1, NULL, 0);
+            ok = taint2_add_module_summary(module.c_str(), offset, name.c_str());
+        } else if (isdigit((unsigned char)entry[at + 1])) {
+            target_ulong pc = strtoull(entry.c_str() + at + 1, NULL, 0);
+            ok = taint2_add_summary(0, pc, name.c_str());
+        } else {
+            std::string symbol = entry.substr(at + 1);
+            ok = taint2_add_summary_by_name(symbol.c_str(), name.c_str());
+        }
+        if (!ok) return false;
+        std::cerr << PANDA_MSG "taint summary " << entry << std::endl;
+    }
+    return true;
+}
+
+extern "C" {
+
+bool taint2_add_summary(uint64_t asid, uint64_t pc, const char *name) {
+    const SummaryDef *def = find_summary_def(name);
+    if (!def) return false;
+    add_summary(asid, pc, def, false);
+    return true;
+}
+
+bool taint2_add_module_summary(const char *module, uint64_t offset,
+        const char *name) {
+    const SummaryDef *def = find_summary_def(name);
+    if (!def) return false;
+    return add_module_summary(module, offset, def);
+}
+
+bool taint2_add_summary_by_name(const char *symbol, const char *name) {
+    const SummaryDef *def = find_summary_def(name);
+    if (!def) return false;
+    return add_symbol_summary(symbol, def);
+}
+
+}
@@ -0,0 +1,32 @@
+/*!
+ * @file taint_summary.h
+ * @brief Function-level taint summaries for guest library routines.
+ *
+ * A summary stands in for the taint propagation of a whole guest function:
+ * when the function is entered its effect on taint (e.g. copying the taint
+ * of n bytes for memcpy) is applied in one go, and its body then runs
+ * uninstrumented until it returns.
+ *
+ * @copyright This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ */
+#pragma once
+
+#include "panda/plugin.h"
+
+// Number of guest instructions run inside summarized functions, and the
+// number of calls that were summarized.
+extern uint64_t summary_instrs;
+extern uint64_t summary_calls;
+
+// Registers the summaries in a taint2 `summaries` argument, a list of
+// `name@address`, `name@module+offset`, `name@symbol` and `name` entries
+// separated by ':'.
+bool taint_summary_parse(const char *spec);
+
+// Called by the LLVM block filter for each block. Returns true if the block
+// belongs to a summarized function and should run without instrumentation.
+bool taint_summary_block(CPUState *cpu, TranslationBlock *tb);
+
+// Resolves module and symbol summaries for the process that is now running.
+void taint_summary_asid_changed(CPUState *cpu, target_ulong new_asid);
@@ -857,16 +857,20 @@ class Panda():
 
     ########################## LIBPANDA FUNCTIONS ########################
     # Methods that directly pass data to/from PANDA with no extra logic beyond argument reformatting.
-    def set_pandalog(self, name):
+    def set_pandalog(self, name, codec=None):
         '''
         Enable recording to a pandalog (plog) named `name`
 
             Parameters:
                 name: file to output data to
+                codec: chunk compression, "zlib" (default), "zstd" or "lz4"
             
             Returns:
                 None
         '''
+        if codec is not None:
+            if not self.libpanda.panda_set_pandalog_codec(ffi.new("char[]", bytes(codec, "utf-8"))):
+                raise ValueError(f"pandalog codec {codec} is not supported by this build")
         charptr = ffi.new("char[]", bytes(name, "utf-8"))
         self.libpanda.panda_start_pandalog(charptr)
 
@@ -2157,7 +2161,8 @@ class Panda():
         if not enabled: # Note the registered_callbacks dict starts with enabled true and then we update it to false as necessary here
             self.disable_callback(name)
 
-        if "block" in cb.name:
+        # start_block_exec and end_block_exec are called from the blocks' own code
+        if "block" in cb.name and cb.name not in ("start_block_exec", "end_block_exec"):
             if not self.disabled_tb_chaining:
                 print("Warning: disabling TB chaining to support {} callback".format(cb.name))
                 self.disable_tb_chaining()
@@ -2433,7 +2438,7 @@ class Panda():
 
     def hook(self, addr, enabled=True, kernel=True, libraryname=None, procname=None, name=None):
         '''
-        Decorate a function to setup a hook: when a guest goes to execute a basic block beginning with addr,
+        Decorate a function to setup a hook: when a guest goes to execute the instruction at addr,
         the function will be called with args (CPUState, TranslationBlock)
         '''
         if procname:
@@ -2443,7 +2448,7 @@ class Panda():
             self._register_mmap_cb()
 
         def decorator(fun):
-            # Ultimately, our hook resolves as a before_block_exec so we must match its args
+            # Hooks get the same args as before_block_exec
             hook_cb_type = self.callback.before_block_exec # (CPUState, TranslationBlock)
 
             if 'hooks' not in self.plugins:
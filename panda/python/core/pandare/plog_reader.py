@@ -3,13 +3,18 @@
 import zlib
 import struct
 
+# chunk codecs, indexed by the codec field of a version 3 header (PlCodec)
+PLOG_CODECS = ['zlib', 'zstd', 'lz4']
+
 class PLogReader:
     '''
     A class for reading pandalog files.
     '''
     def __init__(self, fn):
         self.f = open(fn, 'rb')
-        self.version, _, self.dir_pos, _, self.chunk_gsize = struct.unpack('<IIQII', self.f.read(24))
+        self.version, _, self.dir_pos, self.chunk_gsize, codec = struct.unpack('<IIQII', self.f.read(24))
+        # the codec field was padding before version 3, when chunks were always zlib
+        self.codec = PLOG_CODECS[codec] if self.version >= 3 else 'zlib'
 
         self.f.seek(self.dir_pos)
         self.nchunks, = struct.unpack('<I', self.f.read(4)) # number of chunks
@@ -19,6 +24,16 @@ class PLogReader:
         self.chunk_data = None                              # data of current chunk
         self.chunk_data_idx = 0
 
+    def _decompress(self, zbuf):
+        if self.codec == 'zlib':
+            return zlib.decompress(zbuf, 15, self.chunk_gsize)
+        if self.codec == 'zstd':
+            import zstandard
+            return zstandard.ZstdDecompressor().decompress(zbuf, max_output_size=self.chunk_gsize)
+        # lz4 chunks start with their uncompressed size
+        import lz4.block
+        return lz4.block.decompress(zbuf)
+
     def __iter__(self):
         return self
 
@@ -47,7 +62,7 @@ class PLogReader:
 
             # read and decompress chunk data
             self.f.seek(cur[1])
-            self.chunk_data = zlib.decompress(self.f.read(zchunk_size), 15, self.chunk_gsize)
+            self.chunk_data = self._decompress(self.f.read(zchunk_size))
             self.chunk_size = len(self.chunk_data)
             self.chunk_data_idx = 0
 
@@ -68,6 +68,8 @@ def read_kernelinfo(kernelinfo, config):
 	mm.start_brk_offset = int(config['mm.start_brk_offset'])
 	mm.brk_offset = int(config['mm.brk_offset'])
 	mm.start_stack_offset = int(config['mm.start_stack_offset'])
+	mm.map_count_offset = int(config.get('mm.map_count_offset', 0))
+	mm.total_vm_offset = int(config.get('mm.total_vm_offset', 0))
 	# read vma information
 	vma.size = int(config['vma.size'])
 	vma.vm_mm_offset = int(config['vma.vm_mm_offset'])
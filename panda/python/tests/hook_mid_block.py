@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+'''
+1) Start guest and identify kernel symbol->address mappings. End execution
+2) Restart guest with sys_access hooked. The first time its block is
+   translated, note the address of its second instruction. From the
+   sys_access hook, add a second hook there, in the middle of the block.
+3) The mid-block hook removes itself, from inside the hook, after it has run
+   a few times. Run programs in the guest, each of which calls access() from
+   the dynamic loader, then check both hooks' counts
+
+The mid-block hook must run only after it was added, exactly as many times as
+it ran before removing itself, and once per sys_access call in between.
+'''
+
+from pandare import Panda, blocking
+
+arch = "i386"
+panda = Panda(generic=arch)
+
+# First run - Just get symbols
+kallsyms = {}
+@blocking
+def extract_kallsyms():
+    panda.revert_sync("root")
+    syms = panda.run_serial_cmd("cat /boot/System.map*", timeout=9999)
+
+    for line in syms.split("\n"):
+        line = line.strip()
+        addr = int(line.split(" ")[0], 16)
+        name = line.split(" ")[-1]
+        kallsyms[name] = addr
+    panda.end_analysis()
+
+panda.queue_async(extract_kallsyms)
+print("\nStarting guest to extract kernel symbols. This will take a moment...")
+panda.run()
+assert(len(kallsyms) > 100), f"Error - Only identified {len(kallsyms)} symbols"
+
+sys_access = kallsyms["sys_access"]
+print(f"\tsys_access at 0x{sys_access:x}")
+
+MID_HOOK_RUNS = 3
+
+block_start = None
+mid_pc = None       # second instruction of the block at sys_access
+mid_added = False
+mid_removed = False
+entry_ctr = 0       # sys_access calls seen by the entry hook
+mid_ctr = 0
+pending_mid = 0     # entries whose mid-block instruction hasn't run yet
+
+@panda.cb_before_block_translate
+def before_translate(env, pc):
+    global block_start
+    block_start = pc
+
+@panda.cb_insn_translate
+def insn_translate(env, pc):
+    global mid_pc
+    if mid_pc is None and block_start == sys_access and pc != sys_access:
+        mid_pc = pc
+        panda.disable_callback("before_translate")
+        panda.disable_callback("insn_translate")
+    return False
+
+def mid_hook(env, tb):
+    global mid_ctr, pending_mid, mid_removed
+    assert(mid_added and not mid_removed), "Mid-block hook ran when it shouldn't have"
+    assert(pending_mid == 1), f"Mid-block hook ran {1 - pending_mid} times too many"
+    pending_mid = 0
+    mid_ctr += 1
+    if mid_ctr == MID_HOOK_RUNS:
+        # Remove the hook from inside itself
+        panda.disable_hook("mid_hook")
+        mid_removed = True
+
+@panda.hook(sys_access, kernel=True, name="entry_hook")
+def entry_hook(env, tb):
+    global entry_ctr, pending_mid, mid_added
+    entry_ctr += 1
+    if mid_added and not mid_removed:
+        assert(pending_mid == 0), "Mid-block hook didn't run after the last sys_access"
+        pending_mid = 1
+    if mid_pc is not None and not mid_added:
+        # Add a hook from inside a hook. It applies from the next call on.
+        print(f"Adding mid-block hook at 0x{mid_pc:x}")
+        panda.hook(mid_pc, kernel=True, name="mid_hook")(mid_hook)
+        mid_added = True
+
+@blocking
+def my_runcmd():
+    panda.revert_sync('root')
+    panda.run_serial_cmd("for i in 1 2 3 4 5 6 7 8 9 10; do /bin/true; done")
+    panda.run_serial_cmd("cat /proc/self/environ")
+    panda.stop_run()
+panda.queue_async(my_runcmd)
+
+print("Running guest with a hook added mid-block from a hook")
+panda.run()
+
+assert(mid_pc is not None), "Never translated the block at sys_access"
+assert(mid_added), "Mid-block hook was never added"
+assert(mid_ctr == MID_HOOK_RUNS), f"Mid-block hook ran {mid_ctr} times, expected {MID_HOOK_RUNS}"
+assert(entry_ctr > MID_HOOK_RUNS + 1), f"sys_access only ran {entry_ctr} times"
+
+print(f"Test finished successfully. sys_access hook ran {entry_ctr} times")
+print(f"\tand the mid-block hook ran {mid_ctr} times before removing itself.")
@@ -0,0 +1,241 @@
+#!/usr/bin/env python3
+
+"""
+Run a PANDA analysis over a recording in parallel.
+
+The recording is split into instruction-count slices at saved checkpoints
+(see the checkpoint plugin's save option). If none have been saved yet, one
+cheap replay without analysis plugins saves them first. Each slice is then
+replayed by its own PANDA process, starting from its checkpoint
+(-replay-checkpoint) and stopping at the next one (-replay-end-at), with the
+analysis arguments given after "--". Finally the per-slice pandalogs, and any
+plugin output files named with --concat, are merged in instruction order.
+
+Each slice runs in its own directory under --out, so plugins that write
+files to the current directory don't clobber each other. Plugins that carry
+state across the whole replay (taint, callstacks) will only see what happens
+within their slice.
+
+usage: parallel_replay.py [options] <panda-system-binary> <rr_basename> -- <analysis args>
+
+e.g.
+  parallel_replay.py -j 16 --qemu-args "-m 2G" --pandalog strings.plog \\
+      --concat foo_string_matches.txt \\
+      build/x86_64-softmmu/panda-system-x86_64 foo -- -panda stringsearch:name=foo
+"""
+
+import argparse
+import bisect
+import os
+import shlex
+import shutil
+import struct
+import subprocess
+import sys
+from concurrent.futures import ThreadPoolExecutor
+
+# Pandalog layout (see panda/src/plog.c): a 128-byte region holding the
+# PlHeader, the compressed chunks, then the directory at dir_pos.
+PL_HEADER = struct.Struct('<IIQII')   # version, pad, dir_pos, chunk_size, codec
+PL_HEADER_SIZE = 128
+PL_DIR_ENTRY = struct.Struct('<QQQ')  # first instr, file pos, num entries
+
+def read_checkpoint_index(base):
+    """Instruction counts of the checkpoints saved for this recording."""
+    index = base + '-rr-ckpt.idx'
+    instrs = set()
+    if os.path.exists(index):
+        with open(index) as f:
+            for line in f:
+                fields = line.split()
+                if len(fields) == 3 and \
+                        os.path.exists(os.path.join(os.path.dirname(base), fields[2])):
+                    instrs.add(int(fields[0]))
+    return sorted(instrs)
+
+def save_checkpoints(args, base):
+    cmd = [args.panda] + shlex.split(args.qemu_args) + \
+          ['-replay', base, '-panda', 'checkpoint:count=%d,save=true' % args.slices]
+    print("Saving checkpoints:", ' '.join(shlex.quote(c) for c in cmd))
+    with open(os.path.join(args.out, 'checkpoints.log'), 'w') as log:
+        subprocess.check_call(cmd, stdout=log, stderr=subprocess.STDOUT)
+
+def run_slice(args, base, i, start, end):
+    slice_dir = os.path.join(args.out, 'slice-%03d' % i)
+    os.makedirs(slice_dir, exist_ok=True)
+    cmd = [args.panda] + shlex.split(args.qemu_args) + ['-replay', base]
+    if start:
+        cmd += ['-replay-checkpoint', str(start)]
+    if end is not None:
+        cmd += ['-replay-end-at', str(end)]
+    if args.pandalog:
+        cmd += ['-pandalog', 'slice.plog']
+    cmd += args.analysis
+    with open(os.path.join(slice_dir, 'panda.log'), 'w') as log:
+        ret = subprocess.call(cmd, cwd=slice_dir, stdout=log,
+                              stderr=subprocess.STDOUT)
+    print("slice %d [%d, %s): exit %d" %
+          (i, start, end if end is not None else 'end', ret))
+    return ret
+
+def read_pandalog_dir(fn):
+    """Header fields and directory entries of a pandalog."""
+    with open(fn, 'rb') as f:
+        header = PL_HEADER.unpack(f.read(PL_HEADER.size))
+        f.seek(header[2])
+        n, = struct.unpack('<I', f.read(4))
+        entries = [PL_DIR_ENTRY.unpack(f.read(PL_DIR_ENTRY.size))
+                   for _ in range(n)]
+    return header, entries
+
+def merge_pandalogs(inputs, output, starts):
+    """Concatenate pandalogs whose instructions don't overlap, in order.
+
+    Compressed chunks are copied as they are; only the directory is rebuilt.
+    starts[i] is the first instruction of inputs[i]. Returns the range of
+    merged chunks each input contributed, as (first, end) indices.
+
+    PandaLog::seek binary searches the directory by instr, so it must stay
+    sorted. Logs written before chunks took the instr of their first entry
+    start at instr 0, and a chunk holding only entries written outside the
+    main loop has none of its own, so instrs are raised to at least the
+    start of their slice and the chunk before them.
+    """
+    directory = []
+    ranges = []
+    version = None
+    codec = None
+    chunk_size = 0
+    with open(output, 'wb') as out:
+        out.write(b'\0' * PL_HEADER_SIZE)
+        for fn, start in zip(inputs, starts):
+            (v, _, dir_pos, csize, c), entries = read_pandalog_dir(fn)
+            with open(fn, 'rb') as f:
+                if version is None:
+                    version = v
+                elif v != version:
+                    raise ValueError("%s is pandalog version %d, not %d" % (fn, v, version))
+                # chunks are copied as they are, so they must share a codec
+                if codec is None:
+                    codec = c
+                elif c != codec:
+                    raise ValueError("%s uses pandalog codec %d, not %d" % (fn, c, codec))
+                chunk_size = max(chunk_size, csize)
+
+                ranges.append((len(directory), len(directory) + len(entries)))
+                if not entries:
+                    continue
+
+                first = entries[0][1]
+                shift = out.tell() - first
+                f.seek(first)
+                remaining = dir_pos - first
+                while remaining:
+                    buf = f.read(min(remaining, 1 << 24))
+                    if not buf:
+                        raise ValueError("%s is truncated" % fn)
+                    out.write(buf)
+                    remaining -= len(buf)
+                floor = max(start, directory[-1][0] if directory else 0)
+                for instr, pos, num in entries:
+                    floor = max(floor, instr)
+                    directory.append((floor, pos + shift, num))
+
+        dir_pos = out.tell()
+        out.write(struct.pack('<I', len(directory)))
+        for entry in directory:
+            out.write(PL_DIR_ENTRY.pack(*entry))
+        out.seek(0)
+        out.write(PL_HEADER.pack(version or 0, 0, dir_pos, chunk_size, codec or 0))
+    return ranges
+
+def check_merged_pandalog(output, ranges):
+    """Seek the merged log to each slice as PandaLog::seek would.
+
+    Its directory must be sorted by instr, and the chunk found for the
+    first instr of a slice must be one of that slice's.
+    """
+    _, directory = read_pandalog_dir(output)
+    instrs = [instr for instr, _, _ in directory]
+    if instrs != sorted(instrs):
+        raise ValueError("%s: directory is not sorted by instr" % output)
+    for i, (first, end) in enumerate(ranges):
+        if first == end:
+            continue
+        chunk = bisect.bisect_right(instrs, instrs[first]) - 1
+        if not first <= chunk < end:
+            raise ValueError("%s: seeking to instr %d of slice %d finds chunk %d, "
+                             "not one of %d-%d" %
+                             (output, instrs[first], i, chunk, first, end - 1))
+
+def concat_files(inputs, output):
+    with open(output, 'wb') as out:
+        for fn in inputs:
+            with open(fn, 'rb') as f:
+                shutil.copyfileobj(f, out)
+
+def main():
+    argv = sys.argv[1:]
+    analysis = []
+    if '--' in argv:
+        analysis = argv[argv.index('--') + 1:]
+        argv = argv[:argv.index('--')]
+
+    parser = argparse.ArgumentParser(
+        description="Replay a recording in parallel slices split at checkpoints.")
+    parser.add_argument('panda', help="panda-system-<arch> binary")
+    parser.add_argument('recording', help="recording basename")
+    parser.add_argument('-j', '--jobs', type=int, default=os.cpu_count(),
+                        help="number of PANDA processes to run at once")
+    parser.add_argument('-n', '--slices', type=int,
+                        help="number of checkpoints to save if there are none (default: jobs)")
+    parser.add_argument('-o', '--out', default='parallel_replay',
+                        help="directory for per-slice and merged output")
+    parser.add_argument('--qemu-args', default='',
+                        help="machine arguments the recording needs, e.g. \"-m 2G\"")
+    parser.add_argument('--fresh', action='store_true',
+                        help="save new checkpoints even if some exist")
+    parser.add_argument('--pandalog', metavar='FILE',
+                        help="give each slice a pandalog and merge them into FILE")
+    parser.add_argument('--concat', metavar='FILE', action='append', default=[],
+                        help="plugin output file to concatenate across slices")
+    args = parser.parse_args(argv)
+    args.analysis = analysis
+    args.slices = args.slices or args.jobs
+
+    base = os.path.abspath(args.recording)
+    os.makedirs(args.out, exist_ok=True)
+
+    if args.fresh and os.path.exists(base + '-rr-ckpt.idx'):
+        os.remove(base + '-rr-ckpt.idx')
+    starts = read_checkpoint_index(base)
+    if not starts:
+        save_checkpoints(args, base)
+        starts = read_checkpoint_index(base)
+    starts = sorted(set([0] + starts))
+    ends = starts[1:] + [None]
+    print("Replaying %d slices, %d at a time" % (len(starts), args.jobs))
+
+    with ThreadPoolExecutor(max_workers=args.jobs) as pool:
+        rets = list(pool.map(lambda s: run_slice(args, base, *s),
+                             [(i, start, end) for i, (start, end)
+                              in enumerate(zip(starts, ends))]))
+    if any(rets):
+        print("Some slices failed; see panda.log in their directories",
+              file=sys.stderr)
+        sys.exit(1)
+
+    slice_dirs = [os.path.join(args.out, 'slice-%03d' % i) for i in range(len(starts))]
+    if args.pandalog:
+        merged = os.path.join(args.out, args.pandalog)
+        ranges = merge_pandalogs([os.path.join(d, 'slice.plog') for d in slice_dirs],
+                                 merged, starts)
+        check_merged_pandalog(merged, ranges)
+    for name in args.concat:
+        concat_files([os.path.join(d, name) for d in slice_dirs
+                      if os.path.exists(os.path.join(d, name))],
+                     os.path.join(args.out, name))
+    print("Merged output is in", args.out)
+
+if __name__ == '__main__':
+    main()
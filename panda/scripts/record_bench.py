@@ -0,0 +1,84 @@
+#!/usr/bin/env python3
+
+USAGE = """record_bench.py [--arch ARCH] [--runs N] [--compress LEVEL] [--cmd CMD]
+
+Measures how much slower a guest runs while PANDA records it. A command is
+run from the root snapshot of a generic image, alternately as is and while
+recording, and the wall-clock time from pressing enter to getting the prompt
+back is compared. The default command reads files off the disk and
+/dev/urandom, so it is heavy in interrupts, port I/O and DMA, which is what
+the nondet log records.
+
+    --arch      generic image to use (default: i386)
+    --runs      times to run the command each way (default: 3)
+    --compress  zlib level for the nondet log, 0 (none) to 9 (default: 1)
+    --cmd       guest command to time instead of the default
+
+The generic image is downloaded to ~/.panda on first use.
+"""
+
+import argparse
+import os
+import statistics
+import time
+
+from pandare import Panda, blocking
+
+DEFAULT_CMD = ("find /usr -xdev -type f 2>/dev/null | head -n 4000 | "
+               "xargs cat 2>/dev/null | md5sum; "
+               "dd if=/dev/urandom bs=4k count=2048 2>/dev/null | md5sum")
+RECORDING = "record_bench"
+
+parser = argparse.ArgumentParser(usage=USAGE)
+parser.add_argument("--arch", default="i386")
+parser.add_argument("--runs", type=int, default=3)
+parser.add_argument("--compress", type=int, default=1)
+parser.add_argument("--cmd", default=DEFAULT_CMD)
+args = parser.parse_args()
+
+panda = Panda(generic=args.arch,
+              extra_args=["-record-compress", str(args.compress)])
+plain_times = []
+record_times = []
+log_sizes = []
+
+def remove_recording():
+    for suffix in ["-rr-nondet.log", "-rr-snp"]:
+        if os.path.isfile(RECORDING + suffix):
+            os.remove(RECORDING + suffix)
+
+# Typed before the clock starts, like record_cmd does, so the recording
+# doesn't include the typing either
+def time_cmd(record):
+    panda.revert_sync("root")
+    panda.type_serial_cmd(args.cmd)
+    if record:
+        panda.run_monitor_cmd("begin_record {}".format(RECORDING))
+    start = time.monotonic()
+    panda.finish_serial_cmd()
+    elapsed = time.monotonic() - start
+    if record:
+        panda.run_monitor_cmd("end_record")
+    return elapsed
+
+@blocking
+def bench():
+    for i in range(args.runs):
+        plain_times.append(time_cmd(False))
+        record_times.append(time_cmd(True))
+        log_sizes.append(os.path.getsize(RECORDING + "-rr-nondet.log"))
+        remove_recording()
+        print("run {}: {:.2f}s plain, {:.2f}s recording".format(
+            i, plain_times[-1], record_times[-1]))
+    panda.end_analysis()
+
+remove_recording()
+panda.queue_async(bench)
+panda.run()
+
+plain = statistics.median(plain_times)
+record = statistics.median(record_times)
+print("median over {} runs: {:.2f}s plain, {:.2f}s recording, "
+      "{:.2f}x slowdown".format(args.runs, plain, record, record / plain))
+print("nondet log: {:.1f} MiB at compression level {}".format(
+    statistics.median(log_sizes) / (1 << 20), args.compress))
@@ -24,17 +24,40 @@ if os.path.exists(outfname):
     print("%s already exists; will not overwrite. Aborting." % outfname, file=sys.stderr)
     sys.exit(1)
 
+# Nondet log v2 (see panda/include/panda/rr/rr_log_stream.h):
+# 0x00: uint64_t num_instructions (same as v1)
+# 0x08: magic "PANDARR2", uint32_t version, uint32_t chunk_size,
+#       uint64_t index_offset, uint64_t num_chunks, uint64_t raw_size
+# 0x30: zlib-compressed chunks, then the chunk index at index_offset
+NONDET_V2_MAGIC = b"PANDARR2"
+NONDET_V2_HEADER = struct.Struct("<8sIIQQQ")
+
+def nondet_log_info(fname):
+    with open(fname, 'rb') as f:
+        num_guest_insns = struct.unpack("<Q", f.read(8))[0]
+        hdr = f.read(NONDET_V2_HEADER.size)
+    if len(hdr) == NONDET_V2_HEADER.size and hdr[:8] == NONDET_V2_MAGIC:
+        magic, version, chunk_size, index_offset, num_chunks, raw_size = \
+            NONDET_V2_HEADER.unpack(hdr)
+        if index_offset == 0:
+            print("Warning: %s has no chunk index (recording not closed cleanly?)" % fname,
+                  file=sys.stderr)
+        return num_guest_insns, version, num_chunks, raw_size
+    return num_guest_insns, 1, 0, os.path.getsize(fname)
+
 # Get number of instructions
 try:
-    with open(base + '-rr-nondet.log', 'rb') as f:
-        # num_guest_insns is 64-bit int at offset 16
-        f.seek(16)
-        num_guest_insns = struct.unpack("<Q", f.read(8))[0]
+    num_guest_insns, version, num_chunks, raw_size = \
+        nondet_log_info(base + '-rr-nondet.log')
 except EnvironmentError:
     print("Failed to open", base + '-rr-nondet.log. Aborting.', file=sys.stderr)
     sys.exit(1)
 
 print("Packing RR log %s with %d instructions..." % (base, num_guest_insns))
+if version >= 2:
+    comp_size = os.path.getsize(base + '-rr-nondet.log')
+    print("Nondet log is v%d: %d chunks, %d bytes compressed to %d" %
+          (version, num_chunks, raw_size, comp_size))
 outf = open(outfname, 'wb')
 outf.write(RRPACK_MAGIC)
 outf.write(struct.pack("<Q", num_guest_insns))
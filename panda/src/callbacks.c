@@ -23,6 +23,7 @@ PANDAENDCOMMENT */
 #include "hmp.h"
 #include "qapi/error.h"
 #include "monitor/monitor.h"
+#include "qemu/rcu.h"
 
 #ifdef CONFIG_LLVM
 #include "tcg.h"
@@ -31,6 +32,7 @@ PANDAENDCOMMENT */
 #endif
 
 #include "panda/common.h"
+#include "panda/callbacks/cb-support.h"
 #include "panda/rr/rr_api.h"
 
 #define LIBRARY_DIR "/" TARGET_NAME "-softmmu/libpanda-" TARGET_NAME ".so"
@@ -48,6 +50,14 @@ WARNING: This is all gloriously thread-unsafe!!!
 // Array of pointers to PANDA callback lists, one per callback type
 panda_cb_list *panda_cbs[PANDA_CB_LAST];
 
+// The enabled callbacks of each type as flat arrays, NULL if there are none.
+// Dispatch reads these under RCU, see panda_cbs_rebuild().
+panda_cb_array *panda_cbs_enabled[PANDA_CB_LAST];
+
+// Bumped whenever a callback that blocks may call directly goes away, see
+// panda_cb_direct().
+uint32_t panda_cb_direct_gen;
+
 // Storage for command line options
 const gchar *panda_argv[MAX_PANDA_PLUGIN_ARGS];
 int panda_argc;
@@ -66,6 +76,7 @@ bool panda_please_flush_tb = false;
 bool panda_update_pc = false;
 bool panda_use_memcb = false;
 bool panda_tb_chaining = true;
+bool panda_replay_tb_chaining = false;
 
 bool panda_help_wanted = false;
 bool panda_plugin_load_failed = false;
@@ -404,6 +415,151 @@ void *panda_get_plugin_by_name(const char *plugin_name)
     return NULL;
 }
 
+typedef struct panda_cb_array_retired {
+    struct rcu_head rcu;
+    panda_cb_array *cbs;
+} panda_cb_array_retired;
+
+static void panda_cb_array_free(panda_cb_array_retired *retired)
+{
+    g_free(retired->cbs);
+    g_free(retired);
+}
+
+// Blocks may call a lone insn_exec/after_insn_exec callback straight from
+// generated code, see panda_cb_direct().
+static bool panda_cb_type_direct(panda_cb_type type)
+{
+    return type == PANDA_CB_INSN_EXEC || type == PANDA_CB_AFTER_INSN_EXEC;
+}
+
+// Callbacks called from each block's code, see panda_gen_block_exec_cbs()
+// in translate-all.c.
+static bool panda_cb_type_inline(panda_cb_type type)
+{
+    return type == PANDA_CB_START_BLOCK_EXEC || type == PANDA_CB_END_BLOCK_EXEC;
+}
+
+// Makes the CPU leave the code it may be chained in and translate it anew.
+static void panda_cbs_retranslate(void)
+{
+    panda_do_flush_tb();
+    if (first_cpu) {
+        cpu_exit(first_cpu);
+    }
+}
+
+/**
+ * @brief Rebuilds the flat array of enabled callbacks of this type from its
+ * callback list.
+ *
+ * Called whenever callbacks are registered, unregistered, enabled or
+ * disabled. A callback may do this while it is being dispatched, so the
+ * array is replaced rather than updated and the old one is freed after an
+ * RCU grace period.
+ */
+static void panda_cbs_rebuild(panda_cb_type type)
+{
+    panda_cb_array *old = panda_cbs_enabled[type];
+    panda_cb_array *cbs = NULL;
+    int n = 0;
+
+    for (panda_cb_list *plist = panda_cbs[type]; plist != NULL;
+         plist = plist->next) {
+        n += plist->enabled;
+    }
+    if (n) {
+        cbs = g_malloc(sizeof(*cbs) + n * sizeof(panda_cb));
+        cbs->fns = (panda_cb *)(cbs + 1);
+        cbs->n = 0;
+        for (panda_cb_list *plist = panda_cbs[type]; plist != NULL;
+             plist = plist->next) {
+            if (plist->enabled) {
+                cbs->fns[cbs->n++] = plist->entry;
+            }
+        }
+    }
+    atomic_rcu_set(&panda_cbs_enabled[type], cbs);
+
+    if (panda_cb_type_inline(type) && !old != !cbs) {
+        // Blocks only have calls to these while some are enabled
+        panda_cbs_retranslate();
+    }
+    if (panda_cb_type_direct(type) && !old != !cbs) {
+        // Blocks count instructions precisely while there are some, see
+        // panda_precise_pc_needed()
+        panda_do_flush_tb();
+    }
+    if (old == NULL) {
+        return;
+    }
+    if (panda_cb_type_direct(type) && old->n == 1 &&
+        !(cbs && cbs->n == 1 && cbs->fns[0].cbaddr == old->fns[0].cbaddr)) {
+        // Code calling the old callback directly must not run again. The
+        // rest of the current block still may, so its calls check the
+        // generation first.
+        atomic_inc(&panda_cb_direct_gen);
+        panda_cbs_retranslate();
+    }
+    panda_cb_array_retired *retired = g_new(panda_cb_array_retired, 1);
+    retired->cbs = old;
+    call_rcu(retired, panda_cb_array_free, rcu);
+}
+
+/**
+ * @brief Returns the callback that generated code may call directly instead
+ * of going through the dispatch helper, or NULL.
+ *
+ * This is the case when exactly one callback of the type is enabled and
+ * blocks are not translated to LLVM, which only knows about real helpers.
+ * When that callback changes, panda_cb_direct_gen is bumped and blocks are
+ * flushed; generated code only makes the call while the generation is the
+ * one it was translated under, so an unregistered or disabled callback
+ * doesn't run again even in the block that is executing.
+ */
+void *panda_cb_direct(panda_cb_type type)
+{
+    panda_cb_array *cbs = panda_cbs_enabled[type];
+
+    assert(panda_cb_type_direct(type));
+    if (generate_llvm || cbs == NULL || cbs->n != 1) {
+        return NULL;
+    }
+    return (void *)cbs->fns[0].cbaddr;
+}
+
+// Callbacks set aside while fast-forwarding, see panda_fast_forward_begin()
+static panda_cb_list *panda_cbs_paused[PANDA_CB_LAST];
+
+// Callbacks that are not set aside while fast-forwarding
+static bool panda_cb_type_pausable(panda_cb_type type)
+{
+    switch (type) {
+    case PANDA_CB_MONITOR:
+    case PANDA_CB_AFTER_MACHINE_INIT:
+    case PANDA_CB_DURING_MACHINE_INIT:
+    case PANDA_CB_PRE_SHUTDOWN:
+        return false;
+    default:
+        return true;
+    }
+}
+
+/**
+ * @brief Returns the head of the list the callbacks of this type are kept in.
+ *
+ * While fast-forwarding, pausable callbacks are kept in panda_cbs_paused, so
+ * that registering, unregistering, enabling or disabling them meanwhile
+ * changes what is put back when it ends, and nothing starts running early.
+ */
+static panda_cb_list **panda_cbs_head(panda_cb_type type)
+{
+    if (panda_fast_forward_instr && panda_cb_type_pausable(type)) {
+        return &panda_cbs_paused[type];
+    }
+    return &panda_cbs[type];
+}
+
 /**
  * @brief Adds callback to the tail of the callback list and enables it.
  *
@@ -423,8 +579,9 @@ void panda_register_callback(void *plugin, panda_cb_type type, panda_cb cb)
     new_list->enabled = true;
     assert(type < PANDA_CB_LAST);
 
-    if (panda_cbs[type] != NULL) {
-        for (panda_cb_list *plist = panda_cbs[type]; plist != NULL;
+    panda_cb_list **head = panda_cbs_head(type);
+    if (*head != NULL) {
+        for (panda_cb_list *plist = *head; plist != NULL;
              plist = plist->next) {
             // the same plugin can register the same callback function only once
             assert(!(plist->owner == plugin &&
@@ -434,8 +591,9 @@ void panda_register_callback(void *plugin, panda_cb_type type, panda_cb cb)
         plist_last->next = new_list;
         new_list->prev = plist_last;
     } else {
-        panda_cbs[type] = new_list;
+        *head = new_list;
     }
+    panda_cbs_rebuild(type);
 }
 
 /**
@@ -445,8 +603,9 @@ void panda_register_callback(void *plugin, panda_cb_type type, panda_cb cb)
  */
 bool panda_is_callback_enabled(void *plugin, panda_cb_type type, panda_cb cb) {
     assert(type < PANDA_CB_LAST);
-    if (panda_cbs[type] != NULL) {
-        for (panda_cb_list *plist = panda_cbs[type]; plist != NULL; plist = plist->next) {
+    panda_cb_list *head = *panda_cbs_head(type);
+    if (head != NULL) {
+        for (panda_cb_list *plist = head; plist != NULL; plist = plist->next) {
             if (plist->owner == plugin && (plist->entry.cbaddr) == cb.cbaddr) {
                 return plist->enabled;
             }
@@ -468,8 +627,9 @@ void panda_disable_callback(void *plugin, panda_cb_type type, panda_cb cb)
 {
     bool found = false;
     assert(type < PANDA_CB_LAST);
-    if (panda_cbs[type] != NULL) {
-        for (panda_cb_list *plist = panda_cbs[type]; plist != NULL;
+    panda_cb_list *head = *panda_cbs_head(type);
+    if (head != NULL) {
+        for (panda_cb_list *plist = head; plist != NULL;
              plist = plist->next) {
             if (plist->owner == plugin && (plist->entry.cbaddr) == cb.cbaddr) {
                 found = true;
@@ -483,6 +643,7 @@ void panda_disable_callback(void *plugin, panda_cb_type type, panda_cb cb)
     }
     // no callback found to disable
     assert(found);
+    panda_cbs_rebuild(type);
 }
 
 /**
@@ -498,8 +659,9 @@ void panda_enable_callback(void *plugin, panda_cb_type type, panda_cb cb)
 {
     bool found = false;
     assert(type < PANDA_CB_LAST);
-    if (panda_cbs[type] != NULL) {
-        for (panda_cb_list *plist = panda_cbs[type]; plist != NULL;
+    panda_cb_list *head = *panda_cbs_head(type);
+    if (head != NULL) {
+        for (panda_cb_list *plist = head; plist != NULL;
              plist = plist->next) {
             if (plist->owner == plugin && (plist->entry.cbaddr) == cb.cbaddr) {
                 found = true;
@@ -513,6 +675,7 @@ void panda_enable_callback(void *plugin, panda_cb_type type, panda_cb cb)
     }
     // no callback found to enable
     assert(found);
+    panda_cbs_rebuild(type);
 }
 
 /**
@@ -526,7 +689,7 @@ void panda_unregister_callbacks(void *plugin)
 {
     for (int i = 0; i < PANDA_CB_LAST; i++) {
         panda_cb_list *plist;
-        plist = panda_cbs[i];
+        plist = *panda_cbs_head(i);
         bool done = false;
         panda_cb_list *plist_head = plist;
         while (!done && plist != NULL) {
@@ -556,7 +719,8 @@ void panda_unregister_callbacks(void *plugin)
             plist = plist_next;
         }
         // update head
-        panda_cbs[i] = plist_head;
+        *panda_cbs_head(i) = plist_head;
+        panda_cbs_rebuild(i);
     }
 }
 
@@ -571,13 +735,14 @@ void panda_enable_plugin(void *plugin)
 {
     for (int i = 0; i < PANDA_CB_LAST; i++) {
         panda_cb_list *plist;
-        plist = panda_cbs[i];
+        plist = *panda_cbs_head(i);
         while (plist != NULL) {
             if (plist->owner == plugin) {
                 plist->enabled = true;
             }
             plist = plist->next;
         }
+        panda_cbs_rebuild(i);
     }
 }
 
@@ -592,13 +757,14 @@ void panda_disable_plugin(void *plugin)
 {
     for (int i = 0; i < PANDA_CB_LAST; i++) {
         panda_cb_list *plist;
-        plist = panda_cbs[i];
+        plist = *panda_cbs_head(i);
         while (plist != NULL) {
             if (plist->owner == plugin) {
                 plist->enabled = false;
             }
             plist = plist->next;
         }
+        panda_cbs_rebuild(i);
     }
 }
 
@@ -632,46 +798,514 @@ void panda_do_flush_tb(void)
 
 void panda_enable_precise_pc(void)
 {
+    // Blocks are translated with or without per-instruction PC updates
+    // (CF_PRECISE_PC), so retranslate them when that changes.
+    if (!panda_update_pc) {
+        panda_do_flush_tb();
+    }
     panda_update_pc = true;
 }
 
 void panda_disable_precise_pc(void)
 {
+    if (panda_update_pc) {
+        panda_do_flush_tb();
+    }
     panda_update_pc = false;
 }
 
+/*
+ * Fast-forwarding (-replay-start-at): until the replay reaches the target
+ * instruction count, plugin callbacks are set aside and whatever plugins did
+ * to slow down execution (LLVM, memory callbacks, no chaining) is undone.
+ * Everything is put back in one go at a block boundary, and code is
+ * retranslated with the plugins' instrumentation. While fast-forwarding,
+ * the setters below change the saved settings that are put back, so that
+ * what plugins ask for meanwhile (e.g. in after_machine_init) sticks, and
+ * callbacks registered, unregistered, enabled or disabled meanwhile go to the
+ * set-aside list (see panda_cbs_head()).
+ */
+uint64_t panda_fast_forward_instr = 0;
+static struct {
+    bool tb_chaining;
+    bool replay_tb_chaining;
+    bool use_memcb;
+    int generate_llvm;
+    int execute_llvm;
+} panda_fast_forward_saved;
+
 void panda_enable_memcb(void)
 {
+    if (panda_fast_forward_instr) {
+        panda_fast_forward_saved.use_memcb = true;
+        return;
+    }
+    // see panda_precise_pc_needed()
+    if (!panda_use_memcb) {
+        panda_do_flush_tb();
+    }
     panda_use_memcb = true;
 }
 
 void panda_disable_memcb(void)
 {
+    if (panda_fast_forward_instr) {
+        panda_fast_forward_saved.use_memcb = false;
+        return;
+    }
+    if (panda_use_memcb) {
+        panda_do_flush_tb();
+    }
     panda_use_memcb = false;
 }
 
+/*
+ * Ranges watched with panda_watch_range(). The TLB sends accesses to pages
+ * holding one through the panda-watch region in exec.c, the way it does for
+ * watchpoints, and that region runs the memory callbacks for the accesses
+ * that touch a range.
+ */
+typedef struct panda_watch {
+    int id;
+    int flags;
+    uint64_t start;
+    uint64_t last;  // inclusive, so a range can end at the top of memory
+} panda_watch;
+
+static GArray *panda_watches;
+static int panda_watch_next_id = 1;
+
+// Pages of a virtual range are dropped from the TLB one by one, up to this
+// many. Physical ranges can be mapped anywhere, so they flush the whole TLB.
+#define PANDA_WATCH_MAX_FLUSH_PAGES 64
+
+static void panda_watch_flush(const panda_watch *w)
+{
+    uint64_t first = w->start & TARGET_PAGE_MASK;
+    uint64_t npages = ((w->last & TARGET_PAGE_MASK) - first) / TARGET_PAGE_SIZE + 1;
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        if ((w->flags & PANDA_WATCH_PHYS) ||
+            npages > PANDA_WATCH_MAX_FLUSH_PAGES) {
+            tlb_flush(cpu);
+            continue;
+        }
+        for (uint64_t i = 0; i < npages; i++) {
+            tlb_flush_page(cpu, first + i * TARGET_PAGE_SIZE);
+        }
+    }
+}
+
+int panda_watch_range(uint64_t start, uint64_t len, int flags)
+{
+    panda_watch w = {
+        .id = panda_watch_next_id++,
+        .flags = flags,
+        .start = start,
+        .last = start + len - 1,
+    };
+
+    assert(len && w.last >= start);
+    assert(flags & (PANDA_WATCH_READ | PANDA_WATCH_WRITE));
+    if (!panda_watches) {
+        panda_watches = g_array_new(false, false, sizeof(panda_watch));
+    }
+    bool precise = panda_precise_pc_needed();
+    g_array_append_val(panda_watches, w);
+    if (!precise) {
+        panda_do_flush_tb();
+    }
+    panda_watch_flush(&w);
+    return w.id;
+}
+
+/**
+ * @brief Stops watching a range added by panda_watch_range().
+ *
+ * @note Unwatching an unknown id will trigger an assertion error.
+ */
+void panda_unwatch_range(int id)
+{
+    for (guint i = 0; panda_watches && i < panda_watches->len; i++) {
+        panda_watch w = g_array_index(panda_watches, panda_watch, i);
+        if (w.id == id) {
+            g_array_remove_index_fast(panda_watches, i);
+            if (!panda_precise_pc_needed()) {
+                panda_do_flush_tb();
+            }
+            panda_watch_flush(&w);
+            return;
+        }
+    }
+    assert(false);
+}
+
+/**
+ * @brief Whether blocks are to be translated with PC and instruction count
+ * updates at every instruction (CF_PRECISE_PC).
+ *
+ * Besides plugins that asked for it, this is the case while memory or
+ * instruction callbacks are on, or ranges are watched: they run in the middle
+ * of blocks, where the PC and the count of blocks that count on entry are not
+ * exact. Hooks make the count
+ * exact themselves, see helper_panda_hooks().
+ */
+bool panda_precise_pc_needed(void)
+{
+    return panda_update_pc || panda_use_memcb ||
+        panda_cbs_enabled[PANDA_CB_INSN_EXEC] ||
+        panda_cbs_enabled[PANDA_CB_AFTER_INSN_EXEC] ||
+        (panda_watches && panda_watches->len);
+}
+
+static bool panda_watch_overlaps(const panda_watch *w, target_ptr_t vaddr,
+                                 hwaddr paddr, uint64_t size)
+{
+    uint64_t addr = (w->flags & PANDA_WATCH_PHYS) ? paddr : vaddr;
+    return w->start <= addr + size - 1 && addr <= w->last;
+}
+
+// Whether the TLB entry for this page has to take the slow path
+bool panda_watch_page(target_ptr_t vaddr, hwaddr paddr, int prot)
+{
+    for (guint i = 0; panda_watches && i < panda_watches->len; i++) {
+        panda_watch *w = &g_array_index(panda_watches, panda_watch, i);
+        // Reads aren't trapped for a write watch on a read-only page
+        if (((w->flags & PANDA_WATCH_READ) || (prot & PAGE_WRITE)) &&
+            panda_watch_overlaps(w, vaddr, paddr, TARGET_PAGE_SIZE)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether an access that took the slow path touches a watched range
+bool panda_watch_hit(target_ptr_t vaddr, hwaddr paddr, size_t size,
+                     bool is_write)
+{
+    int access = is_write ? PANDA_WATCH_WRITE : PANDA_WATCH_READ;
+
+    // With memory callbacks on, every access gets them already
+    if (panda_use_memcb) {
+        return false;
+    }
+    for (guint i = 0; panda_watches && i < panda_watches->len; i++) {
+        panda_watch *w = &g_array_index(panda_watches, panda_watch, i);
+        if ((w->flags & access) &&
+            panda_watch_overlaps(w, vaddr, paddr, size)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Hooks added with panda_hook_add(), by guest pc. Blocks are translated with
+ * a call to panda_run_hooks() before each hooked instruction, see
+ * panda_gen_plugin_calls() in translate-all.c.
+ */
+typedef struct panda_hook {
+    int id;
+    panda_hook_func_t fn;   // NULL once removed, until it is swept
+    void *opaque;
+} panda_hook;
+
+typedef struct panda_hook_site {
+    uint64_t pc;
+    GArray *hooks;  // of panda_hook, in the order they were added
+} panda_hook_site;
+
+static GHashTable *panda_hook_sites;    // pc -> panda_hook_site
+static GHashTable *panda_hook_ids;      // id -> panda_hook_site
+static int panda_hook_next_id = 1;
+// Hooks may remove hooks, so while they run removed ones are only marked
+static int panda_hooks_running;
+static bool panda_hooks_removed;
+// Pcs that gained their first hook or lost their last one. Their blocks are
+// invalidated together by panda_hooks_invalidate(), so adding many hooks
+// costs one pass over the TBs rather than one per hook.
+static GArray *panda_hooks_stale;   // of uint64_t
+
+static void panda_hook_site_free(gpointer data)
+{
+    panda_hook_site *site = data;
+    g_array_free(site->hooks, true);
+    g_free(site);
+}
+
+static void panda_hooks_mark_stale(uint64_t pc)
+{
+    if (!panda_hooks_stale) {
+        panda_hooks_stale = g_array_new(false, false, sizeof(uint64_t));
+    }
+    g_array_append_val(panda_hooks_stale, pc);
+}
+
+static gint panda_hooks_pc_cmp(gconstpointer a, gconstpointer b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Retranslates the blocks holding pcs whose hooks were added or
+ * removed since the last call.
+ *
+ * Runs before every block lookup and after the hooks at an instruction
+ * return, so a hook added or removed from a hook or a callback applies from
+ * the next block on.
+ */
+void panda_hooks_invalidate(void)
+{
+    if (!panda_hooks_stale || panda_hooks_stale->len == 0) {
+        return;
+    }
+    g_array_sort(panda_hooks_stale, panda_hooks_pc_cmp);
+    tb_invalidate_virt_pcs((uint64_t *)panda_hooks_stale->data,
+                           panda_hooks_stale->len);
+    g_array_set_size(panda_hooks_stale, 0);
+}
+
+int panda_hook_add(target_ptr_t pc, panda_hook_func_t fn, void *opaque)
+{
+    uint64_t key = pc;
+    panda_hook h = { .id = panda_hook_next_id++, .fn = fn, .opaque = opaque };
+    panda_hook_site *site;
+
+    assert(fn);
+    if (!panda_hook_sites) {
+        panda_hook_sites = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                                 NULL, panda_hook_site_free);
+        panda_hook_ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+    site = g_hash_table_lookup(panda_hook_sites, &key);
+    if (!site) {
+        site = g_new(panda_hook_site, 1);
+        site->pc = pc;
+        site->hooks = g_array_new(false, false, sizeof(panda_hook));
+        g_hash_table_insert(panda_hook_sites, &site->pc, site);
+        panda_hooks_mark_stale(pc);
+    }
+    g_array_append_val(site->hooks, h);
+    g_hash_table_insert(panda_hook_ids, GINT_TO_POINTER(h.id), site);
+    return h.id;
+}
+
+// Drops removed hooks, and the sites that have none left
+static void panda_hooks_sweep(void)
+{
+    GHashTableIter it;
+    panda_hook_site *site;
+
+    g_hash_table_iter_init(&it, panda_hook_sites);
+    while (g_hash_table_iter_next(&it, NULL, (gpointer *)&site)) {
+        for (guint i = 0; i < site->hooks->len; ) {
+            if (g_array_index(site->hooks, panda_hook, i).fn) {
+                i++;
+            } else {
+                g_array_remove_index(site->hooks, i);
+            }
+        }
+        if (site->hooks->len == 0) {
+            panda_hooks_mark_stale(site->pc);
+            g_hash_table_iter_remove(&it);
+        }
+    }
+    panda_hooks_removed = false;
+}
+
+/**
+ * @brief Removes a hook added by panda_hook_add().
+ *
+ * @note Removing an unknown id will trigger an assertion error.
+ */
+void panda_hook_remove(int id)
+{
+    panda_hook_site *site = panda_hook_ids ?
+        g_hash_table_lookup(panda_hook_ids, GINT_TO_POINTER(id)) : NULL;
+
+    assert(site);
+    g_hash_table_remove(panda_hook_ids, GINT_TO_POINTER(id));
+    for (guint i = 0; i < site->hooks->len; i++) {
+        panda_hook *h = &g_array_index(site->hooks, panda_hook, i);
+        if (h->id == id) {
+            h->fn = NULL;
+            break;
+        }
+    }
+    panda_hooks_removed = true;
+    if (!panda_hooks_running) {
+        panda_hooks_sweep();
+    }
+}
+
+bool panda_hooks_present(void)
+{
+    return panda_hook_sites && g_hash_table_size(panda_hook_sites);
+}
+
+bool panda_hooked(target_ptr_t pc)
+{
+    uint64_t key = pc;
+    return g_hash_table_contains(panda_hook_sites, &key);
+}
+
+// Called from generated code before the instruction at pc
+void panda_run_hooks(CPUState *env, TranslationBlock *tb, target_ptr_t pc)
+{
+    uint64_t key = pc;
+    panda_hook_site *site;
+
+    if (!panda_hook_sites) {
+        return;
+    }
+    site = g_hash_table_lookup(panda_hook_sites, &key);
+    if (!site) {
+        return;
+    }
+    panda_hooks_running++;
+    // Hooks added meanwhile may grow the array, so it's indexed each time
+    for (guint i = 0; i < site->hooks->len; i++) {
+        panda_hook h = g_array_index(site->hooks, panda_hook, i);
+        if (h.fn) {
+            h.fn(env, tb, pc, h.opaque);
+        }
+    }
+    panda_hooks_running--;
+    if (!panda_hooks_running) {
+        if (panda_hooks_removed) {
+            panda_hooks_sweep();
+        }
+        panda_hooks_invalidate();
+    }
+}
+
 void panda_enable_tb_chaining(void)
 {
+    if (panda_fast_forward_instr) {
+        panda_fast_forward_saved.tb_chaining = true;
+        return;
+    }
     panda_tb_chaining = true;
 }
 
 void panda_disable_tb_chaining(void)
 {
+    if (panda_fast_forward_instr) {
+        panda_fast_forward_saved.tb_chaining = false;
+        return;
+    }
     panda_tb_chaining = false;
 }
 
+/**
+ * @brief Allows TB chaining during replay.
+ *
+ * Blocks translated while this is on check a per-CPU instruction budget on
+ * entry, so chained execution still returns to the main loop right before
+ * the next interrupt or main loop wait in the nondet log. Chaining remains
+ * subject to panda_enable_tb_chaining()/panda_disable_tb_chaining().
+ */
+void panda_enable_replay_tb_chaining(void)
+{
+    if (panda_fast_forward_instr) {
+        panda_fast_forward_saved.replay_tb_chaining = true;
+        return;
+    }
+    if (!panda_replay_tb_chaining) {
+        panda_replay_tb_chaining = true;
+        panda_do_flush_tb();
+    }
+}
+
+void panda_disable_replay_tb_chaining(void)
+{
+    if (panda_fast_forward_instr) {
+        panda_fast_forward_saved.replay_tb_chaining = false;
+        return;
+    }
+    if (panda_replay_tb_chaining) {
+        panda_replay_tb_chaining = false;
+        panda_do_flush_tb();
+    }
+}
+
+
+void panda_fast_forward_begin(uint64_t instr)
+{
+    assert(!panda_fast_forward_instr && instr);
+    for (int i = 0; i < PANDA_CB_LAST; i++) {
+        if (panda_cb_type_pausable(i)) {
+            panda_cbs_paused[i] = panda_cbs[i];
+            panda_cbs[i] = NULL;
+            panda_cbs_rebuild(i);
+        }
+    }
+    panda_fast_forward_saved.tb_chaining = panda_tb_chaining;
+    panda_fast_forward_saved.replay_tb_chaining = panda_replay_tb_chaining;
+    panda_fast_forward_saved.use_memcb = panda_use_memcb;
+    panda_fast_forward_saved.generate_llvm = generate_llvm;
+    panda_fast_forward_saved.execute_llvm = execute_llvm;
+    panda_tb_chaining = true;
+    panda_replay_tb_chaining = true;
+    panda_use_memcb = false;
+    generate_llvm = execute_llvm = 0;
+
+    panda_fast_forward_instr = instr;
+    panda_do_flush_tb();
+}
+
+void panda_fast_forward_end(void)
+{
+    assert(panda_fast_forward_instr);
+    for (int i = 0; i < PANDA_CB_LAST; i++) {
+        if (!panda_cb_type_pausable(i)) {
+            continue;
+        }
+        // anything registered meanwhile went to the paused list as well
+        assert(panda_cbs[i] == NULL);
+        panda_cbs[i] = panda_cbs_paused[i];
+        panda_cbs_paused[i] = NULL;
+        panda_cbs_rebuild(i);
+    }
+    panda_tb_chaining = panda_fast_forward_saved.tb_chaining;
+    panda_replay_tb_chaining = panda_fast_forward_saved.replay_tb_chaining;
+    panda_use_memcb = panda_fast_forward_saved.use_memcb;
+    generate_llvm = panda_fast_forward_saved.generate_llvm;
+    execute_llvm = panda_fast_forward_saved.execute_llvm;
+
+    panda_fast_forward_instr = 0;
+    panda_do_flush_tb();
+}
+
 #ifdef CONFIG_LLVM
+bool (*panda_llvm_block_filter)(CPUState *cpu, TranslationBlock *tb);
+
 void panda_enable_llvm(void) {
-    panda_do_flush_tb();
-    execute_llvm = 1;
-    generate_llvm = 1;
+    // the translator is set up now either way; fast-forwarding only turns
+    // its use on once it ends
+    if (panda_fast_forward_instr) {
+        panda_fast_forward_saved.execute_llvm = 1;
+        panda_fast_forward_saved.generate_llvm = 1;
+    } else {
+        panda_do_flush_tb();
+        execute_llvm = 1;
+        generate_llvm = 1;
+    }
     tcg_llvm_initialize();
 }
 
 void panda_disable_llvm(void) {
-    panda_do_flush_tb();
-    execute_llvm = 0;
-    generate_llvm = 0;
+    if (panda_fast_forward_instr) {
+        panda_fast_forward_saved.execute_llvm = 0;
+        panda_fast_forward_saved.generate_llvm = 0;
+    } else {
+        panda_do_flush_tb();
+        execute_llvm = 0;
+        generate_llvm = 0;
+    }
+    panda_llvm_block_filter = NULL;
     tcg_llvm_destroy();
     tcg_llvm_translator = NULL;
 }
@@ -683,6 +1317,10 @@ void panda_enable_llvm_helpers(void) {
 void panda_disable_llvm_helpers(void) {
     uninit_llvm_helpers();
 }
+
+void panda_set_llvm_block_filter(bool (*filter)(CPUState *cpu, TranslationBlock *tb)) {
+    panda_llvm_block_filter = filter;
+}
 #endif
 
 void panda_memsavep(FILE *f) {
@@ -1248,11 +1886,14 @@ void hmp_panda_list_plugins(Monitor *mon, const QDict *qdict) {
 }
 
 void hmp_panda_plugin_cmd(Monitor *mon, const QDict *qdict) {
-    panda_cb_list *plist;
+    panda_cb_array *cbs;
     const char *cmd = qdict_get_try_str(qdict, "cmd");
-    for(plist = panda_cbs[PANDA_CB_MONITOR]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.monitor(mon, cmd);
+    rcu_read_lock();
+    cbs = atomic_rcu_read(&panda_cbs_enabled[PANDA_CB_MONITOR]);
+    for (int i = 0; cbs && i < cbs->n; i++) {
+        cbs->fns[i].monitor(mon, cmd);
     }
+    rcu_read_unlock();
 }
 
 #endif // CONFIG_SOFTMMU
@@ -9,6 +9,7 @@
 #include "panda/rr/rr_api.h"
 #include "exec/cpu-common.h"
 #include "exec/ram_addr.h"
+#include "qemu/rcu.h"
 
 // For each callback, use MAKE_CALLBACK or MAKE_REPLAY_ONLY_CALLBACK as defined in
 #include "panda/callbacks/cb-macros.h"
@@ -53,6 +54,13 @@ MAKE_CALLBACK(void, AFTER_BLOCK_EXEC, after_block_exec,
                     CPUState*, cpu, TranslationBlock*, tb,
                     uint8_t, exitCode);
 
+// These are called from generated code, see cb-helper-impl.h
+MAKE_CALLBACK(void, START_BLOCK_EXEC, start_block_exec,
+                    CPUState*, cpu, TranslationBlock*, tb);
+
+MAKE_CALLBACK(void, END_BLOCK_EXEC, end_block_exec,
+                    CPUState*, cpu, TranslationBlock*, tb);
+
 MAKE_CALLBACK(void, BEFORE_BLOCK_TRANSLATE, before_block_translate,
                     CPUState*, cpu, target_ptr_t, pc);
 
@@ -174,25 +182,50 @@ void PCB(before_find_fast)(void) {
             }
         }
     }
+    panda_hooks_invalidate();
     if (panda_flush_tb()) {
         tb_flush(first_cpu);
     }
 }
 bool PCB(after_find_fast)(CPUState *cpu, TranslationBlock *tb,
                           bool bb_invalidate_done, bool *invalidate) {
-    panda_cb_list *plist;
+    panda_cb_array *cbs;
     if (!bb_invalidate_done) {
-        for (plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT];
-             plist != NULL; plist = panda_cb_list_next(plist)) {
-            if (plist->enabled)
-              *invalidate |=
-                  plist->entry.before_block_exec_invalidate_opt(cpu, tb);
+        rcu_read_lock();
+        cbs = PANDA_CBS_ENABLED(BEFORE_BLOCK_EXEC_INVALIDATE_OPT);
+        for (int i = 0; cbs && i < cbs->n; i++) {
+            *invalidate |= cbs->fns[i].before_block_exec_invalidate_opt(cpu, tb);
         }
+        rcu_read_unlock();
         return true;
     }
     return false;
 }
 
+// These are used in cb-helper-impl.h, for blocks that don't call a lone
+// callback directly. The return value of the callbacks is ignored.
+int PCB(insn_exec)(CPUState *env, target_ptr_t pc) {
+    panda_cb_array *cbs;
+    rcu_read_lock();
+    cbs = PANDA_CBS_ENABLED(INSN_EXEC);
+    for (int i = 0; cbs && i < cbs->n; i++) {
+        cbs->fns[i].insn_exec(env, pc);
+    }
+    rcu_read_unlock();
+    return 0;
+}
+
+int PCB(after_insn_exec)(CPUState *env, target_ptr_t pc) {
+    panda_cb_array *cbs;
+    rcu_read_lock();
+    cbs = PANDA_CBS_ENABLED(AFTER_INSN_EXEC);
+    for (int i = 0; cbs && i < cbs->n; i++) {
+        cbs->fns[i].after_insn_exec(env, pc);
+    }
+    rcu_read_unlock();
+    return 0;
+}
+
 
 // this callback allows us to swallow exceptions
 //
@@ -204,20 +237,20 @@ bool PCB(after_find_fast)(CPUState *cpu, TranslationBlock *tb,
 // change the current cpu exception.  Sorry.
 
 int32_t PCB(before_handle_exception)(CPUState *cpu, int32_t exception_index) {
-    panda_cb_list *plist;
+    panda_cb_array *cbs;
     bool got_new_exception = false;
     int32_t new_exception;
 
-    for (plist = panda_cbs[PANDA_CB_BEFORE_HANDLE_EXCEPTION]; plist != NULL;
-         plist = panda_cb_list_next(plist)) {
-        if (plist->enabled) {
-            int32_t new_e = plist->entry.before_handle_exception(cpu, exception_index);
-            if (!got_new_exception && new_e != exception_index) {
-                got_new_exception = true;
-                new_exception = new_e;
-            }
+    rcu_read_lock();
+    cbs = PANDA_CBS_ENABLED(BEFORE_HANDLE_EXCEPTION);
+    for (int i = 0; cbs && i < cbs->n; i++) {
+        int32_t new_e = cbs->fns[i].before_handle_exception(cpu, exception_index);
+        if (!got_new_exception && new_e != exception_index) {
+            got_new_exception = true;
+            new_exception = new_e;
         }
     }
+    rcu_read_unlock();
 
     if (got_new_exception)
         return new_exception;
@@ -227,20 +260,20 @@ int32_t PCB(before_handle_exception)(CPUState *cpu, int32_t exception_index) {
 
 
 int32_t PCB(before_handle_interrupt)(CPUState *cpu, int32_t interrupt_request) {
-    panda_cb_list *plist;
+    panda_cb_array *cbs;
     bool got_new_interrupt = false;
     int32_t new_interrupt;
 
-    for (plist = panda_cbs[PANDA_CB_BEFORE_HANDLE_INTERRUPT]; plist != NULL;
-         plist = panda_cb_list_next(plist)) {
-        if (plist->enabled) {
-            int32_t new_i = plist->entry.before_handle_interrupt(cpu, interrupt_request);
-            if (!got_new_interrupt && new_i != interrupt_request) {
-                got_new_interrupt = true;
-                new_interrupt = new_i;
-            }
+    rcu_read_lock();
+    cbs = PANDA_CBS_ENABLED(BEFORE_HANDLE_INTERRUPT);
+    for (int i = 0; cbs && i < cbs->n; i++) {
+        int32_t new_i = cbs->fns[i].before_handle_interrupt(cpu, interrupt_request);
+        if (!got_new_interrupt && new_i != interrupt_request) {
+            got_new_interrupt = true;
+            new_interrupt = new_i;
         }
     }
+    rcu_read_unlock();
 
     if (got_new_interrupt)
         return new_interrupt;
@@ -253,81 +286,89 @@ int32_t PCB(before_handle_interrupt)(CPUState *cpu, int32_t interrupt_request) {
 // ram_ptr is a possible pointer into host memory from the TLB code. Can be NULL.
 void PCB(mem_before_read)(CPUState *env, target_ptr_t pc, target_ptr_t addr,
                           size_t data_size, void *ram_ptr) {
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_BEFORE_READ]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
-        if (plist->enabled) plist->entry.virt_mem_before_read(env, env->panda_guest_pc, addr,
-                                                              data_size);
+    panda_cb_array *cbs;
+    rcu_read_lock();
+    cbs = PANDA_CBS_ENABLED(VIRT_MEM_BEFORE_READ);
+    for (int i = 0; cbs && i < cbs->n; i++) {
+        cbs->fns[i].virt_mem_before_read(env, env->panda_guest_pc, addr,
+                                         data_size);
     }
-    if (panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_READ]) {
+    cbs = PANDA_CBS_ENABLED(PHYS_MEM_BEFORE_READ);
+    if (cbs) {
         hwaddr paddr = get_paddr(env, addr, ram_ptr);
-        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_READ]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-            if (plist->enabled) plist->entry.phys_mem_before_read(env, env->panda_guest_pc,
-                                                                  paddr, data_size);
+        for (int i = 0; i < cbs->n; i++) {
+            cbs->fns[i].phys_mem_before_read(env, env->panda_guest_pc,
+                                             paddr, data_size);
         }
     }
+    rcu_read_unlock();
 }
 
 
 void PCB(mem_after_read)(CPUState *env, target_ptr_t pc, target_ptr_t addr,
                          size_t data_size, uint64_t result, void *ram_ptr) {
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_AFTER_READ]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
+    panda_cb_array *cbs;
+    rcu_read_lock();
+    cbs = PANDA_CBS_ENABLED(VIRT_MEM_AFTER_READ);
+    for (int i = 0; cbs && i < cbs->n; i++) {
         /* mstamat: Passing &result as the last cb arg doesn't make much sense. */
-        if (plist->enabled) plist->entry.virt_mem_after_read(env, env->panda_guest_pc, addr,
-                                         data_size, (uint8_t *)&result);
+        cbs->fns[i].virt_mem_after_read(env, env->panda_guest_pc, addr,
+                                        data_size, (uint8_t *)&result);
     }
-    if (panda_cbs[PANDA_CB_PHYS_MEM_AFTER_READ]) {
+    cbs = PANDA_CBS_ENABLED(PHYS_MEM_AFTER_READ);
+    if (cbs) {
         hwaddr paddr = get_paddr(env, addr, ram_ptr);
-        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_AFTER_READ]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
+        for (int i = 0; i < cbs->n; i++) {
             /* mstamat: Passing &result as the last cb arg doesn't make much sense. */
-            if (plist->enabled) plist->entry.phys_mem_after_read(env, env->panda_guest_pc, paddr,
-                                             data_size, (uint8_t *)&result);
+            cbs->fns[i].phys_mem_after_read(env, env->panda_guest_pc, paddr,
+                                            data_size, (uint8_t *)&result);
         }
     }
+    rcu_read_unlock();
 }
 
 
 void PCB(mem_before_write)(CPUState *env, target_ptr_t pc, target_ptr_t addr,
                            size_t data_size, uint64_t val, void *ram_ptr) {
-    panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_BEFORE_WRITE]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
+    panda_cb_array *cbs;
+    rcu_read_lock();
+    cbs = PANDA_CBS_ENABLED(VIRT_MEM_BEFORE_WRITE);
+    for (int i = 0; cbs && i < cbs->n; i++) {
         /* mstamat: Passing &val as the last arg doesn't make much sense. */
-        if (plist->enabled) plist->entry.virt_mem_before_write(env, env->panda_guest_pc, addr,
-                                           data_size, (uint8_t *)&val);
+        cbs->fns[i].virt_mem_before_write(env, env->panda_guest_pc, addr,
+                                          data_size, (uint8_t *)&val);
     }
-    if (panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_WRITE]) {
+    cbs = PANDA_CBS_ENABLED(PHYS_MEM_BEFORE_WRITE);
+    if (cbs) {
         hwaddr paddr = get_paddr(env, addr, ram_ptr);
-        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_WRITE]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
+        for (int i = 0; i < cbs->n; i++) {
             /* mstamat: Passing &val as the last cb arg doesn't make much sense. */
-            if (plist->enabled) plist->entry.phys_mem_before_write(env, env->panda_guest_pc, paddr,
-                                               data_size, (uint8_t *)&val);
+            cbs->fns[i].phys_mem_before_write(env, env->panda_guest_pc, paddr,
+                                              data_size, (uint8_t *)&val);
         }
     }
+    rcu_read_unlock();
 }
 
 
 void PCB(mem_after_write)(CPUState *env, target_ptr_t pc, target_ptr_t addr,
                           size_t data_size, uint64_t val, void *ram_ptr) {
-    panda_cb_list *plist;
-    for (plist = panda_cbs[PANDA_CB_VIRT_MEM_AFTER_WRITE]; plist != NULL;
-         plist = panda_cb_list_next(plist)) {
+    panda_cb_array *cbs;
+    rcu_read_lock();
+    cbs = PANDA_CBS_ENABLED(VIRT_MEM_AFTER_WRITE);
+    for (int i = 0; cbs && i < cbs->n; i++) {
         /* mstamat: Passing &val as the last cb arg doesn't make much sense. */
-        if (plist->enabled) plist->entry.virt_mem_after_write(env, env->panda_guest_pc, addr,
-                                          data_size, (uint8_t *)&val);
+        cbs->fns[i].virt_mem_after_write(env, env->panda_guest_pc, addr,
+                                         data_size, (uint8_t *)&val);
     }
-    if (panda_cbs[PANDA_CB_PHYS_MEM_AFTER_WRITE]) {
+    cbs = PANDA_CBS_ENABLED(PHYS_MEM_AFTER_WRITE);
+    if (cbs) {
         hwaddr paddr = get_paddr(env, addr, ram_ptr);
-        for (plist = panda_cbs[PANDA_CB_PHYS_MEM_AFTER_WRITE]; plist != NULL;
-             plist = panda_cb_list_next(plist)) {
+        for (int i = 0; i < cbs->n; i++) {
             /* mstamat: Passing &val as the last cb arg doesn't make much sense. */
-            if (plist->enabled) plist->entry.phys_mem_after_write(env, env->panda_guest_pc, paddr,
-                                              data_size, (uint8_t *)&val);
+            cbs->fns[i].phys_mem_after_write(env, env->panda_guest_pc, paddr,
+                                             data_size, (uint8_t *)&val);
         }
     }
+    rcu_read_unlock();
 }
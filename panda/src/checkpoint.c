@@ -8,12 +8,17 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#ifdef CONFIG_LINUX
+#include <sys/syscall.h>
+#endif
 
 #include "qemu/osdep.h"
 #include "cpu.h"
 
 #include "exec/exec-all.h"
 #include "exec/memory.h"
+#include "exec/ram_addr.h"
 #include "io/channel-file.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
@@ -22,6 +27,13 @@
 
 #include "panda/rr/rr_log.h"
 #include "panda/common.h"
+#include "panda/plugin.h"
+#include "panda/plog.h"
+#include "panda/plog-cc-bridge.h"
+#include "qemu/bitmap.h"
+#include "qemu/bitops.h"
+#include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "qemu/memfd.h"
 
 #if !defined(CONFIG_MEMFD)
@@ -49,6 +61,546 @@ extern unsigned long long rr_size_of_log_entries[RR_LAST];
 extern unsigned long long rr_max_num_queue_entries;
 static size_t total_usage = 0;
 static size_t next_checkpoint_num = 0;
+static bool checkpoint_fork = false;
+// fork backend: device state of all checkpoints, and memory only the parked
+// processes hold, as last measured
+static size_t fork_device_usage = 0;
+static size_t fork_private_usage = 0;
+
+/*
+ * Checkpoints keep device state in a memfd, but guest RAM goes into a page
+ * store shared by all checkpoints. Each checkpoint records only the pages
+ * that changed since its parent (found with dirty-page logging), and pages
+ * with identical contents are stored once. Every
+ * CHECKPOINT_KEYFRAME_INTERVAL checkpoints we also keep a full page table,
+ * so rebuilding the RAM of any checkpoint walks a bounded chain.
+ */
+#define CHECKPOINT_KEYFRAME_INTERVAL 64
+// pages per dirty-bitmap probe when looking for dirty pages
+#define CHECKPOINT_DIRTY_STRIDE 64
+
+struct CheckpointPage {
+    CheckpointPage *next;   // other pages with the same hash
+    uint64_t hash;
+    uint8_t data[];
+};
+
+/*
+ * With the fork backend (panda_checkpoint_use_fork), each checkpoint instead
+ * forks a child that parks with a copy-on-write image of guest RAM. The
+ * checkpoint only remembers which pages were written since its parent, and a
+ * restore reads back just the pages that can differ from the child's image.
+ */
+#define CHECKPOINT_IOV_MAX 1024
+
+typedef struct CheckpointRAMBlock {
+    uint8_t *host;
+    ram_addr_t offset;
+    size_t npages;
+    size_t first;           // index of the block's first page in page tables
+} CheckpointRAMBlock;
+
+static struct {
+    CheckpointRAMBlock *blocks;
+    size_t num_blocks;
+    size_t total_pages;
+    // guest RAM as of the last checkpoint or restore
+    CheckpointPage **cur;
+    Checkpoint *last;
+    GHashTable *store;      // hash -> CheckpointPage chain
+    size_t unique_pages;
+} ckpt_ram;
+
+static int checkpoint_add_ram_block(const char *block_name, void *host_addr,
+                                    ram_addr_t offset, ram_addr_t length,
+                                    void *opaque) {
+    CheckpointRAMBlock *block;
+
+    ckpt_ram.blocks = g_renew(CheckpointRAMBlock, ckpt_ram.blocks,
+                              ckpt_ram.num_blocks + 1);
+    block = &ckpt_ram.blocks[ckpt_ram.num_blocks++];
+    block->host = host_addr;
+    block->offset = offset;
+    block->npages = length >> TARGET_PAGE_BITS;
+    block->first = ckpt_ram.total_pages;
+    ckpt_ram.total_pages += block->npages;
+    return 0;
+}
+
+static void checkpoint_ram_init(void) {
+    qemu_ram_foreach_block(checkpoint_add_ram_block, NULL);
+    if (!checkpoint_fork) {
+        ckpt_ram.cur = g_new0(CheckpointPage *, ckpt_ram.total_pages);
+        ckpt_ram.store = g_hash_table_new(g_int64_hash, g_int64_equal);
+    }
+    // from now on, guest RAM writes are logged in DIRTY_MEMORY_MIGRATION
+    memory_global_dirty_log_start();
+}
+
+static uint64_t checkpoint_page_hash(const uint8_t *data) {
+    const uint64_t *w = (const uint64_t *)data;
+    uint64_t h0 = 1, h1 = 2, h2 = 3, h3 = 4;
+
+    for (size_t i = 0; i < TARGET_PAGE_SIZE / sizeof(*w); i += 4) {
+        h0 = rol64(h0 ^ w[i], 29) * 0x9e3779b97f4a7c15ULL;
+        h1 = rol64(h1 ^ w[i + 1], 29) * 0x9e3779b97f4a7c15ULL;
+        h2 = rol64(h2 ^ w[i + 2], 29) * 0x9e3779b97f4a7c15ULL;
+        h3 = rol64(h3 ^ w[i + 3], 29) * 0x9e3779b97f4a7c15ULL;
+    }
+    return h0 ^ rol64(h1, 16) ^ rol64(h2, 32) ^ rol64(h3, 48);
+}
+
+static inline bool checkpoint_page_matches(CheckpointPage *page,
+                                           const uint8_t *data) {
+    return page ? memcmp(page->data, data, TARGET_PAGE_SIZE) == 0
+                : buffer_is_zero(data, TARGET_PAGE_SIZE);
+}
+
+// Find or add a page with these contents. Returns NULL for a zero page.
+static CheckpointPage *checkpoint_page_intern(const uint8_t *data,
+                                              size_t *usage) {
+    CheckpointPage *head, *page;
+    uint64_t hash;
+
+    if (buffer_is_zero(data, TARGET_PAGE_SIZE)) {
+        return NULL;
+    }
+    hash = checkpoint_page_hash(data);
+    head = g_hash_table_lookup(ckpt_ram.store, &hash);
+    for (page = head; page; page = page->next) {
+        if (memcmp(page->data, data, TARGET_PAGE_SIZE) == 0) {
+            return page;
+        }
+    }
+
+    page = g_malloc(sizeof(*page) + TARGET_PAGE_SIZE);
+    page->next = head;
+    page->hash = hash;
+    memcpy(page->data, data, TARGET_PAGE_SIZE);
+    g_hash_table_insert(ckpt_ram.store, &page->hash, page);
+    ckpt_ram.unique_pages++;
+    *usage += sizeof(*page) + TARGET_PAGE_SIZE;
+    return page;
+}
+
+static inline bool checkpoint_pages_dirty(CheckpointRAMBlock *block,
+                                          size_t i, size_t n) {
+    return cpu_physical_memory_get_dirty(
+            block->offset + ((ram_addr_t)i << TARGET_PAGE_BITS),
+            (ram_addr_t)n << TARGET_PAGE_BITS, DIRTY_MEMORY_MIGRATION);
+}
+
+static inline void checkpoint_clear_dirty(CheckpointRAMBlock *block) {
+    cpu_physical_memory_test_and_clear_dirty(block->offset,
+            (ram_addr_t)block->npages << TARGET_PAGE_BITS,
+            DIRTY_MEMORY_MIGRATION);
+}
+
+// Record the pages that changed since the last checkpoint or restore.
+static void checkpoint_save_ram(Checkpoint *checkpoint) {
+    bool full = ckpt_ram.last == NULL;
+    size_t cap = 0;
+
+    for (size_t b = 0; b < ckpt_ram.num_blocks; b++) {
+        CheckpointRAMBlock *block = &ckpt_ram.blocks[b];
+        for (size_t i = 0; i < block->npages; i++) {
+            if (!full) {
+                if (i % CHECKPOINT_DIRTY_STRIDE == 0 &&
+                    !checkpoint_pages_dirty(block, i,
+                        MIN(CHECKPOINT_DIRTY_STRIDE, block->npages - i))) {
+                    i += CHECKPOINT_DIRTY_STRIDE - 1;
+                    continue;
+                }
+                if (!checkpoint_pages_dirty(block, i, 1)) continue;
+            }
+
+            size_t idx = block->first + i;
+            const uint8_t *data = block->host + (i << TARGET_PAGE_BITS);
+            // written, but perhaps back to what it was
+            if (checkpoint_page_matches(ckpt_ram.cur[idx], data)) continue;
+
+            if (checkpoint->num_dirty == cap) {
+                cap = MAX(1024, cap * 2);
+                checkpoint->dirty_idx = g_renew(uint32_t,
+                        checkpoint->dirty_idx, cap);
+                checkpoint->dirty_pages = g_renew(CheckpointPage *,
+                        checkpoint->dirty_pages, cap);
+            }
+            CheckpointPage *page = checkpoint_page_intern(data,
+                    &checkpoint->ram_usage);
+            checkpoint->dirty_idx[checkpoint->num_dirty] = idx;
+            checkpoint->dirty_pages[checkpoint->num_dirty] = page;
+            checkpoint->num_dirty++;
+            ckpt_ram.cur[idx] = page;
+        }
+        checkpoint_clear_dirty(block);
+    }
+    checkpoint->dirty_idx = g_renew(uint32_t, checkpoint->dirty_idx,
+            checkpoint->num_dirty);
+    checkpoint->dirty_pages = g_renew(CheckpointPage *,
+            checkpoint->dirty_pages, checkpoint->num_dirty);
+    checkpoint->ram_usage += checkpoint->num_dirty *
+        (sizeof(*checkpoint->dirty_idx) + sizeof(*checkpoint->dirty_pages));
+
+    checkpoint->parent = ckpt_ram.last;
+    checkpoint->depth = checkpoint->parent ? checkpoint->parent->depth + 1 : 0;
+    if (!checkpoint->parent ||
+        checkpoint->depth >= CHECKPOINT_KEYFRAME_INTERVAL) {
+        checkpoint->depth = 0;
+        checkpoint->pages = g_memdup(ckpt_ram.cur,
+                ckpt_ram.total_pages * sizeof(*ckpt_ram.cur));
+        checkpoint->ram_usage += ckpt_ram.total_pages * sizeof(*ckpt_ram.cur);
+    }
+    ckpt_ram.last = checkpoint;
+}
+
+// Page table of guest RAM at this checkpoint; caller frees.
+static CheckpointPage **checkpoint_page_table(Checkpoint *checkpoint) {
+    Checkpoint *chain[CHECKPOINT_KEYFRAME_INTERVAL];
+    CheckpointPage **table;
+    Checkpoint *c;
+    size_t n = 0;
+
+    for (c = checkpoint; !c->pages; c = c->parent) {
+        assert(n < ARRAY_SIZE(chain));
+        chain[n++] = c;
+    }
+    table = g_memdup(c->pages, ckpt_ram.total_pages * sizeof(*table));
+    while (n--) {
+        c = chain[n];
+        for (size_t i = 0; i < c->num_dirty; i++) {
+            table[c->dirty_idx[i]] = c->dirty_pages[i];
+        }
+    }
+    return table;
+}
+
+// Rewrite the guest pages that differ from the checkpoint.
+static void checkpoint_restore_ram(Checkpoint *checkpoint) {
+    CheckpointPage **table = checkpoint_page_table(checkpoint);
+    size_t restored = 0;
+
+    for (size_t b = 0; b < ckpt_ram.num_blocks; b++) {
+        CheckpointRAMBlock *block = &ckpt_ram.blocks[b];
+        for (size_t i = 0; i < block->npages; i++) {
+            size_t idx = block->first + i;
+            if (table[idx] == ckpt_ram.cur[idx] &&
+                !checkpoint_pages_dirty(block, i, 1)) {
+                continue;
+            }
+            uint8_t *data = block->host + (i << TARGET_PAGE_BITS);
+            if (table[idx]) {
+                memcpy(data, table[idx]->data, TARGET_PAGE_SIZE);
+            } else {
+                memset(data, 0, TARGET_PAGE_SIZE);
+            }
+            restored++;
+        }
+        checkpoint_clear_dirty(block);
+    }
+
+    g_free(ckpt_ram.cur);
+    ckpt_ram.cur = table;
+    ckpt_ram.last = checkpoint;
+    // code pages may have changed underneath translated blocks
+    panda_do_flush_tb();
+
+    printf("Restored %zu of %zu guest pages\n", restored, ckpt_ram.total_pages);
+}
+
+// Set the bits of pages written since the last checkpoint or restore.
+static void checkpoint_dirty_bitmap(unsigned long *bitmap) {
+    for (size_t b = 0; b < ckpt_ram.num_blocks; b++) {
+        CheckpointRAMBlock *block = &ckpt_ram.blocks[b];
+        for (size_t i = 0; i < block->npages; i++) {
+            if (i % CHECKPOINT_DIRTY_STRIDE == 0 &&
+                !checkpoint_pages_dirty(block, i,
+                    MIN(CHECKPOINT_DIRTY_STRIDE, block->npages - i))) {
+                i += CHECKPOINT_DIRTY_STRIDE - 1;
+                continue;
+            }
+            if (checkpoint_pages_dirty(block, i, 1)) {
+                set_bit(block->first + i, bitmap);
+            }
+        }
+    }
+}
+
+// Fork backend: remember which pages were written since the parent.
+static void checkpoint_save_dirty(Checkpoint *checkpoint) {
+    if (ckpt_ram.last) {
+        unsigned long *dirty = bitmap_new(ckpt_ram.total_pages);
+        size_t idx, count = 0;
+
+        checkpoint_dirty_bitmap(dirty);
+        for (idx = 0; idx < BITS_TO_LONGS(ckpt_ram.total_pages); idx++) {
+            count += ctpopl(dirty[idx]);
+        }
+        checkpoint->dirty_idx = g_new(uint32_t, count);
+        for (idx = find_first_bit(dirty, ckpt_ram.total_pages);
+             idx < ckpt_ram.total_pages;
+             idx = find_next_bit(dirty, ckpt_ram.total_pages, idx + 1)) {
+            checkpoint->dirty_idx[checkpoint->num_dirty++] = idx;
+        }
+        g_free(dirty);
+    }
+    for (size_t b = 0; b < ckpt_ram.num_blocks; b++) {
+        checkpoint_clear_dirty(&ckpt_ram.blocks[b]);
+    }
+
+    // The live process now copies each of these pages away from the parent's
+    // image as it writes them, so charge roughly that much for each checkpoint.
+    checkpoint->ram_usage = checkpoint->num_dirty *
+        (TARGET_PAGE_SIZE + sizeof(*checkpoint->dirty_idx));
+    checkpoint->parent = ckpt_ram.last;
+    ckpt_ram.last = checkpoint;
+}
+
+// Close the fds in [first, last] (last inclusive) in the forked child.
+static void checkpoint_park_close_range(int first, int last) {
+    if (first > last) {
+        return;
+    }
+#ifdef __NR_close_range
+    if (syscall(__NR_close_range, first, last, 0) == 0) {
+        return;
+    }
+#endif
+    for (int fd = first; fd <= last; fd++) {
+        close(fd);
+    }
+}
+
+/*
+ * Runs in the forked child, where only the calling thread exists, so stick
+ * to async-signal-safe calls. The child holds on to its copy of guest RAM
+ * until the pipe to it is closed, i.e. until the live process exits.
+ *
+ * Everything but stdio and the pipe is closed: the pipes that keep the
+ * other children parked, but also the replay log, pandalog, snapshot files
+ * and sockets, which must not stay open (or, for the pipes, keep their
+ * readers parked) after the live process lets go of them.
+ */
+static void QEMU_NORETURN checkpoint_park(int fd) {
+    long max_fd = sysconf(_SC_OPEN_MAX);
+    char c;
+
+    if (max_fd < 0 || max_fd > INT_MAX) {
+        max_fd = INT_MAX;
+    }
+    checkpoint_park_close_range(STDERR_FILENO + 1, fd - 1);
+    checkpoint_park_close_range(fd + 1, max_fd - 1);
+    while (read(fd, &c, 1) < 0 && errno == EINTR) {
+    }
+    _exit(0);
+}
+
+/*
+ * Let the parked processes go and reap them. Closing every pipe first lets
+ * them all exit at once rather than one by one.
+ */
+static void checkpoint_fork_release(void) {
+    for (size_t i = 0; i < next_checkpoint_num; i++) {
+        if (checkpoints[i]->park_fd >= 0) {
+            close(checkpoints[i]->park_fd);
+            checkpoints[i]->park_fd = -1;
+        }
+    }
+    for (size_t i = 0; i < next_checkpoint_num; i++) {
+        if (checkpoints[i]->pid > 0) {
+            while (waitpid(checkpoints[i]->pid, NULL, 0) < 0 && errno == EINTR) {
+            }
+            checkpoints[i]->pid = 0;
+        }
+    }
+}
+
+// Guest RAM is mapped MADV_DONTFORK (see ram_block_add), which would leave
+// the child without it; it's let through for the fork only.
+static int checkpoint_madvise_block(const char *block_name, void *host_addr,
+                                    ram_addr_t offset, ram_addr_t length,
+                                    void *opaque) {
+    return qemu_madvise(host_addr, length, *(int *)opaque);
+}
+
+static bool checkpoint_ram_advise(int advice) {
+    if (qemu_ram_foreach_block(checkpoint_madvise_block, &advice) != 0) {
+        perror("panda_checkpoint: madvise");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Bytes of memory mapped by the parked process pid alone, i.e. the pages the
+ * live process (and the processes parked after it) copied away from it since.
+ * Needs /proc/<pid>/smaps_rollup, from Linux 4.14 on.
+ */
+static bool checkpoint_fork_private_usage(pid_t pid, size_t *usage) {
+    char path[64], line[256];
+    size_t kb, total = 0;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", (int)pid);
+    fp = fopen(path, "r");
+    if (!fp) {
+        return false;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "Private_Clean: %zu kB", &kb) == 1 ||
+            sscanf(line, "Private_Dirty: %zu kB", &kb) == 1) {
+            total += kb << 10;
+        }
+    }
+    fclose(fp);
+    *usage = total;
+    return true;
+}
+
+static void checkpoint_fork_measure(Checkpoint *checkpoint) {
+    size_t usage;
+
+    if (checkpoint_fork_private_usage(checkpoint->pid, &usage)) {
+        fork_private_usage -= checkpoint->private_usage;
+        fork_private_usage += usage;
+        checkpoint->private_usage = usage;
+    }
+}
+
+static bool checkpoint_fork_park(Checkpoint *checkpoint) {
+    int fds[2];
+    pid_t pid;
+
+    // The newest parked process gains private pages as the live process
+    // writes, until the next one is forked and shares them instead; this is
+    // its final count.
+    if (next_checkpoint_num) {
+        checkpoint_fork_measure(checkpoints[next_checkpoint_num - 1]);
+    }
+    // Only this thread is forked. Let the pandalog threads finish what they
+    // were handed, so none of them is halfway through a chunk buffer or
+    // holding a lock at the fork. The other threads (RCU, I/O) may be busy,
+    // which is harmless since the child only makes async-signal-safe calls.
+    if (pandalog) {
+        pandalog_cc_quiesce();
+    }
+    if (qemu_pipe(fds) < 0) {
+        perror("panda_checkpoint: pipe");
+        return false;
+    }
+    if (!checkpoint_ram_advise(QEMU_MADV_DOFORK)) {
+        checkpoint_ram_advise(QEMU_MADV_DONTFORK);
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    pid = fork();
+    if (pid == 0) {
+        close(fds[1]);
+        checkpoint_park(fds[0]);
+    }
+    checkpoint_ram_advise(QEMU_MADV_DONTFORK);
+    if (pid < 0) {
+        perror("panda_checkpoint: fork");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    close(fds[0]);
+    checkpoint->pid = pid;
+    checkpoint->park_fd = fds[1];
+    return true;
+}
+
+// Set the bits of pages that can differ between two checkpoints: those
+// written anywhere on the path between them through their common ancestor.
+static void checkpoint_tree_diff(Checkpoint *from, Checkpoint *to,
+                                 unsigned long *bitmap) {
+    GHashTable *ancestors = g_hash_table_new(NULL, NULL);
+    Checkpoint *c, *lca;
+
+    for (c = to; c; c = c->parent) {
+        g_hash_table_insert(ancestors, c, c);
+    }
+    for (lca = from; lca && !g_hash_table_lookup(ancestors, lca);
+         lca = lca->parent) {
+        for (size_t i = 0; i < lca->num_dirty; i++) {
+            set_bit(lca->dirty_idx[i], bitmap);
+        }
+    }
+    for (c = to; c != lca; c = c->parent) {
+        for (size_t i = 0; i < c->num_dirty; i++) {
+            set_bit(c->dirty_idx[i], bitmap);
+        }
+    }
+    g_hash_table_destroy(ancestors);
+}
+
+static void checkpoint_fork_readv(Checkpoint *checkpoint, struct iovec *iov,
+                                  size_t n, size_t len) {
+    // guest RAM sits at the same addresses in the child
+    ssize_t ret = process_vm_readv(checkpoint->pid, iov, n, iov, n, 0);
+    if (ret != (ssize_t)len) {
+        fprintf(stderr, "panda_restore: reading guest RAM from checkpoint "
+                "process %d failed: %s\n", checkpoint->pid,
+                ret < 0 ? strerror(errno) : "short read");
+        abort();
+    }
+}
+
+// Fork backend: copy back the pages that differ from the child's image.
+static void checkpoint_fork_restore_ram(Checkpoint *checkpoint) {
+    unsigned long *diff = bitmap_new(ckpt_ram.total_pages);
+    struct iovec iov[CHECKPOINT_IOV_MAX];
+    size_t n = 0, len = 0, restored = 0;
+
+    checkpoint_dirty_bitmap(diff);
+    checkpoint_tree_diff(ckpt_ram.last, checkpoint, diff);
+
+    for (size_t b = 0; b < ckpt_ram.num_blocks; b++) {
+        CheckpointRAMBlock *block = &ckpt_ram.blocks[b];
+        size_t end = block->first + block->npages;
+        size_t i = find_next_bit(diff, end, block->first);
+
+        while (i < end) {
+            size_t run = find_next_zero_bit(diff, end, i) - i;
+            iov[n].iov_base = block->host +
+                ((i - block->first) << TARGET_PAGE_BITS);
+            iov[n].iov_len = run << TARGET_PAGE_BITS;
+            len += iov[n].iov_len;
+            restored += run;
+            if (++n == CHECKPOINT_IOV_MAX) {
+                checkpoint_fork_readv(checkpoint, iov, n, len);
+                n = len = 0;
+            }
+            i = find_next_bit(diff, end, i + run);
+        }
+        checkpoint_clear_dirty(block);
+    }
+    if (n) {
+        checkpoint_fork_readv(checkpoint, iov, n, len);
+    }
+    g_free(diff);
+
+    ckpt_ram.last = checkpoint;
+    panda_do_flush_tb();
+
+    printf("Restored %zu of %zu guest pages from process %d\n", restored,
+            ckpt_ram.total_pages, checkpoint->pid);
+}
+
+void panda_checkpoint_use_fork(void) {
+#ifdef CONFIG_LINUX
+    assert(next_checkpoint_num == 0);
+    if (!checkpoint_fork) {
+        atexit(checkpoint_fork_release);
+    }
+    checkpoint_fork = true;
+#else
+    fprintf(stderr, "Fork-based checkpoints need Linux; "
+            "keeping checkpoints in memory\n");
+#endif
+}
 
 /*
  * Returns closest checkpoint containing target_instr_count 
@@ -80,6 +632,21 @@ size_t get_num_checkpoints(void) {
     return next_checkpoint_num;
 }
 
+/*
+ * With the fork backend, the RAM part of total_usage is an estimate from the
+ * guest pages written between checkpoints. It misses what the parked
+ * processes hold of PANDA's own memory (translated code, heap), while the
+ * measured private pages miss pages that several parked processes still
+ * share. Go by whichever is larger.
+ */
+size_t get_checkpoint_total_usage(void) {
+    if (checkpoint_fork && next_checkpoint_num) {
+        checkpoint_fork_measure(checkpoints[next_checkpoint_num - 1]);
+        return MAX(total_usage, fork_device_usage + fork_private_usage);
+    }
+    return total_usage;
+}
+
 /*
  * Gets checkpoint from array by idx.
  * If idx <= 0, return last one
@@ -116,7 +683,12 @@ void *panda_checkpoint(void) {
         //if (check->guest_instr_count > instr_count) break;
     //}
 
-    Checkpoint *checkpoint = (Checkpoint *)malloc(sizeof(Checkpoint));
+    Checkpoint *checkpoint = (Checkpoint *)calloc(1, sizeof(Checkpoint));
+
+    if (checkpoint_fork && !checkpoint_fork_park(checkpoint)) {
+        free(checkpoint);
+        return NULL;
+    }
 
     // TODO: Do we want to insert checkpoint in list in order?
     checkpoints[next_checkpoint_num] = checkpoint;
@@ -140,20 +712,128 @@ void *panda_checkpoint(void) {
     QEMUFile *file = qemu_fopen_channel_output(QIO_CHANNEL(iochannel));
 
     global_state_store_running();
-    qemu_savevm_state(file, NULL);
+    panda_save_device_state(file);
 
     qemu_fflush(file);
     checkpoint->memfd_usage = lseek(checkpoint->memfd, 0, SEEK_CUR);
-    total_usage += checkpoint->memfd_usage;
 
-    printf("Created checkpoint @ %" PRIu64 ". Size %.1f MB. Total usage %.1f GB\n",
-            instr_count, ((float) checkpoint->memfd_usage) / (1 << 20),
-            ((float) total_usage) / (1 << 30));
+    if (!ckpt_ram.blocks) {
+        checkpoint_ram_init();
+    }
+    if (checkpoint_fork) {
+        checkpoint_save_dirty(checkpoint);
+    } else {
+        checkpoint_save_ram(checkpoint);
+    }
+    total_usage += checkpoint->memfd_usage + checkpoint->ram_usage;
+    fork_device_usage += checkpoint->memfd_usage;
+
+    printf("Created checkpoint @ %" PRIu64 ". %zu changed pages%s, size %.1f MB. "
+            "Total usage %.1f GB (%zu unique pages)\n",
+            instr_count, checkpoint->num_dirty,
+            checkpoint->pages ? " (keyframe)" : "",
+            ((float) (checkpoint->memfd_usage + checkpoint->ram_usage)) / (1 << 20),
+            ((float) get_checkpoint_total_usage()) / (1 << 30),
+            ckpt_ram.unique_pages);
 
     return checkpoint;
 }
 
 
+#define RR_NONDET_LOG_SUFFIX "-rr-nondet.log"
+
+// <path>/<name> of the recording being replayed
+static char *checkpoint_replay_prefix(void) {
+    const char *log = rr_nondet_log->name;
+    size_t len = strlen(log);
+
+    assert(g_str_has_suffix(log, RR_NONDET_LOG_SUFFIX));
+    return g_strndup(log, len - strlen(RR_NONDET_LOG_SUFFIX));
+}
+
+bool panda_checkpoint_save(void) {
+    assert(rr_in_replay());
+
+    uint64_t instr_count = rr_get_guest_instr_count();
+    uint64_t log_pos = rr_queue_head
+        ? rr_queue_head->header.file_pos
+        : rr_nondet_log->bytes_read;
+    char *prefix = checkpoint_replay_prefix();
+    char *file = g_strdup_printf("%s-rr-ckpt-%" PRIu64, prefix, instr_count);
+    char *index = g_strdup_printf("%s-rr-ckpt.idx", prefix);
+    Error *err = NULL;
+    bool ok = false;
+    FILE *fp;
+
+    QIOChannelFile *ioc = qio_channel_file_new_path(file,
+            O_WRONLY | O_CREAT | O_TRUNC, 0660, &err);
+    if (!ioc) {
+        error_report_err(err);
+        goto out;
+    }
+    QEMUFile *f = qemu_fopen_channel_output(QIO_CHANNEL(ioc));
+    global_state_store_running();
+    int ret = qemu_savevm_state(f, &err);
+    qemu_fclose(f);
+    if (ret < 0) {
+        error_report_err(err);
+        goto out;
+    }
+
+    // the index only names the snapshot, so the recording can be moved
+    fp = fopen(index, "a");
+    if (!fp) {
+        perror(index);
+        goto out;
+    }
+    char *base = g_path_get_basename(file);
+    fprintf(fp, "%" PRIu64 " %" PRIu64 " %s\n", instr_count, log_pos, base);
+    g_free(base);
+    ok = fclose(fp) == 0;
+
+    printf("Saved checkpoint @ %" PRIu64 " to %s\n", instr_count, file);
+out:
+    g_free(index);
+    g_free(file);
+    g_free(prefix);
+    return ok;
+}
+
+bool panda_checkpoint_find_saved(const char *prefix, uint64_t instr_count,
+                                 SavedCheckpoint *saved) {
+    char *index = g_strdup_printf("%s-rr-ckpt.idx", prefix);
+    char *dir = g_path_get_dirname(prefix);
+    char line[1024], name[1024];
+    bool found = false;
+    FILE *fp;
+
+    fp = fopen(index, "r");
+    if (fp) {
+        while (fgets(line, sizeof(line), fp)) {
+            uint64_t instr, pos;
+            if (sscanf(line, "%" SCNu64 " %" SCNu64 " %1023s",
+                       &instr, &pos, name) != 3) {
+                continue;
+            }
+            // a checkpoint may have been saved more than once
+            if (instr <= instr_count &&
+                (!found || instr >= saved->guest_instr_count)) {
+                if (found) {
+                    g_free(saved->file);
+                }
+                saved->guest_instr_count = instr;
+                saved->nondet_log_position = pos;
+                saved->file = g_build_filename(dir, name, NULL);
+                found = true;
+            }
+        }
+        fclose(fp);
+    }
+    g_free(dir);
+    g_free(index);
+    return found;
+}
+
 void panda_restore_by_num(int num) {
     if (num <= 0) {
         panda_restore(checkpoints[next_checkpoint_num-1]); 
@@ -185,6 +865,12 @@ void panda_restore(void *opaque) {
     QIOChannelFile *iochannel = qio_channel_file_new_fd(checkpoint->memfd);
     QEMUFile *file = qemu_fopen_channel_input(QIO_CHANNEL(iochannel));
     qemu_system_reset(VMRESET_SILENT);
+    // RAM first: device post_load hooks may look at guest memory
+    if (checkpoint_fork) {
+        checkpoint_fork_restore_ram(checkpoint);
+    } else {
+        checkpoint_restore_ram(checkpoint);
+    }
     MigrationIncomingState* mis = migration_incoming_get_current();
     mis->from_src_file = file;
 
@@ -195,9 +881,7 @@ void panda_restore(void *opaque) {
 
     first_cpu->rr_guest_instr_count = checkpoint->guest_instr_count;
     first_cpu->panda_guest_pc = panda_current_pc(first_cpu);
-    rr_nondet_log->bytes_read = checkpoint->nondet_log_position;
-    fseek(rr_nondet_log->fp, checkpoint->nondet_log_position, SEEK_SET);
-    rr_queue_head = rr_queue_tail = NULL;
+    rr_nondet_log_seek(checkpoint->nondet_log_position);
 
     memcpy(rr_number_of_log_entries, checkpoint->number_of_log_entries,
             sizeof(rr_number_of_log_entries));
@@ -126,6 +126,100 @@ target_ulong panda_current_pc(CPUState *cpu) {
     return pc;
 }
 
+/*
+ * PANDA's translation cache, used by panda_virtual_memory_rw() and friends
+ * instead of walking the guest page tables on every access. Entries are
+ * keyed by (asid, virtual page) and live until QEMU's TLB is next flushed.
+ * That covers page table switches, which flush the TLB or change the asid,
+ * and changes to existing mappings, which guests must follow with a flush.
+ * Failed translations are not cached, so pages mapped without a flush are
+ * still found.
+ */
+#define PANDA_TLB_BITS 10
+#define PANDA_TLB_SIZE (1 << PANDA_TLB_BITS)
+
+typedef struct PandaTLBEntry {
+    uint64_t gen;
+    target_ulong asid;
+    target_ulong page;
+    hwaddr phys;
+} PandaTLBEntry;
+
+static PandaTLBEntry panda_tlb[PANDA_TLB_SIZE];
+// Entries of older generations are stale. Starts at 1 to skip zeroed entries.
+static uint64_t panda_tlb_gen = 1;
+static uint64_t panda_tlb_hits;
+static uint64_t panda_tlb_misses;
+
+// Returns false if the page isn't translated through a page table.
+static inline bool panda_tlb_asid(CPUState *cpu, target_ulong page,
+                                  target_ulong *asid) {
+#if defined(TARGET_ARM) && !defined(TARGET_AARCH64)
+    // The table covering the page itself, whereas panda_current_asid()
+    // picks one from the pc. It also doesn't assert with the MMU off.
+    uint32_t table;
+    if (!arm_get_vaddr_table(cpu, &table, page)) {
+        return false;
+    }
+    *asid = table;
+#else
+    *asid = panda_current_asid(cpu);
+#endif
+    return true;
+}
+
+hwaddr panda_virt_to_phys_page(CPUState *cpu, target_ulong page) {
+    target_ulong asid;
+    PandaTLBEntry *e;
+    hwaddr phys;
+
+    if (!panda_tlb_asid(cpu, page, &asid)) {
+        return cpu_get_phys_page_debug(cpu, page);
+    }
+    e = &panda_tlb[((page >> TARGET_PAGE_BITS) ^
+                    ((uint32_t)asid * 0x9e3779b1u >> (32 - PANDA_TLB_BITS))) &
+                   (PANDA_TLB_SIZE - 1)];
+    if (e->gen == panda_tlb_gen && e->page == page && e->asid == asid) {
+        panda_tlb_hits++;
+        return e->phys;
+    }
+
+    panda_tlb_misses++;
+    phys = cpu_get_phys_page_debug(cpu, page);
+    if (phys != -1) {
+        e->gen = panda_tlb_gen;
+        e->asid = asid;
+        e->page = page;
+        e->phys = phys;
+    }
+    return phys;
+}
+
+void panda_tlb_flush(void) {
+    panda_tlb_gen++;
+}
+
+void panda_tlb_stats(uint64_t *hits, uint64_t *misses) {
+    *hits = panda_tlb_hits;
+    *misses = panda_tlb_misses;
+}
+
+int panda_virtual_memory_read_vec(CPUState *cpu, panda_mem_req *reqs, int n) {
+    bool changed_priv = false;
+    int failed = 0;
+
+    for (int i = 0; i < n; i++) {
+        reqs[i].ret = panda_virtual_memory_rw_batch(cpu, reqs[i].addr,
+                                                    reqs[i].buf, reqs[i].len,
+                                                    false, &changed_priv);
+        if (reqs[i].ret != 0) {
+            failed++;
+        }
+    }
+    if (changed_priv) exit_priv(cpu);
+    return failed;
+}
+
 /**
  * @brief Wrapper around QEMU's disassembly function.
  */
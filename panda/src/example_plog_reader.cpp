@@ -32,15 +32,10 @@ target_ulong panda_current_pc(CPUState *env) {
 
 /* *** */
 
-void pprint(std::unique_ptr<panda::LogEntry> ple) {
-    if (ple == NULL) {
-        printf("PLE is NULL\n");
-        return;
-    }
-
+void pprint(const panda::LogEntry &ple) {
     printf("\n{\n");
-    printf("\tPC = %" PRId64 "\n", ple->pc());
-    printf("\tinstr = %" PRId64 "\n", ple->instr());
+    printf("\tPC = %" PRId64 "\n", ple.pc());
+    printf("\tinstr = %" PRId64 "\n", ple.instr());
 
     /*if (ple->has_llvmentry()) {*/
         /*pprint_llvmentry(std::move(ple));*/
@@ -71,12 +66,15 @@ int main (int argc, char **argv) {
     /*}*/
     
     //read the pandalog
+    //read_entry_view hands out entries without copying them; read_entry
+    //returns copies of your own. To pick out some entries, e.g. the ones
+    //with some asid, use query (and build_index to skip whole chunks).
     {
         PandaLog p;
         p.open_read_fwd((const char *) argv[1]);
-        std::unique_ptr<panda::LogEntry> ple;
-        while ((ple = p.read_entry()) != NULL) {
-            pprint(std::move(ple));
+        std::shared_ptr<const panda::LogEntry> ple;
+        while ((ple = p.read_entry_view()) != NULL) {
+            pprint(*ple);
         }
         p.close();
     }
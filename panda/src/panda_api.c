@@ -23,6 +23,7 @@ int panda_init(int argc, char **argv, char **envp) {
 }
 
 extern void pandalog_cc_init_write(const char * fname);
+extern bool pandalog_cc_set_codec(const char *name);
 extern int panda_in_main_loop;
 
 // vl.c
@@ -62,6 +63,10 @@ void panda_start_pandalog(const char * name) {
     printf ("pandalogging to [%s]\n", name);
 }
 
+bool panda_set_pandalog_codec(const char *codec) {
+    return pandalog_cc_set_codec(codec);
+}
+
 int panda_revert(char *snapshot_name) {
     int ret = load_vmstate(snapshot_name);
 //    printf ("Got back load_vmstate ret=%d\n", ret);
@@ -1,16 +1,128 @@
 
+#include <algorithm>
 #include <cinttypes>
 #include <iostream>
 #include <math.h>
 #include <fstream>
 #include <memory>
+#include <sys/stat.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
 #include "panda/plog-cc.hpp"
 #include "panda/plog-cc-bridge.h"
 
+#ifndef PLOG_READER
+#include "config-host.h"
+#endif
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+
 using namespace std; 
 
 extern int panda_in_main_loop;
 
+static const char *pl_codec_names[PL_CODEC_LAST] = { "zlib", "zstd", "lz4" };
+
+static bool pl_codec_supported(PlCodec codec) {
+    switch (codec) {
+    case PL_CODEC_ZLIB:
+        return true;
+#ifdef CONFIG_ZSTD
+    case PL_CODEC_ZSTD:
+        return true;
+#endif
+#ifdef CONFIG_LZ4
+    case PL_CODEC_LZ4:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+// Compresses len bytes at in into out, replacing its contents.
+// lz4 blocks don't record their uncompressed size, so it goes first.
+static void pl_compress(PlCodec codec, const unsigned char *in,
+                        unsigned long len, std::vector<unsigned char> &out) {
+    switch (codec) {
+    case PL_CODEC_ZLIB: {
+        unsigned long ccs = compressBound(len);
+        out.resize(ccs);
+        int ret = compress2(out.data(), &ccs, in, len, PL_Z_LEVEL);
+        assert(ret == Z_OK);
+        out.resize(ccs);
+        break;
+    }
+#ifdef CONFIG_ZSTD
+    case PL_CODEC_ZSTD: {
+        out.resize(ZSTD_compressBound(len));
+        size_t ccs = ZSTD_compress(out.data(), out.size(), in, len, PL_ZSTD_LEVEL);
+        assert(!ZSTD_isError(ccs));
+        out.resize(ccs);
+        break;
+    }
+#endif
+#ifdef CONFIG_LZ4
+    case PL_CODEC_LZ4: {
+        uint32_t raw_size = len;
+        out.resize(sizeof(raw_size) + LZ4_compressBound(len));
+        memcpy(out.data(), &raw_size, sizeof(raw_size));
+        int ccs = LZ4_compress_default((const char *) in,
+                                       (char *) out.data() + sizeof(raw_size),
+                                       len, out.size() - sizeof(raw_size));
+        assert(ccs > 0);
+        out.resize(sizeof(raw_size) + ccs);
+        break;
+    }
+#endif
+    default:
+        assert(false && "Unsupported pandalog codec");
+    }
+}
+
+// Uncompresses zlen bytes at zbuf into buf, which holds *len bytes.
+// Returns false if buf is too small, else sets *len to the uncompressed size.
+static bool pl_uncompress(PlCodec codec, unsigned char *buf, unsigned long *len,
+                          const unsigned char *zbuf, unsigned long zlen) {
+    switch (codec) {
+    case PL_CODEC_ZLIB: {
+        int ret = uncompress(buf, len, zbuf, zlen);
+        if (ret == Z_BUF_ERROR) return false;
+        assert(ret == Z_OK && "Decompression failed");
+        return true;
+    }
+#ifdef CONFIG_ZSTD
+    case PL_CODEC_ZSTD: {
+        size_t ret = ZSTD_decompress(buf, *len, zbuf, zlen);
+        if (ZSTD_getErrorCode(ret) == ZSTD_error_dstSize_tooSmall) return false;
+        assert(!ZSTD_isError(ret) && "Decompression failed");
+        *len = ret;
+        return true;
+    }
+#endif
+#ifdef CONFIG_LZ4
+    case PL_CODEC_LZ4: {
+        uint32_t raw_size;
+        assert(zlen >= sizeof(raw_size));
+        memcpy(&raw_size, zbuf, sizeof(raw_size));
+        if (raw_size > *len) return false;
+        int ret = LZ4_decompress_safe((const char *) zbuf + sizeof(raw_size),
+                                      (char *) buf, zlen - sizeof(raw_size), *len);
+        assert(ret == (int) raw_size && "Decompression failed");
+        *len = ret;
+        return true;
+    }
+#endif
+    default:
+        fprintf(stderr, "Pandalog codec %u is not supported by this build\n", codec);
+        exit(1);
+    }
+}
+
 void PandaLog::create(uint32_t chunk_size) {
     this->chunk.size = chunk_size;
     this->chunk.zsize = chunk_size;
@@ -18,25 +130,27 @@ void PandaLog::create(uint32_t chunk_size) {
     // the invariant that all log entries for an instruction reside in same
     // chunk.  this should be big enough but don't worry, we'll be monitoring it.
     this->chunk.buf = (unsigned char *) malloc(this->chunk.size);
+    this->chunk.cap = this->chunk.size;
     this->chunk.buf_p = this->chunk.buf;
     this->chunk.zbuf = (unsigned char *) malloc(this->chunk.zsize);
+    this->chunk.start_instr = -1;
     this->chunk.start_pos = PL_HEADER_SIZE;
-    this->chunk.entries = std::vector<std::unique_ptr<panda::LogEntry>>();
+    this->chunk.num_entries = 0;
+    this->chunk.ind_entry = 0;
     return;
 }
 
 void PandaLog::read_dir(){
     PlHeader *plh = read_header();
 
-    printf("Header: version: %u dir_pos: %" PRIu64 " chunk_size: %u\n", plh->version, plh->dir_pos, plh->chunk_size);
+    this->codec = plh->version >= 3 ? (PlCodec) plh->codec : PL_CODEC_ZLIB;
+    printf("Header: version: %u dir_pos: %" PRIu64 " chunk_size: %u codec: %s\n", plh->version, plh->dir_pos, plh->chunk_size,
+           this->codec < PL_CODEC_LAST ? pl_codec_names[this->codec] : "unknown");
     
+    // chunks are decompressed into buffers of their own; this is only
+    // where their size starts
     this->chunk.size = plh->chunk_size;
     this->chunk.zsize = plh->chunk_size;
-    
-    this->chunk.buf = (unsigned char *) realloc(this->chunk.buf, this->chunk.size);
-    this->chunk.buf_p = this->chunk.buf;
-
-    this->chunk.zbuf = (unsigned char *) realloc(this->chunk.zbuf, this->chunk.size);
 
     this->file->seekg(plh->dir_pos);
     uint32_t num_chunks;
@@ -62,7 +176,7 @@ void PandaLog::read_dir(){
     }
 
     // a little hack so unmarshall_chunk will work
-    this->dir.pos[num_chunks] = plh->dir_pos;
+    this->dir.pos.push_back(plh->dir_pos);
 }
 
 PlHeader* PandaLog::read_header(){
@@ -139,64 +253,64 @@ void PandaLog::open_read_fwd(const char* fname){
     open_read(fname, PL_MODE_READ_FWD);
 }
 
-std::unique_ptr<panda::LogEntry> PandaLog::read_entry(){
-    
+bool PandaLog::next_entry(uint32_t *ind){
     PandalogCcChunk *plc = &(this->chunk);
-    uint32_t new_chunk_num;
-    std::unique_ptr<panda::LogEntry> returnEntry (new panda::LogEntry());
-    
-    // start by unmarshalling chunk, if necessary
+
     if (this->mode == PL_MODE_READ_FWD) {
         // if we've gone past the end of the current chunk
         if (plc->ind_entry > plc->num_entries-1){
 
-            //if this is the last chunk, just return NULL. We've read everything!
-            if (this->chunk_num == this->dir.num_chunks-1) return NULL;
+            //if this is the last chunk, we've read everything!
+            if (this->chunk_num == this->dir.num_chunks-1) return false;
 
-            // otherwise, unmarshall next chunk
-            new_chunk_num = this->chunk_num+1;
-            this->chunk_num = new_chunk_num;
-
-            unmarshall_chunk(new_chunk_num);
-            plc = &(this->chunk);
-            //reset ind_entry and return first element of new chunk
+            // otherwise, unmarshall next chunk and start at its first element
+            this->chunk_num++;
+            unmarshall_chunk(this->chunk_num);
             plc->ind_entry = 0;
-            returnEntry->CopyFrom(*plc->entries[plc->ind_entry]);
-            plc->ind_entry++;
-        } else {
-            //more to read in this chunk
-            returnEntry->CopyFrom(*plc->entries[plc->ind_entry]);
-            plc->ind_entry++;
         }
+        *ind = plc->ind_entry++;
+        return true;
     }
 
-    if (this->mode == PL_MODE_READ_BWD) {
-        if (plc->ind_entry == -1){
-            // if we've gone past beginning of current chunk
-
-            //if this is first chunk, return NULL.
-            if (this->chunk_num == 0) return NULL;
-            
-            //otherwise, unmarshall next chunk
-            new_chunk_num = this->chunk_num-1;
-            this->chunk_num = new_chunk_num;
+    assert(this->mode == PL_MODE_READ_BWD);
+    if (plc->ind_entry == -1){
+        // if we've gone past beginning of current chunk
 
-            unmarshall_chunk(new_chunk_num);
-            plc = &(this->chunk);
+        //if this is first chunk, we've read everything
+        if (this->chunk_num == 0) return false;
 
-            //reset ind_entry and return last element of new chunk
-            plc->ind_entry = this->dir.num_entries[new_chunk_num]-1;
-            returnEntry->CopyFrom(*plc->entries[plc->ind_entry]);
-            plc->ind_entry--;
-        } else {
-            //more to read in this chunk
-            returnEntry->CopyFrom(*plc->entries[plc->ind_entry]);
-            plc->ind_entry--;
-        }
+        //otherwise, unmarshall previous chunk and start at its last element
+        this->chunk_num--;
+        unmarshall_chunk(this->chunk_num);
+        plc->ind_entry = this->dir.num_entries[this->chunk_num]-1;
     }
+    *ind = plc->ind_entry--;
+    return true;
+}
 
+std::unique_ptr<panda::LogEntry> PandaLog::read_entry(){
+    uint32_t ind;
+    if (!next_entry(&ind)) return NULL;
+
+    std::unique_ptr<panda::LogEntry> returnEntry (new panda::LogEntry());
+    returnEntry->CopyFrom(*this->cur_chunk->entry(ind));
     return returnEntry;
-} 
+}
+
+std::shared_ptr<const panda::LogEntry> PandaLog::read_entry_view(){
+    uint32_t ind;
+    if (!next_entry(&ind)) return NULL;
+
+    // shares ownership of the chunk the entry lives in
+    return std::shared_ptr<const panda::LogEntry>(this->cur_chunk, this->cur_chunk->entry(ind));
+}
+
+const unsigned char *PandaLog::read_entry_packed(uint32_t *size){
+    uint32_t ind;
+    if (!next_entry(&ind)) return NULL;
+
+    return this->cur_chunk->packed(ind, size);
+}
 
 void PandaLog::write_header(PlHeader* plh){
     //go to beginning of file
@@ -210,13 +324,15 @@ void PandaLog::write_dir(){
 
     //create header
     PlHeader plh;
+    memset(&plh, 0, sizeof(plh));
     plh.version = PL_CURRENT_VERSION;
     
     plh.dir_pos = this->file->tellp();
     plh.chunk_size = this->chunk.size;
+    plh.codec = this->codec;
 
-    printf("header: version=%d  dir_pos=%" PRIu64 " chunk_size=%d\n",
-            plh.version, plh.dir_pos, plh.chunk_size);
+    printf("header: version=%d  dir_pos=%" PRIu64 " chunk_size=%d codec=%s\n",
+            plh.version, plh.dir_pos, plh.chunk_size, pl_codec_names[plh.codec]);
 
     // now go ahead and write dir where we are in logfile
     this->file->write((char*) &num_chunks, sizeof(num_chunks));
@@ -231,35 +347,65 @@ void PandaLog::write_dir(){
     write_header(&plh);
 }
 
-void PandaLog::add_dir_entry(){
-    // this is start instr and start file position for this chunk
-    this->dir.instr.push_back(this->chunk.start_instr);
-    this->dir.pos.push_back(this->chunk.start_pos);
-    // and this is the number of entries in this chunk
-    this->dir.num_entries.push_back(this->chunk.ind_entry);
+bool PandaLog::set_codec(PlCodec codec){
+    if (codec >= PL_CODEC_LAST || !pl_codec_supported(codec)) {
+        return false;
+    }
+    // every chunk in a log uses the codec named in its header
+    if (!this->dir.instr.empty()) {
+        return false;
+    }
+    this->codec = codec;
+    return true;
 }
 
 int PandaLog::close(){
 
     if (this->mode == PL_MODE_WRITE){
         write_current_chunk();
-        add_dir_entry();
+        // let the compression threads finish what's queued
+        stop_workers();
+        assert(this->next_chunk_out == this->chunk_num);
+        for (unsigned char *buf : this->free_bufs) {
+            free(buf);
+        }
+        this->free_bufs.clear();
         write_dir();
+    } else {
+        stop_workers();
+        this->read_jobs.clear();
+        this->read_queued.clear();
+        this->read_chunks.clear();
+        this->cur_chunk.reset();
     }
 
     this->file->close();
     return 0;
 }
 
-// compress current chunk and write it to file,
+void PandaLog::stop_workers(){
+    {
+        std::lock_guard<std::mutex> guard(this->jobs_lock);
+        this->stopping = true;
+    }
+    this->jobs_cv.notify_all();
+    for (std::thread &t : this->workers) {
+        t.join();
+    }
+    this->workers.clear();
+}
+
+void PandaLog::quiesce(){
+    std::unique_lock<std::mutex> lock(this->jobs_lock);
+    this->jobs_cv.wait(lock, [this]{
+        return this->jobs_pending == 0 && this->read_queued.empty();
+    });
+}
+
+// hand off current chunk to the compression threads,
 // also update directory map
 void PandaLog::write_current_chunk(){
 #ifndef PLOG_READER 
-    //uncompressed chunk size
-    unsigned long chunk_sz = this->chunk.buf_p - this->chunk.buf;
-    unsigned long ccs = this->chunk.zsize;
-    int ret;
-
     if (this->filename == NULL) {
       fprintf(stderr,"ERROR: Attempted to write to pandalog  but there isn't one! Did " \
                      " you run with -pandalog [filename]?\n");
@@ -268,33 +414,51 @@ void PandaLog::write_current_chunk(){
       return;
     }
 
-    // loop allows compress2 to fail and resize output buffer as needed
-    uint32_t i;
-    for (i=0; i<10; i++) {
-        ret = compress2(this->chunk.zbuf, &ccs, this->chunk.buf, chunk_sz, Z_BEST_COMPRESSION);
-        
-        if (ret == Z_OK) break;
-        // bigger output buffer needed to perform compression?
-        this->chunk.zsize *= 2;
-        this->chunk.zbuf = (unsigned char *) realloc(this->chunk.zbuf, this->chunk.zsize);
-        assert (this->chunk.zbuf != NULL);
-    }
-
-    // ccs is final compressed chunk size
-    assert(ret == Z_OK);
-    printf("writing chunk %u of pandalog, %lu / %lu = %.2f compression, %u entries\n",
-            this->chunk_num, chunk_sz, ccs, ((float)chunk_sz) / ccs,
-            this->chunk.ind_entry);
     if (this->chunk.ind_entry == 0) {
         printf("WARNING: Empty chunk written to pandalog. Did you forget?\n");
     }
 
-    this->file->write((char*)this->chunk.zbuf, ccs);
-    //assert(this->)
-    add_dir_entry();
-    // reset start instr / pos
-    this->chunk.start_instr = rr_get_guest_instr_count();
-    this->chunk.start_pos = this->file->tellg();
+    PandalogCcJob job;
+    job.chunk_num = this->chunk_num;
+    job.num_entries = this->chunk.ind_entry;
+    job.codec = this->codec;
+    job.buf = this->chunk.buf;
+    job.size = this->chunk.buf_p - this->chunk.buf;
+    job.cap = this->chunk.cap;
+
+    // start instr and number of entries for this chunk. its file position
+    // is added when it is written. a chunk holding only entries written
+    // outside the main loop has no instr; it takes the previous chunk's, so
+    // the directory stays sorted for find_chunk
+    this->dir.instr.push_back(this->chunk.start_instr == (uint64_t) -1
+                              ? (this->dir.instr.empty() ? 0 : this->dir.instr.back())
+                              : this->chunk.start_instr);
+    this->dir.num_entries.push_back(this->chunk.ind_entry);
+
+    {
+        std::unique_lock<std::mutex> lock(this->jobs_lock);
+        if (this->workers.empty()) {
+            for (int i = 0; i < PL_COMPRESS_THREADS; i++) {
+                this->workers.emplace_back(&PandaLog::compress_chunks, this);
+            }
+        }
+        // bounded, so a slow disk throttles the writer rather than growing memory
+        this->jobs_cv.wait(lock, [this]{ return this->jobs_pending < PL_MAX_PENDING_CHUNKS; });
+        this->jobs.push_back(job);
+        this->jobs_pending++;
+        if (this->free_bufs.empty()) {
+            this->chunk.buf = (unsigned char *) malloc(this->chunk.size);
+        } else {
+            this->chunk.buf = this->free_bufs.back();
+            this->free_bufs.pop_back();
+        }
+        assert (this->chunk.buf != NULL);
+        this->chunk.cap = this->chunk.size;
+    }
+    this->jobs_cv.notify_all();
+
+    // the next chunk starts at its first entry's instr
+    this->chunk.start_instr = -1;
     // rewind chunk buf and inc chunk #
     this->chunk.buf_p = this->chunk.buf;
     this->chunk_num ++;
@@ -302,6 +466,52 @@ void PandaLog::write_current_chunk(){
 #endif
 }
 
+void PandaLog::compress_chunks(){
+    std::unique_lock<std::mutex> lock(this->jobs_lock);
+    while (true) {
+        this->jobs_cv.wait(lock, [this]{ return this->stopping || !this->jobs.empty(); });
+        if (this->jobs.empty()) {
+            return;
+        }
+        PandalogCcJob job = this->jobs.front();
+        this->jobs.pop_front();
+        lock.unlock();
+
+        std::vector<unsigned char> zbuf;
+        pl_compress(job.codec, job.buf, job.size, zbuf);
+        printf("writing chunk %u of pandalog, %lu / %zu = %.2f compression (%s), %u entries\n",
+                job.chunk_num, job.size, zbuf.size(), ((float)job.size) / zbuf.size(),
+                pl_codec_names[job.codec], job.num_entries);
+
+        {
+            std::lock_guard<std::mutex> guard(this->file_lock);
+            this->compressed[job.chunk_num] = std::move(zbuf);
+            write_compressed_chunks();
+        }
+
+        lock.lock();
+        // buffers that grew for one instr's entries aren't kept around
+        if (job.cap == this->chunk.size) {
+            this->free_bufs.push_back(job.buf);
+        } else {
+            free(job.buf);
+        }
+        this->jobs_pending--;
+        this->jobs_cv.notify_all();
+    }
+}
+
+void PandaLog::write_compressed_chunks(){
+    auto it = this->compressed.find(this->next_chunk_out);
+    while (it != this->compressed.end()) {
+        this->dir.pos.push_back(this->file->tellp());
+        this->file->write((char *) it->second.data(), it->second.size());
+        this->compressed.erase(it);
+        this->next_chunk_out++;
+        it = this->compressed.find(this->next_chunk_out);
+    }
+}
+
 uint64_t last_instr_entry = -1;
 
 void PandaLog::write_entry(std::unique_ptr<panda::LogEntry> entry){
@@ -316,96 +526,429 @@ void PandaLog::write_entry(std::unique_ptr<panda::LogEntry> entry){
     }
 
     size_t n = entry->ByteSize();
+    entry->SerializeToArray(reserve_entry(n, entry->instr()), n);
+#endif
+}
 
+unsigned char *PandaLog::reserve_entry(size_t n, uint64_t instr){
     // invariant: all log entries for an instruction belong in a single chunk
     if(last_instr_entry != -1 
-        && (last_instr_entry != entry->instr())
+        && (last_instr_entry != instr)
         && (this->chunk.buf_p + n  >= this->chunk.buf + this->chunk.size)) {
         // if entry won't fit in current chunk
         // and new entry is a different instr from last entry written
             write_current_chunk();
     }
 
-    // create another chunk
+    // grow the chunk past its nominal size, keeping all of this instr's
+    // entries in it
     if (this->chunk.buf_p + sizeof(uint32_t) + n
-        >= this->chunk.buf + ((int)(floor(this->chunk.size)))) {
+        >= this->chunk.buf + this->chunk.cap) {
 
-        uint32_t offset = this->chunk.buf_p - this->chunk.buf;
-        uint32_t new_size = offset * 2;
-        this->chunk.buf = (unsigned char *) realloc(this->chunk.buf, new_size);
-        this->chunk.buf_p = this->chunk.buf + offset;
+        size_t offset = this->chunk.buf_p - this->chunk.buf;
+        size_t new_cap = std::max<size_t>(this->chunk.cap * 2, offset + sizeof(uint32_t) + n);
+        this->chunk.buf = (unsigned char *) realloc(this->chunk.buf, new_cap);
         assert (this->chunk.buf != NULL);
+        this->chunk.cap = new_cap;
+        this->chunk.buf_p = this->chunk.buf + offset;
     }
 
-    // now write the entry itself to the buffer.  size then entry itself
-    *((uint32_t *) this->chunk.buf_p) = n;
+    // now write the entry size to the buffer.  the caller packs the entry
+    // itself right after it
+    uint32_t entry_size = n;
+    memcpy(this->chunk.buf_p, &entry_size, sizeof(entry_size));
     this->chunk.buf_p += sizeof(uint32_t);
-    // and then the entry itself (packed)
-    entry->SerializeToArray(this->chunk.buf_p, n);
+    unsigned char *entry_buf = this->chunk.buf_p;
     this->chunk.buf_p += n;
+    // the chunk's directory entry has its first instr, which for a log
+    // that starts mid-replay (-replay-checkpoint) isn't 0. the bogus entry
+    // open_write starts with has none.
+    if (this->chunk.start_instr == (uint64_t) -1) {
+        this->chunk.start_instr = instr;
+    }
     // remember instr for last entry
-    last_instr_entry = entry->instr();
+    last_instr_entry = instr;
     this->chunk.ind_entry ++;
-#endif
+    return entry_buf;
 }
 
-void PandaLog::unmarshall_chunk(uint32_t chunk_num){  
-    printf ("unmarshalling chunk %d\n", chunk_num);
-    PandalogCcChunk *chunk = &(this->chunk);
-    // read compressed chunk data off disk
-    this->file->seekg(this->dir.pos[chunk_num]);
+const unsigned char *PandalogCcReadChunk::packed(uint32_t i, uint32_t *size) const {
+    const unsigned char *p = this->buf.data() + this->offsets[i];
+    memcpy(size, p, sizeof(*size));
+    return p + sizeof(uint32_t);
+}
 
-    unsigned long compressed_size = this->dir.pos[chunk_num+1] - this->dir.pos[chunk_num] + 1;
-     this->file->read((char* ) chunk->zbuf, compressed_size);
-    assert (this->file->gcount() == compressed_size);
-    unsigned long uncompressed_size = chunk->size;
+const panda::LogEntry *PandalogCcReadChunk::entry(uint32_t i){
+    if (this->entries[i] == NULL) {
+        uint32_t size;
+        const unsigned char *p = packed(i, &size);
+        panda::LogEntry *ple = google::protobuf::Arena::CreateMessage<panda::LogEntry>(&this->arena);
+        ple->ParseFromArray(p, size);
+        this->entries[i] = ple;
+    }
+    return this->entries[i];
+}
 
-    // uncompress it
-    printf ("chunk size=%lu compressed=%lu\n", uncompressed_size, compressed_size);
+// Walks the top-level fields of a packed LogEntry without parsing it,
+// calling fn(field number, value) for each. value is only meaningful for
+// varint fields, such as pc, instr and asid.
+template <typename F>
+static void pl_scan_entry(const unsigned char *p, uint32_t size, F fn) {
+    using google::protobuf::internal::WireFormatLite;
+    google::protobuf::io::CodedInputStream in(p, size);
+    uint32_t tag;
+    while ((tag = in.ReadTag()) != 0) {
+        uint32_t field = WireFormatLite::GetTagFieldNumber(tag);
+        uint64_t value = 0;
+        if (WireFormatLite::GetTagWireType(tag) == WireFormatLite::WIRETYPE_VARINT) {
+            if (!in.ReadVarint64(&value)) break;
+        } else if (!WireFormatLite::SkipField(&in, tag)) {
+            break;
+        }
+        fn(field, value);
+    }
+}
+
+// LogEntry field number of asid, or 0 if no plugin defines it
+static uint32_t pl_asid_field() {
+    const google::protobuf::FieldDescriptor *fd =
+        panda::LogEntry::descriptor()->FindFieldByName("asid");
+    return fd ? fd->number() : 0;
+}
 
-    int ret;
+std::shared_ptr<PandalogCcReadChunk> PandaLog::load_chunk(uint32_t chunk_num){
+    // read compressed chunk data off disk
+    unsigned long compressed_size = this->dir.pos[chunk_num+1] - this->dir.pos[chunk_num];
+    std::vector<unsigned char> zbuf(compressed_size);
+    {
+        std::lock_guard<std::mutex> guard(this->file_lock);
+        this->file->seekg(this->dir.pos[chunk_num]);
+        this->file->read((char *) zbuf.data(), compressed_size);
+        assert (this->file->gcount() == compressed_size);
+    }
+
+    // uncompress it
+    std::shared_ptr<PandalogCcReadChunk> chunk = std::make_shared<PandalogCcReadChunk>();
+    unsigned long buf_size = std::max<unsigned long>(this->chunk.size, 1);
+    unsigned long uncompressed_size;
     while (true) {
-        ret = uncompress(chunk->buf, &uncompressed_size, chunk->zbuf, compressed_size);
-
-        printf ("ret = %d\n", ret);
-
-        if (ret == Z_BUF_ERROR) {
-            // need a bigger buffer
-            // make sure we won't int overflow
-            assert (chunk->size < UINT32_MAX/2);
-            chunk->size *= 2;
-            printf ("grew chunk buffer to %d\n", chunk->size);
-            free(chunk->buf);
-            chunk->buf = (unsigned char *)malloc(chunk->size);
-            chunk->buf_p = chunk->buf;
-            uncompressed_size = chunk->size;
-        } else if (ret == Z_OK) {
+        chunk->buf.resize(buf_size);
+        uncompressed_size = buf_size;
+        if (pl_uncompress(this->codec, chunk->buf.data(), &uncompressed_size, zbuf.data(), compressed_size)) {
             break;
+        }
+        // need a bigger buffer
+        // make sure we won't int overflow
+        assert (buf_size < UINT32_MAX/2);
+        buf_size *= 2;
+    }
+    chunk->buf.resize(uncompressed_size);
+
+    // find the entries, but leave parsing them for when they're read
+    uint32_t num_entries = this->dir.num_entries[chunk_num];
+    chunk->offsets.resize(num_entries);
+    chunk->entries.assign(num_entries, NULL);
+    unsigned long offset = 0;
+    for (uint32_t i = 0; i < num_entries; i++) {
+        uint32_t entry_size;
+        assert (offset + sizeof(uint32_t) <= uncompressed_size);
+        chunk->offsets[i] = offset;
+        memcpy(&entry_size, &chunk->buf[offset], sizeof(entry_size));
+        offset += sizeof(uint32_t) + entry_size;
+    }
+    assert (offset <= uncompressed_size);
+    return chunk;
+}
+
+void PandaLog::index_chunk(uint32_t chunk_num, const PandalogCcReadChunk &chunk){
+    PandalogCcChunkIndex &ci = this->index[chunk_num];
+    uint32_t asid_field = pl_asid_field();
+    std::set<uint32_t> fields;
+    std::set<uint64_t> asids;
+
+    ci.pc_min = UINT64_MAX;
+    ci.pc_max = 0;
+    for (uint32_t i = 0; i < chunk.offsets.size(); i++) {
+        uint32_t size;
+        const unsigned char *p = chunk.packed(i, &size);
+        pl_scan_entry(p, size, [&](uint32_t field, uint64_t value) {
+            if (field == panda::LogEntry::kPcFieldNumber) {
+                ci.pc_min = std::min(ci.pc_min, value);
+                ci.pc_max = std::max(ci.pc_max, value);
+            } else if (field == asid_field && asids.size() <= PL_INDEX_MAX_ASIDS) {
+                asids.insert(value);
+            }
+            fields.insert(field);
+        });
+    }
+    ci.fields.assign(fields.begin(), fields.end());
+    ci.any_asid = asids.size() > PL_INDEX_MAX_ASIDS;
+    if (!ci.any_asid) {
+        ci.asids.assign(asids.begin(), asids.end());
+    }
+    ci.built = true;
+}
+
+void PandaLog::decompress_chunks(){
+    std::unique_lock<std::mutex> lock(this->jobs_lock);
+    while (true) {
+        this->jobs_cv.wait(lock, [this]{ return this->stopping || !this->read_jobs.empty(); });
+        if (this->stopping) {
+            return;
+        }
+        uint32_t chunk_num = this->read_jobs.front();
+        this->read_jobs.pop_front();
+        bool indexing = this->indexing;
+        lock.unlock();
+
+        std::shared_ptr<PandalogCcReadChunk> chunk = load_chunk(chunk_num);
+        if (indexing) {
+            index_chunk(chunk_num, *chunk);
+        }
+
+        lock.lock();
+        this->read_queued.erase(chunk_num);
+        this->read_chunks[chunk_num] = chunk;
+        this->jobs_cv.notify_all();
+    }
+}
+
+std::shared_ptr<PandalogCcReadChunk> PandaLog::get_chunk(uint32_t chunk_num,
+                                                         const std::vector<uint32_t> &ahead){
+    std::unique_lock<std::mutex> lock(this->jobs_lock);
+    if (this->workers.empty()) {
+        this->stopping = false;
+        for (int i = 0; i < PL_READ_THREADS; i++) {
+            this->workers.emplace_back(&PandaLog::decompress_chunks, this);
+        }
+    }
+
+    // drop the chunks we're done with
+    for (auto it = this->read_chunks.begin(); it != this->read_chunks.end(); ) {
+        if (it->first != chunk_num &&
+            std::find(ahead.begin(), ahead.end(), it->first) == ahead.end()) {
+            it = this->read_chunks.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    // the chunk we're waiting for goes first
+    if (!this->read_chunks.count(chunk_num) && this->read_queued.insert(chunk_num).second) {
+        this->read_jobs.push_front(chunk_num);
+    }
+    for (uint32_t n : ahead) {
+        if (!this->read_chunks.count(n) && this->read_queued.insert(n).second) {
+            this->read_jobs.push_back(n);
+        }
+    }
+    this->jobs_cv.notify_all();
+
+    this->jobs_cv.wait(lock, [&]{ return this->read_chunks.count(chunk_num) != 0; });
+    return this->read_chunks[chunk_num];
+}
+
+void PandaLog::unmarshall_chunk(uint32_t chunk_num){  
+    printf ("unmarshalling chunk %d\n", chunk_num);
+
+    std::vector<uint32_t> ahead;
+    for (uint32_t i = 1; i <= PL_READ_AHEAD; i++) {
+        if (this->mode == PL_MODE_READ_BWD) {
+            if (chunk_num < i) break;
+            ahead.push_back(chunk_num - i);
         } else {
-            assert(false && "Decompression failed");
+            if (chunk_num + i >= this->dir.num_chunks) break;
+            ahead.push_back(chunk_num + i);
+        }
+    }
+    this->cur_chunk = get_chunk(chunk_num, ahead);
+
+    this->chunk.num_entries = this->dir.num_entries[chunk_num];
+    this->chunk.ind_entry = 0;  // a guess
+}
+
+void PandaLog::build_index(){
+    if (load_index()) {
+        return;
+    }
+
+    this->index.assign(this->dir.num_chunks, PandalogCcChunkIndex());
+    {
+        std::lock_guard<std::mutex> guard(this->jobs_lock);
+        this->indexing = true;
+    }
+    for (uint32_t n = 0; n < this->dir.num_chunks; n++) {
+        std::vector<uint32_t> ahead;
+        for (uint32_t i = n + 1; i < this->dir.num_chunks && i <= n + PL_READ_THREADS * 2; i++) {
+            ahead.push_back(i);
         }
+        std::shared_ptr<PandalogCcReadChunk> chunk = get_chunk(n, ahead);
+        // chunks decompressed before we started indexing
+        if (!this->index[n].built) {
+            index_chunk(n, *chunk);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> guard(this->jobs_lock);
+        this->indexing = false;
+    }
+    save_index();
+}
+
+static bool pl_chunk_may_match(const PandalogCcChunkIndex &ci, const PandalogQuery &q){
+    if (ci.pc_max < q.pc_lo || ci.pc_min > q.pc_hi) {
+        return false;
+    }
+    if (q.field && !std::binary_search(ci.fields.begin(), ci.fields.end(), q.field)) {
+        return false;
     }
+    if (q.has_asid && !ci.any_asid &&
+        !std::binary_search(ci.asids.begin(), ci.asids.end(), q.asid)) {
+        return false;
+    }
+    return true;
+}
 
-    // clear previous chunk's entries 
-    chunk->entries.clear();
+void PandaLog::query(const PandalogQuery &q,
+                     const std::function<void(const panda::LogEntry &)> &fn){
+    uint32_t asid_field = pl_asid_field();
+    if (q.has_asid && asid_field == 0) {
+        // no entry has an asid
+        return;
+    }
 
-    if (chunk->max_num_entries < this->dir.num_entries[chunk_num]) {
-        chunk->max_num_entries = this->dir.num_entries[chunk_num];
+    std::vector<uint32_t> chunks;
+    for (uint32_t n = 0; n < this->dir.num_chunks; n++) {
+        if (this->index.empty() || pl_chunk_may_match(this->index[n], q)) {
+            chunks.push_back(n);
+        }
     }
-    chunk->num_entries = this->dir.num_entries[chunk_num];
 
-    printf("num_entries %u\n", chunk->num_entries);
-    unsigned char *p = chunk->buf;
-    for (int i = 0; i < chunk->num_entries; i++) {
-        assert (p < chunk->buf + chunk->size);
-        uint32_t entry_size = *((uint32_t *) p);
-        p += sizeof(uint32_t);
-        std::unique_ptr<panda::LogEntry> ple (new panda::LogEntry());
-        ple->ParseFromArray(p, entry_size);
-        p += entry_size;
-        chunk->entries.push_back(std::move(ple));
+    for (size_t k = 0; k < chunks.size(); k++) {
+        std::vector<uint32_t> ahead(chunks.begin() + k + 1,
+                                    chunks.begin() + std::min(chunks.size(), k + 1 + PL_READ_AHEAD));
+        std::shared_ptr<PandalogCcReadChunk> chunk = get_chunk(chunks[k], ahead);
+        for (uint32_t i = 0; i < chunk->offsets.size(); i++) {
+            uint32_t size;
+            const unsigned char *p = chunk->packed(i, &size);
+            uint64_t pc = 0;
+            bool field_set = q.field == 0;
+            bool asid_match = !q.has_asid;
+            pl_scan_entry(p, size, [&](uint32_t field, uint64_t value) {
+                if (field == panda::LogEntry::kPcFieldNumber) {
+                    pc = value;
+                } else if (field == asid_field && q.has_asid) {
+                    asid_match = value == q.asid;
+                }
+                field_set |= field == q.field;
+            });
+            if (field_set && asid_match && q.pc_lo <= pc && pc <= q.pc_hi) {
+                fn(*chunk->entry(i));
+            }
+        }
+    }
+}
+
+// <log>.idx holds the number of chunks, the directory position, the size and
+// a hash of the directory of the log it indexes, so that an index left over
+// from another log of the same shape isn't used. Then for each chunk pc_min,
+// pc_max, any_asid, the number of fields, the fields, the number of asids and
+// the asids.
+#define PL_INDEX_MAGIC 0x32494c50   // "PLI2"
+
+// FNV-1a over the chunk start instrs, entry counts and file positions
+static uint64_t pl_dir_hash(const PandalogCcDir &dir) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    auto add = [&h](uint64_t v) {
+        for (int i = 0; i < 8; i++) {
+            h = (h ^ ((v >> (i * 8)) & 0xff)) * 0x100000001b3ULL;
+        }
+    };
+    for (uint32_t i = 0; i < dir.num_chunks; i++) {
+        add(dir.instr[i]);
+        add(dir.num_entries[i]);
+        add(dir.pos[i]);
+    }
+    add(dir.pos[dir.num_chunks]);
+    return h;
+}
+
+static uint64_t pl_file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : 0;
+}
+
+bool PandaLog::load_index(){
+    std::string path = std::string(this->filename) + ".idx";
+    std::ifstream in(path, ios::binary);
+    if (!in) {
+        return false;
+    }
+    uint32_t magic = 0, num_chunks = 0;
+    uint64_t dir_pos = 0, log_size = 0, dir_hash = 0;
+    in.read((char *) &magic, sizeof(magic));
+    in.read((char *) &num_chunks, sizeof(num_chunks));
+    in.read((char *) &dir_pos, sizeof(dir_pos));
+    in.read((char *) &log_size, sizeof(log_size));
+    in.read((char *) &dir_hash, sizeof(dir_hash));
+    if (!in || magic != PL_INDEX_MAGIC || num_chunks != this->dir.num_chunks ||
+        dir_pos != this->dir.pos[this->dir.num_chunks] ||
+        log_size != pl_file_size(this->filename) ||
+        dir_hash != pl_dir_hash(this->dir)) {
+        printf("ignoring pandalog index %s, it's for another log\n", path.c_str());
+        return false;
+    }
+
+    std::vector<PandalogCcChunkIndex> loaded(num_chunks);
+    for (PandalogCcChunkIndex &ci : loaded) {
+        uint32_t any_asid = 0, num_fields = 0, num_asids = 0;
+        in.read((char *) &ci.pc_min, sizeof(ci.pc_min));
+        in.read((char *) &ci.pc_max, sizeof(ci.pc_max));
+        in.read((char *) &any_asid, sizeof(any_asid));
+        in.read((char *) &num_fields, sizeof(num_fields));
+        if (!in) return false;
+        ci.fields.resize(num_fields);
+        in.read((char *) ci.fields.data(), num_fields * sizeof(uint32_t));
+        in.read((char *) &num_asids, sizeof(num_asids));
+        if (!in) return false;
+        ci.asids.resize(num_asids);
+        in.read((char *) ci.asids.data(), num_asids * sizeof(uint64_t));
+        if (!in) return false;
+        ci.any_asid = any_asid;
+        ci.built = true;
+    }
+    this->index = std::move(loaded);
+    printf("loaded pandalog index %s\n", path.c_str());
+    return true;
+}
+
+void PandaLog::save_index(){
+    std::string path = std::string(this->filename) + ".idx";
+    std::ofstream out(path, ios::binary);
+    uint32_t magic = PL_INDEX_MAGIC;
+    uint32_t num_chunks = this->dir.num_chunks;
+    uint64_t dir_pos = this->dir.pos[num_chunks];
+    uint64_t log_size = pl_file_size(this->filename);
+    uint64_t dir_hash = pl_dir_hash(this->dir);
+    out.write((char *) &magic, sizeof(magic));
+    out.write((char *) &num_chunks, sizeof(num_chunks));
+    out.write((char *) &dir_pos, sizeof(dir_pos));
+    out.write((char *) &log_size, sizeof(log_size));
+    out.write((char *) &dir_hash, sizeof(dir_hash));
+    for (const PandalogCcChunkIndex &ci : this->index) {
+        uint32_t any_asid = ci.any_asid;
+        uint32_t num_fields = ci.fields.size();
+        uint32_t num_asids = ci.asids.size();
+        out.write((char *) &ci.pc_min, sizeof(ci.pc_min));
+        out.write((char *) &ci.pc_max, sizeof(ci.pc_max));
+        out.write((char *) &any_asid, sizeof(any_asid));
+        out.write((char *) &num_fields, sizeof(num_fields));
+        out.write((char *) ci.fields.data(), num_fields * sizeof(uint32_t));
+        out.write((char *) &num_asids, sizeof(num_asids));
+        out.write((char *) ci.asids.data(), num_asids * sizeof(uint64_t));
+    }
+    if (!out) {
+        printf("couldn't write pandalog index %s\n", path.c_str());
     }
-    chunk->ind_entry = 0;  // a guess
 }
 
 uint32_t PandaLog::find_ind(uint64_t instr, uint32_t lo_idx, uint32_t high_idx){
@@ -414,22 +957,23 @@ uint32_t PandaLog::find_ind(uint64_t instr, uint32_t lo_idx, uint32_t high_idx){
 
     //First entry of log always has pc = -1 and instr = -1
     // skip it if that's the case
-    PandalogCcChunk *chunk = &(this->chunk);
-    if (chunk->entries[lo_idx]->instr() == -1 && chunk->entries[lo_idx]->pc() == -1){
+    PandalogCcReadChunk *chunk = this->cur_chunk.get();
+    if (chunk->entry(lo_idx)->instr() == -1 && chunk->entry(lo_idx)->pc() == -1){
         lo_idx++;
     }
 
-    if (instr < chunk->entries[lo_idx]->instr()) return lo_idx;
-    if (instr > chunk->entries[high_idx]->instr()) return high_idx;
+    if (instr < chunk->entry(lo_idx)->instr()) return lo_idx;
+    if (instr > chunk->entry(high_idx)->instr()) return high_idx;
 
     uint32_t mid_idx = (lo_idx + high_idx)/2;
-    if (chunk->entries[lo_idx]->instr() <= instr && instr <= chunk->entries[mid_idx]->instr()){
+    if (chunk->entry(lo_idx)->instr() <= instr && instr <= chunk->entry(mid_idx)->instr()){
         return find_ind(instr, lo_idx, mid_idx);
     }
 
-    assert(chunk->entries[mid_idx]->instr() <= instr && instr <= chunk->entries[high_idx]->instr());
+    assert(chunk->entry(mid_idx)->instr() < instr && instr <= chunk->entry(high_idx)->instr());
 
-    return find_ind(instr, mid_idx, high_idx);
+    // the first entry for instr comes after mid
+    return find_ind(instr, mid_idx + 1, high_idx);
 }
 
 uint32_t PandaLog::find_chunk(uint64_t instr, uint32_t lo, uint32_t high){
@@ -439,6 +983,8 @@ uint32_t PandaLog::find_chunk(uint64_t instr, uint32_t lo, uint32_t high){
     if (lo == high) return lo;
     if (instr < this->dir.instr[lo])   return lo;
     if (instr > this->dir.instr[high]) return high;
+    // otherwise lo would be mid_chunk below, forever
+    if (high == lo + 1) return instr < this->dir.instr[high] ? lo : high;
 
     uint32_t mid_chunk = (lo+high)/2;
     // recursive search in lower half
@@ -460,15 +1006,11 @@ void PandaLog::seek(uint64_t instr){
 
     uint32_t ind = find_ind(instr, 0, this->dir.num_entries[chunk_num]-1);
 
-    std::unique_ptr<panda::LogEntry> ple (new panda::LogEntry);
-    ple->CopyFrom(*this->chunk.entries[ind]);
-
     if(this->mode == PL_MODE_READ_BWD && instr != -1){
         //search forward for last index with this instr number
 
         for (uint32_t i = ind; i < this->dir.num_entries[chunk_num]; i++){
-            ple->CopyFrom(*this->chunk.entries[i]);
-            if (ple->instr() != instr){
+            if (this->cur_chunk->entry(i)->instr() != instr){
                 // we've gone past the last entry with that instr num
                 // backtrack by one and return
                 ind --;
@@ -507,6 +1049,23 @@ void pandalog_cc_close(){
     globalLog.close();
 }
 
+void pandalog_cc_quiesce(){
+    globalLog.quiesce();
+}
+
+bool pandalog_cc_set_codec(const char *name){
+    for (int i = 0; i < PL_CODEC_LAST; i++) {
+        if (0 == strcmp(name, pl_codec_names[i])) {
+            return globalLog.set_codec((PlCodec) i);
+        }
+    }
+    return false;
+}
+
+
+unsigned char *pandalog_cc_reserve(size_t entry_size, uint64_t instr){
+    return globalLog.reserve_entry(entry_size, instr);
+}
 
 // Unpack entry from buffer into C++ protobuf object
 // and write it to the log
@@ -522,16 +1081,16 @@ void pandalog_write_packed(size_t entry_size, unsigned char* buf){
 // return packed data
 unsigned char* pandalog_read_packed(void){
     
-    std::unique_ptr<panda::LogEntry> ple = globalLog.read_entry();
-    if (!ple){
+    // the entry is handed over as it was packed, without a parse
+    uint32_t n;
+    const unsigned char *packed = globalLog.read_entry_packed(&n);
+    if (!packed){
         return NULL;
     }
-    size_t n = ple->ByteSize();
     unsigned char* buf = (unsigned char *) malloc(n + sizeof(size_t));
 
     *((size_t*) buf) = n;
-    
-    ple->SerializeToArray((unsigned char*)(buf + sizeof(size_t)), n);
+    memcpy(buf + sizeof(size_t), packed, n);
 
     return buf;
 }
@@ -5,13 +5,15 @@
   ---------------------
   Bytes 0 .. PL_HEADER_SIZE-1
 
-  Currently, the header consists of just three ints
+  Currently, the header consists of just four ints
 
   u32 version      (a version number)
   u64 dir_pos     (file position of directory)
   u32 chunk_size  (size of an uncompressed chunk for this log)
+  u32 codec       (PlCodec used for every chunk; version 3 and later,
+                   older logs are zlib)
 
-  That's just 16 bytes.  Header is currently 128 so lots of room
+  That's 24 bytes with padding.  Header is currently 128 so lots of room
 
 
   Section 2: The chunks
@@ -24,7 +26,9 @@
   compress that chunk of pandalog and write it to the file, keeping
   track in an array the file position of the start of each chunk.  The
   next compressed chunk data will go right after the previous
-  compressed chunk data.
+  compressed chunk data.  Chunks are compressed on worker threads but
+  always written in order.  An lz4 chunk starts with a u32 holding its
+  uncompressed size, since lz4 blocks don't record it.
 
   CHUNKS section is just a sequence of compressed chunk data, varying
   in length.  Only way to tell where one compressed chunk starts and
@@ -68,6 +72,7 @@
 
 // Externed functions that are wrappers around the C++ pandalog functions
 extern void pandalog_write_packed(size_t entry_size, unsigned char* buf);
+extern unsigned char *pandalog_cc_reserve(size_t entry_size, uint64_t instr);
 extern unsigned char* pandalog_read_packed(void);
 extern void pandalog_cc_init_read(const char* path);
 extern void pandalog_cc_init_write(const char* path);
@@ -78,15 +83,27 @@ extern void pandalog_cc_close(void);
 void pandalog_open_read(const char *path, uint32_t pl_mode);
 
 
+#ifndef PLOG_READER
+extern int panda_in_main_loop;
+#endif
+
 void pandalog_write_entry(Panda__LogEntry *entry) {
-	// Pack this entry and pass it on to a C++ interface
-		
-	size_t packed_size = panda__log_entry__get_packed_size(entry);
-	unsigned char* buf = malloc(packed_size);
-	panda__log_entry__pack(entry, buf);
-
-	pandalog_write_packed(packed_size, buf);
-  free(buf);
+    // Fill in pc and instr as PandaLog::write_entry does, then pack the
+    // entry straight into the current chunk. Going through
+    // pandalog_write_packed would parse it into a C++ LogEntry and
+    // serialize it again.
+#ifndef PLOG_READER
+    if (panda_in_main_loop) {
+        entry->pc = panda_current_pc(first_cpu);
+        entry->instr = rr_get_guest_instr_count();
+    } else {
+        entry->pc = -1;
+        entry->instr = -1;
+    }
+#endif
+
+    size_t packed_size = panda__log_entry__get_packed_size(entry);
+    panda__log_entry__pack(entry, pandalog_cc_reserve(packed_size, entry->instr));
 }
 
 void pandalog_open_read(const char *path, uint32_t pl_mode) {
@@ -57,6 +57,9 @@
 #include "panda/callbacks/cb-support.h"
 #include "exec/gdbstub.h"
 #include "sysemu/cpus.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "panda/checkpoint.h"
 
 /******************************************************************************************/
 /* GLOBALS */
@@ -81,6 +84,15 @@ RR_log* rr_nondet_log = NULL;
 
 bool rr_replay_complete = false;
 
+// -replay-checkpoint: start replay from the latest saved checkpoint at or
+// before this instruction count (0 to start from the beginning)
+uint64_t rr_replay_checkpoint_instr = 0;
+// -replay-start-at: fast-forward with plugins off until this instruction
+// count, starting from the nearest saved checkpoint if there is one
+uint64_t rr_replay_start_instr = 0;
+// -replay-end-at: end replay once this many instructions have run (0: never)
+uint64_t rr_replay_end_instr = 0;
+
 // our own assertion mechanism
 #define rr_assert(exp)                                                         \
     if (!(exp)) {                                                              \
@@ -118,9 +130,14 @@ RR_log_entry* rr_get_queue_head(void) { return rr_queue_head; }
 // Check if replay is really finished. Conditions:
 // 1) The log is empty
 // 2) The only thing in the queue is RR_END_OF_LOG
+// Or: we've reached -replay-end-at
 uint8_t rr_replay_finished(void)
 {
     assert(!rr_queue_empty()); // If queue is empty early, replay is corrupt?
+    if (rr_replay_end_instr &&
+        rr_get_guest_instr_count() >= rr_replay_end_instr) {
+        return 1;
+    }
     return rr_log_is_empty()
         && rr_queue_head->header.kind == RR_END_OF_LOG
         && rr_get_guest_instr_count() >=
@@ -255,24 +272,42 @@ static inline void rr_assert_fail(const char* exp, const char* file, int line,
 /* RECORD */
 /******************************************************************************************/
 
-static inline size_t rr_fwrite(void *ptr, size_t size, size_t nmemb) {
-    size_t result = fwrite(ptr, size, nmemb, rr_nondet_log->fp);
-    rr_assert(result == nmemb);
-    return result;
+static inline void rr_fwrite(void *ptr, size_t size, size_t nmemb) {
+    rr_assert(rr_log_stream_write(rr_nondet_log->stream, ptr, size * nmemb));
+}
+
+// The fixed-size part of an entry is put together here and handed to the
+// log in one write; only variable-length payloads are written separately.
+// Every field put is a distinct member of the RR_log_entry, so they all fit.
+typedef struct {
+    uint8_t buf[sizeof(RR_log_entry)];
+    size_t len;
+} RR_entry_buf;
+
+static inline void rr_entry_put(RR_entry_buf *eb, const void *ptr,
+                                size_t len) {
+    memcpy(eb->buf + eb->len, ptr, len);
+    eb->len += len;
 }
 
 // mz write the current log item to file
 static inline void rr_write_item(RR_log_entry item)
 {
+    RR_entry_buf eb = { .len = 0 };
+    const void *payload = NULL;
+    size_t payload_len = 0;
+
     // mz save the header
     if (!rr_in_record()) return;
     rr_assert(rr_nondet_log != NULL);
+    rr_assert(rr_log_stream_begin_entry(rr_nondet_log->stream,
+                item.header.prog_point.guest_instr_count));
 
-#define RR_WRITE_ITEM(field) rr_fwrite(&(field), sizeof(field), 1)
+#define RR_WRITE_ITEM(field) rr_entry_put(&eb, &(field), sizeof(field))
     // keep replay format the same.
     RR_WRITE_ITEM(item.header.prog_point.guest_instr_count);
-    rr_fwrite(&(item.header.kind), 1, 1);
-    rr_fwrite(&(item.header.callsite_loc), 1, 1);
+    rr_entry_put(&eb, &(item.header.kind), 1);
+    rr_entry_put(&eb, &(item.header.callsite_loc), 1);
 
     // mz also save the program point in the log structure to ensure that our
     // header will include the latest program point.
@@ -305,27 +340,27 @@ static inline void rr_write_item(RR_log_entry item)
             break;
         case RR_SKIPPED_CALL: {
             RR_skipped_call_args* args = &item.variant.call_args;
-            rr_fwrite(&(args->kind), 1, 1);
+            rr_entry_put(&eb, &(args->kind), 1);
             switch (args->kind) {
                 case RR_CALL_CPU_MEM_RW:
                     RR_WRITE_ITEM(args->variant.cpu_mem_rw_args);
-                    rr_fwrite(args->variant.cpu_mem_rw_args.buf, 1,
-                            args->variant.cpu_mem_rw_args.len);
+                    payload = args->variant.cpu_mem_rw_args.buf;
+                    payload_len = args->variant.cpu_mem_rw_args.len;
                     break;
                 case RR_CALL_CPU_MEM_UNMAP:
                     RR_WRITE_ITEM(args->variant.cpu_mem_unmap);
-                    rr_fwrite(args->variant.cpu_mem_unmap.buf, 1,
-                                args->variant.cpu_mem_unmap.len);
+                    payload = args->variant.cpu_mem_unmap.buf;
+                    payload_len = args->variant.cpu_mem_unmap.len;
                     break;
                 case RR_CALL_CPU_REG_WRITE:
                     RR_WRITE_ITEM(args->variant.cpu_reg_write_args);
-                    rr_fwrite(args->variant.cpu_reg_write_args.buf, 1,
-                                args->variant.cpu_reg_write_args.len);
+                    payload = args->variant.cpu_reg_write_args.buf;
+                    payload_len = args->variant.cpu_reg_write_args.len;
                     break;
                 case RR_CALL_MEM_REGION_CHANGE:
                     RR_WRITE_ITEM(args->variant.mem_region_change_args);
-                    rr_fwrite(args->variant.mem_region_change_args.name, 1,
-                            args->variant.mem_region_change_args.len);
+                    payload = args->variant.mem_region_change_args.name;
+                    payload_len = args->variant.mem_region_change_args.len;
                     break;
                 case RR_CALL_HD_TRANSFER:
                     RR_WRITE_ITEM(args->variant.hd_transfer_args);
@@ -335,8 +370,8 @@ static inline void rr_write_item(RR_log_entry item)
                     break;
                 case RR_CALL_HANDLE_PACKET:
                     RR_WRITE_ITEM(args->variant.handle_packet_args);
-                    rr_fwrite(args->variant.handle_packet_args.buf,
-                            args->variant.handle_packet_args.size, 1);
+                    payload = args->variant.handle_packet_args.buf;
+                    payload_len = args->variant.handle_packet_args.size;
                     break;
                 case RR_CALL_SERIAL_RECEIVE:
                     RR_WRITE_ITEM(args->variant.serial_receive_args);
@@ -362,6 +397,12 @@ static inline void rr_write_item(RR_log_entry item)
             // mz unimplemented
             rr_assert(0 && "Unimplemented replay log entry!");
     }
+#undef RR_WRITE_ITEM
+
+    rr_fwrite(eb.buf, eb.len, 1);
+    if (payload_len) {
+        rr_fwrite((void *)payload, payload_len, 1);
+    }
 }
 
 static inline RR_header rr_header(RR_log_entry_kind kind,
@@ -536,18 +577,144 @@ static inline uint32_t rr_chunked_crc32(void *ptr, size_t len) {
     return crc;
 }
 
-extern QLIST_HEAD(rr_map_list, RR_MapList) rr_map_list;
+// A region mapped with address_space_map while recording. Its contents are
+// hashed in RR_MAP_SEGMENT sized pieces, and the pieces whose hash changes
+// are recorded as device writes. Writes through the mapping bypass the
+// dirty memory bitmaps until it's unmapped, so those can't tell us.
+#define RR_MAP_SEGMENT 4096
+
+typedef struct RR_MapList {
+    void *ptr;
+    hwaddr addr;
+    hwaddr len;
+    unsigned refs;          // it can be mapped more than once
+    uint64_t *hashes;       // one per segment
+} RR_MapList;
+
+// RR_MapList by ptr and len
+static GHashTable *rr_map_table;
+
+static guint rr_map_hash(gconstpointer key) {
+    const RR_MapList *region = key;
+    return g_direct_hash(region->ptr) ^ (guint)region->len;
+}
+
+static gboolean rr_map_equal(gconstpointer a, gconstpointer b) {
+    const RR_MapList *ra = a, *rb = b;
+    return ra->ptr == rb->ptr && ra->len == rb->len;
+}
+
+static void rr_map_free(gpointer data) {
+    RR_MapList *region = data;
+    g_free(region->hashes);
+    g_free(region);
+}
+
+static uint64_t rr_segment_hash(const uint8_t *p, size_t len) {
+    uint64_t h0 = 1, h1 = 2, h2 = 3, h3 = len;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        h0 = rol64(h0 ^ ldq_he_p(p + i), 29) * 0x9e3779b97f4a7c15ULL;
+        h1 = rol64(h1 ^ ldq_he_p(p + i + 8), 29) * 0x9e3779b97f4a7c15ULL;
+        h2 = rol64(h2 ^ ldq_he_p(p + i + 16), 29) * 0x9e3779b97f4a7c15ULL;
+        h3 = rol64(h3 ^ ldq_he_p(p + i + 24), 29) * 0x9e3779b97f4a7c15ULL;
+    }
+    for (; i < len; i++) {
+        h0 = rol64(h0 ^ p[i], 29) * 0x9e3779b97f4a7c15ULL;
+    }
+    return h0 ^ rol64(h1, 16) ^ rol64(h2, 32) ^ rol64(h3, 48);
+}
+
+static inline size_t rr_map_segments(RR_MapList *region) {
+    return DIV_ROUND_UP(region->len, RR_MAP_SEGMENT);
+}
+
+static inline size_t rr_map_segment_len(RR_MapList *region, size_t i) {
+    return MIN(RR_MAP_SEGMENT, region->len - i * RR_MAP_SEGMENT);
+}
+
+void rr_tracked_mem_region_map(hwaddr addr, void *ptr, hwaddr len) {
+    RR_MapList key = { .ptr = ptr, .len = len };
+    RR_MapList *region;
+
+    if (!rr_map_table) {
+        rr_map_table = g_hash_table_new_full(rr_map_hash, rr_map_equal,
+                                             NULL, rr_map_free);
+    }
+    region = g_hash_table_lookup(rr_map_table, &key);
+    if (region) {
+        region->refs++;
+        return;
+    }
+
+    region = g_new(RR_MapList, 1);
+    region->addr = addr;
+    region->len = len;
+    region->ptr = ptr;
+    region->refs = 1;
+    region->hashes = g_new(uint64_t, rr_map_segments(region));
+    for (size_t i = 0; i < rr_map_segments(region); i++) {
+        region->hashes[i] = rr_segment_hash(region->ptr + i * RR_MAP_SEGMENT,
+                                            rr_map_segment_len(region, i));
+    }
+    g_hash_table_add(rr_map_table, region);
+}
+
+void rr_tracked_mem_region_unmap(void *ptr, hwaddr len) {
+    RR_MapList key = { .ptr = ptr, .len = len };
+    RR_MapList *region;
+
+    // mapped before recording began
+    if (!rr_map_table ||
+        !(region = g_hash_table_lookup(rr_map_table, &key))) {
+        return;
+    }
+    if (--region->refs == 0) {
+        g_hash_table_remove(rr_map_table, region);
+    }
+}
+
+void rr_tracked_mem_regions_clear(void) {
+    if (rr_map_table) {
+        g_hash_table_remove_all(rr_map_table);
+    }
+}
 
 void rr_tracked_mem_regions_record(void) {
+    GHashTableIter iter;
     RR_MapList *region;
-    QLIST_FOREACH(region, &rr_map_list, link) {
-        uint32_t crc = rr_chunked_crc32(region->ptr, region->len);
-        if (crc != region->crc) {
-            // Pretend this is just a mem_rw call
-            rr_device_mem_rw_call_record(region->addr, region->ptr, region->len, 1);
+
+    if (!rr_map_table) {
+        return;
+    }
+    g_hash_table_iter_init(&iter, rr_map_table);
+    while (g_hash_table_iter_next(&iter, (gpointer *)&region, NULL)) {
+        // changed segments next to each other go in one record
+        size_t first_changed = 0, changed = 0;
+        for (size_t i = 0; i <= rr_map_segments(region); i++) {
+            if (i < rr_map_segments(region)) {
+                uint64_t hash = rr_segment_hash(
+                    region->ptr + i * RR_MAP_SEGMENT,
+                    rr_map_segment_len(region, i));
+                if (hash != region->hashes[i]) {
+                    // Update it so we don't keep recording it
+                    region->hashes[i] = hash;
+                    if (changed++ == 0) {
+                        first_changed = i;
+                    }
+                    continue;
+                }
+            }
+            if (changed) {
+                hwaddr off = first_changed * RR_MAP_SEGMENT;
+                hwaddr len = MIN(changed * RR_MAP_SEGMENT, region->len - off);
+                // Pretend this is just a mem_rw call
+                rr_device_mem_rw_call_record(region->addr + off,
+                                             region->ptr + off, len, 1);
+                changed = 0;
+            }
         }
-        // Update it so we don't keep recording it
-        region->crc = crc;
     }
 }
 
@@ -656,6 +823,58 @@ static inline void rr_record_end_of_log(void) {
 /* REPLAY */
 /******************************************************************************************/
 
+// The replay log is read and parsed ahead of the CPU thread by a reader
+// thread, which hands finished entries over through a single-producer,
+// single-consumer ring. Skipped-call payloads are carved out of a byte arena
+// that the CPU thread gives back, in log order, as entries are consumed; the
+// reader falls back to g_malloc when the arena is full so that it never has
+// to wait on the CPU thread for anything but a free ring slot.
+#define RR_PREFETCH_RING_LEN 4096
+#define RR_PREFETCH_ARENA_SIZE (32 * 1024 * 1024)
+#define RR_PREFETCH_ARENA_MAX_ALLOC (RR_PREFETCH_ARENA_SIZE / 8)
+
+typedef struct {
+    RR_log_entry entry;
+    uint64_t end_pos;   // log offset just past this entry
+} RR_prefetch_slot;
+
+typedef struct {
+    QemuThread thread;
+    QemuMutex lock;
+    QemuCond cond;
+    bool running;
+
+    // reader-side log position; the log itself is rr_nondet_log->stream
+    uint64_t read_pos;
+
+    // head is advanced by the consumer, tail by the reader
+    RR_prefetch_slot ring[RR_PREFETCH_RING_LEN];
+    size_t ring_head;
+    size_t ring_tail;
+
+    uint8_t *arena;
+    size_t arena_alloc_pos;     // reader
+    size_t arena_release_pos;   // consumer
+
+    int stop;
+    int eof;
+    int consumer_waiting;
+    int producer_waiting;
+} RR_prefetch;
+
+static RR_prefetch rr_prefetch;
+
+static inline bool rr_prefetch_owns(void *buf) {
+    return rr_prefetch.arena && (uint8_t *)buf >= rr_prefetch.arena &&
+        (uint8_t *)buf < rr_prefetch.arena + RR_PREFETCH_ARENA_SIZE;
+}
+
+static inline void rr_free_payload(void *buf) {
+    if (!rr_prefetch_owns(buf)) {
+        g_free(buf);
+    }
+}
+
 static inline void free_entry_params(RR_log_entry* entry)
 {
     // mz cleanup associated resources
@@ -663,19 +882,19 @@ static inline void free_entry_params(RR_log_entry* entry)
     case RR_SKIPPED_CALL:
         switch (entry->variant.call_args.kind) {
         case RR_CALL_CPU_MEM_RW:
-            g_free(entry->variant.call_args.variant.cpu_mem_rw_args.buf);
+            rr_free_payload(entry->variant.call_args.variant.cpu_mem_rw_args.buf);
             entry->variant.call_args.variant.cpu_mem_rw_args.buf = NULL;
             break;
         case RR_CALL_CPU_MEM_UNMAP:
-            g_free(entry->variant.call_args.variant.cpu_mem_unmap.buf);
+            rr_free_payload(entry->variant.call_args.variant.cpu_mem_unmap.buf);
             entry->variant.call_args.variant.cpu_mem_unmap.buf = NULL;
             break;
         case RR_CALL_CPU_REG_WRITE:
-            g_free(entry->variant.call_args.variant.cpu_reg_write_args.buf);
+            rr_free_payload(entry->variant.call_args.variant.cpu_reg_write_args.buf);
             entry->variant.call_args.variant.cpu_reg_write_args.buf = NULL;
             break;
         case RR_CALL_HANDLE_PACKET:
-            g_free(entry->variant.call_args.variant.handle_packet_args.buf);
+            rr_free_payload(entry->variant.call_args.variant.handle_packet_args.buf);
             entry->variant.call_args.variant.handle_packet_args.buf = NULL;
             break;
         default: break;
@@ -689,13 +908,11 @@ static inline void free_entry_params(RR_log_entry* entry)
     default:
         break;
     }
-}
-
-static inline size_t rr_fread(void *ptr, size_t size, size_t nmemb) {
-    size_t result = fread(ptr, size, nmemb, rr_nondet_log->fp);
-    rr_nondet_log->bytes_read += nmemb * size;
-    rr_assert(result == nmemb);
-    return result;
+    // entries are consumed in log order, so arena space comes back in order
+    if (entry->arena_pos) {
+        atomic_mb_set(&rr_prefetch.arena_release_pos, entry->arena_pos);
+        entry->arena_pos = 0;
+    }
 }
 
 static inline int rr_queue_size(void) {
@@ -744,22 +961,51 @@ static inline void rr_queue_pop_front(void) {
     }
 }
 
-// Add an entry to the back of the queue.
-// Returns pointer to item just read.
-static RR_log_entry *rr_read_item(void) {
-    RR_log_entry *item = rr_queue_alloc_back();
+/******************************************************************************************/
+/* PREFETCH */
+/******************************************************************************************/
 
-    rr_assert(rr_in_replay());
-    rr_assert(!rr_log_is_empty());
-    rr_assert(rr_nondet_log->fp != NULL);
+// Runs on the reader thread, which also does the decompression for v2
+// logs. This cannot use rr_assert, which pokes at CPU-thread state.
+static inline void rr_prefetch_fread(RR_prefetch *pf, void *ptr, size_t size,
+                                     size_t nmemb) {
+    if (!rr_log_stream_read(rr_nondet_log->stream, ptr, size * nmemb)) {
+        fprintf(stderr, "RR: short read from nondet log at offset %" PRIu64
+                "\n", pf->read_pos);
+        abort();
+    }
+    pf->read_pos += nmemb * size;
+}
 
-    item->header.file_pos = rr_nondet_log->bytes_read;
+// Allocate a payload buffer, from the arena if it has room.
+static void *rr_prefetch_alloc(RR_prefetch *pf, RR_log_entry *item, size_t len) {
+    if (len == 0 || len > RR_PREFETCH_ARENA_MAX_ALLOC) {
+        return g_malloc(len);
+    }
+    size_t pos = pf->arena_alloc_pos;
+    size_t off = pos % RR_PREFETCH_ARENA_SIZE;
+    if (off + len > RR_PREFETCH_ARENA_SIZE) {
+        // don't straddle the end; skip to the start of the arena
+        pos += RR_PREFETCH_ARENA_SIZE - off;
+        off = 0;
+    }
+    if (pos + len - atomic_mb_read(&pf->arena_release_pos) >
+            RR_PREFETCH_ARENA_SIZE) {
+        return g_malloc(len);
+    }
+    pf->arena_alloc_pos = pos + len;
+    item->arena_pos = pos + len;
+    return pf->arena + off;
+}
 
-#define RR_READ_ITEM(field) rr_fread(&(field), sizeof(field), 1)
+static void rr_prefetch_parse(RR_prefetch *pf, RR_log_entry *item) {
+    item->header.file_pos = pf->read_pos;
+
+#define RR_READ_ITEM(field) rr_prefetch_fread(pf, &(field), sizeof(field), 1)
     // mz read header
     RR_READ_ITEM(item->header.prog_point.guest_instr_count);
-    rr_fread(&(item->header.kind), 1, 1);
-    rr_fread(&(item->header.callsite_loc), 1, 1);
+    rr_prefetch_fread(pf, &(item->header.kind), 1, 1);
+    rr_prefetch_fread(pf, &(item->header.callsite_loc), 1, 1);
 
     // mz read the rest of the item
     switch (item->header.kind) {
@@ -789,36 +1035,36 @@ static RR_log_entry *rr_read_item(void) {
             break;
         case RR_SKIPPED_CALL: {
             RR_skipped_call_args* args = &item->variant.call_args;
-            rr_fread(&(args->kind), 1, 1);
+            rr_prefetch_fread(pf, &(args->kind), 1, 1);
             switch (args->kind) {
                 case RR_CALL_CPU_MEM_RW:
                     RR_READ_ITEM(args->variant.cpu_mem_rw_args);
                     // mz buffer length in args->variant.cpu_mem_rw_args.len
-                    args->variant.cpu_mem_rw_args.buf =
-                        g_malloc(args->variant.cpu_mem_rw_args.len);
+                    args->variant.cpu_mem_rw_args.buf = rr_prefetch_alloc(pf,
+                        item, args->variant.cpu_mem_rw_args.len);
                     // mz read the buffer
-                    rr_fread(args->variant.cpu_mem_rw_args.buf, 1,
+                    rr_prefetch_fread(pf, args->variant.cpu_mem_rw_args.buf, 1,
                             args->variant.cpu_mem_rw_args.len);
                     break;
                 case RR_CALL_CPU_MEM_UNMAP:
                     RR_READ_ITEM(args->variant.cpu_mem_unmap);
-                    args->variant.cpu_mem_unmap.buf =
-                        g_malloc(args->variant.cpu_mem_unmap.len);
-                    rr_fread(args->variant.cpu_mem_unmap.buf, 1,
+                    args->variant.cpu_mem_unmap.buf = rr_prefetch_alloc(pf,
+                        item, args->variant.cpu_mem_unmap.len);
+                    rr_prefetch_fread(pf, args->variant.cpu_mem_unmap.buf, 1,
                                 args->variant.cpu_mem_unmap.len);
                     break;
                 case RR_CALL_CPU_REG_WRITE:
                     RR_READ_ITEM(args->variant.cpu_reg_write_args);
-                    args->variant.cpu_reg_write_args.buf =
-                        g_malloc(args->variant.cpu_reg_write_args.len);
-                    rr_fread(args->variant.cpu_reg_write_args.buf, 1,
+                    args->variant.cpu_reg_write_args.buf = rr_prefetch_alloc(pf,
+                        item, args->variant.cpu_reg_write_args.len);
+                    rr_prefetch_fread(pf, args->variant.cpu_reg_write_args.buf, 1,
                                 args->variant.cpu_reg_write_args.len);
                     break;
                 case RR_CALL_MEM_REGION_CHANGE:
                     RR_READ_ITEM(args->variant.mem_region_change_args);
                     args->variant.mem_region_change_args.name =
                         g_malloc0(args->variant.mem_region_change_args.len + 1);
-                    rr_fread(args->variant.mem_region_change_args.name, 1,
+                    rr_prefetch_fread(pf, args->variant.mem_region_change_args.name, 1,
                             args->variant.mem_region_change_args.len);
                     break;
                 case RR_CALL_HD_TRANSFER:
@@ -834,12 +1080,12 @@ static RR_log_entry *rr_read_item(void) {
                     // mz XXX HACK
                     args->buf_addr_rec = (uint64_t)args->variant.handle_packet_args.buf;
                     // mz buffer length in args->variant.cpu_mem_rw_args.len
-                    // mz always allocate a new one. we free it when the item is added
-                    // to the recycle list
-                    args->variant.handle_packet_args.buf =
-                        g_malloc(args->variant.handle_packet_args.size);
+                    // mz always allocate a new one. we free it when the item is
+                    // popped off the queue
+                    args->variant.handle_packet_args.buf = rr_prefetch_alloc(pf,
+                        item, args->variant.handle_packet_args.size);
                     // mz read the buffer
-                    rr_fread(args->variant.handle_packet_args.buf,
+                    rr_prefetch_fread(pf, args->variant.handle_packet_args.buf,
                             args->variant.handle_packet_args.size, 1);
                     break;
                 case RR_CALL_SERIAL_RECEIVE:
@@ -856,7 +1102,10 @@ static RR_log_entry *rr_read_item(void) {
                     break;
                 default:
                     // mz unimplemented
-                    rr_assert(0 && "Unimplemented skipped call!");
+                    fprintf(stderr, "RR: unimplemented skipped call %d at "
+                            "offset %" PRIu64 "\n", args->kind,
+                            item->header.file_pos);
+                    abort();
             }
         } break;
         case RR_END_OF_LOG:
@@ -864,9 +1113,134 @@ static RR_log_entry *rr_read_item(void) {
             break;
         default:
             // mz unimplemented
-            rr_assert(0 && "Unimplemented replay log entry!");
+            fprintf(stderr, "RR: unimplemented replay log entry %d at offset %"
+                    PRIu64 "\n", item->header.kind, item->header.file_pos);
+            abort();
+    }
+#undef RR_READ_ITEM
+}
+
+// Wake the other side if it has gone to sleep on pf->cond. The waiter sets
+// its flag before re-checking the ring, and we publish before checking the
+// flag, so one of us always sees the other.
+static inline void rr_prefetch_wake(RR_prefetch *pf, int *waiting) {
+    if (atomic_mb_read(waiting)) {
+        qemu_mutex_lock(&pf->lock);
+        qemu_cond_broadcast(&pf->cond);
+        qemu_mutex_unlock(&pf->lock);
+    }
+}
+
+static inline bool rr_prefetch_ring_full(RR_prefetch *pf) {
+    return pf->ring_tail - atomic_mb_read(&pf->ring_head) == RR_PREFETCH_RING_LEN;
+}
+
+static inline bool rr_prefetch_ring_empty(RR_prefetch *pf) {
+    return atomic_mb_read(&pf->ring_tail) == pf->ring_head;
+}
+
+static void *rr_prefetch_thread(void *opaque) {
+    RR_prefetch *pf = opaque;
+
+    while (!atomic_mb_read(&pf->stop) && pf->read_pos < rr_nondet_log->size) {
+        if (rr_prefetch_ring_full(pf)) {
+            qemu_mutex_lock(&pf->lock);
+            atomic_mb_set(&pf->producer_waiting, 1);
+            while (rr_prefetch_ring_full(pf) && !atomic_mb_read(&pf->stop)) {
+                qemu_cond_wait(&pf->cond, &pf->lock);
+            }
+            atomic_mb_set(&pf->producer_waiting, 0);
+            qemu_mutex_unlock(&pf->lock);
+            continue;
+        }
+
+        RR_prefetch_slot *slot = &pf->ring[pf->ring_tail % RR_PREFETCH_RING_LEN];
+        memset(&slot->entry, 0, sizeof(slot->entry));
+        rr_prefetch_parse(pf, &slot->entry);
+        slot->end_pos = pf->read_pos;
+
+        atomic_mb_set(&pf->ring_tail, pf->ring_tail + 1);
+        rr_prefetch_wake(pf, &pf->consumer_waiting);
+    }
+
+    qemu_mutex_lock(&pf->lock);
+    atomic_mb_set(&pf->eof, 1);
+    qemu_cond_broadcast(&pf->cond);
+    qemu_mutex_unlock(&pf->lock);
+    return NULL;
+}
+
+// Start reading ahead from the current position of rr_nondet_log.
+static void rr_prefetch_start(void) {
+    RR_prefetch *pf = &rr_prefetch;
+    rr_assert(!pf->running);
+
+    if (!pf->arena) {
+        pf->arena = g_malloc(RR_PREFETCH_ARENA_SIZE);
+    }
+    pf->read_pos = rr_nondet_log->bytes_read;
+    pf->ring_head = pf->ring_tail = 0;
+    pf->arena_alloc_pos = pf->arena_release_pos = 0;
+    pf->stop = pf->eof = 0;
+    pf->consumer_waiting = pf->producer_waiting = 0;
+
+    qemu_mutex_init(&pf->lock);
+    qemu_cond_init(&pf->cond);
+    qemu_thread_create(&pf->thread, "rr_prefetch", rr_prefetch_thread, pf,
+                       QEMU_THREAD_JOINABLE);
+    pf->running = true;
+}
+
+// Stop the reader and throw away whatever it had parsed ahead. The file
+// position of rr_nondet_log is left wherever the reader got to.
+static void rr_prefetch_stop(void) {
+    RR_prefetch *pf = &rr_prefetch;
+    if (!pf->running) return;
+
+    qemu_mutex_lock(&pf->lock);
+    atomic_mb_set(&pf->stop, 1);
+    qemu_cond_broadcast(&pf->cond);
+    qemu_mutex_unlock(&pf->lock);
+    qemu_thread_join(&pf->thread);
+
+    while (pf->ring_head != pf->ring_tail) {
+        free_entry_params(&pf->ring[pf->ring_head % RR_PREFETCH_RING_LEN].entry);
+        pf->ring_head++;
+    }
+    qemu_cond_destroy(&pf->cond);
+    qemu_mutex_destroy(&pf->lock);
+    pf->running = false;
+}
+
+// Add an entry to the back of the queue.
+// Returns pointer to item just read.
+static RR_log_entry *rr_read_item(void) {
+    RR_prefetch *pf = &rr_prefetch;
+
+    rr_assert(rr_in_replay());
+    rr_assert(!rr_log_is_empty());
+    rr_assert(pf->running);
+
+    if (rr_prefetch_ring_empty(pf)) {
+        qemu_mutex_lock(&pf->lock);
+        atomic_mb_set(&pf->consumer_waiting, 1);
+        while (rr_prefetch_ring_empty(pf) && !atomic_mb_read(&pf->eof)) {
+            qemu_cond_wait(&pf->cond, &pf->lock);
+        }
+        atomic_mb_set(&pf->consumer_waiting, 0);
+        qemu_mutex_unlock(&pf->lock);
+        // the log isn't empty, so the reader must have produced something
+        rr_assert(!rr_prefetch_ring_empty(pf));
     }
 
+    RR_prefetch_slot *slot = &pf->ring[pf->ring_head % RR_PREFETCH_RING_LEN];
+    RR_log_entry *item = rr_queue_alloc_back();
+    *item = slot->entry;
+    rr_nondet_log->bytes_read = slot->end_pos;
+
+    atomic_mb_set(&pf->ring_head, pf->ring_head + 1);
+    rr_prefetch_wake(pf, &pf->producer_waiting);
+
     // mz let's do some counting
     rr_size_of_log_entries[item->header.kind] +=
         rr_nondet_log->bytes_read - item->header.file_pos;
@@ -875,6 +1249,18 @@ static RR_log_entry *rr_read_item(void) {
     return item;
 }
 
+void rr_nondet_log_seek(uint64_t file_pos) {
+    rr_assert(rr_nondet_log && rr_nondet_log->type == REPLAY);
+
+    rr_prefetch_stop();
+    while (!rr_queue_empty()) {
+        rr_queue_pop_front();
+    }
+    rr_nondet_log->bytes_read = file_pos;
+    rr_assert(rr_log_stream_seek(rr_nondet_log->stream, file_pos));
+    rr_prefetch_start();
+}
+
 // mz fill the queue of log entries from the file
 void rr_fill_queue(void) {
     unsigned long long num_entries = 0;
@@ -900,6 +1286,13 @@ void rr_fill_queue(void) {
     if (num_entries > rr_max_num_queue_entries) {
         rr_max_num_queue_entries = num_entries;
     }
+
+    // The queue tail (and so the distance to the next interrupt) just
+    // changed; make any chained TBs drop back to the main loop to pick up
+    // the new instruction budget.
+    if (first_cpu) {
+        first_cpu->rr_instr_budget = 0;
+    }
 }
 
 // Makes sure queue is full and returns fron entry.
@@ -1068,6 +1461,22 @@ static MemoryRegion * rr_memory_region_find_parent(MemoryRegion *root, MemoryReg
     return NULL;
 }
 
+// Inputs logged in the middle of a block that counts its instructions on
+// entry need the count of the current instruction. Device accesses from
+// generated code have done this already (see io_readx()), so this is for
+// helpers, which have no host return address to go by.
+TranslationBlock *rr_sync_insn_count(void)
+{
+    return current_cpu ? cpu_sync_insn_count_pc(current_cpu) : NULL;
+}
+
+void rr_unsync_insn_count(TranslationBlock *tb)
+{
+    if (tb) {
+        cpu_unsync_insn_count(current_cpu, tb);
+    }
+}
+
 // mz this function consumes 2 types of entries:
 // RR_SKIPPED_CALL_CPU_MEM_RW and RR_SKIPPED_CALL_CPU_REG_MEM_REGION
 // XXX call_site parameter no longer used...
@@ -1195,12 +1604,6 @@ void rr_create_record_log(const char* filename)
 
     rr_nondet_log->type = RECORD;
     rr_nondet_log->name = g_strdup(filename);
-    rr_nondet_log->fp = fopen(rr_nondet_log->name, "w");
-    rr_assert(rr_nondet_log->fp != NULL);
-
-    if (rr_debug_whisper()) {
-        qemu_log("opened %s for write.\n", rr_nondet_log->name);
-    }
     // mz It would be very handy to know how "far" we are in a particular replay
     // execution.  To do this, let's store a header in the log (we'll fill it in
     // again when we close the log) that includes the maximum instruction
@@ -1208,48 +1611,60 @@ void rr_create_record_log(const char* filename)
     // This way, when we print progress, we can use something better than size
     // of log consumed
     //(as that can jump //sporadically).
-    rr_fwrite(&(rr_nondet_log->last_prog_point.guest_instr_count),
-            sizeof(rr_nondet_log->last_prog_point.guest_instr_count), 1);
+    // The stream writes a placeholder header for us.
+    rr_nondet_log->stream = rr_log_stream_open_write(rr_nondet_log->name);
+    rr_assert(rr_nondet_log->stream != NULL);
+
+    if (rr_debug_whisper()) {
+        qemu_log("opened %s for write.\n", rr_nondet_log->name);
+    }
 }
 
 // create replay log
 void rr_create_replay_log(const char* filename)
 {
-    struct stat statbuf = {0};
     // create log
     rr_nondet_log = g_new0(RR_log, 1);
     rr_assert(rr_nondet_log != NULL);
 
     rr_nondet_log->type = REPLAY;
     rr_nondet_log->name = g_strdup(filename);
-    rr_nondet_log->fp = fopen(rr_nondet_log->name, "r");
-    rr_assert(rr_nondet_log->fp != NULL);
+    rr_nondet_log->stream = rr_log_stream_open_read(rr_nondet_log->name);
+    rr_assert(rr_nondet_log->stream != NULL);
 
-    // mz fill in log size
-    stat(rr_nondet_log->name, &statbuf);
-    rr_nondet_log->size = statbuf.st_size;
-    rr_nondet_log->bytes_read = 0;
+    // mz fill in log size. For compressed logs this is the uncompressed size,
+    // which is what bytes_read counts.
+    rr_nondet_log->size = rr_log_stream_size(rr_nondet_log->stream);
+    rr_nondet_log->bytes_read = RR_LOG_HEADER_SIZE;
     if (rr_debug_whisper()) {
-        qemu_log("opened %s for read.  len=%llu bytes.\n", rr_nondet_log->name,
+        qemu_log("opened %s (v%d) for read.  len=%llu bytes.\n",
+                 rr_nondet_log->name,
+                 rr_log_stream_version(rr_nondet_log->stream),
                  rr_nondet_log->size);
     }
-    // mz read the last program point from the log header.
-    rr_fread(&(rr_nondet_log->last_prog_point.guest_instr_count),
-            sizeof(rr_nondet_log->last_prog_point.guest_instr_count), 1);
+    // mz the last program point from the log header.
+    rr_nondet_log->last_prog_point.guest_instr_count =
+        rr_log_stream_last_instr(rr_nondet_log->stream);
+
+    rr_prefetch_start();
 }
 
 // close file and free associated memory
 void rr_destroy_log(void)
 {
-    if (rr_nondet_log->fp) {
+    if (rr_nondet_log->type == REPLAY) {
+        rr_prefetch_stop();
+        g_free(rr_prefetch.arena);
+        rr_prefetch.arena = NULL;
+    }
+    if (rr_nondet_log->stream) {
         // mz if in record, update the header with the last written prog point.
         if (rr_nondet_log->type == RECORD) {
-            rewind(rr_nondet_log->fp);
-            rr_fwrite(&(rr_nondet_log->last_prog_point.guest_instr_count),
-                    sizeof(rr_nondet_log->last_prog_point.guest_instr_count), 1);
+            rr_log_stream_set_last_instr(rr_nondet_log->stream,
+                    rr_nondet_log->last_prog_point.guest_instr_count);
         }
-        fclose(rr_nondet_log->fp);
-        rr_nondet_log->fp = NULL;
+        rr_assert(rr_log_stream_close(rr_nondet_log->stream));
+        rr_nondet_log->stream = NULL;
     }
     g_free(rr_nondet_log->name);
     g_free(rr_nondet_log);
@@ -1499,6 +1914,7 @@ void rr_do_end_record(void)
     // log_all_cpu_states();
 
     rr_destroy_log();
+    rr_tracked_mem_regions_clear();
 
     g_free(rr_path_base);
     g_free(rr_name_base);
@@ -1547,7 +1963,24 @@ int rr_do_begin_replay(const char* file_name_full, CPUState* cpu_state)
         qemu_log("path = [%s]  file_name_base = [%s]\n", rr_path, rr_name);
     }
     // first retrieve snapshot
-    rr_get_snapshot_file_name(rr_name, rr_path, name_buf, sizeof(name_buf));
+    SavedCheckpoint saved = {0};
+    uint64_t checkpoint_instr = rr_replay_checkpoint_instr
+        ? rr_replay_checkpoint_instr
+        : rr_replay_start_instr;
+    if (checkpoint_instr) {
+        char* prefix = g_strdup_printf("%s/%s", rr_path, rr_name);
+        if (!panda_checkpoint_find_saved(prefix, checkpoint_instr, &saved)) {
+            printf("no saved checkpoint at or before instr %" PRIu64
+                   ", starting from the beginning\n", checkpoint_instr);
+        }
+        g_free(prefix);
+    }
+    if (saved.file) {
+        snprintf(name_buf, sizeof(name_buf), "%s", saved.file);
+        g_free(saved.file);
+    } else {
+        rr_get_snapshot_file_name(rr_name, rr_path, name_buf, sizeof(name_buf));
+    }
     if (rr_debug_whisper()) {
         qemu_log("reading snapshot:\t%s\n", name_buf);
     }
@@ -1589,6 +2022,17 @@ int rr_do_begin_replay(const char* file_name_full, CPUState* cpu_state)
     // set up event queue
     rr_queue_head = rr_queue_tail = NULL;
     rr_queue_end = &rr_queue[RR_QUEUE_MAX_LEN];
+    if (saved.guest_instr_count) {
+        printf("starting from checkpoint @ instr %" PRIu64 "\n",
+               saved.guest_instr_count);
+        cpu_state->rr_guest_instr_count = saved.guest_instr_count;
+        rr_nondet_log_seek(saved.nondet_log_position);
+        rr_next_progress = MAX(1, (unsigned)rr_get_percentage());
+    }
+    if (rr_get_guest_instr_count() < rr_replay_start_instr) {
+        printf("fast-forwarding to instr %" PRIu64 "\n", rr_replay_start_instr);
+        panda_fast_forward_begin(rr_replay_start_instr);
+    }
     rr_fill_queue();
 
     // Resume execution of the CPU thread when using PANDA as a library
@@ -1646,6 +2090,10 @@ void rr_do_end_replay(int is_error)
     }
     rr_queue_head = NULL;
     rr_queue_tail = NULL;
+    // replay ended before -replay-start-at; give plugins their callbacks back
+    if (panda_fast_forward_instr) {
+        panda_fast_forward_end();
+    }
     // mz print CPU state at end of replay
     // log_all_cpu_states();
     // close logs
@@ -0,0 +1,627 @@
+/*
+ * Record and Replay for QEMU
+ *
+ * Byte stream underneath the nondet log; see rr_log_stream.h for the
+ * on-disk formats.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+#include "panda/rr/rr_log_stream.h"
+
+#define RR_LOG_V2_DATA_OFFSET (RR_LOG_HEADER_SIZE + sizeof(RR_log_v2_header))
+// where chunks start in logs with a version 2 header, which has no codec
+#define RR_LOG_V2_OLD_HEADER_SIZE offsetof(RR_log_v2_header, codec)
+// Full chunks waiting for the writer thread. The recording only stalls if
+// compression falls this far behind.
+#define RR_LOG_V2_QUEUE_DEPTH 4
+
+// favour recording speed; entries compress well even at this level
+static int rr_log_v2_level = Z_BEST_SPEED;
+
+// A chunk handed to the writer thread. Slots keep their buffers once the
+// chunk is written, and the recording swaps its raw buffer for one of them.
+typedef struct {
+    uint8_t *raw;
+    size_t raw_len;
+    size_t raw_cap;
+    uint64_t raw_offset;
+    uint64_t first_instr;
+} RR_log_write_job;
+
+struct RR_log_stream {
+    FILE *fp;
+    bool writing;
+    int version;
+    uint64_t last_instr;
+    uint64_t size;              // logical size, reading only
+    RR_log_codec codec;
+    uint64_t data_offset;       // file offset of the first chunk
+
+    // v2 chunk index
+    RR_log_chunk_index *index;
+    size_t num_chunks;
+    size_t index_cap;
+
+    // raw bytes of the current chunk, starting at logical offset raw_base
+    uint8_t *raw;
+    size_t raw_len;
+    size_t raw_pos;
+    size_t raw_cap;
+    uint64_t raw_base;
+    ssize_t cur;                // index of the chunk in raw, -1 if none
+
+    uint8_t *comp;
+    size_t comp_cap;
+
+    uint64_t file_pos;          // where fp is, as far as we know
+    uint64_t chunk_first_instr; // writing only
+
+    // Writing: full chunks are compressed and written out by the writer
+    // thread, in order. Once it has started, it alone touches fp, comp,
+    // file_pos and the index until it is joined.
+    int level;
+    GThread *writer;
+    GMutex lock;
+    GCond cond;
+    RR_log_write_job jobs[RR_LOG_V2_QUEUE_DEPTH];
+    size_t job_head;
+    size_t num_jobs;            // queued or being written
+    bool stop;
+    bool failed;
+};
+
+static void rr_log_stream_reserve(uint8_t **buf, size_t *cap, size_t len) {
+    if (len > *cap) {
+        *cap = MAX(len, *cap * 2);
+        *buf = g_realloc(*buf, *cap);
+    }
+}
+
+static void rr_log_stream_append_index(RR_log_stream *s,
+                                       const RR_log_chunk_index *ci) {
+    if (s->num_chunks == s->index_cap) {
+        s->index_cap = MAX(64, s->index_cap * 2);
+        s->index = g_renew(RR_log_chunk_index, s->index, s->index_cap);
+    }
+    s->index[s->num_chunks++] = *ci;
+}
+
+static void rr_log_stream_free(RR_log_stream *s) {
+    for (int i = 0; i < RR_LOG_V2_QUEUE_DEPTH; i++) {
+        g_free(s->jobs[i].raw);
+    }
+    g_free(s->index);
+    g_free(s->raw);
+    g_free(s->comp);
+    g_free(s);
+}
+
+/******************************************************************************************/
+/* WRITE */
+/******************************************************************************************/
+
+static gpointer rr_log_stream_writer(gpointer opaque);
+
+// zstd when we have it; level 0 stays zlib's stored blocks
+static RR_log_codec rr_log_stream_write_codec(int level) {
+#ifdef CONFIG_ZSTD
+    if (level > 0) return RR_LOG_CODEC_ZSTD;
+#endif
+    return RR_LOG_CODEC_ZLIB;
+}
+
+RR_log_stream *rr_log_stream_open_write(const char *path) {
+    RR_log_stream *s = g_new0(RR_log_stream, 1);
+    RR_log_v2_header hdr = {
+        .magic = RR_LOG_V2_MAGIC,
+        .version = RR_LOG_V2_VERSION,
+        .chunk_size = RR_LOG_V2_CHUNK_SIZE,
+        .codec = rr_log_stream_write_codec(rr_log_v2_level),
+    };
+    uint64_t last_instr = 0;
+
+    s->fp = fopen(path, "w");
+    if (!s->fp) {
+        rr_log_stream_free(s);
+        return NULL;
+    }
+    s->writing = true;
+    s->version = 2;
+    s->cur = -1;
+    s->raw_base = RR_LOG_HEADER_SIZE;
+
+    // both headers are rewritten on close
+    if (fwrite(&last_instr, sizeof(last_instr), 1, s->fp) != 1 ||
+        fwrite(&hdr, sizeof(hdr), 1, s->fp) != 1) {
+        fclose(s->fp);
+        rr_log_stream_free(s);
+        return NULL;
+    }
+    s->data_offset = s->file_pos = RR_LOG_V2_DATA_OFFSET;
+    s->level = rr_log_v2_level;
+    s->codec = hdr.codec;
+    // entries are appended in small pieces; don't let the first chunk grow
+    // its buffer a few bytes at a time
+    rr_log_stream_reserve(&s->raw, &s->raw_cap, RR_LOG_V2_CHUNK_SIZE);
+
+    g_mutex_init(&s->lock);
+    g_cond_init(&s->cond);
+    s->writer = g_thread_new("rr_log_writer", rr_log_stream_writer, s);
+    return s;
+}
+
+bool rr_log_stream_set_write_level(int level) {
+    if (level < Z_NO_COMPRESSION || level > Z_BEST_COMPRESSION) return false;
+    rr_log_v2_level = level;
+    return true;
+}
+
+// Compress a chunk with the log's codec into s->comp. Level 0 still goes
+// through zlib, as stored blocks, so readers needn't know about it.
+static bool rr_log_stream_compress(RR_log_stream *s, const uint8_t *raw,
+                                   size_t raw_len, size_t *comp_len) {
+    switch (s->codec) {
+    case RR_LOG_CODEC_ZLIB: {
+        uLongf len = compressBound(raw_len);
+        rr_log_stream_reserve(&s->comp, &s->comp_cap, len);
+        if (compress2(s->comp, &len, raw, raw_len, s->level) != Z_OK) {
+            return false;
+        }
+        *comp_len = len;
+        return true;
+    }
+#ifdef CONFIG_ZSTD
+    case RR_LOG_CODEC_ZSTD: {
+        size_t len = ZSTD_compressBound(raw_len);
+        rr_log_stream_reserve(&s->comp, &s->comp_cap, len);
+        len = ZSTD_compress(s->comp, len, raw, raw_len, s->level);
+        if (ZSTD_isError(len)) return false;
+        *comp_len = len;
+        return true;
+    }
+#endif
+    default:
+        return false;
+    }
+}
+
+// Decompress ci->comp_size bytes of s->comp into s->raw, which must hold
+// ci->raw_size bytes.
+static bool rr_log_stream_decompress(RR_log_stream *s,
+                                     const RR_log_chunk_index *ci) {
+    switch (s->codec) {
+    case RR_LOG_CODEC_ZLIB: {
+        uLongf raw_len = ci->raw_size;
+        return uncompress(s->raw, &raw_len, s->comp, ci->comp_size) == Z_OK &&
+            raw_len == ci->raw_size;
+    }
+#ifdef CONFIG_ZSTD
+    case RR_LOG_CODEC_ZSTD: {
+        size_t raw_len = ZSTD_decompress(s->raw, ci->raw_size, s->comp,
+                                         ci->comp_size);
+        return !ZSTD_isError(raw_len) && raw_len == ci->raw_size;
+    }
+#endif
+    default:
+        return false;
+    }
+}
+
+// Compress a chunk and write it after the ones before it.
+static bool rr_log_stream_write_chunk(RR_log_stream *s,
+                                      const RR_log_write_job *job) {
+    size_t comp_len;
+    if (!rr_log_stream_compress(s, job->raw, job->raw_len, &comp_len)) {
+        return false;
+    }
+
+    RR_log_chunk_header ch = {
+        .first_instr = job->first_instr,
+        .raw_size = job->raw_len,
+        .comp_size = comp_len,
+    };
+    if (fwrite(&ch, sizeof(ch), 1, s->fp) != 1 ||
+        fwrite(s->comp, 1, comp_len, s->fp) != comp_len) {
+        return false;
+    }
+
+    RR_log_chunk_index ci = {
+        .first_instr = job->first_instr,
+        .raw_offset = job->raw_offset,
+        .file_offset = s->file_pos,
+        .raw_size = job->raw_len,
+        .comp_size = comp_len,
+    };
+    rr_log_stream_append_index(s, &ci);
+    s->file_pos += sizeof(ch) + comp_len;
+    return true;
+}
+
+static gpointer rr_log_stream_writer(gpointer opaque) {
+    RR_log_stream *s = opaque;
+
+    g_mutex_lock(&s->lock);
+    for (;;) {
+        while (s->num_jobs == 0 && !s->stop) {
+            g_cond_wait(&s->cond, &s->lock);
+        }
+        if (s->num_jobs == 0) break;
+
+        // the recording doesn't touch a queued slot until it's released
+        RR_log_write_job *job = &s->jobs[s->job_head];
+        bool failed = s->failed;
+        g_mutex_unlock(&s->lock);
+        // after a failure, chunks are dropped so the recording can't block
+        bool ok = !failed && rr_log_stream_write_chunk(s, job);
+        g_mutex_lock(&s->lock);
+
+        s->failed |= !ok;
+        s->job_head = (s->job_head + 1) % RR_LOG_V2_QUEUE_DEPTH;
+        s->num_jobs--;
+        g_cond_broadcast(&s->cond);
+    }
+    g_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+// Hand the current chunk to the writer thread and carry on with an empty
+// buffer. Returns false once the writer has failed.
+static bool rr_log_stream_flush_chunk(RR_log_stream *s) {
+    g_mutex_lock(&s->lock);
+    if (s->raw_len == 0 || s->failed) {
+        bool ok = !s->failed;
+        g_mutex_unlock(&s->lock);
+        return ok;
+    }
+    while (s->num_jobs == RR_LOG_V2_QUEUE_DEPTH) {
+        g_cond_wait(&s->cond, &s->lock);
+    }
+    RR_log_write_job *job =
+        &s->jobs[(s->job_head + s->num_jobs) % RR_LOG_V2_QUEUE_DEPTH];
+    uint8_t *free_raw = job->raw;
+    size_t free_cap = job->raw_cap;
+    *job = (RR_log_write_job) {
+        .raw = s->raw,
+        .raw_len = s->raw_len,
+        .raw_cap = s->raw_cap,
+        .raw_offset = s->raw_base,
+        .first_instr = s->chunk_first_instr,
+    };
+    s->num_jobs++;
+    g_cond_broadcast(&s->cond);
+    g_mutex_unlock(&s->lock);
+
+    s->raw = free_raw;
+    s->raw_cap = free_cap;
+    rr_log_stream_reserve(&s->raw, &s->raw_cap, RR_LOG_V2_CHUNK_SIZE);
+    s->raw_base += s->raw_len;
+    s->raw_len = 0;
+    return true;
+}
+
+// Wait for every chunk handed over so far to be written and stop the writer
+// thread. Returns false if any of them couldn't be.
+static bool rr_log_stream_stop_writer(RR_log_stream *s) {
+    if (!s->writer) return true;
+
+    g_mutex_lock(&s->lock);
+    s->stop = true;
+    g_cond_broadcast(&s->cond);
+    g_mutex_unlock(&s->lock);
+    g_thread_join(s->writer);
+    s->writer = NULL;
+    g_mutex_clear(&s->lock);
+    g_cond_clear(&s->cond);
+    return !s->failed;
+}
+
+bool rr_log_stream_begin_entry(RR_log_stream *s, uint64_t instr) {
+    if (s->raw_len >= RR_LOG_V2_CHUNK_SIZE && !rr_log_stream_flush_chunk(s)) {
+        return false;
+    }
+    if (s->raw_len == 0) {
+        s->chunk_first_instr = instr;
+    }
+    return true;
+}
+
+bool rr_log_stream_write(RR_log_stream *s, const void *ptr, size_t len) {
+    rr_log_stream_reserve(&s->raw, &s->raw_cap, s->raw_len + len);
+    memcpy(s->raw + s->raw_len, ptr, len);
+    s->raw_len += len;
+    return true;
+}
+
+static bool rr_log_stream_finish(RR_log_stream *s) {
+    bool flushed = rr_log_stream_flush_chunk(s);
+    if (!rr_log_stream_stop_writer(s) || !flushed) return false;
+
+    RR_log_v2_header hdr = {
+        .magic = RR_LOG_V2_MAGIC,
+        .version = RR_LOG_V2_VERSION,
+        .chunk_size = RR_LOG_V2_CHUNK_SIZE,
+        .index_offset = s->file_pos,
+        .num_chunks = s->num_chunks,
+        .raw_size = s->raw_base - RR_LOG_HEADER_SIZE,
+        .codec = s->codec,
+    };
+    if (s->num_chunks &&
+        fwrite(s->index, sizeof(*s->index), s->num_chunks, s->fp) !=
+            s->num_chunks) {
+        return false;
+    }
+    rewind(s->fp);
+    return fwrite(&s->last_instr, sizeof(s->last_instr), 1, s->fp) == 1 &&
+        fwrite(&hdr, sizeof(hdr), 1, s->fp) == 1;
+}
+
+/******************************************************************************************/
+/* READ */
+/******************************************************************************************/
+
+// Rebuild the index of a log that was never closed, dropping a torn chunk
+// at the end.
+static void rr_log_stream_scan(RR_log_stream *s, uint64_t file_size) {
+    uint64_t pos = s->data_offset;
+    uint64_t raw_offset = RR_LOG_HEADER_SIZE;
+    RR_log_chunk_header ch;
+
+    while (pos + sizeof(ch) <= file_size) {
+        if (fseeko(s->fp, pos, SEEK_SET) != 0 ||
+            fread(&ch, sizeof(ch), 1, s->fp) != 1 ||
+            pos + sizeof(ch) + ch.comp_size > file_size) {
+            break;
+        }
+        RR_log_chunk_index ci = {
+            .first_instr = ch.first_instr,
+            .raw_offset = raw_offset,
+            .file_offset = pos,
+            .raw_size = ch.raw_size,
+            .comp_size = ch.comp_size,
+        };
+        rr_log_stream_append_index(s, &ci);
+        pos += sizeof(ch) + ch.comp_size;
+        raw_offset += ch.raw_size;
+    }
+}
+
+RR_log_stream *rr_log_stream_open_read(const char *path) {
+    RR_log_stream *s = g_new0(RR_log_stream, 1);
+    RR_log_v2_header hdr;
+    struct stat statbuf;
+
+    s->fp = fopen(path, "r");
+    if (!s->fp) {
+        rr_log_stream_free(s);
+        return NULL;
+    }
+    // entries are read in small pieces; give stdio a bigger buffer
+    setvbuf(s->fp, NULL, _IOFBF, 1 << 20);
+    if (fstat(fileno(s->fp), &statbuf) != 0 ||
+        fread(&s->last_instr, sizeof(s->last_instr), 1, s->fp) != 1) {
+        goto fail;
+    }
+    s->cur = -1;
+    s->raw_base = RR_LOG_HEADER_SIZE;
+
+    memset(&hdr, 0, sizeof(hdr));
+    if (fread(&hdr, RR_LOG_V2_OLD_HEADER_SIZE, 1, s->fp) != 1 ||
+        memcmp(hdr.magic, RR_LOG_V2_MAGIC, sizeof(hdr.magic)) != 0) {
+        // v1: the file is the logical stream
+        s->version = 1;
+        s->size = statbuf.st_size;
+        if (fseeko(s->fp, RR_LOG_HEADER_SIZE, SEEK_SET) != 0) goto fail;
+        return s;
+    }
+    s->version = 2;
+    if (hdr.version == 2) {
+        s->codec = RR_LOG_CODEC_ZLIB;
+        s->data_offset = RR_LOG_HEADER_SIZE + RR_LOG_V2_OLD_HEADER_SIZE;
+    } else if (hdr.version == RR_LOG_V2_VERSION) {
+        size_t rest = sizeof(hdr) - RR_LOG_V2_OLD_HEADER_SIZE;
+        if (fread((uint8_t *)&hdr + RR_LOG_V2_OLD_HEADER_SIZE, rest, 1,
+                  s->fp) != 1) {
+            goto fail;
+        }
+        s->codec = hdr.codec;
+        s->data_offset = RR_LOG_V2_DATA_OFFSET;
+    } else {
+        goto fail;
+    }
+    switch (s->codec) {
+    case RR_LOG_CODEC_ZLIB:
+#ifdef CONFIG_ZSTD
+    case RR_LOG_CODEC_ZSTD:
+#endif
+        break;
+    default:
+        fprintf(stderr, "nondet log codec %u is not supported by this build\n",
+                s->codec);
+        goto fail;
+    }
+
+    if (hdr.index_offset) {
+        s->num_chunks = s->index_cap = hdr.num_chunks;
+        s->index = g_new(RR_log_chunk_index, s->num_chunks);
+        if (fseeko(s->fp, hdr.index_offset, SEEK_SET) != 0 ||
+            fread(s->index, sizeof(*s->index), s->num_chunks, s->fp) !=
+                s->num_chunks) {
+            // index is damaged; fall back to walking the chunks
+            s->num_chunks = 0;
+        }
+    }
+    if (s->num_chunks == 0) {
+        rr_log_stream_scan(s, statbuf.st_size);
+    }
+
+    s->size = RR_LOG_HEADER_SIZE;
+    if (s->num_chunks) {
+        const RR_log_chunk_index *last = &s->index[s->num_chunks - 1];
+        s->size = last->raw_offset + last->raw_size;
+    }
+    // force a seek before the first chunk is read
+    s->file_pos = UINT64_MAX;
+    return s;
+
+fail:
+    fclose(s->fp);
+    rr_log_stream_free(s);
+    return NULL;
+}
+
+static bool rr_log_stream_load_chunk(RR_log_stream *s, size_t i) {
+    if (i >= s->num_chunks) return false;
+
+    const RR_log_chunk_index *ci = &s->index[i];
+    RR_log_chunk_header ch;
+    // chunks are laid out back to back, so reading sequentially needn't seek
+    if (s->file_pos != ci->file_offset &&
+        fseeko(s->fp, ci->file_offset, SEEK_SET) != 0) {
+        s->file_pos = UINT64_MAX;
+        return false;
+    }
+    rr_log_stream_reserve(&s->comp, &s->comp_cap, ci->comp_size);
+    rr_log_stream_reserve(&s->raw, &s->raw_cap, ci->raw_size);
+    if (fread(&ch, sizeof(ch), 1, s->fp) != 1 ||
+        ch.comp_size != ci->comp_size ||
+        fread(s->comp, 1, ci->comp_size, s->fp) != ci->comp_size) {
+        s->file_pos = UINT64_MAX;
+        return false;
+    }
+    s->file_pos = ci->file_offset + sizeof(ch) + ci->comp_size;
+
+    if (!rr_log_stream_decompress(s, ci)) {
+        return false;
+    }
+    s->cur = i;
+    s->raw_base = ci->raw_offset;
+    s->raw_len = ci->raw_size;
+    s->raw_pos = 0;
+    return true;
+}
+
+bool rr_log_stream_read(RR_log_stream *s, void *ptr, size_t len) {
+    if (s->version == 1) {
+        return len == 0 || fread(ptr, len, 1, s->fp) == 1;
+    }
+
+    uint8_t *out = ptr;
+    while (len) {
+        if (s->raw_pos == s->raw_len) {
+            if (!rr_log_stream_load_chunk(s, s->cur + 1)) return false;
+            continue;
+        }
+        size_t n = MIN(len, s->raw_len - s->raw_pos);
+        memcpy(out, s->raw + s->raw_pos, n);
+        s->raw_pos += n;
+        out += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool rr_log_stream_seek(RR_log_stream *s, uint64_t pos) {
+    if (pos < RR_LOG_HEADER_SIZE || pos > s->size) return false;
+    if (s->version == 1) {
+        return fseeko(s->fp, pos, SEEK_SET) == 0;
+    }
+
+    if (pos == s->size) {
+        // park at the end; the next read fails as it should
+        s->cur = (ssize_t)s->num_chunks - 1;
+        s->raw_base = pos;
+        s->raw_len = s->raw_pos = 0;
+        return true;
+    }
+
+    // last chunk starting at or before pos
+    size_t lo = 0, hi = s->num_chunks;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (s->index[mid].raw_offset <= pos) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    if (s->cur != (ssize_t)lo || s->raw_base != s->index[lo].raw_offset) {
+        if (!rr_log_stream_load_chunk(s, lo)) return false;
+    }
+    s->raw_pos = pos - s->raw_base;
+    return true;
+}
+
+uint64_t rr_log_stream_find_instr(RR_log_stream *s, uint64_t instr) {
+    if (s->version == 1 || s->num_chunks == 0) return RR_LOG_HEADER_SIZE;
+
+    // Last chunk whose first entry is strictly before instr. Entries at
+    // exactly instr may have spilled over from the chunk before.
+    size_t lo = 0, hi = s->num_chunks;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (s->index[mid].first_instr < instr) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return s->index[lo].raw_offset;
+}
+
+/******************************************************************************************/
+/* COMMON */
+/******************************************************************************************/
+
+bool rr_log_stream_close(RR_log_stream *s) {
+    bool ok = true;
+    if (s->writing) {
+        ok = rr_log_stream_finish(s);
+    }
+    if (fclose(s->fp) != 0) {
+        ok = false;
+    }
+    rr_log_stream_free(s);
+    return ok;
+}
+
+int rr_log_stream_version(RR_log_stream *s) {
+    return s->version;
+}
+
+uint64_t rr_log_stream_last_instr(RR_log_stream *s) {
+    return s->last_instr;
+}
+
+void rr_log_stream_set_last_instr(RR_log_stream *s, uint64_t instr) {
+    s->last_instr = instr;
+}
+
+uint64_t rr_log_stream_size(RR_log_stream *s) {
+    return s->size;
+}
+
+uint64_t rr_log_stream_tell(RR_log_stream *s) {
+    if (s->version == 1) {
+        return ftello(s->fp);
+    }
+    return s->raw_base + (s->writing ? s->raw_len : s->raw_pos);
+}
+
+size_t rr_log_stream_num_chunks(RR_log_stream *s) {
+    return s->num_chunks;
+}
+
+const RR_log_chunk_index *rr_log_stream_chunk(RR_log_stream *s, size_t i) {
+    return i < s->num_chunks ? &s->index[i] : NULL;
+}
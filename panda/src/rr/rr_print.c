@@ -27,7 +27,7 @@ RR_log *rr_nondet_log = NULL;
 
 static inline uint8_t log_is_empty(void) {
     if ((rr_nondet_log->type == REPLAY) &&
-        (rr_nondet_log->size - ftell(rr_nondet_log->fp) == 0)) {
+        (rr_nondet_log->size - rr_log_stream_tell(rr_nondet_log->stream) == 0)) {
         return 1;
     }
     else {
@@ -37,6 +37,16 @@ static inline uint8_t log_is_empty(void) {
 
 RR_debug_level_type rr_debug_level = RR_DEBUG_WHISPER;
 
+// fread-alike over the (possibly compressed) log
+static inline size_t log_read(void *ptr, size_t size, size_t nmemb) {
+    return rr_log_stream_read(rr_nondet_log->stream, ptr, size * nmemb) ? nmemb : 0;
+}
+
+static inline void log_skip(uint64_t len) {
+    uint64_t pos = rr_log_stream_tell(rr_nondet_log->stream);
+    assert(rr_log_stream_seek(rr_nondet_log->stream, pos + len));
+}
+
 // write this program point to this file 
 static void rr_spit_prog_point_fp(FILE *fp, RR_prog_point pp) {
   fprintf(fp, "{guest_instr_count=%llu}\n",
@@ -167,116 +177,103 @@ static RR_log_entry *rr_read_item(void) {
     //mz read header
     assert (rr_in_replay());
     assert ( ! log_is_empty());
-    assert (rr_nondet_log->fp != NULL);
+    assert (rr_nondet_log->stream != NULL);
 
     //mz XXX we assume that the log is not trucated - should probably fix this.
-    if (fread(&(item->header.prog_point.guest_instr_count),
-                sizeof(item->header.prog_point.guest_instr_count), 1, rr_nondet_log->fp) != 1) {
+    if (log_read(&(item->header.prog_point.guest_instr_count),
+                sizeof(item->header.prog_point.guest_instr_count), 1) != 1) {
         //mz an error occurred
-        if (feof(rr_nondet_log->fp)) {
-            // replay is done - we've reached the end of file
-            //mz we should never get here!
-            assert(0);
-        } 
-        else {
-            //mz some other kind of error
-            //mz XXX something more graceful, perhaps?
-            assert(0);
-        }
+        //mz XXX something more graceful, perhaps?
+        assert(0);
     }
     //mz this is more compact, as it doesn't include extra padding.
-    assert(fread(&(item->header.kind), 1, 1, rr_nondet_log->fp) == 1);
-    assert(fread(&(item->header.callsite_loc), 1, 1, rr_nondet_log->fp) == 1);
+    assert(log_read(&(item->header.kind), 1, 1) == 1);
+    assert(log_read(&(item->header.callsite_loc), 1, 1) == 1);
 
     //mz read the rest of the item
     switch (item->header.kind) {
         case RR_INPUT_1:
-            assert(fread(&(item->variant.input_1), sizeof(item->variant.input_1), 1, rr_nondet_log->fp) == 1);
+            assert(log_read(&(item->variant.input_1), sizeof(item->variant.input_1), 1) == 1);
             break;
         case RR_INPUT_2:
-            assert(fread(&(item->variant.input_2), sizeof(item->variant.input_2), 1, rr_nondet_log->fp) == 1);
+            assert(log_read(&(item->variant.input_2), sizeof(item->variant.input_2), 1) == 1);
             break;
         case RR_INPUT_4:
-            assert(fread(&(item->variant.input_4), sizeof(item->variant.input_4), 1, rr_nondet_log->fp) == 1);
+            assert(log_read(&(item->variant.input_4), sizeof(item->variant.input_4), 1) == 1);
             break;
         case RR_INPUT_8:
-            assert(fread(&(item->variant.input_8), sizeof(item->variant.input_8), 1, rr_nondet_log->fp) == 1);
+            assert(log_read(&(item->variant.input_8), sizeof(item->variant.input_8), 1) == 1);
             break;
         case RR_INTERRUPT_REQUEST:
-            assert(fread(&(item->variant.interrupt_request), sizeof(item->variant.interrupt_request), 1, rr_nondet_log->fp) == 1);
+            assert(log_read(&(item->variant.interrupt_request), sizeof(item->variant.interrupt_request), 1) == 1);
             break;
         case RR_EXIT_REQUEST:
-            assert(fread(&(item->variant.exit_request), sizeof(item->variant.exit_request), 1, rr_nondet_log->fp) == 1);
+            assert(log_read(&(item->variant.exit_request), sizeof(item->variant.exit_request), 1) == 1);
             break;
         case RR_PENDING_INTERRUPTS:
-            assert(fread(&(item->variant.pending_interrupts), sizeof(item->variant.pending_interrupts), 1, rr_nondet_log->fp) == 1);
+            assert(log_read(&(item->variant.pending_interrupts), sizeof(item->variant.pending_interrupts), 1) == 1);
             break;
         case RR_EXCEPTION:
-            assert(fread(&(item->variant.exception_index), sizeof(item->variant.exception_index), 1, rr_nondet_log->fp) == 1);
+            assert(log_read(&(item->variant.exception_index), sizeof(item->variant.exception_index), 1) == 1);
             break;
         case RR_SKIPPED_CALL:
             {
                 RR_skipped_call_args *args = &item->variant.call_args;
                 //mz read kind first!
-                assert(fread(&(args->kind), 1, 1, rr_nondet_log->fp) == 1);
+                assert(log_read(&(args->kind), 1, 1) == 1);
                 switch(args->kind) {
                     case RR_CALL_CPU_MEM_RW:
-                        assert(fread(&(args->variant.cpu_mem_rw_args), sizeof(args->variant.cpu_mem_rw_args), 1, rr_nondet_log->fp) == 1);
+                        assert(log_read(&(args->variant.cpu_mem_rw_args), sizeof(args->variant.cpu_mem_rw_args), 1) == 1);
                         //mz buffer length in args->variant.cpu_mem_rw_args.len
                         //mz always allocate a new one. we free it when the item is added to the recycle list
                         //args->variant.cpu_mem_rw_args.buf = g_malloc(args->variant.cpu_mem_rw_args.len);
                         //mz read the buffer
                         //assert(fread(args->variant.cpu_mem_rw_args.buf, 1, args->variant.cpu_mem_rw_args.len, rr_nondet_log->fp) > 0);
-                        fseek(rr_nondet_log->fp, args->variant.cpu_mem_rw_args.len, SEEK_CUR);
+                        log_skip(args->variant.cpu_mem_rw_args.len);
                         break;
                     case RR_CALL_CPU_MEM_UNMAP:
-                        assert(fread(&(args->variant.cpu_mem_unmap), sizeof(args->variant.cpu_mem_unmap), 1, rr_nondet_log->fp) == 1);
+                        assert(log_read(&(args->variant.cpu_mem_unmap), sizeof(args->variant.cpu_mem_unmap), 1) == 1);
                         //mz buffer length in args->variant.cpu_mem_unmap.len
                         //mz always allocate a new one. we free it when the item is added to the recycle list
                         //args->variant.cpu_mem_unmap.buf = g_malloc(args->variant.cpu_mem_unmap.len);
                         //mz read the buffer
                         //assert(fread(args->variant.cpu_mem_unmap.buf, 1, args->variant.cpu_mem_unmap.len, rr_nondet_log->fp) > 0);
-                        fseek(rr_nondet_log->fp, args->variant.cpu_mem_unmap.len, SEEK_CUR);
+                        log_skip(args->variant.cpu_mem_unmap.len);
                         break;
                     case RR_CALL_MEM_REGION_CHANGE:
-                        assert(fread(&(args->variant.mem_region_change_args),
-                            sizeof(args->variant.mem_region_change_args), 1,
-                            rr_nondet_log->fp) == 1);
-                        fseek(rr_nondet_log->fp, args->variant.mem_region_change_args.len, SEEK_CUR);
+                        assert(log_read(&(args->variant.mem_region_change_args),
+                            sizeof(args->variant.mem_region_change_args), 1) == 1);
+                        log_skip(args->variant.mem_region_change_args.len);
                         break;
                     case RR_CALL_HD_TRANSFER:
-                        assert(fread(&(args->variant.hd_transfer_args),
-                              sizeof(args->variant.hd_transfer_args), 1, rr_nondet_log->fp) == 1);
+                        assert(log_read(&(args->variant.hd_transfer_args),
+                              sizeof(args->variant.hd_transfer_args), 1) == 1);
                         break;
                     case RR_CALL_HANDLE_PACKET:
-                        assert(fread(&(args->variant.handle_packet_args),
-                              sizeof(args->variant.handle_packet_args), 1, rr_nondet_log->fp) == 1);
-                        fseek(rr_nondet_log->fp,
-                            args->variant.handle_packet_args.size, SEEK_CUR);
+                        assert(log_read(&(args->variant.handle_packet_args),
+                              sizeof(args->variant.handle_packet_args), 1) == 1);
+                        log_skip(args->variant.handle_packet_args.size);
                         break;
                     case RR_CALL_NET_TRANSFER:
-                        assert(fread(&(args->variant.net_transfer_args),
-                              sizeof(args->variant.net_transfer_args), 1, rr_nondet_log->fp) == 1);
+                        assert(log_read(&(args->variant.net_transfer_args),
+                              sizeof(args->variant.net_transfer_args), 1) == 1);
                         break;
                     case RR_CALL_SERIAL_RECEIVE:
-                        assert(fread(&(args->variant.serial_receive_args),
+                        assert(log_read(&(args->variant.serial_receive_args),
                                      sizeof(args->variant.serial_receive_args),
-                                     1, rr_nondet_log->fp) == 1);
+                                     1) == 1);
                         break;
                     case RR_CALL_SERIAL_READ:
-                        assert(fread(&(args->variant.serial_read_args),
-                                     sizeof(args->variant.serial_read_args), 1,
-                                     rr_nondet_log->fp) == 1);
+                        assert(log_read(&(args->variant.serial_read_args),
+                                     sizeof(args->variant.serial_read_args), 1) == 1);
                         break;
                     case RR_CALL_SERIAL_SEND:
-                        assert(fread(&(args->variant.serial_send_args),
-                                     sizeof(args->variant.serial_send_args), 1,
-                                     rr_nondet_log->fp) == 1);
+                        assert(log_read(&(args->variant.serial_send_args),
+                                     sizeof(args->variant.serial_send_args), 1) == 1);
                         break;
                     case RR_CALL_SERIAL_WRITE:
-                        assert(fread(&(args->variant.serial_write_args),
-                                     sizeof(args->variant.serial_write_args), 1,
-                                     rr_nondet_log->fp) == 1);
+                        assert(log_read(&(args->variant.serial_write_args),
+                                     sizeof(args->variant.serial_write_args), 1) == 1);
                         break;
                     default:
                         //mz unimplemented
@@ -299,7 +296,6 @@ static RR_log_entry *rr_read_item(void) {
 
 // create replay log
 void rr_create_replay_log (const char *filename) {
-  struct stat statbuf = {0};
   // create log
   rr_nondet_log = (RR_log *) g_malloc (sizeof (RR_log));
   assert (rr_nondet_log != NULL);
@@ -307,24 +303,39 @@ void rr_create_replay_log (const char *filename) {
 
   rr_nondet_log->type = REPLAY;
   rr_nondet_log->name = g_strdup(filename);
-  rr_nondet_log->fp = fopen(rr_nondet_log->name, "r");
-  assert(rr_nondet_log->fp != NULL);
+  rr_nondet_log->stream = rr_log_stream_open_read(rr_nondet_log->name);
+  assert(rr_nondet_log->stream != NULL);
 
   //mz fill in log size
-  stat(rr_nondet_log->name, &statbuf);
-  rr_nondet_log->size = statbuf.st_size;
-  fprintf (stdout, "opened %s for read.  len=%llu bytes.\n",
-     rr_nondet_log->name, rr_nondet_log->size);
-  //mz read the last program point from the log header.
-  assert(fread(&(rr_nondet_log->last_prog_point), sizeof(RR_prog_point), 1, rr_nondet_log->fp) == 1);
+  rr_nondet_log->size = rr_log_stream_size(rr_nondet_log->stream);
+  fprintf (stdout, "opened %s (v%d, %zu chunks) for read.  len=%llu bytes.\n",
+     rr_nondet_log->name, rr_log_stream_version(rr_nondet_log->stream),
+     rr_log_stream_num_chunks(rr_nondet_log->stream), rr_nondet_log->size);
+  //mz the last program point from the log header.
+  rr_nondet_log->last_prog_point.guest_instr_count =
+      rr_log_stream_last_instr(rr_nondet_log->stream);
 }
 
 int main(int argc, char **argv) {
+    uint64_t start_instr = 0;
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s <nondet log> [start instr count]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 3) {
+        start_instr = strtoull(argv[2], NULL, 0);
+    }
     rr_create_replay_log(argv[1]);
     printf("RR Log with %llu instructions\n", (unsigned long long) rr_nondet_log->last_prog_point.guest_instr_count);
+    // jump close to start_instr using the chunk index, then skip the rest
+    assert(rr_log_stream_seek(rr_nondet_log->stream,
+        rr_log_stream_find_instr(rr_nondet_log->stream, start_instr)));
     RR_log_entry *log_entry = NULL;
     while(!log_is_empty()) {
         log_entry = rr_read_item();
+        if (log_entry->header.prog_point.guest_instr_count < start_instr) {
+            continue;
+        }
         rr_spit_log_entry(*log_entry);
     }
     if (log_entry) g_free(log_entry);
@@ -4163,14 +4163,42 @@ DEF("record-from", HAS_ARG, QEMU_OPTION_record_from,
     "-record-from <snapshot>:<record-name>\n"
     "                load snapshot <snapshot> and begin recording\n", QEMU_ARCH_ALL)
 
+DEF("record-compress", HAS_ARG, QEMU_OPTION_record_compress,
+    "-record-compress <level>\n"
+    "                zstd (or zlib) level for the nondet log of new recordings, 0 (none) to 9 (default: 1)\n", QEMU_ARCH_ALL)
+
 DEF("replay", HAS_ARG, QEMU_OPTION_replay,
     "-replay </path/to/snapshot-prefix>\n"
     "                replay the recording that starts at <snapshot>\n", QEMU_ARCH_ALL)
 
+DEF("replay-chaining", 0, QEMU_OPTION_replay_chaining,
+    "-replay-chaining\n"
+    "                allow translation block chaining during replay\n", QEMU_ARCH_ALL)
+
+DEF("replay-checkpoint", HAS_ARG, QEMU_OPTION_replay_checkpoint,
+    "-replay-checkpoint <icount>\n"
+    "                start replay from the latest saved checkpoint at or before <icount>\n", QEMU_ARCH_ALL)
+
+DEF("replay-start-at", HAS_ARG, QEMU_OPTION_replay_start_at,
+    "-replay-start-at <icount>\n"
+    "                replay with plugins disabled until <icount> instructions have run\n", QEMU_ARCH_ALL)
+
+DEF("replay-end-at", HAS_ARG, QEMU_OPTION_replay_end_at,
+    "-replay-end-at <icount>\n"
+    "                end replay once <icount> instructions have run\n", QEMU_ARCH_ALL)
+
+DEF("replay-checkpoint-fork", 0, QEMU_OPTION_replay_checkpoint_fork,
+    "-replay-checkpoint-fork\n"
+    "                keep replay checkpoints in forked copy-on-write processes\n", QEMU_ARCH_ALL)
+
 DEF("pandalog", HAS_ARG, QEMU_OPTION_pandalog,
     "-pandalog <filename>\n"
     "                enable panda logging to file\n", QEMU_ARCH_ALL)
 
+DEF("pandalog-codec", HAS_ARG, QEMU_OPTION_pandalog_codec,
+    "-pandalog-codec zlib|zstd|lz4\n"
+    "                compress pandalog chunks with this codec (default: zlib)\n", QEMU_ARCH_ALL)
+
 DEF("panda-plugin", HAS_ARG, QEMU_OPTION_panda_plugin,
     "-panda-plugin <file>\n"
     "                load PANDA plugin from <file>\n", QEMU_ARCH_ALL)
@@ -40,7 +40,6 @@
 
 #ifdef CONFIG_SOFTMMU
 #include "panda/rr/rr_log.h"
-extern bool panda_update_pc;
 #endif
 
 #define ENABLE_ARCH_4T    arm_dc_feature(s, ARM_FEATURE_V4T)
@@ -77,6 +76,7 @@ static TCGv_i32 cpu_F0s, cpu_F1s;
 static TCGv_i64 cpu_F0d, cpu_F1d;
 
 #include "exec/gen-icount.h"
+#include "panda/callbacks/cb-helper-gen.h"
 
 static const char *regnames[] =
     { "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7",
@@ -11813,12 +11813,8 @@ void gen_intermediate_code(CPUARMState *env, TranslationBlock *tb)
         max_insns = TCG_MAX_INSNS;
     }
 
-    if (rr_in_replay()) {
-        uint64_t until_interrupt = rr_num_instr_before_next_interrupt();
-        if (max_insns > until_interrupt) {
-            max_insns = until_interrupt;
-        }
-    }
+    /* Replay TBs cut short at an interrupt carry their length in
+     * CF_COUNT_MASK (CF_RR_TRUNC); others keep their full length.  */
 
     gen_tb_start(tb);
 
@@ -11921,8 +11917,10 @@ void gen_intermediate_code(CPUARMState *env, TranslationBlock *tb)
 
 #ifdef CONFIG_SOFTMMU
         //mz let's count this instruction
-        // In LLVM mode we generate this more efficiently.
-        if ((rr_on() || panda_update_pc) && !generate_llvm) {
+        // Unless a plugin wants a precise PC, gen_tb_start counts the
+        // whole TB on entry instead (CF_TB_ICOUNT).
+        // The LLVM translation drops these stores and generates its own.
+        if (tb->cflags & CF_PRECISE_PC) {
             gen_op_update_panda_pc(dc->pc);
             gen_op_update_rr_icount();
         }
@@ -11948,7 +11946,7 @@ void gen_intermediate_code(CPUARMState *env, TranslationBlock *tb)
         // PANDA: ask if anyone wants execution notification
         if (unlikely(panda_callbacks_insn_translate(cs, dc->pc))) {
             // PANDA: Insert the instrumentation
-            gen_helper_panda_insn_exec(tcg_const_tl(dc->pc));
+            gen_panda_insn_exec(dc->pc);
         }
 
         if (dc->thumb) {
@@ -11969,7 +11967,7 @@ void gen_intermediate_code(CPUARMState *env, TranslationBlock *tb)
 
         if (unlikely(panda_callbacks_after_insn_translate(cs, dc->pc))
                 && !dc->is_jmp) {
-            gen_helper_panda_after_insn_exec(tcg_const_tl(dc->pc));
+            gen_panda_after_insn_exec(dc->pc);
         }
 
         if (dc->condjmp && !dc->is_jmp) {
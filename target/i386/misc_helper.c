@@ -34,8 +34,12 @@ void helper_outb(CPUX86State *env, uint32_t port, uint32_t data)
 #ifdef CONFIG_USER_ONLY
     fprintf(stderr, "outb: port=0x%04x, data=%02x\n", port, data);
 #else
+    CPUState *cs = CPU(x86_env_get_cpu(env));
+    TranslationBlock *rr_tb = cpu_sync_insn_count(cs, GETPC());
+
     address_space_stb(&address_space_io, port, data,
                       cpu_get_mem_attrs(env), NULL);
+    cpu_unsync_insn_count(cs, rr_tb);
 #endif
 }
 
@@ -45,8 +49,14 @@ target_ulong helper_inb(CPUX86State *env, uint32_t port)
     fprintf(stderr, "inb: port=0x%04x\n", port);
     return 0;
 #else
-    return address_space_ldub(&address_space_io, port,
-                              cpu_get_mem_attrs(env), NULL);
+    CPUState *cs = CPU(x86_env_get_cpu(env));
+    TranslationBlock *rr_tb = cpu_sync_insn_count(cs, GETPC());
+    target_ulong val;
+
+    val = address_space_ldub(&address_space_io, port,
+                             cpu_get_mem_attrs(env), NULL);
+    cpu_unsync_insn_count(cs, rr_tb);
+    return val;
 #endif
 }
 
@@ -55,8 +65,12 @@ void helper_outw(CPUX86State *env, uint32_t port, uint32_t data)
 #ifdef CONFIG_USER_ONLY
     fprintf(stderr, "outw: port=0x%04x, data=%04x\n", port, data);
 #else
+    CPUState *cs = CPU(x86_env_get_cpu(env));
+    TranslationBlock *rr_tb = cpu_sync_insn_count(cs, GETPC());
+
     address_space_stw(&address_space_io, port, data,
                       cpu_get_mem_attrs(env), NULL);
+    cpu_unsync_insn_count(cs, rr_tb);
 #endif
 }
 
@@ -66,8 +80,14 @@ target_ulong helper_inw(CPUX86State *env, uint32_t port)
     fprintf(stderr, "inw: port=0x%04x\n", port);
     return 0;
 #else
-    return address_space_lduw(&address_space_io, port,
-                              cpu_get_mem_attrs(env), NULL);
+    CPUState *cs = CPU(x86_env_get_cpu(env));
+    TranslationBlock *rr_tb = cpu_sync_insn_count(cs, GETPC());
+    target_ulong val;
+
+    val = address_space_lduw(&address_space_io, port,
+                             cpu_get_mem_attrs(env), NULL);
+    cpu_unsync_insn_count(cs, rr_tb);
+    return val;
 #endif
 }
 
@@ -76,8 +96,12 @@ void helper_outl(CPUX86State *env, uint32_t port, uint32_t data)
 #ifdef CONFIG_USER_ONLY
     fprintf(stderr, "outw: port=0x%04x, data=%08x\n", port, data);
 #else
+    CPUState *cs = CPU(x86_env_get_cpu(env));
+    TranslationBlock *rr_tb = cpu_sync_insn_count(cs, GETPC());
+
     address_space_stl(&address_space_io, port, data,
                       cpu_get_mem_attrs(env), NULL);
+    cpu_unsync_insn_count(cs, rr_tb);
 #endif
 }
 
@@ -87,8 +111,14 @@ target_ulong helper_inl(CPUX86State *env, uint32_t port)
     fprintf(stderr, "inl: port=0x%04x\n", port);
     return 0;
 #else
-    return address_space_ldl(&address_space_io, port,
-                             cpu_get_mem_attrs(env), NULL);
+    CPUState *cs = CPU(x86_env_get_cpu(env));
+    TranslationBlock *rr_tb = cpu_sync_insn_count(cs, GETPC());
+    target_ulong val;
+
+    val = address_space_ldl(&address_space_io, port,
+                            cpu_get_mem_attrs(env), NULL);
+    cpu_unsync_insn_count(cs, rr_tb);
+    return val;
 #endif
 }
 
@@ -193,21 +223,25 @@ void helper_invlpg(CPUX86State *env, target_ulong addr)
     tlb_flush_page(CPU(cpu), addr);
 }
 
-void helper_rdtsc(CPUX86State *env)
+static void do_rdtsc(CPUX86State *env, uintptr_t retaddr)
 {
     uint64_t val;
 
     if ((env->cr[4] & CR4_TSD_MASK) && ((env->hflags & HF_CPL_MASK) != 0)) {
-        raise_exception_ra(env, EXCP0D_GPF, GETPC());
+        raise_exception_ra(env, EXCP0D_GPF, retaddr);
     }
-    cpu_svm_check_intercept_param(env, SVM_EXIT_RDTSC, 0, GETPC());
+    cpu_svm_check_intercept_param(env, SVM_EXIT_RDTSC, 0, retaddr);
 
 #ifdef CONFIG_SOFTMMU
+    CPUState *cs = CPU(x86_env_get_cpu(env));
+    TranslationBlock *rr_tb = cpu_sync_insn_count(cs, retaddr);
+
     RR_DO_RECORD_OR_REPLAY(
         /*action=*/val = cpu_get_tsc(env) + env->tsc_offset,
         /*record=*/rr_input_8(&val),
         /*replay=*/rr_input_8(&val),
         /*location=*/RR_CALLSITE_RDTSC);
+    cpu_unsync_insn_count(cs, rr_tb);
 #else
         val = cpu_get_tsc(env) + env->tsc_offset;
 #endif
@@ -216,9 +250,14 @@ void helper_rdtsc(CPUX86State *env)
     env->regs[R_EDX] = (uint32_t)(val >> 32);
 }
 
+void helper_rdtsc(CPUX86State *env)
+{
+    do_rdtsc(env, GETPC());
+}
+
 void helper_rdtscp(CPUX86State *env)
 {
-    helper_rdtsc(env);
+    do_rdtsc(env, GETPC());
     env->regs[R_ECX] = (uint32_t)(env->tsc_aux);
 }
 
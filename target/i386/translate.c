@@ -29,7 +29,6 @@
 #include "panda/rr/rr_log.h"
 #include "panda/rr/rr_api.h"
 #include "panda/checkpoint.h"
-extern bool panda_update_pc;
 #endif
 
 #include "panda/callbacks/cb-support.h"
@@ -99,6 +98,7 @@ static TCGv_i32 cpu_tmp2_i32, cpu_tmp3_i32;
 static TCGv_i64 cpu_tmp1_i64;
 
 #include "exec/gen-icount.h"
+#include "panda/callbacks/cb-helper-gen.h"
 
 #ifdef TARGET_X86_64
 static int x86_64_hregs;
@@ -7164,6 +7164,11 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         gen_update_cc_op(s);
         gen_jmp_im(pc_start - s->cs_base);
         gen_helper_cpuid(cpu_env);
+        /* PANDA: cpuid is also the guest hypercall.  End the block, so that
+           what a hypercall changes (e.g. taint labels, which decide whether
+           the next block runs instrumented) applies from the next insn.  */
+        gen_jmp_im(s->pc - s->cs_base);
+        gen_eob(s);
         break;
     case 0xf4: /* hlt */
         if (s->cpl != 0) {
@@ -8457,14 +8462,9 @@ void gen_intermediate_code(CPUX86State *env, TranslationBlock *tb)
 
 //    bool replay_interrupt = false;
 
+    /* Replay TBs cut short at an interrupt carry their length in
+     * CF_COUNT_MASK (CF_RR_TRUNC); others keep their full length.  */
     if (rr_in_replay()) {
-//        tb->replay_interrupt = false;
-        uint64_t until_interrupt = rr_num_instr_before_next_interrupt();
-        if (max_insns > until_interrupt) {
-            max_insns = until_interrupt;
-//            tb->replay_interrupt = true;
-//            replay_interrupt = true;
-        }
 //        tb->tcg_op_buf_full = false;
         tb->was_split = false;
     }
@@ -8535,8 +8535,10 @@ generate_debug:
 
 #ifdef CONFIG_SOFTMMU
         //mz let's count this instruction
-        // In LLVM mode we generate this more efficiently.
-        if ((rr_on() || panda_update_pc) && !generate_llvm) {
+        // Unless a plugin wants a precise PC, gen_tb_start counts the
+        // whole TB on entry instead (CF_TB_ICOUNT).
+        // The LLVM translation drops these stores and generates its own.
+        if (tb->cflags & CF_PRECISE_PC) {
             gen_op_update_panda_pc(pc_ptr);
             gen_op_update_rr_icount();
         }
@@ -8545,7 +8547,7 @@ generate_debug:
         // PANDA: ask if anyone wants execution notification
         if (unlikely(panda_callbacks_insn_translate(ENV_GET_CPU(env), pc_ptr))) {
             gen_update_cc_op(dc);
-            gen_helper_panda_insn_exec(tcg_const_tl(pc_ptr));
+            gen_panda_insn_exec(pc_ptr);
         }
 
         pc_ptr = disas_insn(env, dc, pc_ptr);
@@ -8553,7 +8555,7 @@ generate_debug:
 
         if (unlikely(panda_callbacks_after_insn_translate(ENV_GET_CPU(env), pc_ptr))
                 && !dc->is_jmp) {
-            gen_helper_panda_after_insn_exec(tcg_const_tl(pc_ptr));
+            gen_panda_after_insn_exec(pc_ptr);
         }
 
         /* stop translation if indicated */
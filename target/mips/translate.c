@@ -42,7 +42,6 @@
 
 #ifdef CONFIG_SOFTMMU
 #include "panda/rr/rr_log.h"
-extern bool panda_update_pc;
 #endif
 
 #define MIPS_DEBUG_DISAS 0
@@ -1375,6 +1374,7 @@ static TCGv_i64 fpu_f64[32];
 static TCGv_i64 msa_wr_d[64];
 
 #include "exec/gen-icount.h"
+#include "panda/callbacks/cb-helper-gen.h"
 
 #define gen_helper_0e0i(name, arg) do {                           \
     TCGv_i32 helper_tmp = tcg_const_i32(arg);                     \
@@ -19960,13 +19960,9 @@ void gen_intermediate_code(CPUMIPSState *env, struct TranslationBlock *tb)
     if (max_insns > TCG_MAX_INSNS) {
         max_insns = TCG_MAX_INSNS;
     }
-    
-    if (rr_in_replay()) {
-        uint64_t until_interrupt = rr_num_instr_before_next_interrupt();
-        if (max_insns > until_interrupt) {
-            max_insns = until_interrupt;
-        }
-    }
+
+    /* Replay TBs cut short at an interrupt carry their length in
+     * CF_COUNT_MASK (CF_RR_TRUNC); others keep their full length.  */
 
     uint64_t rr_updated_instr_count = rr_get_guest_instr_count();
 
@@ -19994,8 +19990,10 @@ void gen_intermediate_code(CPUMIPSState *env, struct TranslationBlock *tb)
 
 #ifdef CONFIG_SOFTMMU 
         //mz let's count this instruction
-        // In LLVM mode we generate this more efficiently.
-        if ((rr_on() || panda_update_pc) && !generate_llvm) {
+        // Unless a plugin wants a precise PC, gen_tb_start counts the
+        // whole TB on entry instead (CF_TB_ICOUNT).
+        // The LLVM translation drops these stores and generates its own.
+        if (tb->cflags & CF_PRECISE_PC) {
             gen_op_update_panda_pc(ctx.pc);
             gen_op_update_rr_icount();
         }
@@ -20003,7 +20001,7 @@ void gen_intermediate_code(CPUMIPSState *env, struct TranslationBlock *tb)
         // PANDA: ask if anyone wants execution notification
         if (unlikely(panda_callbacks_insn_translate(cs, ctx.pc))) {
             // PANDA: Insert the instrumentation
-            gen_helper_panda_insn_exec(tcg_const_tl(ctx.pc));
+            gen_panda_insn_exec(ctx.pc);
         }
 
         is_slot = ctx.hflags & MIPS_HFLAG_BMASK;
@@ -20043,7 +20041,7 @@ void gen_intermediate_code(CPUMIPSState *env, struct TranslationBlock *tb)
 
         if (unlikely(panda_callbacks_after_insn_translate(cs, ctx.pc))
                 && !is_slot) { // XXX: af - unsure about is_slot?
-            gen_helper_panda_after_insn_exec(tcg_const_tl(ctx.pc));
+            gen_panda_after_insn_exec(ctx.pc);
         }
 
         /* Execute a branch and its delay slot as a single instruction.
@@ -25,24 +25,47 @@
 /*****************************************************************************/
 /* SPR accesses */
 
+/* Time base accesses are logged by record/replay, at the instruction count
+ * of the mftb or mttb that made them. */
+
 target_ulong helper_load_tbl(CPUPPCState *env)
 {
-    return (target_ulong)cpu_ppc_load_tbl(env);
+    CPUState *cs = CPU(ppc_env_get_cpu(env));
+    TranslationBlock *rr_tb = cpu_sync_insn_count(cs, GETPC());
+    target_ulong val = (target_ulong)cpu_ppc_load_tbl(env);
+
+    cpu_unsync_insn_count(cs, rr_tb);
+    return val;
 }
 
 target_ulong helper_load_tbu(CPUPPCState *env)
 {
-    return cpu_ppc_load_tbu(env);
+    CPUState *cs = CPU(ppc_env_get_cpu(env));
+    TranslationBlock *rr_tb = cpu_sync_insn_count(cs, GETPC());
+    target_ulong val = cpu_ppc_load_tbu(env);
+
+    cpu_unsync_insn_count(cs, rr_tb);
+    return val;
 }
 
 target_ulong helper_load_atbl(CPUPPCState *env)
 {
-    return (target_ulong)cpu_ppc_load_atbl(env);
+    CPUState *cs = CPU(ppc_env_get_cpu(env));
+    TranslationBlock *rr_tb = cpu_sync_insn_count(cs, GETPC());
+    target_ulong val = (target_ulong)cpu_ppc_load_atbl(env);
+
+    cpu_unsync_insn_count(cs, rr_tb);
+    return val;
 }
 
 target_ulong helper_load_atbu(CPUPPCState *env)
 {
-    return cpu_ppc_load_atbu(env);
+    CPUState *cs = CPU(ppc_env_get_cpu(env));
+    TranslationBlock *rr_tb = cpu_sync_insn_count(cs, GETPC());
+    target_ulong val = cpu_ppc_load_atbu(env);
+
+    cpu_unsync_insn_count(cs, rr_tb);
+    return val;
 }
 
 #if defined(TARGET_PPC64) && !defined(CONFIG_USER_ONLY)
@@ -65,22 +88,38 @@ target_ulong helper_load_601_rtcu(CPUPPCState *env)
 #if !defined(CONFIG_USER_ONLY)
 void helper_store_tbl(CPUPPCState *env, target_ulong val)
 {
+    CPUState *cs = CPU(ppc_env_get_cpu(env));
+    TranslationBlock *rr_tb = cpu_sync_insn_count(cs, GETPC());
+
     cpu_ppc_store_tbl(env, val);
+    cpu_unsync_insn_count(cs, rr_tb);
 }
 
 void helper_store_tbu(CPUPPCState *env, target_ulong val)
 {
+    CPUState *cs = CPU(ppc_env_get_cpu(env));
+    TranslationBlock *rr_tb = cpu_sync_insn_count(cs, GETPC());
+
     cpu_ppc_store_tbu(env, val);
+    cpu_unsync_insn_count(cs, rr_tb);
 }
 
 void helper_store_atbl(CPUPPCState *env, target_ulong val)
 {
+    CPUState *cs = CPU(ppc_env_get_cpu(env));
+    TranslationBlock *rr_tb = cpu_sync_insn_count(cs, GETPC());
+
     cpu_ppc_store_atbl(env, val);
+    cpu_unsync_insn_count(cs, rr_tb);
 }
 
 void helper_store_atbu(CPUPPCState *env, target_ulong val)
 {
+    CPUState *cs = CPU(ppc_env_get_cpu(env));
+    TranslationBlock *rr_tb = cpu_sync_insn_count(cs, GETPC());
+
     cpu_ppc_store_atbu(env, val);
+    cpu_unsync_insn_count(cs, rr_tb);
 }
 
 void helper_store_601_rtcl(CPUPPCState *env, target_ulong val)
@@ -82,6 +82,7 @@ static TCGv cpu_fpscr;
 static TCGv_i32 cpu_access_type;
 
 #include "exec/gen-icount.h"
+#include "panda/callbacks/cb-helper-gen.h"
 
 void ppc_translate_init(void)
 {
@@ -7254,12 +7255,8 @@ void gen_intermediate_code(CPUPPCState *env, struct TranslationBlock *tb)
         max_insns = TCG_MAX_INSNS;
     }
 
-    if (rr_in_replay()) {
-        uint64_t until_interrupt = rr_num_instr_before_next_interrupt();
-        if (max_insns > until_interrupt) {
-            max_insns = until_interrupt;
-        }
-    }
+    /* Replay TBs cut short at an interrupt carry their length in
+     * CF_COUNT_MASK (CF_RR_TRUNC); others keep their full length.  */
 
     gen_tb_start(tb);
     tcg_clear_temp_count();
@@ -7286,8 +7283,10 @@ void gen_intermediate_code(CPUPPCState *env, struct TranslationBlock *tb)
 
 #ifdef CONFIG_SOFTMMU
         //mz let's count this instruction
-        // In LLVM mode we generate this more efficiently.
-        if (rr_on() && !generate_llvm) {
+        // Unless a plugin wants a precise PC, gen_tb_start counts the
+        // whole TB on entry instead (CF_TB_ICOUNT).
+        // The LLVM translation drops these stores and generates its own.
+        if (tb->cflags & CF_PRECISE_PC) {
             gen_op_update_panda_pc(ctx.nip);
             gen_op_update_rr_icount();
         }
@@ -7349,7 +7348,7 @@ void gen_intermediate_code(CPUPPCState *env, struct TranslationBlock *tb)
         // PANDA: ask if anyone wants execution notification
         if (unlikely(panda_callbacks_insn_translate(cs, ctx.nip))) {
             // PANDA: Insert the instrumentation
-            gen_helper_panda_insn_exec(tcg_const_tl(ctx.nip));
+            gen_panda_insn_exec(ctx.nip);
         }
 
         (*(handler->handler))(&ctx);
@@ -7358,7 +7357,7 @@ void gen_intermediate_code(CPUPPCState *env, struct TranslationBlock *tb)
 #endif
 
         if (unlikely(panda_callbacks_after_insn_translate(cs, ctx.nip))) {
-            gen_helper_panda_after_insn_exec(tcg_const_tl(ctx.nip));
+            gen_panda_after_insn_exec(ctx.nip);
         }
 
         /* Check trace mode exceptions */
@@ -729,6 +729,24 @@ int tcg_check_temp_count(void)
 /* Note: we convert the 64 bit args to 32 bit and do some alignment
    and endian swap. Maybe it would be better to do the alignment
    and endian swap in tcg_reg_alloc_call(). */
+/* Make FUNC, which has no DEF_HELPER entry, callable with tcg_gen_callN.
+   FLAGS and SIZEMASK are as for the helpers in all_helpers.  */
+void tcg_register_helper(TCGContext *s, void *func, const char *name,
+                         unsigned flags, unsigned sizemask)
+{
+    TCGHelperInfo *info;
+
+    if (g_hash_table_lookup(s->helpers, func)) {
+        return;
+    }
+    info = g_new(TCGHelperInfo, 1);
+    info->func = func;
+    info->name = name;
+    info->flags = flags;
+    info->sizemask = sizemask;
+    g_hash_table_insert(s->helpers, func, info);
+}
+
 void tcg_gen_callN(TCGContext *s, void *func, TCGArg ret,
                    int nargs, TCGArg *args)
 {
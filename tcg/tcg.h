@@ -929,6 +929,8 @@ do {\
 
 void tcg_gen_callN(TCGContext *s, void *func,
                    TCGArg ret, int nargs, TCGArg *args);
+void tcg_register_helper(TCGContext *s, void *func, const char *name,
+                         unsigned flags, unsigned sizemask);
 
 void tcg_op_remove(TCGContext *s, TCGOp *op);
 TCGOp *tcg_op_insert_before(TCGContext *s, TCGOp *op, TCGOpcode opc, int narg);
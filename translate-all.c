@@ -76,9 +76,14 @@
 #include "panda/tcg-llvm.h"
 #endif
 
+#include "exec/helper-proto.h"
 #include "panda/rr/rr_log.h"
+#include "panda/plugin.h"
 #include "panda/callbacks/cb-support.h"
 
+extern bool panda_replay_tb_chaining;
+extern bool panda_update_pc;
+
 /* #define DEBUG_TB_INVALIDATE */
 /* #define DEBUG_TB_FLUSH */
 /* make various TB consistency checks */
@@ -297,6 +302,177 @@ static int encode_search(TranslationBlock *tb, uint8_t *block)
     return p - block;
 }
 
+#if defined(CONFIG_LLVM)
+/* Even with LLVM on, a block may have run its TCG version instead (see
+ * panda_set_llvm_block_filter), so go by where the host pc is.
+ */
+static inline bool tc_ptr_in_llvm(uintptr_t tc_ptr)
+{
+    return execute_llvm &&
+        !(tc_ptr >= (uintptr_t)tcg_ctx.code_gen_buffer &&
+          tc_ptr < (uintptr_t)tcg_ctx.code_gen_ptr);
+}
+#endif
+
+/* A CF_TB_ICOUNT TB adds all of its instructions to rr_guest_instr_count
+ * on entry.  Make the count exact for its insn I instead, which has DATA
+ * as its insn_start data, by holding back the instructions after I in
+ * rr_icount_ahead.  Counts held back earlier are taken into account, so
+ * this may be repeated.
+ */
+static void tb_exact_insn_count(CPUState *cpu, TranslationBlock *tb, int i,
+                                target_ulong *data)
+{
+    uint64_t count = cpu->rr_guest_instr_count + cpu->rr_icount_ahead;
+
+    cpu->rr_icount_ahead = tb->icount - (i + 1);
+    cpu->rr_guest_instr_count = count - cpu->rr_icount_ahead;
+    cpu->panda_guest_pc = data[0];
+    cpu->rr_icount_tb = NULL;
+}
+
+/* Find the insn of TB whose host code contains searched_pc, filling in
+ * its insn_start data.  Returns its index, or -1 if there is none.
+ */
+static int tb_find_insn_by_host_pc(TranslationBlock *tb,
+                                   uintptr_t searched_pc, target_ulong *data)
+{
+    uintptr_t host_pc = (uintptr_t)tb->tc_ptr;
+    uint8_t *p = tb->tc_search;
+    int i, j;
+
+    if (searched_pc < host_pc) {
+        return -1;
+    }
+    data[0] = tb->pc;
+    for (j = 1; j < TARGET_INSN_START_WORDS; ++j) {
+        data[j] = 0;
+    }
+    for (i = 0; i < tb->icount; ++i) {
+        for (j = 0; j < TARGET_INSN_START_WORDS; ++j) {
+            data[j] += decode_sleb128(&p);
+        }
+        host_pc += decode_sleb128(&p);
+        if (host_pc > searched_pc) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Find the insn of TB at guest pc, filling in its insn_start data.
+ * Returns its index, or -1 if there is none.
+ */
+static int tb_find_insn_by_guest_pc(TranslationBlock *tb, target_ulong pc,
+                                    target_ulong *data)
+{
+    uint8_t *p = tb->tc_search;
+    int i, j;
+
+    data[0] = tb->pc;
+    for (j = 1; j < TARGET_INSN_START_WORDS; ++j) {
+        data[j] = 0;
+    }
+    for (i = 0; i < tb->icount; ++i) {
+        for (j = 0; j < TARGET_INSN_START_WORDS; ++j) {
+            data[j] += decode_sleb128(&p);
+        }
+        decode_sleb128(&p);
+        if (data[0] == pc) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Make rr_guest_instr_count exact for the instruction that called a helper
+ * or I/O access at retaddr, e.g. before record/replay logs an input.
+ * Returns the TB to pass to cpu_unsync_insn_count once done, or NULL if
+ * the count was exact already.
+ */
+TranslationBlock *cpu_sync_insn_count(CPUState *cpu, uintptr_t retaddr)
+{
+    TranslationBlock *tb = cpu->rr_icount_tb;
+    target_ulong data[TARGET_INSN_START_WORDS];
+    int i;
+
+    if (!tb || !retaddr) {
+        return NULL;
+    }
+    i = tb_find_insn_by_host_pc(tb, retaddr - GETPC_ADJ, data);
+    if (i < 0) {
+        return NULL;
+    }
+    tb_exact_insn_count(cpu, tb, i, data);
+    return tb;
+}
+
+/* Like cpu_sync_insn_count, for code that has no host return address to
+ * go by, such as device accesses made by helpers through address_space_rw
+ * (see RR_DO_RECORD_OR_REPLAY).  The instruction is found from the guest
+ * PC, so the count is only exact if the translator stored the PC before
+ * calling the helper, as it does for helpers that may fault; otherwise it
+ * is that of the whole TB.
+ */
+TranslationBlock *cpu_sync_insn_count_pc(CPUState *cpu)
+{
+    TranslationBlock *tb = cpu->rr_icount_tb;
+    CPUArchState *env = cpu->env_ptr;
+    target_ulong data[TARGET_INSN_START_WORDS];
+    target_ulong pc, cs_base;
+    uint32_t flags;
+    int i;
+
+    if (!tb) {
+        return NULL;
+    }
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    i = tb_find_insn_by_guest_pc(tb, pc, data);
+    if (i < 0) {
+        return NULL;
+    }
+    tb_exact_insn_count(cpu, tb, i, data);
+    return tb;
+}
+
+void cpu_unsync_insn_count(CPUState *cpu, TranslationBlock *tb)
+{
+    if (tb) {
+        cpu->rr_guest_instr_count += cpu->rr_icount_ahead;
+        cpu->rr_icount_ahead = 0;
+        cpu->rr_icount_tb = tb;
+    }
+}
+
+/* Called when execution longjmps out of generated code.  A TB that left
+ * without cpu_restore_state (e.g. through a helper that raises an
+ * exception after the translator stored the guest PC) still has its whole
+ * insn count added, so work out where it stopped from the guest PC.
+ */
+void cpu_restore_insn_count(CPUState *cpu)
+{
+    TranslationBlock *tb = cpu->rr_icount_tb;
+    CPUArchState *env = cpu->env_ptr;
+    target_ulong data[TARGET_INSN_START_WORDS];
+    target_ulong pc, cs_base;
+    uint32_t flags;
+    int i;
+
+    if (tb) {
+        cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+        i = tb_find_insn_by_guest_pc(tb, pc, data);
+        if (i >= 0) {
+            tb_exact_insn_count(cpu, tb, i, data);
+        } else {
+            /* A PC outside the TB means it ran to its end.  */
+            cpu->rr_guest_instr_count += cpu->rr_icount_ahead;
+            cpu->rr_icount_tb = NULL;
+        }
+    }
+    /* Whatever is still held back was never executed.  */
+    cpu->rr_icount_ahead = 0;
+}
+
 /* The cpu state corresponding to 'searched_pc' is restored.
  * Called with tb_lock held.
  */
@@ -318,7 +494,7 @@ static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
 
 #if defined(CONFIG_LLVM)
     target_ulong guest_pc = cpu->panda_guest_pc;
-    if (execute_llvm) {
+    if (tc_ptr_in_llvm(searched_pc)) {
         assert(guest_pc >= tb->pc);
         assert(guest_pc < tb->pc + tb->size);
         for (i = 0; i < num_insns; ++i) {
@@ -352,6 +528,9 @@ static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
     return -1;
 
  found:
+    if (tb == cpu->rr_icount_tb) {
+        tb_exact_insn_count(cpu, tb, i, data);
+    }
     if (tb->cflags & CF_USE_ICOUNT) {
         assert(use_icount);
         /* Reset the cycle counter to the start of the block.  */
@@ -1301,6 +1480,139 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
 #endif
 }
 
+/* PANDA: insert a call to func(args[0], ...) after op, with nargs 64-bit
+   constant arguments, and return the call op.  */
+static TCGOp *panda_insert_call(TCGOp *op, void *func, int nargs,
+                                const uint64_t *args)
+{
+    TCGv_i64 tmps[2];
+    TCGArg *call_args;
+    int i;
+
+    QEMU_BUILD_BUG_ON(TCG_TARGET_REG_BITS != 64);
+    assert(nargs <= ARRAY_SIZE(tmps));
+    for (i = 0; i < nargs; i++) {
+        tmps[i] = tcg_temp_new_i64();
+        op = tcg_op_insert_after(&tcg_ctx, op, INDEX_op_movi_i64, 2);
+        tcg_ctx.gen_opparam_buf[op->args] = GET_TCGV_I64(tmps[i]);
+        tcg_ctx.gen_opparam_buf[op->args + 1] = args[i];
+    }
+
+    op = tcg_op_insert_after(&tcg_ctx, op, INDEX_op_call, nargs + 2);
+    op->callo = 0;
+    op->calli = nargs;
+    call_args = &tcg_ctx.gen_opparam_buf[op->args];
+    for (i = 0; i < nargs; i++) {
+        call_args[i] = GET_TCGV_I64(tmps[i]);
+        tcg_temp_free_i64(tmps[i]);
+    }
+    call_args[nargs] = (uintptr_t)func;
+    /* The callbacks may read and change any guest state.  */
+    call_args[nargs + 1] = 0;
+    return op;
+}
+
+/* PANDA: guest pc of an insn_start op, as in tcg_dump_ops().  */
+static target_ulong panda_insn_start_pc(TCGOp *op)
+{
+    TCGArg *args = &tcg_ctx.gen_opparam_buf[op->args];
+#if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
+    return ((target_ulong)args[1] << 32) | args[0];
+#else
+    return args[0];
+#endif
+}
+
+/* PANDA: add the calls that generated code makes to plugins.
+ *
+ * The start_block_exec and end_block_exec callbacks are called from the
+ * TB's own code, so that it can still be chained to other TBs.  The start
+ * call goes after the first guest instruction marker, past the checks of
+ * gen_tb_start() that leave before the TB runs.  The end call goes before
+ * each exit to the next TB: goto_tb, whose exit_tb is only reached while
+ * the jump is unpatched, and exit_tb(0) for the TBs whose successor is
+ * looked up by cpu_exec().  Other exit_tbs come from those checks.
+ *
+ * Instructions with hooks (see panda_hook_add()) call them before they
+ * run.  Other TBs have no hook overhead at all.
+ */
+static void panda_gen_plugin_calls(TranslationBlock *tb)
+{
+    bool start = atomic_read(&panda_cbs_enabled[PANDA_CB_START_BLOCK_EXEC]);
+    bool end = atomic_read(&panda_cbs_enabled[PANDA_CB_END_BLOCK_EXEC]);
+    bool hooks = panda_hooks_present();
+    bool first = true;
+    TCGOp *op;
+    int oi;
+
+    if (!start && !end && !hooks) {
+        return;
+    }
+    for (oi = tcg_ctx.gen_op_buf[0].next; oi != 0; oi = op->next) {
+        op = &tcg_ctx.gen_op_buf[oi];
+        if (op->opc == INDEX_op_insn_start) {
+            target_ulong pc = panda_insn_start_pc(op);
+            TCGOp *after = op;
+
+            if (first && start) {
+                uint64_t args[1] = { (uintptr_t)tb };
+                after = panda_insert_call(after, helper_panda_start_block_exec,
+                                          1, args);
+            }
+            if (hooks && panda_hooked(pc)) {
+                uint64_t args[2] = { (uintptr_t)tb, pc };
+                panda_insert_call(after, helper_panda_hooks, 2, args);
+            }
+            first = false;
+        } else if (end && (op->opc == INDEX_op_goto_tb ||
+                           (op->opc == INDEX_op_exit_tb &&
+                            tcg_ctx.gen_opparam_buf[op->args] == 0))) {
+            uint64_t args[1] = { (uintptr_t)tb };
+            panda_insert_call(&tcg_ctx.gen_op_buf[op->prev],
+                              helper_panda_end_block_exec, 1, args);
+        }
+    }
+}
+
+/* PANDA: invalidate the TBs holding the guest instruction at any of the
+   n virtual addresses in pcs, in any address space.  pcs must be sorted;
+   this is a single pass over the TBs however many there are.  */
+void tb_invalidate_virt_pcs(const uint64_t *pcs, size_t n)
+{
+    bool locked = have_tb_lock;
+    int i;
+
+    if (n == 0) {
+        return;
+    }
+    if (!locked) {
+        tb_lock();
+    }
+    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
+        TranslationBlock *tb = &tcg_ctx.tb_ctx.tbs[i];
+        size_t lo = 0, hi = n;
+
+        if (atomic_read(&tb->invalid)) {
+            continue;
+        }
+        /* first pc at or above the start of the TB */
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (pcs[mid] < tb->pc) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo < n && pcs[lo] - tb->pc < tb->size) {
+            tb_phys_invalidate(tb, -1);
+        }
+    }
+    if (!locked) {
+        tb_unlock();
+    }
+}
+
 /* Called with mmap_lock held for user mode emulation.  */
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base,
@@ -1321,6 +1633,23 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     if (use_icount && !(cflags & CF_IGNORE_ICOUNT)) {
         cflags |= CF_USE_ICOUNT;
     }
+#ifdef CONFIG_SOFTMMU
+    /* Replay TBs that may be chained carry their own instruction budget
+     * check so the chain stops at the next nondet log event. */
+    if (rr_in_replay() && panda_replay_tb_chaining
+            && !(cflags & (CF_USE_ICOUNT | CF_NOCACHE))) {
+        cflags |= CF_RR_BUDGET;
+    }
+    /* Only plugins that asked for a precise PC, or have callbacks that run
+     * mid-block, pay for updating it and the instruction count at every
+     * instruction.  Record/replay otherwise counts whole TBs, see
+     * cpu_restore_insn_count. */
+    if (panda_precise_pc_needed()) {
+        cflags |= CF_PRECISE_PC;
+    } else if (rr_on()) {
+        cflags |= CF_TB_ICOUNT;
+    }
+#endif
 
     tb = tb_alloc(pc);
     if (unlikely(!tb)) {
@@ -1376,6 +1705,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
        the tcg optimization currently hidden inside tcg_gen_code.  All
        that should be required is to flush the TBs, allocate a new TB,
        re-initialize it per above, and re-do the actual code generation.  */
+    panda_gen_plugin_calls(tb);
     panda_callbacks_before_tcg_codegen(first_cpu, tb);
     gen_code_size = tcg_gen_code(&tcg_ctx, tb);
 
@@ -1759,7 +2089,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
     }
 
 #ifdef CONFIG_LLVM
-    if (execute_llvm) {
+    if (tc_ptr_in_llvm(tc_ptr)) {
         /* first check last tb. optimization for coming from generated code. */
         tb = tcg_llvm_runtime.last_tb;
         if (tb && tb->llvm_asm_ptr
@@ -2050,6 +2380,9 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
             atomic_read(&tcg_ctx.tb_ctx.tb_flush_count));
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
+    cpu_fprintf(f, "RR truncated TBs    %u translated, %u reused\n",
+            tcg_ctx.tb_ctx.rr_trunc_gen_count,
+            tcg_ctx.tb_ctx.rr_trunc_hit_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
     tcg_dump_info(f, cpu_fprintf);
 
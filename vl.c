@@ -153,10 +153,13 @@ extern bool panda_load_plugin(const char *, const char *);
 extern void panda_unload_plugins(void);
 extern char *panda_plugin_path(const char *name);
 extern void panda_set_os_name(char *os_name);
+extern void panda_enable_replay_tb_chaining(void);
+extern void panda_checkpoint_use_fork(void);
 extern void panda_callbacks_after_machine_init(CPUState *);
 extern void panda_callbacks_pre_shutdown(void);
 extern void panda_callbacks_main_loop_wait(void);
 extern void pandalog_cc_init_write(const char * fname);
+extern bool pandalog_cc_set_codec(const char *name);
 
 int pandalog = 0;
 int panda_in_main_loop = 0;
@@ -169,6 +172,7 @@ const char* replay_name = NULL;
 
 #include "panda/debug.h"
 #include "panda/rr/rr_log_all.h"
+#include "panda/rr/rr_log_stream.h"
 
 #ifdef CONFIG_LLVM
 struct TCGLLVMTranslator;
@@ -4232,14 +4236,54 @@ int main_aux(int argc, char **argv, char **envp, PandaMainMode pmm)
                 display_type = DT_NONE;
                 replay_name = optarg;
                 break;
+            case QEMU_OPTION_replay_chaining:
+                panda_enable_replay_tb_chaining();
+                break;
+            case QEMU_OPTION_replay_checkpoint:
+                if (qemu_strtou64(optarg, NULL, 0,
+                                  &rr_replay_checkpoint_instr) < 0) {
+                    error_report("invalid instruction count %s", optarg);
+                    exit(1);
+                }
+                break;
+            case QEMU_OPTION_replay_start_at:
+                if (qemu_strtou64(optarg, NULL, 0, &rr_replay_start_instr) < 0) {
+                    error_report("invalid instruction count %s", optarg);
+                    exit(1);
+                }
+                break;
+            case QEMU_OPTION_replay_end_at:
+                if (qemu_strtou64(optarg, NULL, 0, &rr_replay_end_instr) < 0) {
+                    error_report("invalid instruction count %s", optarg);
+                    exit(1);
+                }
+                break;
+            case QEMU_OPTION_replay_checkpoint_fork:
+                panda_checkpoint_use_fork();
+                break;
             case QEMU_OPTION_pandalog:
                 pandalog = 1;
                 pandalog_cc_init_write(optarg);
                 printf ("pandalogging to [%s]\n", optarg);
                 break;
+            case QEMU_OPTION_pandalog_codec:
+                if (!pandalog_cc_set_codec(optarg)) {
+                    error_report("pandalog codec %s is not supported", optarg);
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_record_from:
                 record_name = optarg;
                 break;
+            case QEMU_OPTION_record_compress: {
+                long record_level;
+                if (qemu_strtol(optarg, NULL, 10, &record_level) < 0 ||
+                    !rr_log_stream_set_write_level(record_level)) {
+                    error_report("invalid record compression level %s", optarg);
+                    exit(1);
+                }
+                break;
+            }
             case QEMU_OPTION_panda_arg:
                 // panda_add_arg() currently always return true
                 assert(panda_add_arg(NULL, optarg));